@@ -21,8 +21,11 @@
 #include "driver/uart_register.h"
 #include "mem.h"
 #include "os_type.h"
+#include "user_config.h"
 
 #ifdef _ENABLE_RING_BUFFER
+    static spscbuf_t rxFifo;
+    static spscbuf_t txFifo;
     static ringbuf_t rxBuff;
     static ringbuf_t txBuff;
 #endif
@@ -35,10 +38,23 @@ extern UartDevice    UartDev;
 
 /* Local variables */
 static uint8 uart_recvTaskPrio = 0;
+static uart_tx_ready_cb_t uart_tx_ready_cb = NULL;
+static volatile uint8 uart_tx_blocked = 0;
+
+#if _ENABLE_CONSOLE_INTEGRATION == 1
+static uint8 uart_echo = 1;
+static volatile uint8 uart_rx_posted = 0;   // SIG_CONSOLE_RX in the task queue
+static uint8 uart_rx_discard = 0;           // skipping the rest of an overlong line
+static uint8 uart_rx_draining = 0;          // in a run of UART_RecvConsoleLine() calls
+#endif
+
+UartRxStats uart_rx_stats;
 
 /* Internal Functions */
 static  void ICACHE_FLASH_ATTR uart_config(uint8 uart_no);
 static  void uart0_rx_intr_handler(void *para);
+static  void uart_tx_fill_fifo(uint8 uart_no);
+static  void uart_rx_drain_fifo(uint8 uart_no);
 
 /* Public APIs */
 void ICACHE_FLASH_ATTR UART_init(UartBautRate uart0_br, UartBautRate uart1_br, uint8 recv_task_priority);
@@ -65,6 +81,8 @@ void ICACHE_FLASH_ATTR UART_init_console(UartBautRate uart0_br,
     uart_recvTaskPrio = recv_task_priority;
 
     UartDev.baut_rate = uart0_br;
+    rxFifo = spscbuf_new(RX_RING_BUFFER_SIZE);
+    txFifo = spscbuf_new(UART_TX_BUFFER_SIZE);
     rxBuff = rxbuffer;
     txBuff = txBuffer;
     linked_to_console = 1;
@@ -96,11 +114,89 @@ void ICACHE_FLASH_ATTR UART_init(UartBautRate uart0_br, UartBautRate uart1_br, u
 
     #if _ENABLE_CONSOLE_INTEGRATION == 0
         #if _ENABLE_RING_BUFFER == 1
-            rxBuff = ringbuf_new(RX_RING_BUFFER_SIZE);
+            rxFifo = spscbuf_new(RX_RING_BUFFER_SIZE);
         #endif
     #endif
+    #if _ENABLE_RING_BUFFER == 1
+        txFifo = spscbuf_new(UART_TX_BUFFER_SIZE);
+    #endif
+}
+
+#if _ENABLE_CONSOLE_INTEGRATION == 1
+/******************************************************************************
+ * FunctionName : UART_RecvConsoleLine
+ * Description  : Public API, frames the bytes the ISR has put into the rx FIFO
+ *                into lines. Moves bytes into the console rx ring buffer up to
+ *                and including the next '\r'. To be called from task level,
+ *                repeatedly until it returns false, as one SIG_CONSOLE_RX may
+ *                stand for several lines.
+ *                A line longer than the console buffer is dropped as a whole.
+ * Parameters   : NONE
+ * Returns      : bool (true if a complete line is in the console buffer)
+*******************************************************************************/
+bool ICACHE_FLASH_ATTR UART_RecvConsoleLine(void)
+{
+    uint8_t ch;
+
+    /* Cleared once per signal, before looking, so a line arriving from now
+       on is posted again - but only once, however often it is called */
+    if (!uart_rx_draining)
+    {
+        uart_rx_draining = 1;
+        uart_rx_posted = 0;
+    }
+
+    while (spscbuf_pop_n(&ch, rxFifo, 1) == 1)
+    {
+        if (uart_rx_discard)
+        {
+            if (ch == '\r')
+            {
+                uart_rx_discard = 0;
+                uart_rx_stats.dropped_lines++;
+            }
+            continue;
+        }
+
+        if (ringbuf_is_full(rxBuff))
+        {
+            ringbuf_reset(rxBuff);
+            if (ch == '\r')
+            {
+                uart_rx_stats.dropped_lines++;
+            }
+            else
+            {
+                uart_rx_discard = 1;
+            }
+            continue;
+        }
+
+        ringbuf_memcpy_into(rxBuff, &ch, 1);
+        if (ch == '\r')
+        {
+            uart_rx_stats.lines++;
+            return true;
+        }
+    }
+    uart_rx_draining = 0;
+    return false;
 }
 
+/******************************************************************************
+ * FunctionName : UART_SetEcho
+ * Description  : Public API, switches the echo of received chars on or off.
+ *                The echo is queued behind the output in the tx buffer and
+ *                never waits: chars that do not fit into it are not echoed.
+ * Parameters   : bool on
+ * Returns      : NONE
+*******************************************************************************/
+void ICACHE_FLASH_ATTR UART_SetEcho(bool on)
+{
+    uart_echo = on;
+}
+#endif
+
 
 
 /******************************************************************************
@@ -148,7 +244,9 @@ LOCAL void ICACHE_FLASH_ATTR uart_config(uint8 uart_no)
         int rx_threshold = 10;
 
         #if _ENABLE_CONSOLE_INTEGRATION == 1
-            rx_threshold = 1;
+            // Interrupt on a filled FIFO or after 2 idle char times, so pasted
+            // input is drained in bulk while typed chars still echo at once
+            rx_threshold = UART_RX_FULL_THRESH;
         #endif
 
         //set rx fifo trigger
@@ -158,8 +256,10 @@ LOCAL void ICACHE_FLASH_ATTR uart_config(uint8 uart_no)
                         ((110 & UART_RX_FLOW_THRHD) << UART_RX_FLOW_THRHD_S) |
                         UART_RX_FLOW_EN |   //enbale rx flow control
                         #endif
-//                        (0x02 & UART_RX_TOUT_THRHD) << UART_RX_TOUT_THRHD_S |
-//                        UART_RX_TOUT_EN|
+                        #if _ENABLE_CONSOLE_INTEGRATION == 1
+                        (0x02 & UART_RX_TOUT_THRHD) << UART_RX_TOUT_THRHD_S |
+                        UART_RX_TOUT_EN|
+                        #endif
                         ((0x10 & UART_TXFIFO_EMPTY_THRHD)<<UART_TXFIFO_EMPTY_THRHD_S));//wjl
                         #if UART_HW_CTS
                         SET_PERI_REG_MASK( UART_CONF0(uart_no),UART_TX_FLOW_EN);  //add this sentense to add a tx flow control via MTCK( CTS )
@@ -189,22 +289,14 @@ LOCAL void ICACHE_FLASH_ATTR uart_config(uint8 uart_no)
 *******************************************************************************/
 int UART_Recv(uint8 uart_no, char *buffer, int max_buf_len)
 {
-    uint8 max_unload, index = -1;
+    uint8 index = -1;
 
     #if _ENABLE_RING_BUFFER == 1
-    /* If the ring buffer is enabled, then unload from Rx Ring Buffer */
-    uint8 bytes_ringbuffer = ringbuf_bytes_used(rxBuff);
-
-    //ring_buffer_dump(rxBuff);
-    if (bytes_ringbuffer)
-    {
-        max_unload = (bytes_ringbuffer<max_buf_len ? bytes_ringbuffer: max_buf_len);
-
-	ringbuf_memcpy_from(buffer, rxBuff, max_unload);
-    }
+    /* If the ring buffer is enabled, then unload from the Rx FIFO filled by the ISR */
+    index = spscbuf_pop_n(buffer, rxFifo, max_buf_len);
     #else
     /* If the ring buffer is not enabled, then unload from Rx FIFO */
-    uint8 fifo_len = (READ_PERI_REG(UART_STATUS(uart_no))>>UART_RXFIFO_CNT_S)&UART_RXFIFO_CNT;
+    uint8 max_unload, fifo_len = (READ_PERI_REG(UART_STATUS(uart_no))>>UART_RXFIFO_CNT_S)&UART_RXFIFO_CNT;
 
     if (fifo_len)
     {
@@ -224,11 +316,43 @@ int UART_Recv(uint8 uart_no, char *buffer, int max_buf_len)
     return index;
 }
 
+/******************************************************************************
+ * FunctionName : UART_Send
+ * Description  : Public API, queues data for transmission. With the ring
+ *                buffer enabled on UART0 the data is copied into the tx buffer
+ *                and sent by the TXFIFO_EMPTY interrupt, the call never waits.
+ *                If not all data fits, the tx ready callback is called once
+ *                the buffer has drained to half of its size. The ISR pushes
+ *                the echo into the same buffer, so the UART interrupt is
+ *                masked while the data is queued.
+ * Parameters   :   IN      uart number (uart_no)
+ *                  IN      char *buffer
+ *                  IN      int len
+ * Returns      : int (number of bytes queued or sent)
+*******************************************************************************/
 int UART_Send(uint8 uart_no, char *buffer, int len)
 {
     int     index = 0;
     char    ch ;
 
+    #if _ENABLE_RING_BUFFER == 1
+    if (uart_no == UART0 && txFifo != NULL)
+    {
+        if (len == 0)
+            return 0;
+
+        ETS_UART_INTR_DISABLE();
+        index = spscbuf_push_n(txFifo, buffer, len);
+        if (index < len)
+            uart_tx_blocked = 1;
+
+        /* Kick the drain, fires right away as long as the HW FIFO is below threshold */
+        SET_PERI_REG_MASK(UART_INT_ENA(uart_no), UART_TXFIFO_EMPTY_INT_ENA);
+        ETS_UART_INTR_ENABLE();
+        return index;
+    }
+    #endif
+
     //DBG1("Sending: %s\n", buffer);
     for (index=0; index <len; index ++)
     {
@@ -294,39 +418,24 @@ static void uart0_rx_intr_handler(void *para)
         goto end_int_handler;
     }
 
+    if(UART_RXFIFO_OVF_INT_ST == (READ_PERI_REG(UART_INT_ST(uart_no)) & UART_RXFIFO_OVF_INT_ST))
+    {
+        /* HW FIFO overflowed, chars are lost already - save what is there */
+        uart_rx_stats.overruns++;
+        #if _ENABLE_RING_BUFFER == 1
+        uart_rx_drain_fifo(uart_no);
+        #endif
+        WRITE_PERI_REG(UART_INT_CLR(uart_no), UART_RXFIFO_OVF_INT_CLR);
+        goto end_int_handler;
+    }
+
     if(UART_RXFIFO_FULL_INT_ST == (READ_PERI_REG(UART_INT_ST(uart_no)) & UART_RXFIFO_FULL_INT_ST))
     {
         /* Rx FIFO is full, hence the interrupt */
         #if _ENABLE_RING_BUFFER == 1
-        uint16_t index;
-        uint16_t fifo_len = (READ_PERI_REG(UART_STATUS(uart_no))>>UART_RXFIFO_CNT_S)&UART_RXFIFO_CNT;
-        //DBG1("RX FIFO FULL [%d]\r\n", fifo_len );
-
-        if (fifo_len)
-        {
-            //DBG1("Rx Fifo contains %d characters have to unload\r\n", fifo_len);
-
-            for (index=0;index<fifo_len; index++)
-            {
-                uint8_t ch = (READ_PERI_REG(UART_FIFO(UART0)) & 0xFF);
-
-                //if (ch == '\r') ch = '\n';
-	        ringbuf_memcpy_into(rxBuff, &ch, 1);
-                #if _ENABLE_CONSOLE_INTEGRATION == 1
-                uart_tx_one_char(uart_no, ch);
-                if (ch == '\r')
-                {
-                    system_os_post(0, SIG_CONSOLE_RX, 0);
-                }
-                #endif
-            }
-
-            WRITE_PERI_REG(UART_INT_CLR(uart_no), UART_RXFIFO_FULL_INT_CLR);
-            uart_rx_intr_enable(uart_no);
-            #if _ENABLE_CONSOLE_INTEGRATION == 0
-                system_os_post(uart_recvTaskPrio, SIG_UART0, 0);
-            #endif
-        }
+        uart_rx_drain_fifo(uart_no);
+        WRITE_PERI_REG(UART_INT_CLR(uart_no), UART_RXFIFO_FULL_INT_CLR);
+        uart_rx_intr_enable(uart_no);
         #else
         DBG1("RX FIFO FULL [%d]\r\n", (READ_PERI_REG(UART_STATUS(uart_no))>>UART_RXFIFO_CNT_S)& UART_RXFIFO_CNT);
         uart_rx_intr_disable(UART0);
@@ -339,6 +448,13 @@ static void uart0_rx_intr_handler(void *para)
 
     if(UART_RXFIFO_TOUT_INT_ST == (READ_PERI_REG(UART_INT_ST(uart_no)) & UART_RXFIFO_TOUT_INT_ST))
     {
+        #if _ENABLE_CONSOLE_INTEGRATION == 1
+        /* Line is idle with chars below the full threshold in the FIFO */
+        uart_rx_drain_fifo(uart_no);
+        WRITE_PERI_REG(UART_INT_CLR(uart_no), UART_RXFIFO_TOUT_INT_CLR);
+        goto end_int_handler;
+        #endif
+
         /* The Time out threshold for Rx/Tx is being execeeded */
         DBG1("Rx Timeout Threshold not being met \r\n");
         uart_rx_intr_disable(UART0);
@@ -351,11 +467,12 @@ static void uart0_rx_intr_handler(void *para)
     if(UART_TXFIFO_EMPTY_INT_ST == (READ_PERI_REG(UART_INT_ST(uart_no)) & UART_TXFIFO_EMPTY_INT_ST))
     {
         /* The Tx FIFO is empty, the FIFO needs to be fed with new data */
-        DBG1("Tx FIFO is empty\r\n");
         CLEAR_PERI_REG_MASK(UART_INT_ENA(UART0), UART_TXFIFO_EMPTY_INT_ENA);
 
         #if UART_BUFF_EN
             tx_start_uart_buffer(UART0);
+        #elif _ENABLE_RING_BUFFER == 1
+            uart_tx_fill_fifo(UART0);
         #endif
         //system_os_post(uart_recvTaskPrio, 1, 0);
         WRITE_PERI_REG(UART_INT_CLR(uart_no), UART_TXFIFO_EMPTY_INT_CLR);
@@ -365,6 +482,116 @@ end_int_handler:
     return;
 }
 
+/******************************************************************************
+ * FunctionName : uart_rx_drain_fifo
+ * Description  : Internal used function, called from the ISR
+ *                Empties the HW rx FIFO into the rx FIFO in one push. In
+ *                console mode queues the echo behind the pending output and
+ *                posts one SIG_CONSOLE_RX for any number of complete lines,
+ *                or when the rx FIFO overran.
+ * Parameters   : uint8 uart_no
+ * Returns      : NONE
+*******************************************************************************/
+static void uart_rx_drain_fifo(uint8 uart_no)
+{
+    #if _ENABLE_RING_BUFFER == 1
+    uint16_t index, pushed;
+    uint8_t fifo_data[UART_FIFO_LEN];
+    uint16_t fifo_len = (READ_PERI_REG(UART_STATUS(uart_no))>>UART_RXFIFO_CNT_S)&UART_RXFIFO_CNT;
+
+    if (fifo_len == 0)
+        return;
+
+    for (index=0;index<fifo_len; index++)
+    {
+        fifo_data[index] = (READ_PERI_REG(UART_FIFO(UART0)) & 0xFF);
+    }
+    pushed = spscbuf_push_n(rxFifo, fifo_data, fifo_len);
+    uart_rx_stats.bytes += pushed;
+    if (pushed < fifo_len)
+    {
+        uart_rx_stats.overruns++;
+        uart_rx_stats.dropped += fifo_len - pushed;
+    }
+
+    #if _ENABLE_CONSOLE_INTEGRATION == 1
+    {
+        bool new_line = false;
+
+        for (index=0;index<pushed; index++)
+        {
+            if (fifo_data[index] == '\r')
+                new_line = true;
+        }
+        if (uart_echo && txFifo != NULL)
+        {
+            /* Straight into the HW FIFO it would overtake queued output */
+            spscbuf_push_n(txFifo, fifo_data, pushed);
+            uart_tx_fill_fifo(uart_no);
+        }
+        /* A full rx FIFO is posted as well, else a long paste without a
+           '\r' would leave it full and drop every '\r' from then on */
+        if ((new_line || pushed < fifo_len) && !uart_rx_posted)
+        {
+            uart_rx_posted = 1;
+            system_os_post(0, SIG_CONSOLE_RX, 0);
+        }
+    }
+    #else
+    system_os_post(uart_recvTaskPrio, SIG_UART0, 0);
+    #endif
+    #endif
+}
+
+/******************************************************************************
+ * FunctionName : uart_tx_fill_fifo
+ * Description  : Internal used function, called from the ISR
+ *                Moves as much of the tx buffer into the HW FIFO as fits,
+ *                re-arms the TXFIFO_EMPTY interrupt while data is left and
+ *                signals the tx ready callback once a blocked sender may
+ *                continue.
+ * Parameters   : uint8 uart_no
+ * Returns      : NONE
+*******************************************************************************/
+static void uart_tx_fill_fifo(uint8 uart_no)
+{
+    #if _ENABLE_RING_BUFFER == 1
+    uint8_t chunk[UART_FIFO_LEN];
+    uint16_t index, n;
+    uint16_t fifo_cnt = (READ_PERI_REG(UART_STATUS(uart_no))>>UART_TXFIFO_CNT_S)&UART_TXFIFO_CNT;
+
+    n = spscbuf_pop_n(chunk, txFifo, UART_FIFO_LEN - fifo_cnt);
+    for (index = 0; index < n; index++)
+    {
+        WRITE_PERI_REG(UART_FIFO(uart_no), chunk[index]);
+    }
+
+    if (spscbuf_bytes_used(txFifo) != 0)
+    {
+        SET_PERI_REG_MASK(UART_INT_ENA(uart_no), UART_TXFIFO_EMPTY_INT_ENA);
+    }
+
+    if (uart_tx_blocked && spscbuf_bytes_free(txFifo) >= UART_TX_BUFFER_SIZE / 2)
+    {
+        uart_tx_blocked = 0;
+        if (uart_tx_ready_cb != NULL)
+            uart_tx_ready_cb();
+    }
+    #endif
+}
+
+/******************************************************************************
+ * FunctionName : UART_SetTxReadyCb
+ * Description  : Public API, registers the backpressure callback for UART_Send
+ *                It is called from interrupt context.
+ * Parameters   : uart_tx_ready_cb_t cb
+ * Returns      : NONE
+*******************************************************************************/
+void ICACHE_FLASH_ATTR UART_SetTxReadyCb(uart_tx_ready_cb_t cb)
+{
+    uart_tx_ready_cb = cb;
+}
+
 /******************************************************************************
  * FunctionName : uart_tx_one_char_no_wait
  * Description  : uart tx a single char without waiting for fifo
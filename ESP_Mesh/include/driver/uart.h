@@ -21,7 +21,7 @@
 #include "eagle_soc.h"
 #include "c_types.h"
 
-#define UART_TX_BUFFER_SIZE 256  //Ring buffer length of tx buffer
+#define UART_TX_BUFFER_SIZE 512  //Ring buffer length of tx buffer (power of two)
 #define UART_RX_BUFFER_SIZE 256 //Ring buffer length of rx buffer
 
 #define UART_BUFF_EN  0   //use uart buffer  , FOR UART0
@@ -35,7 +35,8 @@
 
 #ifdef _ENABLE_RING_BUFFER
     #include "ringbuf.h"
-    #define RX_RING_BUFFER_SIZE 250
+    #include "spscbuf.h"
+    #define RX_RING_BUFFER_SIZE 256 // ISR to task FIFO, power of two
 #endif
 
 
@@ -228,6 +229,28 @@ void UART_init_console(UartBautRate uart0_br,
                        uint8 recv_task_priority,
                        ringbuf_t rxbuffer,
                        ringbuf_t txBuffer);
+bool UART_RecvConsoleLine(void);
+void UART_SetEcho(bool on);
+int UART_Recv(uint8 uart_no, char *buffer, int max_buf_len);
+int UART_Send(uint8 uart_no, char *buffer, int len);
+
+/* Console rx FIFO trigger level, the rx timeout catches the rest */
+#define UART_RX_FULL_THRESH 32
+
+typedef struct {
+    uint32 bytes;           // chars handed to the rx FIFO
+    uint32 overruns;        // HW FIFO overflows or rx FIFO full
+    uint32 dropped;         // chars lost because the rx FIFO was full
+    uint32 lines;           // complete console lines delivered
+    uint32 dropped_lines;   // console lines longer than the console buffer
+} UartRxStats;
+
+extern UartRxStats uart_rx_stats;
+
+/* Called from interrupt context when the tx buffer has drained after a
+ * UART_Send could not queue all of its data. Must only post to a task. */
+typedef void (*uart_tx_ready_cb_t)(void);
+void UART_SetTxReadyCb(uart_tx_ready_cb_t cb);
 
 #endif
 
@@ -0,0 +1,137 @@
+#ifndef _ACL_FRAME_H_
+#define _ACL_FRAME_H_
+
+#include <string.h>
+
+#include "c_types.h"
+#include "lwip/def.h"
+#include "lwip/ip.h"
+#include "lwip/pbuf.h"
+#include "lwip/udp.h"
+#include "netif/etharp.h"
+#include "acl.h"
+
+//
+// Frames and rules for the ACL test and benchmark, and the linear first
+// match the compiled buckets must agree with
+//
+
+#define FRAME_LEN       (SIZEOF_ETH_HDR + IP_HLEN + 20)
+
+typedef struct {
+        struct pbuf p;
+        uint8_t data[FRAME_LEN];
+        uint8_t proto;
+        uint32_t src, dest;     // network byte order
+        uint16_t s_port, d_port;
+} frame_t;
+
+static const uint16_t frame_ports[] = {0, 22, 53, 80, 123, 443, 1900, 8080};
+
+// 10.24.<0..3>.<0..3>, so masks and addresses overlap
+static inline uint32_t frame_addr(uint32_t *seed)
+{
+    uint32_t r = test_rand(seed);
+
+    return htonl(0x0a180000 | (r & 0x300) | (r & 3));
+}
+
+static inline uint32_t frame_mask(uint32_t *seed)
+{
+    static const uint32_t mask[] = {0, 0xff000000, 0xffff0000, 0xffffff00, 0xffffffff};
+
+    return htonl(mask[test_rand(seed) % 5]);
+}
+
+// A TCP, UDP or ICMP frame, sometimes a later fragment without ports
+static inline void frame_make(frame_t *f, uint32_t *seed)
+{
+    static const uint8_t protos[] = {IP_PROTO_TCP, IP_PROTO_UDP, IP_PROTO_ICMP};
+    struct eth_hdr *eth = (struct eth_hdr *)f->data;
+    struct ip_hdr *iph = (struct ip_hdr *)(f->data + SIZEOF_ETH_HDR);
+    struct udp_hdr *l4 = (struct udp_hdr *)(f->data + SIZEOF_ETH_HDR + IP_HLEN);
+    bool fragment = test_rand(seed) % 8 == 0;
+
+    memset(f, 0, sizeof(frame_t));
+    f->p.payload = f->data;
+    f->p.len = f->p.tot_len = FRAME_LEN;
+    f->proto = protos[test_rand(seed) % 3];
+    f->src = frame_addr(seed);
+    f->dest = frame_addr(seed);
+
+    eth->type = PP_HTONS(ETHTYPE_IP);
+    IPH_VHLTOS_SET(iph, 4, 5, 0);
+    IPH_OFFSET_SET(iph, fragment ? PP_HTONS(100) : 0);
+    IPH_TTL_SET(iph, 64);
+    IPH_PROTO_SET(iph, f->proto);
+    iph->src.addr = f->src;
+    iph->dest.addr = f->dest;
+
+    if (f->proto != IP_PROTO_ICMP)
+    {
+        l4->src = htons(frame_ports[test_rand(seed) % 8] + (test_rand(seed) % 4 == 0 ? 40000 : 0));
+        l4->dest = htons(frame_ports[test_rand(seed) % 8]);
+        if (!fragment)
+        {
+            f->s_port = ntohs(l4->src);
+            f->d_port = ntohs(l4->dest);
+        }
+    }
+}
+
+static inline void rules_make(uint8_t acl_no, int n, uint32_t *seed)
+{
+    static const uint8_t protos[] = {ACL_ANY_PROTO, IP_PROTO_TCP, IP_PROTO_UDP, IP_PROTO_ICMP};
+    uint8_t proto;
+    int i;
+
+    acl_clear(acl_no);
+    for (i = 0; i < n; i++)
+    {
+        proto = protos[test_rand(seed) % 4];
+        acl_add(acl_no, frame_addr(seed), frame_mask(seed), frame_addr(seed), frame_mask(seed), proto,
+                proto == IP_PROTO_ICMP || test_rand(seed) % 4 != 0 ? 0 : frame_ports[test_rand(seed) % 8],
+                proto == IP_PROTO_ICMP || test_rand(seed) % 2 != 0 ? 0 : frame_ports[test_rand(seed) % 8],
+                test_rand(seed) & ACL_ALLOW);
+    }
+}
+
+// Rules for single hosts and small nets on one side, as per client lists
+// are, so the address ranges split the list
+static inline void rules_make_hosts(uint8_t acl_no, int n, uint32_t *seed)
+{
+    static const uint32_t masks[] = {0xffffffff, 0xffffffff, 0xfffffffc, 0xffffff00};
+    uint32_t host, mask;
+    bool src;
+    int i;
+
+    acl_clear(acl_no);
+    for (i = 0; i < n; i++)
+    {
+        host = frame_addr(seed);
+        mask = htonl(masks[test_rand(seed) % 4]);
+        src = test_rand(seed) % 4 != 0;
+        acl_add(acl_no, src ? host : 0, src ? mask : 0, src ? 0 : host, src ? 0 : mask,
+                test_rand(seed) % 2 == 0 ? ACL_ANY_PROTO : IP_PROTO_TCP, 0,
+                test_rand(seed) % 2 == 0 ? 0 : frame_ports[test_rand(seed) % 8], test_rand(seed) & ACL_ALLOW);
+    }
+}
+
+// The first matching rule of the list, -1 for none
+static inline int linear_match(uint8_t acl_no, const frame_t *f)
+{
+    acl_entry *r;
+    int i;
+
+    for (i = 0; i < acl_freep[acl_no]; i++)
+    {
+        r = &acl[acl_no][i];
+        if ((r->proto == ACL_ANY_PROTO || r->proto == f->proto) &&
+            ((f->src ^ r->src) & r->s_mask) == 0 && ((f->dest ^ r->dest) & r->d_mask) == 0 &&
+            (r->s_port == 0 || r->s_port == f->s_port) && (r->d_port == 0 || r->d_port == f->d_port))
+            return i;
+    }
+    return -1;
+}
+
+#endif
@@ -0,0 +1,247 @@
+#include "test.h"
+#include "acl_frame.h"
+
+//
+// acl: ns per acl_check_packet() with the compiled index - port bucket,
+// source and destination range - against the plain first match over the
+// whole list, both parsing the frame the same way. For a port based list,
+// as a firewall for the SoftAP clients would be, a list with a rule per
+// client, and for random lists.
+// Host figures depend on the branch predictor, so the rules checked per
+// packet are counted as well: without a cache or a predictor that is
+// what the time on the LX106 follows. Host ns are the best of REPEAT
+// runs.
+//
+
+#define CHECKS          2000000
+#define REPEAT          9
+#define FRAMES          1024
+#define LINEAR_MAX      4       // ACL_LINEAR_MAX
+#define SPLIT_DIV       2       // ACL_SPLIT_DIV
+
+static frame_t frames[FRAMES];
+
+// The whole list in order, as before the index
+__attribute__((noinline)) static uint8_t linear_check_packet(uint8_t acl_no, struct pbuf *p)
+{
+    struct eth_hdr *eth = (struct eth_hdr *)p->payload;
+    struct ip_hdr *iph = (struct ip_hdr *)((uint8_t *)p->payload + SIZEOF_ETH_HDR);
+    uint16_t hlen;
+    frame_t f;
+    int i;
+
+    if (acl_is_empty(acl_no))
+        return ACL_ALLOW;
+    if (p->len < SIZEOF_ETH_HDR)
+        return ACL_DENY;
+    if (eth->type == PP_HTONS(ETHTYPE_ARP))
+        return ACL_ALLOW;
+    if (eth->type != PP_HTONS(ETHTYPE_IP) || p->len < SIZEOF_ETH_HDR + IP_HLEN)
+        return ACL_DENY;
+
+    f.proto = IPH_PROTO(iph);
+    f.src = iph->src.addr;
+    f.dest = iph->dest.addr;
+    f.s_port = f.d_port = 0;
+    hlen = IPH_HL(iph) * 4;
+    if ((f.proto == IP_PROTO_TCP || f.proto == IP_PROTO_UDP) &&
+        (IPH_OFFSET(iph) & PP_HTONS(IP_OFFMASK)) == 0 && p->len >= SIZEOF_ETH_HDR + hlen + UDP_HLEN)
+    {
+        struct udp_hdr *l4 = (struct udp_hdr *)((uint8_t *)iph + hlen);
+
+        f.s_port = ntohs(l4->src);
+        f.d_port = ntohs(l4->dest);
+    }
+    i = linear_match(acl_no, &f);
+    if (i < 0)
+    {
+        acl_deny_count++;
+        return ACL_DENY;
+    }
+    acl_hits[acl_no][i]++;
+    if (acl[acl_no][i].allow & ACL_ALLOW)
+        acl_allow_count++;
+    else
+        acl_deny_count++;
+    return acl[acl_no][i].allow;
+}
+
+// The group and port condition of the bucket r is in for f
+static bool in_bucket(const acl_entry *r, const frame_t *f, uint16_t port)
+{
+    if (f->proto == IP_PROTO_TCP || f->proto == IP_PROTO_UDP)
+    {
+        if (r->proto != ACL_ANY_PROTO && r->proto != f->proto)
+            return false;
+    }
+    else if (r->proto == IP_PROTO_TCP || r->proto == IP_PROTO_UDP || r->s_port != 0 || r->d_port != 0)
+    {
+        return false;
+    }
+    return r->d_port == 0 || r->d_port == port;
+}
+
+// Rules in the biggest bucket, for each group and port of the list
+static int max_bucket(uint8_t acl_no)
+{
+    static const uint8_t protos[] = {IP_PROTO_TCP, IP_PROTO_UDP, IP_PROTO_ICMP};
+    frame_t f;
+    int g, i, j, n, max = 0;
+
+    for (g = 0; g < 3; g++)
+    {
+        f.proto = protos[g];
+        for (j = -1; j < acl_freep[acl_no]; j++)
+        {
+            for (i = n = 0; i < acl_freep[acl_no]; i++)
+                n += in_bucket(&acl[acl_no][i], &f, j < 0 ? 0 : acl[acl_no][j].d_port);
+            max = n > max ? n : max;
+        }
+    }
+    return max;
+}
+
+// Rules in the biggest address range, at each start and end of a prefix
+static int max_range(uint8_t acl_no, bool src)
+{
+    uint32_t at[2 * MAX_ACL_ENTRIES + 1], a, m;
+    acl_entry *r;
+    int i, j, k, n, max = 0;
+
+    at[0] = 0;
+    for (i = 0, k = 1; i < acl_freep[acl_no]; i++)
+    {
+        r = &acl[acl_no][i];
+        at[k++] = ntohl(src ? r->src : r->dest);
+        at[k++] = (ntohl(src ? r->src : r->dest) | ~ntohl(src ? r->s_mask : r->d_mask)) + 1;
+    }
+    for (j = 0; j < k; j++)
+    {
+        for (i = n = 0; i < acl_freep[acl_no]; i++)
+        {
+            r = &acl[acl_no][i];
+            a = ntohl(src ? r->src : r->dest);
+            m = ntohl(src ? r->s_mask : r->d_mask);
+            n += ((at[j] ^ a) & m) == 0;
+        }
+        max = n > max ? n : max;
+    }
+    return max;
+}
+
+// Rules acl_check() looks at for f: those left by the indexes acl_compile()
+// keeps - the bucket of the port, the ranges of both addresses, each one
+// only if none of its sets has more than half of the rules - up to the
+// match, all of them up to the match in a short list
+static int index_checks(uint8_t acl_no, const frame_t *f)
+{
+    uint16_t port = 0;
+    acl_entry *r;
+    int i, n = 0, match = linear_match(acl_no, f), split = acl_freep[acl_no] / SPLIT_DIV;
+    bool short_list = acl_freep[acl_no] <= LINEAR_MAX;
+    bool by_port = !short_list && max_bucket(acl_no) <= split;
+    bool by_src = !short_list && max_range(acl_no, true) <= split;
+    bool by_dest = !short_list && max_range(acl_no, false) <= split;
+
+    for (i = 0; i < acl_freep[acl_no]; i++)
+    {
+        r = &acl[acl_no][i];
+        if (in_bucket(r, f, f->d_port) && r->d_port == f->d_port)
+            port = f->d_port;
+    }
+    for (i = 0; i < acl_freep[acl_no]; i++)
+    {
+        r = &acl[acl_no][i];
+        if ((by_port && !in_bucket(r, f, port)) || (by_src && ((f->src ^ r->src) & r->s_mask) != 0) ||
+            (by_dest && ((f->dest ^ r->dest) & r->d_mask) != 0))
+            continue;
+        n++;
+        if (i == match)
+            break;
+    }
+    return n;
+}
+
+// ns per packet of CHECKS through one of the two paths
+static double run(bool compiled)
+{
+    volatile uint32_t sink = 0;
+    double t0;
+    int i;
+
+    t0 = test_now_ns();
+    for (i = 0; i < CHECKS; i++)
+    {
+        if (compiled)
+            sink += acl_check_packet(FROM_STA, &frames[i % FRAMES].p);
+        else
+            sink += linear_check_packet(FROM_STA, &frames[i % FRAMES].p);
+    }
+    return (test_now_ns() - t0) / CHECKS;
+}
+
+static void bench(const char *name)
+{
+    uint32_t compiled_checks = 0, linear_checks = 0;
+    double t, t_compiled = 0, t_linear = 0;
+    int i, r;
+
+    // Taking turns, the best of REPEAT runs each
+    for (r = 0; r < REPEAT; r++)
+    {
+        t = run(true);
+        if (r == 0 || t < t_compiled)
+            t_compiled = t;
+        t = run(false);
+        if (r == 0 || t < t_linear)
+            t_linear = t;
+    }
+
+    for (i = 0; i < FRAMES; i++)
+    {
+        compiled_checks += index_checks(FROM_STA, &frames[i]);
+        linear_checks += linear_match(FROM_STA, &frames[i]) < 0 ? acl_freep[FROM_STA] : linear_match(FROM_STA, &frames[i]) + 1;
+    }
+
+    printf("acl: %-9s %2d rules: compiled %4.1f rules %5.1f ns, linear %4.1f rules %5.1f ns per packet\n",
+           name, acl_freep[FROM_STA], (double)compiled_checks / FRAMES, t_compiled,
+           (double)linear_checks / FRAMES, t_linear);
+}
+
+int main(void)
+{
+    static const uint16_t allowed[] = {53, 123, 80, 443, 8080, 1900};
+    uint32_t seed = 20;
+    uint32_t any = 0, net = htonl(0x0a180000), mask16 = htonl(0xffff0000);
+    int i;
+
+    acl_init();
+    for (i = 0; i < FRAMES; i++)
+        frame_make(&frames[i], &seed);
+
+    // Clients may only reach a few services, within the mesh and outside
+    acl_add(FROM_STA, any, any, net, mask16, IP_PROTO_TCP, 0, 22, ACL_DENY);
+    for (i = 0; i < sizeof(allowed) / sizeof(allowed[0]); i++)
+    {
+        acl_add(FROM_STA, net, mask16, any, any, IP_PROTO_UDP, 0, allowed[i], ACL_ALLOW);
+        acl_add(FROM_STA, net, mask16, any, any, IP_PROTO_TCP, 0, allowed[i], ACL_ALLOW);
+    }
+    acl_add(FROM_STA, any, any, any, any, IP_PROTO_ICMP, 0, 0, ACL_ALLOW);
+    acl_add(FROM_STA, any, any, any, any, ACL_ANY_PROTO, 0, 0, ACL_DENY);
+    bench("port list");
+
+    // A rule per client, then the rest of the net
+    acl_clear(FROM_STA);
+    for (i = 0; i < MAX_ACL_ENTRIES - 1; i++)
+        acl_add(FROM_STA, htonl(0x0a180000 | (i & 0xc) << 6 | (i & 3)), htonl(0xffffffff), any, any,
+                ACL_ANY_PROTO, 0, 0, i % 2 == 0 ? ACL_ALLOW : ACL_DENY);
+    acl_add(FROM_STA, net, mask16, any, any, ACL_ANY_PROTO, 0, 0, ACL_ALLOW);
+    bench("host list");
+
+    rules_make(FROM_STA, 4, &seed);
+    bench("random");
+    rules_make(FROM_STA, MAX_ACL_ENTRIES, &seed);
+    bench("random");
+
+    return test_result("bench_acl");
+}
@@ -0,0 +1,165 @@
+#include <string.h>
+
+#include "c_types.h"
+#include "console_cmd.h"
+#include "tokenizer.h"
+#include "test.h"
+
+//
+// console_cmd: dispatch of a corpus of real console commands, walking
+// down the command tables as console_handle_command() does, with
+// console_cmd_find() and with the strcmp cascade it replaced - the names
+// tested one after the other. The tables are those of user_main.c with
+// every option on. Host ns per command (best of REPEAT runs), they show
+// the relation.
+//
+
+#define ROUNDS          200000
+#define REPEAT          5
+#define MAX_TOKENS      9       // MAX_CMD_TOKENS
+
+static int handler(struct espconn *pespconn, char **tokens, int nTokens, char *response)
+{
+    return CMD_DONE;
+}
+
+// As in user_main.c, sorted by name
+static const console_cmd_t route_cmds[] = {
+    { "add",            5, 5, CMD_CFG, handler },
+    { "delete",         4, 4, CMD_CFG, handler },
+};
+
+static const console_cmd_t set_cmds[] = {
+    { "ap_open",        3, 3, CMD_CFG, handler },
+    { "ap_password",    3, 3, CMD_CFG, handler },
+    { "ap_ssid",        3, 3, CMD_CFG, handler },
+    { "automesh",       3, 3, CMD_CFG, handler },
+    { "downstream_kbps", 3, 3, CMD_CFG, handler },
+    { "nat",            3, 3, CMD_CFG, handler },
+    { "network",        3, 3, CMD_CFG, handler },
+    { "password",       3, 3, CMD_CFG, handler },
+    { "ssid",           3, 3, CMD_CFG, handler },
+    { "tcp_timeout",    3, 3, CMD_CFG, handler },
+    { "udp_timeout",    3, 3, CMD_CFG, handler },
+    { "upstream_kbps",  3, 3, CMD_CFG, handler },
+};
+
+static const console_cmd_t show_cmds[] = {
+    { "acl",            2, 2, 0,       handler },
+    { "clients",        2, 2, 0,       handler },
+    { "json",           2, 2, 0,       handler },
+    { "neighbors",      2, 2, 0,       handler },
+    { "route",          2, 2, 0,       handler },
+    { "stats",          2, 2, 0,       handler },
+};
+
+static const console_cmd_t console_cmds[] = {
+    { "acl",            3, 8, CMD_CFG, handler },
+    { "gpio",           3, 5, 0,       handler },
+    { "help",           1, 1, 0,       handler },
+    { "lock",           1, 2, 0,       handler },
+    { "ping",           2, 2, 0,       handler },
+    { "quit",           1, 1, 0,       handler },
+    { "reset",          1, 2, 0,       handler },
+    { "route",          1, 0, 0,       NULL,  route_cmds, CMD_TABLE_LEN(route_cmds) },
+    { "save",           1, 1, CMD_CFG, handler },
+    { "set",            1, 0, 0,       NULL,  set_cmds,   CMD_TABLE_LEN(set_cmds) },
+    { "show",           1, 1, 0,       handler, show_cmds, CMD_TABLE_LEN(show_cmds) },
+    { "unlock",         2, 2, 0,       handler },
+};
+
+static const char *corpus[] = {
+    "show", "show stats", "show clients", "show route", "show json", "show neighbors", "show acl",
+    "set ssid MyUplink", "set password secret123", "set ap_ssid MyMesh", "set ap_password secret123",
+    "set network 192.168.5.0", "set nat 1", "set automesh 1", "set tcp_timeout 1800",
+    "set udp_timeout 60", "set upstream_kbps 2000", "set downstream_kbps 8000",
+    "route add 10.0.0.0 255.0.0.0 192.168.4.2", "route delete 10.0.0.0 255.0.0.0",
+    "acl from_sta allow tcp 192.168.4.0/24 any 80", "acl from_sta clear",
+    "save", "lock", "unlock secret123", "ping 8.8.8.8", "gpio 4 get", "help", "reset",
+    "quit", "set foo 1", "bogus",
+};
+
+static const console_cmd_t *linear_find(const console_cmd_t *table, uint8_t len, const char *name)
+{
+    int i;
+
+    for (i = 0; i < len; i++)
+    {
+        if (strcmp(name, table[i].name) == 0)
+            return &table[i];
+    }
+    return NULL;
+}
+
+// The command the tokens name, as console_handle_command() walks the tables
+static const console_cmd_t *dispatch(char **tokens, int n, bool linear)
+{
+    const console_cmd_t *table = console_cmds, *cmd = NULL, *next;
+    uint8_t table_len = CMD_TABLE_LEN(console_cmds);
+    int level;
+
+    for (level = 0; level < n && table != NULL; level++)
+    {
+        next = linear ? linear_find(table, table_len, tokens[level]) : console_cmd_find(table, table_len, tokens[level]);
+        if (next == NULL)
+            break;
+        cmd = next;
+        table = cmd->sub;
+        table_len = cmd->sub_len;
+    }
+    return cmd;
+}
+
+static bool sorted(const console_cmd_t *table, uint8_t len)
+{
+    int i;
+
+    for (i = 1; i < len; i++)
+    {
+        if (strcmp(table[i - 1].name, table[i].name) >= 0)
+            return false;
+        if (table[i].sub != NULL && !sorted(table[i].sub, table[i].sub_len))
+            return false;
+    }
+    return true;
+}
+
+int main(void)
+{
+    static char lines[sizeof(corpus) / sizeof(corpus[0])][80];
+    char *tokens[sizeof(corpus) / sizeof(corpus[0])][MAX_TOKENS];
+    int ntokens[sizeof(corpus) / sizeof(corpus[0])];
+    const int n = sizeof(corpus) / sizeof(corpus[0]);
+    volatile uintptr_t sink = 0;
+    double t0, t, best[2] = {0, 0};
+    uint32_t r, i;
+    int c, way;
+
+    CHECK(sorted(console_cmds, CMD_TABLE_LEN(console_cmds)));
+    for (c = 0; c < n; c++)
+    {
+        strcpy(lines[c], corpus[c]);
+        ntokens[c] = parse_str_into_tokens(lines[c], tokens[c], MAX_TOKENS);
+        CHECK(dispatch(tokens[c], ntokens[c], false) == dispatch(tokens[c], ntokens[c], true));
+        CHECK((dispatch(tokens[c], ntokens[c], false) == NULL) == (c == n - 1));
+    }
+
+    for (way = 0; way < 2; way++)
+    {
+        for (r = 0; r < REPEAT; r++)
+        {
+            t0 = test_now_ns();
+            for (i = 0; i < ROUNDS; i++)
+            {
+                for (c = 0; c < n; c++)
+                    sink += (uintptr_t)dispatch(tokens[c], ntokens[c], way == 1);
+            }
+            t = (test_now_ns() - t0) / ROUNDS / n;
+            if (r == 0 || t < best[way])
+                best[way] = t;
+        }
+    }
+    printf("console_cmd: %d commands, %d top level: binary search %.1f ns, strcmp cascade %.1f ns per command\n",
+           n, (int)CMD_TABLE_LEN(console_cmds), best[0], best[1]);
+    return test_result("bench_console_cmd");
+}
@@ -0,0 +1,202 @@
+#include <string.h>
+
+#include "c_types.h"
+#include "json_writer.h"
+#include "test.h"
+
+//
+// json_writer: the status document of /status.json and "show json" in
+// the shape status_json() in user_main.c writes it, with a full
+// automesh neighbor table and every optional section. Reported: its
+// size, the time of one serialization, and of the two ways to get it
+// into a heap buffer: measure it, allocate, write it again; or write it
+// once into a buffer sized from the last document plus some slack, as
+// status_json_alloc() does. Host figures, they show the ratio.
+//
+
+#define NEIGHBORS       16      // AUTOMESH_NEIGHBORS
+#define SLACK           64      // STATUS_JSON_SLACK
+#define ROUNDS          200000
+
+static const uint8_t mac[6] = {0x5e, 0xcf, 0x7f, 0x12, 0x34, 0x56};
+
+static void status_doc(json_writer_t *w, uint32_t v, int neighbors)
+{
+    int i;
+
+    json_object_begin(w, NULL);
+    json_uint(w, "uptime", 86400 * 30 + v);
+    json_uint(w, "vdd", 3312);
+    json_uint(w, "bytes_in", 12345678901ULL + v);
+    json_uint(w, "bytes_out", 98765432109ULL + v);
+    json_uint(w, "packets_in", 123456789 + v);
+    json_uint(w, "packets_out", 987654321 + v);
+    json_uint(w, "mesh_level", 2);
+    json_mac(w, "uplink_bssid", mac);
+
+    json_object_begin(w, "automesh");
+    json_uint(w, "state", 3);
+    json_uint(w, "scans", 1234);
+    json_uint(w, "switches", 12);
+    json_uint(w, "held", 34);
+    json_uint(w, "failovers", 5);
+    json_uint(w, "failover_ms", 1870);
+    json_uint(w, "reachable", 100000);
+    json_uint(w, "unreachable", 12);
+    json_uint(w, "rtt", 14);
+    json_array_begin(w, "neighbors");
+    for (i = 0; i < neighbors; i++)
+    {
+        json_object_begin(w, NULL);
+        json_mac(w, "bssid", mac);
+        json_uint(w, "channel", 1 + i % 13);
+        json_int(w, "rssi", -40 - i * 3);
+        json_uint(w, "level", 1 + i % 4);
+        json_uint(w, "load", i % 8);
+        json_uint(w, "napt_free", 254 - i);
+        json_int(w, "uplink_rssi", -55 - i);
+        json_uint(w, "age", i * 1000 + v % 1000);
+        json_uint(w, "cost", 1000 + i * 37);
+        json_object_end(w);
+    }
+    json_array_end(w);
+    json_uint(w, "convergence_ms", 4200);
+    json_object_end(w);
+
+    json_object_begin(w, "napt");
+    json_uint(w, "max", 512);
+    json_uint(w, "portmap_max", 32);
+    json_uint(w, "table", 512);
+    json_uint(w, "tcp", 123);
+    json_uint(w, "udp", 45);
+    json_uint(w, "icmp", 3);
+    json_object_end(w);
+
+    json_object_begin(w, "mesh_route");
+    json_uint(w, "routed", 1);
+    json_uint(w, "adverts_out", 12345);
+    json_uint(w, "adverts_in", 54321);
+    json_uint(w, "rejected", 2);
+    json_uint(w, "conflicts", 1);
+    json_uint(w, "renumbered", 1);
+    json_uint(w, "foreign", 0);
+    json_uint(w, "errors", 0);
+    json_object_end(w);
+
+    json_object_begin(w, "fastpath");
+    json_uint(w, "hits_out", 123456789 + v);
+    json_uint(w, "hits_in", 234567890 + v);
+    json_uint(w, "learned", 123456);
+    json_uint(w, "misses", 234567);
+    json_object_end(w);
+
+    json_object_begin(w, "heap");
+    json_uint(w, "free", 23456 + v % 1000);
+    json_uint(w, "web_peak", 3456);
+    json_object_end(w);
+    json_object_end(w);
+}
+
+// Brackets balanced and outside of strings, no empty members
+static bool well_formed(const char *s, uint16_t len)
+{
+    int depth = 0;
+    bool in_string = false;
+    uint16_t i;
+
+    if (strlen(s) != len)
+        return false;
+    for (i = 0; i < len; i++)
+    {
+        if (s[i] == '"')
+            in_string = !in_string;
+        else if (!in_string && (s[i] == '{' || s[i] == '['))
+            depth++;
+        else if (!in_string && (s[i] == '}' || s[i] == ']'))
+            depth--;
+        else if (!in_string && s[i] == ',' && (s[i + 1] == ',' || s[i + 1] == '}' || s[i + 1] == ']'))
+            return false;
+        if (depth < 0)
+            return false;
+    }
+    return depth == 0 && !in_string;
+}
+
+int main(void)
+{
+    volatile uintptr_t sink = 0;
+    json_writer_t w;
+    char *buf;
+    uint16_t len, len_empty, last_len, size;
+    uint32_t i, rewrites = 0;
+    double t0, t_pass, t_two, t_one;
+
+    json_init(&w, NULL, 0);
+    status_doc(&w, 0, NEIGHBORS);
+    len = w.len;
+    buf = malloc(len + 1);
+    json_init(&w, buf, len + 1);
+    status_doc(&w, 0, NEIGHBORS);
+    CHECK(json_finish(&w));
+    CHECK(well_formed(buf, len));
+    // A buffer one byte short is reported, and still 0-terminated
+    json_init(&w, buf, len);
+    status_doc(&w, 0, NEIGHBORS);
+    CHECK(!json_finish(&w) && strlen(buf) == len - 1);
+    free(buf);
+    json_init(&w, NULL, 0);
+    status_doc(&w, 0, 0);
+    len_empty = w.len;
+
+    t0 = test_now_ns();
+    for (i = 0; i < ROUNDS; i++)
+    {
+        json_init(&w, NULL, 0);
+        status_doc(&w, i, NEIGHBORS);
+        sink += w.len;
+    }
+    t_pass = (test_now_ns() - t0) / ROUNDS;
+
+    t0 = test_now_ns();
+    for (i = 0; i < ROUNDS; i++)
+    {
+        json_init(&w, NULL, 0);
+        status_doc(&w, i, NEIGHBORS);
+        buf = malloc((w.len + 4) & ~3);
+        json_init(&w, buf, w.len + 1);
+        status_doc(&w, i, NEIGHBORS);
+        json_finish(&w);
+        sink += (uintptr_t)buf[w.len / 2];
+        free(buf);
+    }
+    t_two = (test_now_ns() - t0) / ROUNDS;
+
+    last_len = 0;
+    t0 = test_now_ns();
+    for (i = 0; i < ROUNDS; i++)
+    {
+        size = (last_len + SLACK + 4) & ~3;
+        for (;;)
+        {
+            buf = malloc(size);
+            json_init(&w, buf, size);
+            status_doc(&w, i, NEIGHBORS);
+            if (json_finish(&w))
+                break;
+            free(buf);
+            size = (w.len + 4) & ~3;
+            rewrites++;
+        }
+        last_len = w.len;
+        sink += (uintptr_t)buf[w.len / 2];
+        free(buf);
+    }
+    t_one = (test_now_ns() - t0) / ROUNDS;
+
+    CHECK(rewrites == 1);
+    printf("json: status document %u bytes, %u without neighbors; one pass %.0f ns\n",
+           len, len_empty, t_pass);
+    printf("json: measure + malloc + write %.0f ns, write into the last size + %d %.0f ns, %u rewrites\n",
+           t_two, SLACK, t_one, rewrites);
+    return test_result("bench_json");
+}
@@ -0,0 +1,75 @@
+#include <string.h>
+
+#include "c_types.h"
+#include "user_config.h"
+#include "mesh_ie.h"
+#include "test.h"
+
+//
+// mesh_ie: ns per mesh_ie_cache_input() plus mesh_ie_cache_get() on a
+// full cache, as the receive callback and the scan merge use them, for
+// BSSIDs in the cache and for new ones that evict the oldest entry.
+// Host figures, they show the order of magnitude, not the cost on the
+// LX106.
+//
+
+#define ROUNDS          10000000
+#define ELEMENTS        1024
+
+static uint8_t elements[ELEMENTS][5 + MESH_IE_LEN];
+static uint8_t sas[ELEMENTS][6];
+
+static void bench(const char *name, int bssids)
+{
+    static mesh_ie_cache_t c;
+    volatile uintptr_t sink = 0;
+    double t0, t;
+    int i;
+
+    mesh_ie_cache_init(&c);
+    for (i = 0; i < MESH_IE_CACHE; i++)
+        mesh_ie_cache_input(&c, sas[i], elements[i], sizeof(elements[i]), i);
+
+    t0 = test_now_ns();
+    for (i = 0; i < ROUNDS; i++)
+    {
+        int k = i % bssids;
+
+        sink += mesh_ie_cache_input(&c, sas[k], elements[i % ELEMENTS], sizeof(elements[0]), MESH_IE_CACHE + i);
+        sink += (uintptr_t)mesh_ie_cache_get(&c, sas[(i * 7) % bssids], MESH_IE_CACHE + i);
+    }
+    t = (test_now_ns() - t0) / ROUNDS;
+
+    CHECK(c.received == MESH_IE_CACHE + ROUNDS && c.errors == 0);
+    printf("mesh_ie: %2d entries, %-8s: %5.1f ns per insert and lookup\n", MESH_IE_CACHE, name, t);
+}
+
+int main(void)
+{
+    mesh_ie_t ie;
+    uint32_t seed = 23;
+    int i;
+
+    for (i = 0; i < ELEMENTS; i++)
+    {
+        ie.level = test_rand(&seed) % 8;
+        ie.load = test_rand(&seed) % 8;
+        ie.napt_free = test_rand(&seed);
+        ie.uplink_rssi = -(int8_t)(test_rand(&seed) % 90);
+        memset(ie.firmware, 1, 3);
+        elements[i][0] = MESH_IE_ELEMENT_ID;
+        elements[i][1] = 3 + MESH_IE_LEN;
+        elements[i][2] = MESH_IE_OUI0;
+        elements[i][3] = MESH_IE_OUI1;
+        elements[i][4] = MESH_IE_OUI2;
+        mesh_ie_encode(&ie, elements[i] + 5);
+
+        memset(sas[i], 0x24, 6);
+        sas[i][4] = i >> 8;
+        sas[i][5] = i;
+    }
+
+    bench("cached", MESH_IE_CACHE);
+    bench("new", ELEMENTS);
+    return test_result("bench_mesh_ie");
+}
@@ -0,0 +1,280 @@
+#include <string.h>
+
+#include "c_types.h"
+#include "lwip/ip.h"
+#include "napt_table.h"
+#include "test.h"
+
+//
+// napt_table expiry: two hours of NATed traffic through a table of 512
+// flows, with the default NAPT timeouts (TCP 30 min, closing TCP 20 s,
+// UDP and ICMP 2 s) and a sweep once a second. It compares the class
+// queues, which visit only the expired flows and evict the least
+// recently used flow when full, with a flat table that visits every
+// slot per sweep and refuses new flows when full, like the table in
+// liblwip_open_napt.a.
+//
+// Clients open TCP connections that send 5 packets/s for 20 s on
+// average. 10% of them are never closed (a client that left), the rest
+// end with a FIN. On top come 5 DNS lookups/s. Under churn the
+// abandoned connections fill the table for their 30 minutes.
+//
+// Reported: the hit rate (packets after the first of a flow that found
+// its entry), packets refused, live flows that lost their entry (the
+// connection breaks), and the slots visited and ns spent per sweep.
+//
+
+#define MAX_FLOWS       512
+#define TICK            100             // ms
+#define DURATION        (2 * 3600 * 1000)
+#define SWEEP_MAX       32
+#define FLOW_RECORDS    (1 << 17)
+
+static const uint32_t timeouts[NAPT_QUEUES] = {30 * 60 * 1000, 20 * 1000, 2 * 1000, 2 * 1000};
+
+typedef struct {
+        uint8_t proto;
+        bool live;
+        bool broken;
+        bool had_entry[2];
+        uint16_t slot;          // in the flat table, NAPT_NIL if none
+} flow_t;
+
+typedef struct {
+        bool used;
+        uint8_t queue;
+        uint32_t id;
+        uint32_t last;
+} flat_t;
+
+typedef struct {
+        uint32_t packets, firsts, hits, refused, broken;
+        uint32_t sweeps, visited, max_visited;
+        double sweep_ns;
+        uint64_t used_sum;
+} stats_t;
+
+static flow_t flows[FLOW_RECORDS];
+static uint32_t n_flows;
+static uint32_t live[FLOW_RECORDS];
+static uint32_t n_live;
+static flat_t flat[MAX_FLOWS];
+static uint16_t flat_used;
+
+// The 5-tuple of a flow, from its id
+static void flow_key(uint32_t id, uint32_t *src, uint16_t *sport, uint32_t *dst, uint16_t *dport)
+{
+    *src = htonl(0x0a180200 | ((id >> 16) & 0xff));
+    *sport = htons(id & 0xffff);
+    *dst = htonl(0x08080808);
+    *dport = htons(flows[id].proto == IP_PROTO_UDP ? 53 : 443);
+}
+
+static napt_flow_t *table_lookup(napt_table_t *t, uint32_t id)
+{
+    uint32_t src, dst;
+    uint16_t sport, dport;
+
+    flow_key(id, &src, &sport, &dst, &dport);
+    return napt_table_lookup(t, flows[id].proto, src, sport, dst, dport);
+}
+
+static void flat_free(uint16_t i)
+{
+    flows[flat[i].id].slot = NAPT_NIL;
+    flat[i].used = false;
+    flat_used--;
+}
+
+// One packet of flow id through both tables
+static void packet(napt_table_t *t, stats_t *s, uint32_t id, uint32_t now)
+{
+    flow_t *f = &flows[id];
+    uint32_t src, dst;
+    uint16_t sport, dport, i;
+    uint8_t queue = f->proto == IP_PROTO_TCP ? NAPT_Q_TCP : NAPT_Q_UDP;
+    napt_flow_t *nf;
+
+    s[0].packets++;
+    s[1].packets++;
+    if (!f->had_entry[0] && !f->had_entry[1])
+    {
+        s[0].firsts++;
+        s[1].firsts++;
+    }
+
+    // Flat: find it, else take a free slot, else refuse
+    if (f->slot != NAPT_NIL)
+    {
+        s[0].hits++;
+        flat[f->slot].last = now;
+    }
+    else
+    {
+        if (f->had_entry[0] && f->live && !f->broken)
+        {
+            s[0].broken++;
+            f->broken = true;
+        }
+        for (i = 0; i < MAX_FLOWS && flat[i].used; i++)
+            ;
+        if (i == MAX_FLOWS)
+        {
+            s[0].refused++;
+        }
+        else
+        {
+            flat[i].used = true;
+            flat[i].queue = queue;
+            flat[i].id = id;
+            flat[i].last = now;
+            f->slot = i;
+            f->had_entry[0] = true;
+            flat_used++;
+        }
+    }
+
+    // Class queues: find it, else add it and evict if full
+    if ((nf = table_lookup(t, id)) != NULL)
+    {
+        s[1].hits++;
+        napt_table_touch(t, nf, now);
+    }
+    else
+    {
+        if (f->had_entry[1] && f->live)
+            s[1].broken++;
+        flow_key(id, &src, &sport, &dst, &dport);
+        napt_table_insert(t, f->proto, src, sport, dst, dport, now);
+        f->had_entry[1] = true;
+    }
+}
+
+static void flow_start(uint8_t proto)
+{
+    uint32_t id = n_flows++;
+
+    memset(&flows[id], 0, sizeof(flow_t));
+    flows[id].proto = proto;
+    flows[id].slot = NAPT_NIL;
+    flows[id].live = true;
+    live[n_live++] = id;
+}
+
+static void sweep(napt_table_t *t, stats_t *s, uint32_t now)
+{
+    double t0;
+    uint32_t visited;
+    uint16_t i;
+    uint8_t q;
+
+    t0 = test_now_ns();
+    for (i = 0; i < MAX_FLOWS; i++)
+    {
+        if (flat[i].used && now - flat[i].last > timeouts[flat[i].queue])
+            flat_free(i);
+    }
+    s[0].sweep_ns += test_now_ns() - t0;
+    visited = MAX_FLOWS;
+    s[0].visited += visited;
+    if (visited > s[0].max_visited)
+        s[0].max_visited = visited;
+
+    t0 = test_now_ns();
+    visited = napt_table_expire(t, now, SWEEP_MAX);
+    s[1].sweep_ns += test_now_ns() - t0;
+    // The tail still in time ends each class
+    for (q = 0; q < NAPT_QUEUES; q++)
+        visited += t->tail[q] != NAPT_NIL;
+    s[1].visited += visited;
+    if (visited > s[1].max_visited)
+        s[1].max_visited = visited;
+
+    s[0].sweeps++;
+    s[1].sweeps++;
+    s[0].used_sum += flat_used;
+    s[1].used_sum += t->used;
+}
+
+static void simulate(const char *name, uint32_t tcp_per_min)
+{
+    static const char *tables[] = {"flat", "queues"};
+    napt_table_t t;
+    stats_t s[2];
+    uint32_t now, seed = 12, i, j, id;
+    uint8_t q;
+
+    memset(s, 0, sizeof(s));
+    memset(flat, 0, sizeof(flat));
+    flat_used = 0;
+    n_flows = n_live = 0;
+    CHECK(napt_table_init(&t, MAX_FLOWS));
+    for (q = 0; q < NAPT_QUEUES; q++)
+        napt_table_set_timeout(&t, q, timeouts[q]);
+
+    for (now = 0; now < DURATION; now += TICK)
+    {
+        // Arrivals, per 10 ms
+        for (j = 0; j < TICK / 10; j++)
+        {
+            if (test_rand(&seed) % 6000 < tcp_per_min)
+                flow_start(IP_PROTO_TCP);
+            if (test_rand(&seed) % 100 < 5)
+                flow_start(IP_PROTO_UDP);
+        }
+        CHECK(n_flows < FLOW_RECORDS);
+
+        for (i = 0; i < n_live; i++)
+        {
+            id = live[i];
+            if (flows[id].proto == IP_PROTO_UDP)
+            {
+                // Query and answer, then done
+                packet(&t, s, id, now);
+                packet(&t, s, id, now);
+            }
+            else if (test_rand(&seed) % 2 == 0)
+            {
+                packet(&t, s, id, now);
+            }
+
+            if (flows[id].proto == IP_PROTO_UDP || test_rand(&seed) % 200 == 0)
+            {
+                // Done: most TCP connections close, some are abandoned
+                if (flows[id].proto == IP_PROTO_TCP && test_rand(&seed) % 10 != 0)
+                {
+                    napt_flow_t *nf = table_lookup(&t, id);
+
+                    if (nf != NULL)
+                        napt_table_closing(&t, nf);
+                    if (flows[id].slot != NAPT_NIL)
+                        flat[flows[id].slot].queue = NAPT_Q_TCP_FIN;
+                }
+                flows[id].live = false;
+                live[i--] = live[--n_live];
+            }
+        }
+
+        if (now % 1000 == 0)
+            sweep(&t, s, now);
+    }
+
+    for (i = 0; i < 2; i++)
+    {
+        printf("napt_expire: %-6s %-6s: hit rate %5.1f%%, %7u refused, %5u broken flows, "
+               "%4.0f used, sweep %5.1f slots (max %3u) %7.1f ns\n",
+               name, tables[i], 100.0 * s[i].hits / (s[i].packets - s[i].firsts), s[i].refused, s[i].broken,
+               (double)s[i].used_sum / s[i].sweeps, (double)s[i].visited / s[i].sweeps, s[i].max_visited,
+               s[i].sweep_ns / s[i].sweeps);
+    }
+    printf("napt_expire: %-6s %u flows, %u packets, %u evicted, %u expired\n",
+           name, n_flows, s[0].packets, t.evicted, t.expired);
+    napt_table_free(&t);
+}
+
+int main(void)
+{
+    simulate("light", 60);
+    simulate("churn", 180);
+    return test_result("bench_napt_expire");
+}
@@ -0,0 +1,119 @@
+#include <string.h>
+
+#include "c_types.h"
+#include "mem.h"
+#include "ringbuf.h"
+#include "test.h"
+
+//
+// ringbuf: bytes per cycle of the console output path for responses of
+// 80 bytes (a command), 1500 bytes (a full send buffer) and 16 KB. The
+// response is written line by line into a ring of the response size,
+// then handed to the send: the old way copied it out into a heap
+// buffer for espconn_send, the ring now hands its spans over and
+// consumes them when sent. The send itself is left out, both pass
+// pointers to it. The hand-off is measured without the writes too.
+// Host cycles (TSC, best of REPEAT runs), they show the relation, not
+// the figures on the LX106.
+//
+
+#define BYTES           (256 * 1024 * 1024)
+#define LINE            40
+#define REPEAT          5
+
+#define WAY_COPY        0
+#define WAY_SPANS       1
+
+static uint8_t response[16 * 1024];
+
+static void write_lines(ringbuf_t rb, size_t size)
+{
+    size_t i;
+
+    for (i = 0; i < size; i += LINE)
+        ringbuf_memcpy_into(rb, response + i, size - i < LINE ? size - i : LINE);
+}
+
+// Cycles of rounds responses through the ring, the best of REPEAT runs.
+// Without write the response is only committed, for the hand-off alone.
+static uint64_t run(ringbuf_t rb, size_t size, uint32_t rounds, int way, bool write)
+{
+    struct ringbuf_span spans[2];
+    volatile uintptr_t sink = 0;
+    uint64_t t0, t, best = 0;
+    uint32_t i;
+    uint8_t *out;
+    int r;
+
+    for (r = 0; r < REPEAT; r++)
+    {
+        t0 = test_cycles();
+        for (i = 0; i < rounds; i++)
+        {
+            if (write)
+            {
+                write_lines(rb, size);
+            }
+            else
+            {
+                ringbuf_reserve(rb, spans);
+                ringbuf_commit(rb, size);
+            }
+            if (way == WAY_COPY)
+            {
+                out = (uint8_t *)os_malloc(size);
+                ringbuf_memcpy_from(out, rb, size);
+                sink += (uintptr_t)out[i % size];
+                os_free(out);
+            }
+            else
+            {
+                sink += ringbuf_peek(rb, spans) + (uintptr_t)spans[0].data;
+                ringbuf_consume(rb, size);
+            }
+        }
+        t = test_cycles() - t0;
+        if (best == 0 || t < best)
+            best = t;
+    }
+    return best;
+}
+
+static void bench(size_t size)
+{
+    ringbuf_t rb = ringbuf_new(size);
+    uint32_t rounds = BYTES / REPEAT / size;
+    uint64_t t_copy, t_span, h_copy, h_span;
+
+    CHECK(rb != NULL);
+
+    // Start off the buffer start, so the responses wrap now and then
+    ringbuf_memcpy_into(rb, response, size / 3);
+    ringbuf_consume(rb, size / 3);
+
+    t_copy = run(rb, size, rounds, WAY_COPY, true);
+    t_span = run(rb, size, rounds, WAY_SPANS, true);
+    h_copy = run(rb, size, rounds, WAY_COPY, false);
+    h_span = run(rb, size, rounds, WAY_SPANS, false);
+    CHECK(ringbuf_is_empty(rb));
+
+    printf("ringbuf: %5u byte responses: copy %5.2f, spans %5.2f bytes per cycle; "
+           "hand-off copy %7.1f, spans %4.1f cycles\n",
+           (unsigned)size, (double)rounds * size / t_copy, (double)rounds * size / t_span,
+           (double)h_copy / rounds, (double)h_span / rounds);
+    ringbuf_free(&rb);
+}
+
+int main(void)
+{
+    uint32_t seed = 3;
+    size_t i;
+
+    for (i = 0; i < sizeof(response); i++)
+        response[i] = ' ' + test_rand(&seed) % 95;
+
+    bench(80);
+    bench(1500);
+    bench(16 * 1024);
+    return test_result("bench_ringbuf");
+}
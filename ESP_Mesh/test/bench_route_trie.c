@@ -0,0 +1,109 @@
+#include "c_types.h"
+#include "lwip/def.h"
+#include "user_config.h"
+#include "route_trie.h"
+#include "test.h"
+
+//
+// route_trie: ns per ip_find_route() on the trie against a linear longest
+// match over the same routes, as the library scanned ip_rt_table. Once
+// for addresses within the mesh subnets, once for Internet addresses that
+// only match the default route, where most traffic goes. From a few
+// static routes up to the full pool of ROUTE_TRIE_NODES. Host figures,
+// they show the scaling, not the cost on the LX106.
+//
+
+#define LOOKUPS         10000000
+#define ADDRS           1024
+
+static struct route_entry linear[ROUTE_TRIE_NODES];
+static int linear_n;
+
+static struct route_entry *linear_find(ip_addr_t ip)
+{
+    struct route_entry *best = NULL;
+    int i;
+
+    for (i = 0; i < linear_n; i++)
+    {
+        if ((ip.addr & linear[i].mask.addr) == linear[i].ip.addr &&
+            (best == NULL || ntohl(linear[i].mask.addr) > ntohl(best->mask.addr)))
+            best = &linear[i];
+    }
+    return best;
+}
+
+static void lookup(const char *name, const ip_addr_t *addr)
+{
+    volatile uintptr_t sink = 0;
+    double t0, t_trie, t_linear;
+    int i;
+
+    t0 = test_now_ns();
+    for (i = 0; i < LOOKUPS; i++)
+        sink += (uintptr_t)ip_find_route(addr[i % ADDRS]);
+    t_trie = (test_now_ns() - t0) / LOOKUPS;
+
+    t0 = test_now_ns();
+    for (i = 0; i < LOOKUPS; i++)
+        sink += (uintptr_t)linear_find(addr[i % ADDRS]);
+    t_linear = (test_now_ns() - t0) / LOOKUPS;
+
+    printf("route_trie: %3d routes, %3u nodes, %-8s: trie %5.1f ns, linear %5.1f ns per lookup\n",
+           linear_n, route_trie_used(), name, t_trie, t_linear);
+}
+
+static void bench(int routes)
+{
+    static ip_addr_t addr[ADDRS];
+    uint32_t seed = 15;
+    ip_addr_t net, mask, gw;
+    int i;
+
+    for (i = 0; i < linear_n; i++)
+        route_rm_dynamic(linear[i].ip, linear[i].mask);
+    linear_n = 0;
+
+    // A default route, the mesh /16 and /24s below it, like a busy node
+    for (i = 0; i < routes; i++)
+    {
+        if (i == 0)
+            IP4_ADDR(&net, 0, 0, 0, 0);
+        else if (i == 1)
+            IP4_ADDR(&net, 10, 24, 0, 0);
+        else
+            IP4_ADDR(&net, 10, 24, i, 0);
+        mask.addr = htonl(i == 0 ? 0 : (i == 1 ? 0xffff0000 : 0xffffff00));
+        IP4_ADDR(&gw, 10, 24, 0, i);
+        if (!route_add_dynamic(net, mask, gw))
+            break;
+        linear[linear_n].ip = net;
+        linear[linear_n].mask = mask;
+        linear[linear_n].gw = gw;
+        linear_n++;
+    }
+
+    CHECK(linear_n == routes);
+
+    for (i = 0; i < ADDRS; i++)
+        IP4_ADDR(&addr[i], 10, 24, test_rand(&seed) % (routes + 8), test_rand(&seed));
+    lookup("mesh", addr);
+
+    for (i = 0; i < ADDRS; i++)
+    {
+        do
+            addr[i].addr = test_rand(&seed);
+        while (ip4_addr1(&addr[i]) == 10);
+    }
+    lookup("internet", addr);
+}
+
+int main(void)
+{
+    route_trie_reload();
+    bench(MAX_ROUTES);
+    bench(32);
+    bench(128);
+    bench(ROUTE_TRIE_NODES / 2);
+    return test_result("bench_route_trie");
+}
@@ -0,0 +1,172 @@
+#include "test.h"
+#include "shaper_sim.h"
+
+//
+// shaper CoDel: TCP-like uploads through the upstream shaper, with the
+// CoDel of the normal and bulk queues and without it (the queues then
+// only tail drop when full). A flow sends full frames while its window
+// allows, an ACK comes back one base RTT after the shaper delivered a
+// frame, the loss of a dropped frame is noticed one base RTT after the
+// drop. The window grows by one frame per RTT (one per ACK in slow
+// start) and halves at most once per RTT on a loss.
+//
+// Reported: goodput as a share of the rate, and the median and 99th
+// percentile of the time frames wait in the shaper, which is the
+// standing queue the flows keep up. With several flows the queue cannot
+// get much below the frames of their minimum windows that exceed the
+// path, at 4 Mbit/s the bulk class budget of 8 frames is already
+// shorter than the target.
+//
+
+#define DURATION        (60 * 1000000ULL)
+#define WARMUP          (5 * 1000000ULL)
+#define MAX_FLOWS       4
+#define MAX_EVENTS      256
+
+typedef struct {
+        const char *name;
+        uint32_t rate;          // bytes/s
+        uint32_t rtt;           // base RTT, us
+        int flows;              // on two stations
+        bool bounded;           // the class budget alone keeps the queue below the CoDel target
+} scenario_t;
+
+static const scenario_t scenarios[] = {
+    {"1 flow,  1 Mbit/s,  40 ms", 1000 * 1024 / 8, 40000, 1, false},
+    {"4 flows, 1 Mbit/s,  40 ms", 1000 * 1024 / 8, 40000, 4, false},
+    {"4 flows, 1 Mbit/s, 100 ms", 1000 * 1024 / 8, 100000, 4, false},
+    {"4 flows, 4 Mbit/s,  20 ms", 4000 * 1024 / 8, 20000, 4, true},
+};
+
+typedef struct {
+        double cwnd, ssthresh;
+        int inflight;
+        uint64_t last_cut;
+        // ACKs and losses on their way back, in time order
+        uint64_t ev_time[MAX_EVENTS];
+        bool ev_loss[MAX_EVENTS];
+        int ev_head, ev_len;
+} flow_t;
+
+static shaper_t shaper;
+static flow_t flows[MAX_FLOWS];
+static const scenario_t *sc;
+static sim_hist_t hist;
+static uint64_t now, goodput;
+static uint32_t drops;
+
+static void event_add(flow_t *f, bool loss)
+{
+    int i = (f->ev_head + f->ev_len++) % MAX_EVENTS;
+
+    CHECK(f->ev_len <= MAX_EVENTS);
+    f->ev_time[i] = now + sc->rtt;
+    f->ev_loss[i] = loss;
+}
+
+static void sink(struct pbuf *p, struct netif *nif)
+{
+    sim_pbuf_t *sp = sim_pbuf(p);
+
+    sp->delivered = true;
+    event_add(&flows[sp->flow], false);
+    if (now >= WARMUP && now < DURATION)
+    {
+        goodput += p->tot_len;
+        sim_hist_add(&hist, now - sp->offered);
+    }
+    pbuf_free(p);
+}
+
+static void dropped(sim_pbuf_t *sp)
+{
+    event_add(&flows[sp->flow], true);
+    drops++;
+}
+
+static void flow_events(flow_t *f)
+{
+    while (f->ev_len > 0 && f->ev_time[f->ev_head] <= now)
+    {
+        f->inflight--;
+        if (f->ev_loss[f->ev_head])
+        {
+            if (now - f->last_cut > sc->rtt)
+            {
+                f->ssthresh = f->cwnd / 2 < 2 ? 2 : f->cwnd / 2;
+                f->cwnd = f->ssthresh;
+                f->last_cut = now;
+            }
+        }
+        else
+        {
+            f->cwnd += f->cwnd < f->ssthresh ? 1 : 1 / f->cwnd;
+        }
+        f->ev_head = (f->ev_head + 1) % MAX_EVENTS;
+        f->ev_len--;
+    }
+}
+
+static void simulate(bool codel, double *util, double *p50, double *p99)
+{
+    struct pbuf *p;
+    flow_t *f;
+    int i;
+
+    memset(flows, 0, sizeof(flows));
+    memset(&hist, 0, sizeof(hist));
+    goodput = drops = 0;
+    for (i = 0; i < sc->flows; i++)
+    {
+        flows[i].cwnd = 2;
+        flows[i].ssthresh = 64;
+    }
+    shaper_init(&shaper, sink, sink);
+    shaper_set_rate(&shaper, SHAPER_UP, sc->rate, MAX_TOKEN_RATIO * sc->rate, 0);
+    if (!codel)
+        shaper.dir[SHAPER_UP].target = UINT32_MAX;
+    sim_dropped = dropped;
+
+    for (now = 0; now < DURATION; now += SIM_TICK)
+    {
+        for (i = 0; i < sc->flows; i++)
+        {
+            f = &flows[i];
+            flow_events(f);
+            while (f->inflight < (int)f->cwnd)
+            {
+                f->inflight++;
+                p = sim_frame(i % 2, 1514, IP_PROTO_TCP, 5001, now);
+                sim_pbuf(p)->flow = i;
+                shaper_input(&shaper, SHAPER_UP, p, &sim_netif, now);
+            }
+        }
+        shaper_service(&shaper, SHAPER_UP, now);
+    }
+    sim_dropped = NULL;
+    shaper_set_rate(&shaper, SHAPER_UP, 0, 0, now);
+    CHECK(sim_pbufs == 0);
+
+    *util = (double)goodput / sc->rate / ((DURATION - WARMUP) / 1e6);
+    *p50 = sim_hist_ms(&hist, 50);
+    *p99 = sim_hist_ms(&hist, 99);
+    printf("shaper_codel: %s, %-6s: goodput %5.1f%%, queue p50 %5.1f ms, p99 %5.1f ms, %5u drops (%u CoDel)\n",
+           sc->name, codel ? "CoDel" : "off", 100 * *util, *p50, *p99, drops,
+           shaper.dir[SHAPER_UP].cls[SHAPER_BULK].aqm_drops);
+}
+
+int main(void)
+{
+    double util[2], p50[2], p99[2];
+    int s;
+
+    for (s = 0; s < sizeof(scenarios) / sizeof(scenarios[0]); s++)
+    {
+        sc = &scenarios[s];
+        simulate(false, &util[0], &p50[0], &p99[0]);
+        simulate(true, &util[1], &p50[1], &p99[1]);
+        CHECK(sc->bounded ? p50[1] <= p50[0] : p50[1] < 0.7 * p50[0]);
+        CHECK(util[1] > 0.9);
+    }
+    return test_result("bench_shaper_codel");
+}
@@ -0,0 +1,192 @@
+#include "test.h"
+#include "shaper_sim.h"
+
+//
+// shaper fairness: stations sending UDP as fast as they like, or below
+// their share, through the upstream shaper at 1 Mbit/s. Reported is
+// Jain's index of the throughput of each station relative to its
+// max-min fair share (1 is fair, 1/n is one station taking everything)
+// and the use of the rate, for:
+//
+//   fifo      one token bucket and one tail drop queue, the shaper before
+//             it kept per station queues
+//   buckets   a token bucket of rate/n per station, each with its own queue
+//   shaper    shaper.c: one token bucket, deficit round robin over the
+//             station queues
+//
+// Per station buckets are fair only while every station uses its share:
+// what an idle station leaves is lost, so the rate is not reached. The
+// round robin hands it to the stations with a backlog instead.
+//
+
+#define RATE            (1000 * 1024 / 8)
+#define WARMUP          (5 * 1000000ULL)
+#define DURATION        (30 * 1000000ULL)
+#define FIFO_LEN        (SHAPER_NORMAL_QUEUED + SHAPER_BULK_QUEUED)
+#define MAX_STA         SHAPER_STATIONS
+
+typedef struct {
+        const char *name;
+        int n;
+        uint16_t len[MAX_STA];
+        double load[MAX_STA];   // offered, in multiples of the rate
+} scenario_t;
+
+static const scenario_t scenarios[] = {
+    {"equal", 4, {1514, 1514, 1514, 1514}, {2, 2, 2, 2}},
+    {"sizes", 4, {1514, 1000, 600, 1514}, {2, 2, 2, 0.1}},
+    {"hog", 4, {1514, 1514, 1514, 1514}, {5, 0.3, 0.3, 0.3}},
+    {"idle", 8, {1514, 1514, 600, 600, 600, 600, 600, 600}, {2, 2, 0.02, 0.02, 0.02, 0.02, 0.02, 0.02}},
+};
+
+typedef enum { FIFO, BUCKETS, SHAPER } policy_t;
+
+static const char *policies[] = {"fifo", "buckets", "shaper"};
+
+typedef struct {
+        double tokens;
+        uint64_t t_refill;
+        struct pbuf *ring[FIFO_LEN];
+        int head, len, max;
+} model_queue_t;
+
+static shaper_t shaper;
+static double got[MAX_STA];
+static uint64_t now;
+
+static void sink(struct pbuf *p, struct netif *nif)
+{
+    if (now >= WARMUP && now < DURATION)
+        got[sim_pbuf(p)->station] += p->tot_len;
+    pbuf_free(p);
+}
+
+static void model_refill(model_queue_t *q, double rate, uint64_t t)
+{
+    q->tokens += (t - q->t_refill) * rate / 1e6;
+    if (q->tokens > MAX_TOKEN_RATIO * rate)
+        q->tokens = MAX_TOKEN_RATIO * rate;
+    q->t_refill = t;
+}
+
+static void model_input(model_queue_t *q, struct pbuf *p)
+{
+    if (q->len == q->max)
+    {
+        pbuf_free(p);
+        return;
+    }
+    q->ring[(q->head + q->len++) % FIFO_LEN] = p;
+}
+
+static void model_service(model_queue_t *q, double rate, uint64_t t)
+{
+    struct pbuf *p;
+
+    model_refill(q, rate, t);
+    while (q->len > 0 && q->ring[q->head]->tot_len <= q->tokens)
+    {
+        p = q->ring[q->head];
+        q->head = (q->head + 1) % FIFO_LEN;
+        q->len--;
+        q->tokens -= p->tot_len;
+        sink(p, &sim_netif);
+    }
+}
+
+static double simulate(const scenario_t *sc, policy_t policy, double *util)
+{
+    static model_queue_t queues[MAX_STA];
+    double credit[MAX_STA], share[MAX_STA], offered[MAX_STA], sum = 0, jain;
+    struct pbuf *p;
+    uint32_t seed = 17;
+    int i, j, m;
+
+    memset(got, 0, sizeof(got));
+    memset(credit, 0, sizeof(credit));
+    memset(queues, 0, sizeof(queues));
+    for (i = 0; i < MAX_STA; i++)
+        queues[i].max = policy == FIFO ? FIFO_LEN : SHAPER_QUEUE;
+    shaper_init(&shaper, sink, sink);
+    shaper_set_rate(&shaper, SHAPER_UP, RATE, MAX_TOKEN_RATIO * RATE, 0);
+
+    for (now = 0; now < DURATION; now += SIM_TICK)
+    {
+        // The stations in a random order, none is always first
+        for (j = 0, m = test_rand(&seed) % sc->n; j < sc->n; j++)
+        {
+            i = (m + j) % sc->n;
+            credit[i] += sc->load[i] * RATE * SIM_TICK / 1e6;
+            while (credit[i] >= sc->len[i])
+            {
+                credit[i] -= sc->len[i];
+                p = sim_frame(i, sc->len[i], IP_PROTO_UDP, 5001, now);
+                if (policy == SHAPER)
+                    shaper_input(&shaper, SHAPER_UP, p, &sim_netif, now);
+                else
+                    model_input(&queues[policy == FIFO ? 0 : i], p);
+            }
+        }
+
+        if (policy == SHAPER)
+            shaper_service(&shaper, SHAPER_UP, now);
+        else
+        {
+            for (m = 0; m < (policy == FIFO ? 1 : sc->n); m++)
+                model_service(&queues[m], policy == FIFO ? RATE : (double)RATE / sc->n, now);
+        }
+    }
+
+    // Nothing is lost on the way
+    shaper_set_rate(&shaper, SHAPER_UP, 0, 0, now);
+    for (i = 0; i < MAX_STA; i++)
+    {
+        while (queues[i].len > 0)
+        {
+            pbuf_free(queues[i].ring[queues[i].head]);
+            queues[i].head = (queues[i].head + 1) % FIFO_LEN;
+            queues[i].len--;
+        }
+    }
+    CHECK(sim_pbufs == 0);
+
+    for (i = 0; i < sc->n; i++)
+    {
+        offered[i] = sc->load[i] * RATE;
+        got[i] /= (DURATION - WARMUP) / 1e6;
+        sum += got[i];
+    }
+    sim_fair_share(offered, share, sc->n, RATE);
+    jain = sim_jain(got, share, sc->n);
+    *util = sum / RATE;
+
+    printf("shaper_fairness: %-5s %-7s: Jain %.3f, %5.1f%% of the rate, kB/s:", sc->name, policies[policy],
+           jain, 100 * *util);
+    for (i = 0; i < sc->n; i++)
+        printf(" %5.1f", got[i] / 1000);
+    printf("  (fair:");
+    for (i = 0; i < sc->n; i++)
+        printf(" %5.1f", share[i] / 1000);
+    printf(")\n");
+    return jain;
+}
+
+int main(void)
+{
+    double jain, util;
+    int s, p;
+
+    for (s = 0; s < sizeof(scenarios) / sizeof(scenarios[0]); s++)
+    {
+        for (p = FIFO; p <= SHAPER; p++)
+        {
+            jain = simulate(&scenarios[s], p, &util);
+            if (p == SHAPER)
+            {
+                CHECK(jain > 0.98);
+                CHECK(util > 0.97 && util < 1.002);
+            }
+        }
+    }
+    return test_result("bench_shaper_fairness");
+}
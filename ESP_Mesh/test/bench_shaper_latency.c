@@ -0,0 +1,120 @@
+#include "test.h"
+#include "shaper_sim.h"
+
+//
+// shaper latency: small frames (DNS queries, pure TCP ACKs, pings)
+// through the upstream shaper at 1 Mbit/s while two stations upload
+// bulk UDP at twice the rate each. One of them also sends the small
+// frames, a third station sends them on an idle link. Reported are the
+// median and 99th percentile of the time small frames wait and the
+// share that is lost:
+//
+//   before   the small frames are marked CS1, so they take the bulk
+//            class with the upload, as all frames did before classify()
+//   after    classified, the small frames are interactive
+//
+
+#define RATE            (1000 * 1024 / 8)
+#define DURATION        (60 * 1000000ULL)
+#define SMALL_GAP       (20 * 1000)     // us between small frames of a kind
+#define DSCP_CS1        8
+
+enum { BULK_A, BULK_B, QUIET, STATIONS };
+
+typedef struct {
+        const char *name;
+        uint16_t len;
+        uint8_t proto;
+        uint16_t port;
+} small_t;
+
+static const small_t smalls[] = {
+    {"dns", 80, IP_PROTO_UDP, 53},
+    {"ack", 54, IP_PROTO_TCP, 443},
+    {"ping", 98, IP_PROTO_ICMP, 0},
+};
+
+static shaper_t shaper;
+static sim_hist_t hist[STATIONS];
+static uint32_t small_sent[STATIONS], bulk_bytes;
+static uint64_t now;
+
+static void sink(struct pbuf *p, struct netif *nif)
+{
+    sim_pbuf_t *sp = sim_pbuf(p);
+
+    if (p->tot_len < SHAPER_SMALL)
+        sim_hist_add(&hist[sp->station], now - sp->offered);
+    else
+        bulk_bytes += p->tot_len;
+    pbuf_free(p);
+}
+
+static void small_send(uint8_t station, const small_t *k, bool marked)
+{
+    struct pbuf *p = sim_frame(station, k->len, k->proto, k->port, now);
+
+    if (marked)
+        IPH_VHLTOS_SET((struct ip_hdr *)((uint8_t *)p->payload + SIZEOF_ETH_HDR), 4, 5, DSCP_CS1 << 2);
+    small_sent[station]++;
+    shaper_input(&shaper, SHAPER_UP, p, &sim_netif, now);
+}
+
+static void simulate(bool marked, double *p99)
+{
+    static const char *stations[] = {"bulk sender", "", "quiet station"};
+    double credit[2] = {0, 0};
+    uint32_t seed = 18;
+    int i, k;
+
+    memset(hist, 0, sizeof(hist));
+    memset(small_sent, 0, sizeof(small_sent));
+    bulk_bytes = 0;
+    shaper_init(&shaper, sink, sink);
+    shaper_set_rate(&shaper, SHAPER_UP, RATE, MAX_TOKEN_RATIO * RATE, 0);
+
+    for (now = 0; now < DURATION; now += SIM_TICK)
+    {
+        for (i = BULK_A; i <= BULK_B; i++)
+        {
+            credit[i] += 2.0 * RATE * SIM_TICK / 1e6;
+            while (credit[i] >= 1514)
+            {
+                credit[i] -= 1514;
+                shaper_input(&shaper, SHAPER_UP, sim_frame(i, 1514, IP_PROTO_UDP, 5001, now), &sim_netif, now);
+            }
+        }
+        // Each kind about every SMALL_GAP, not in step with the bulk
+        for (k = 0; k < sizeof(smalls) / sizeof(smalls[0]); k++)
+        {
+            if (test_rand(&seed) % (SMALL_GAP / SIM_TICK) == 0)
+                small_send(BULK_A, &smalls[k], marked);
+            if (test_rand(&seed) % (SMALL_GAP / SIM_TICK) == 0)
+                small_send(QUIET, &smalls[k], marked);
+        }
+        shaper_service(&shaper, SHAPER_UP, now);
+    }
+    shaper_set_rate(&shaper, SHAPER_UP, 0, 0, now);
+    CHECK(sim_pbufs == 0);
+
+    for (i = BULK_A; i < STATIONS; i += QUIET - BULK_A)
+    {
+        printf("shaper_latency: %-6s %-13s: p50 %6.1f ms, p99 %6.1f ms, %5.1f%% lost\n",
+               marked ? "before" : "after", stations[i], sim_hist_ms(&hist[i], 50), sim_hist_ms(&hist[i], 99),
+               100.0 * (small_sent[i] - hist[i].n) / small_sent[i]);
+        p99[i] = sim_hist_ms(&hist[i], 99);
+    }
+    printf("shaper_latency: %-6s bulk %.1f kB/s\n", marked ? "before" : "after", bulk_bytes / (DURATION / 1e6) / 1000);
+}
+
+int main(void)
+{
+    double before[STATIONS], after[STATIONS];
+
+    simulate(true, before);
+    simulate(false, after);
+    // Small frames wait only for their own tokens and those of other small frames
+    CHECK(after[BULK_A] < 5 && after[QUIET] < 5);
+    CHECK(after[BULK_A] < before[BULK_A]);
+    return test_result("bench_shaper_latency");
+}
@@ -0,0 +1,156 @@
+#include <ctype.h>
+#include <string.h>
+
+#include "c_types.h"
+#include "tokenizer.h"
+#include "test.h"
+
+//
+// tokenizer: console command lines through the old path - copy the line
+// out of the ring, unescape it in place, then cut it into tokens - and
+// through tokenize_spans() straight from the two spans of the ring.
+// Lines from plain commands to a full MAX_CON_CMD_SIZE line of %XX, each
+// wrapped in the middle of the ring. Host ns per line (best of REPEAT
+// runs) and MB/s of input, they show the relation.
+//
+
+#define ROUNDS          500000
+#define REPEAT          5
+#define MAX_TOKENS      9       // MAX_CMD_TOKENS
+#define CMD_SIZE        80      // MAX_CON_CMD_SIZE
+
+static const char *lines[] = {
+    "show stats\r",
+    "set ssid My\\ Mesh\\ AP\r",
+    "set password my\\ secret%21\r",
+    "acl add from_sta allow tcp 192.168.4.0/24 any 80\r",
+    "set password %41%42%43%44%45%46%47%48%49%4a%4b%4c%4d%4e%4f%50%51%52%53%54\r",
+};
+
+// parse_str_into_tokens() before tokenize_spans(), as the baseline
+static int old_parse(char *str, char **tokens, int max_tokens)
+{
+    char *p, *q, *end;
+    int token_count = 0;
+    bool in_token = false;
+
+    for (p = q = str; *p != 0; p++)
+    {
+        if (*(p) == '%' && *(p + 1) != 0 && *(p + 2) != 0)
+        {
+            uint8_t a;
+            p++;
+            if (*p <= '9')
+                a = *p - '0';
+            else
+                a = toupper(*p) - 'A' + 10;
+            a <<= 4;
+            p++;
+            if (*p <= '9')
+                a += *p - '0';
+            else
+                a += toupper(*p) - 'A' + 10;
+            *q++ = a;
+        }
+        else if (*p == '\\' && *(p + 1) != 0)
+        {
+            *q++ = *++p;
+        }
+        else if (*p == 8)
+        {
+            if (q != str)
+                q--;
+        }
+        else if (*p <= ' ')
+        {
+            *q++ = 0;
+        }
+        else
+        {
+            *q++ = *p;
+        }
+    }
+
+    end = q;
+    *q = 0;
+
+    for (p = str; p != end; p++)
+    {
+        if (*p == 0)
+        {
+            if (in_token)
+                in_token = false;
+        }
+        else if (!in_token)
+        {
+            tokens[token_count++] = p;
+            if (token_count == max_tokens)
+                return token_count;
+            in_token = true;
+        }
+    }
+    return token_count;
+}
+
+// ns per line of rounds through one of the two paths, the best of REPEAT runs
+static double run(const struct ringbuf_span *spans, bool old, int *ntokens)
+{
+    char cmd_line[CMD_SIZE + 1], *tokens[MAX_TOKENS];
+    volatile int sink = 0;
+    double t0, t, best = 0;
+    uint32_t r, i;
+
+    for (r = 0; r < REPEAT; r++)
+    {
+        t0 = test_now_ns();
+        for (i = 0; i < ROUNDS; i++)
+        {
+            if (old)
+            {
+                memcpy(cmd_line, spans[0].data, spans[0].len);
+                memcpy(cmd_line + spans[0].len, spans[1].data, spans[1].len);
+                cmd_line[spans[0].len + spans[1].len] = 0;
+                *ntokens = old_parse(cmd_line, tokens, MAX_TOKENS);
+            }
+            else
+            {
+                *ntokens = tokenize_spans(spans, 2, cmd_line, sizeof(cmd_line), tokens, MAX_TOKENS, NULL);
+            }
+            sink += tokens[*ntokens - 1][0];
+        }
+        t = (test_now_ns() - t0) / ROUNDS;
+        if (r == 0 || t < best)
+            best = t;
+    }
+    return best;
+}
+
+int main(void)
+{
+    static uint8_t ring[2 * CMD_SIZE];
+    struct ringbuf_span spans[2];
+    double t_old, t_new;
+    int l, n_old, n_new;
+    size_t len;
+
+    for (l = 0; l < sizeof(lines) / sizeof(lines[0]); l++)
+    {
+        // The line wraps around the end of the ring in its middle
+        len = strlen(lines[l]);
+        CHECK(len <= CMD_SIZE);
+        spans[0].data = ring + sizeof(ring) - len / 2;
+        spans[0].len = len / 2;
+        spans[1].data = ring;
+        spans[1].len = len - len / 2;
+        memcpy(spans[0].data, lines[l], spans[0].len);
+        memcpy(spans[1].data, lines[l] + spans[0].len, spans[1].len);
+
+        t_old = run(spans, true, &n_old);
+        t_new = run(spans, false, &n_new);
+        CHECK(n_old == n_new);
+        printf("tokenizer: %2u bytes, %d tokens: copy + two passes %6.1f ns (%5.1f MB/s), "
+               "tokenize_spans %6.1f ns (%5.1f MB/s)\n",
+               (unsigned)len, n_new, t_old, len * 1e3 / t_old, t_new, len * 1e3 / t_new);
+    }
+    return test_result("bench_tokenizer");
+}
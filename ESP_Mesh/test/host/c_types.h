@@ -0,0 +1,31 @@
+#ifndef _C_TYPES_H_
+#define _C_TYPES_H_
+
+// Host stand-in for the SDK's c_types.h
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef uint8_t uint8;
+typedef uint16_t uint16;
+typedef uint32_t uint32;
+typedef int8_t sint8;
+typedef int16_t sint16;
+typedef int32_t sint32;
+
+#define ICACHE_FLASH_ATTR
+#define ICACHE_RAM_ATTR
+#define ICACHE_RODATA_ATTR
+
+#define LOCAL static
+
+typedef enum {
+    OK = 0,
+    FAIL,
+    PENDING,
+    BUSY,
+    CANCEL,
+} STATUS;
+
+#endif
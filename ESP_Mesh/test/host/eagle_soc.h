@@ -0,0 +1,30 @@
+#ifndef _EAGLE_SOC_H_
+#define _EAGLE_SOC_H_
+
+// Host stand-in for the SDK's eagle_soc.h: the peripheral registers are
+// read and written through the simulation of the test, the pin muxing
+// is left out
+
+#include "c_types.h"
+
+#define BIT(nr)                         (1UL << (nr))
+
+uint32 host_reg_read(uint32 addr);
+void host_reg_write(uint32 addr, uint32 val);
+
+#define READ_PERI_REG(addr)             host_reg_read(addr)
+#define WRITE_PERI_REG(addr, val)       host_reg_write((addr), (val))
+#define SET_PERI_REG_MASK(reg, mask)    WRITE_PERI_REG((reg), READ_PERI_REG(reg) | (mask))
+#define CLEAR_PERI_REG_MASK(reg, mask)  WRITE_PERI_REG((reg), READ_PERI_REG(reg) & ~(mask))
+
+#define UART_CLK_FREQ                   (26000000 * 3)
+
+#define PERIPHS_IO_MUX_U0TXD_U          0
+#define PERIPHS_IO_MUX_GPIO2_U          0
+#define PERIPHS_IO_MUX_MTDO_U           0
+#define PERIPHS_IO_MUX_MTCK_U           0
+#define FUNC_U0TXD                      0
+#define PIN_FUNC_SELECT(pin, func)      ((void)(pin), (void)(func))
+#define PIN_PULLUP_DIS(pin)             ((void)(pin))
+
+#endif
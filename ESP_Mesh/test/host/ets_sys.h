@@ -0,0 +1,20 @@
+#ifndef _ETS_SYS_H
+#define _ETS_SYS_H
+
+// Host stand-in for the SDK's ets_sys.h: attaching and masking the UART
+// interrupt go to the simulation of the test
+
+#include "c_types.h"
+#include "eagle_soc.h"
+
+typedef void (*host_isr_t)(void *arg);
+
+void host_isr_attach(host_isr_t isr, void *arg);
+void host_isr_mask(bool masked);
+void uart_div_modify(uint8 uart_no, uint32 div);
+
+#define ETS_UART_INTR_ATTACH(func, arg) host_isr_attach((host_isr_t)(func), (arg))
+#define ETS_UART_INTR_ENABLE()          host_isr_mask(false)
+#define ETS_UART_INTR_DISABLE()         host_isr_mask(true)
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef __ESPCONN_H__
+#define __ESPCONN_H__
+
+// Host stand-in for the SDK's espconn.h: the console handlers only pass
+// the connection on, the web sessions use the TCP part, the test
+// provides the functions
+
+#include "c_types.h"
+
+typedef void (*espconn_connect_callback)(void *arg);
+typedef void (*espconn_reconnect_callback)(void *arg, sint8 err);
+typedef void (*espconn_recv_callback)(void *arg, char *pdata, unsigned short len);
+typedef void (*espconn_sent_callback)(void *arg);
+
+typedef struct _esp_tcp {
+    int remote_port;
+    int local_port;
+    uint8 local_ip[4];
+    uint8 remote_ip[4];
+} esp_tcp;
+
+struct espconn {
+    union {
+        esp_tcp *tcp;
+    } proto;
+    void *reverse;
+};
+
+sint8 espconn_send(struct espconn *espconn, uint8 *psent, uint16 length);
+sint8 espconn_disconnect(struct espconn *espconn);
+sint8 espconn_regist_recvcb(struct espconn *espconn, espconn_recv_callback recv_cb);
+sint8 espconn_regist_sentcb(struct espconn *espconn, espconn_sent_callback sent_cb);
+sint8 espconn_regist_disconcb(struct espconn *espconn, espconn_connect_callback discon_cb);
+sint8 espconn_regist_reconcb(struct espconn *espconn, espconn_reconnect_callback recon_cb);
+
+#endif
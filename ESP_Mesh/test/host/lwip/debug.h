@@ -0,0 +1,9 @@
+#ifndef __LWIP_DEBUG_H__
+#define __LWIP_DEBUG_H__
+
+// Host stand-in for lwIP's debug.h, pulled in by ../include/lwip/opt.h
+
+#define LWIP_DBG_OFF    0x00
+#define LWIP_DBG_ON     0x80
+
+#endif
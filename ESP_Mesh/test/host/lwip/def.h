@@ -0,0 +1,18 @@
+#ifndef __LWIP_DEF_H__
+#define __LWIP_DEF_H__
+
+// Host stand-in for lwIP's def.h
+
+#include <arpa/inet.h>
+
+#define PP_HTONS(x)     ((uint16_t)((((x) & 0xff) << 8) | (((x) & 0xff00) >> 8)))
+#define PP_NTOHS(x)     PP_HTONS(x)
+#define PP_HTONL(x)     ((((x) & 0xff) << 24) | (((x) & 0xff00) << 8) | \
+                         (((x) & 0xff0000UL) >> 8) | (((x) & 0xff000000UL) >> 24))
+#define PP_NTOHL(x)     PP_HTONL(x)
+
+#ifndef MIN
+#define MIN(x, y)       ((x) < (y) ? (x) : (y))
+#endif
+
+#endif
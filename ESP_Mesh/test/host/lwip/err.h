@@ -0,0 +1,12 @@
+#ifndef __LWIP_ERR_H__
+#define __LWIP_ERR_H__
+
+// Host stand-in for lwIP's err.h
+
+typedef signed char err_t;
+
+#define ERR_OK          0
+#define ERR_MEM         -1
+#define ERR_ARG         -14
+
+#endif
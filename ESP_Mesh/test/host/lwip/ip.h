@@ -0,0 +1,48 @@
+#ifndef __LWIP_IP_H__
+#define __LWIP_IP_H__
+
+// Host stand-in for lwIP's ip.h, the IPv4 header
+
+#include "c_types.h"
+#include "lwip/def.h"
+#include "lwip/ip_addr.h"
+
+#define IP_HLEN         20
+
+#define IP_PROTO_ICMP   1
+#define IP_PROTO_UDP    17
+#define IP_PROTO_TCP    6
+
+#define IP_RF           0x8000U
+#define IP_DF           0x4000U
+#define IP_MF           0x2000U
+#define IP_OFFMASK      0x1fffU
+
+struct ip_hdr {
+    uint16_t _v_hl_tos;
+    uint16_t _len;
+    uint16_t _id;
+    uint16_t _offset;
+    uint8_t _ttl;
+    uint8_t _proto;
+    uint16_t _chksum;
+    ip_addr_p_t src;
+    ip_addr_p_t dest;
+} __attribute__((packed));
+
+#define IPH_V(hdr)      (ntohs((hdr)->_v_hl_tos) >> 12)
+#define IPH_HL(hdr)     ((ntohs((hdr)->_v_hl_tos) >> 8) & 0x0f)
+#define IPH_TOS(hdr)    (ntohs((hdr)->_v_hl_tos) & 0xff)
+#define IPH_LEN(hdr)    ((hdr)->_len)
+#define IPH_ID(hdr)     ((hdr)->_id)
+#define IPH_OFFSET(hdr) ((hdr)->_offset)
+#define IPH_TTL(hdr)    ((hdr)->_ttl)
+#define IPH_PROTO(hdr)  ((hdr)->_proto)
+#define IPH_CHKSUM(hdr) ((hdr)->_chksum)
+
+#define IPH_VHLTOS_SET(hdr, v, hl, tos) (hdr)->_v_hl_tos = htons(((v) << 12) | ((hl) << 8) | (tos))
+#define IPH_OFFSET_SET(hdr, off) (hdr)->_offset = (off)
+#define IPH_TTL_SET(hdr, ttl) (hdr)->_ttl = (uint8_t)(ttl)
+#define IPH_PROTO_SET(hdr, proto) (hdr)->_proto = (uint8_t)(proto)
+
+#endif
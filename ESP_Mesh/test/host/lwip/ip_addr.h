@@ -0,0 +1,28 @@
+#ifndef __LWIP_IP_ADDR_H__
+#define __LWIP_IP_ADDR_H__
+
+// Host stand-in for lwIP's ip_addr.h
+
+#include "c_types.h"
+
+typedef struct ip_addr {
+    uint32_t addr;
+} ip_addr_t;
+
+typedef struct ip_addr_packed {
+    uint32_t addr;
+} __attribute__((packed)) ip_addr_p_t;
+
+#define IP4_ADDR(ipaddr, a, b, c, d) \
+    (ipaddr)->addr = htonl(((uint32_t)((a) & 0xff) << 24) | ((uint32_t)((b) & 0xff) << 16) | \
+                           ((uint32_t)((c) & 0xff) << 8) | (uint32_t)((d) & 0xff))
+
+#define ip4_addr1(ipaddr) (((uint8_t *)(ipaddr))[0])
+#define ip4_addr2(ipaddr) (((uint8_t *)(ipaddr))[1])
+#define ip4_addr3(ipaddr) (((uint8_t *)(ipaddr))[2])
+#define ip4_addr4(ipaddr) (((uint8_t *)(ipaddr))[3])
+
+#define IPSTR "%d.%d.%d.%d"
+#define IP2STR(ipaddr) ip4_addr1(ipaddr), ip4_addr2(ipaddr), ip4_addr3(ipaddr), ip4_addr4(ipaddr)
+
+#endif
@@ -0,0 +1,25 @@
+#ifndef __LWIP_NETIF_H__
+#define __LWIP_NETIF_H__
+
+// Host stand-in for lwIP's netif.h, the fields the modules use
+
+#include "c_types.h"
+#include "lwip/ip_addr.h"
+
+#define NETIF_MAX_HWADDR_LEN    6U
+
+struct netif {
+    struct netif *next;
+    ip_addr_t ip_addr;
+    ip_addr_t netmask;
+    ip_addr_t gw;
+    uint8_t hwaddr_len;
+    uint8_t hwaddr[NETIF_MAX_HWADDR_LEN];
+    uint16_t mtu;
+    uint8_t flags;
+    char name[2];
+    uint8_t num;
+    uint8_t napt;
+};
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef __LWIP_PBUF_H__
+#define __LWIP_PBUF_H__
+
+// Host stand-in for lwIP's pbuf.h, the fields the modules use
+
+#include "c_types.h"
+#include "lwip/err.h"
+
+typedef enum {
+    PBUF_TRANSPORT,
+    PBUF_IP,
+    PBUF_LINK,
+    PBUF_RAW
+} pbuf_layer;
+
+typedef enum {
+    PBUF_RAM,
+    PBUF_ROM,
+    PBUF_REF,
+    PBUF_POOL,
+    PBUF_ESF_RX
+} pbuf_type;
+
+struct pbuf {
+    struct pbuf *next;
+    void *payload;
+    uint16_t tot_len;
+    uint16_t len;
+    uint8_t type;
+    uint8_t flags;
+    uint16_t ref;
+    void *eb;
+};
+
+// Provided by the test that needs them
+struct pbuf *pbuf_alloc(pbuf_layer layer, uint16_t length, pbuf_type type);
+uint8_t pbuf_free(struct pbuf *p);
+void pbuf_ref(struct pbuf *p);
+err_t pbuf_copy(struct pbuf *p_to, struct pbuf *p_from);
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef __LWIP_TCP_IMPL_H__
+#define __LWIP_TCP_IMPL_H__
+
+// Host stand-in for lwIP's tcp_impl.h, the TCP header
+
+#include "c_types.h"
+#include "lwip/def.h"
+
+#define TCP_HLEN        20
+
+#define TCP_FIN         0x01U
+#define TCP_SYN         0x02U
+#define TCP_RST         0x04U
+#define TCP_PSH         0x08U
+#define TCP_ACK         0x10U
+
+struct tcp_hdr {
+    uint16_t src;
+    uint16_t dest;
+    uint32_t seqno;
+    uint32_t ackno;
+    uint16_t _hdrlen_rsvd_flags;
+    uint16_t wnd;
+    uint16_t chksum;
+    uint16_t urgp;
+} __attribute__((packed));
+
+#define TCPH_HDRLEN(phdr)       (ntohs((phdr)->_hdrlen_rsvd_flags) >> 12)
+#define TCPH_FLAGS(phdr)        (ntohs((phdr)->_hdrlen_rsvd_flags) & 0x3f)
+
+#endif
@@ -0,0 +1,17 @@
+#ifndef __LWIP_UDP_H__
+#define __LWIP_UDP_H__
+
+// Host stand-in for lwIP's udp.h, the UDP header
+
+#include "c_types.h"
+
+#define UDP_HLEN        8
+
+struct udp_hdr {
+    uint16_t src;
+    uint16_t dest;
+    uint16_t len;
+    uint16_t chksum;
+} __attribute__((packed));
+
+#endif
@@ -0,0 +1,12 @@
+#ifndef _MEM_H_
+#define _MEM_H_
+
+// Host stand-in for the SDK's mem.h
+
+#include <stdlib.h>
+
+#define os_malloc       malloc
+#define os_zalloc(s)    calloc(1, (s))
+#define os_free         free
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef __NETIF_ETHARP_H__
+#define __NETIF_ETHARP_H__
+
+// Host stand-in for lwIP's etharp.h, the Ethernet header
+
+#include "c_types.h"
+
+#define ETHARP_HWADDR_LEN       6
+#define SIZEOF_ETH_HDR          14
+
+#define ETHTYPE_ARP     0x0806U
+#define ETHTYPE_IP      0x0800U
+
+struct eth_addr {
+    uint8_t addr[ETHARP_HWADDR_LEN];
+} __attribute__((packed));
+
+struct eth_hdr {
+    struct eth_addr dest;
+    struct eth_addr src;
+    uint16_t type;
+} __attribute__((packed));
+
+#endif
@@ -0,0 +1,13 @@
+#ifndef _OS_TYPES_H_
+#define _OS_TYPES_H_
+
+// Host stand-in for the SDK's os_type.h, the task queue is the test's
+
+#include "c_types.h"
+
+typedef uint32 os_signal_t;
+typedef uint32 os_param_t;
+
+bool system_os_post(uint8 prio, os_signal_t sig, os_param_t par);
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef _OSAPI_H_
+#define _OSAPI_H_
+
+// Host stand-in for the SDK's osapi.h
+
+#include <stdio.h>
+#include <string.h>
+
+#define os_memcmp       memcmp
+#ifdef HOST_MEMCPY_HOOK
+// The test lets its ISR preempt task level copies half way
+void *host_memcpy(void *dst, const void *src, size_t n);
+#define os_memcpy       host_memcpy
+#else
+#define os_memcpy       memcpy
+#endif
+#define os_memmove      memmove
+#define os_memset       memset
+#define os_strcmp       strcmp
+#define os_strlen       strlen
+#define os_strncmp      strncmp
+#define os_strstr       strstr
+#define os_sprintf      sprintf
+#define os_printf       printf
+
+#endif
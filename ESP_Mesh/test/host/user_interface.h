@@ -0,0 +1,10 @@
+#ifndef __USER_INTERFACE_H__
+#define __USER_INTERFACE_H__
+
+// Host stand-in for the SDK's user_interface.h, the test provides the functions
+
+#include "c_types.h"
+
+uint32 system_get_free_heap_size(void);
+
+#endif
@@ -0,0 +1,184 @@
+#ifndef _SHAPER_SIM_H_
+#define _SHAPER_SIM_H_
+
+#include <string.h>
+
+#include "c_types.h"
+#include "lwip/def.h"
+#include "lwip/ip.h"
+#include "lwip/netif.h"
+#include "lwip/pbuf.h"
+#include "lwip/tcp_impl.h"
+#include "lwip/udp.h"
+#include "netif/etharp.h"
+#include "user_config.h"
+#include "shaper.h"
+
+//
+// Host simulation of the SoftAP shaper: the pbufs it queues, frames of
+// the stations with the time they were offered, and the delay
+// histograms the shaper simulations report. Upstream only, the
+// directions are shaped alike. Times in us, as get_long_systime().
+//
+
+#define SIM_TICK        100             // us
+#define SIM_HIST_MAX    20000           // 0.1 ms buckets, 2 s
+
+// A pbuf with the bookkeeping of the simulation in front of the frame
+typedef struct {
+        struct pbuf p;
+        uint64_t offered;       // when the station sent it
+        uint8_t station;
+        uint8_t flow;
+        bool delivered;         // set by the deliver callback before freeing it
+        uint8_t data[SHAPER_QUANTUM];
+} sim_pbuf_t;
+
+typedef struct {
+        uint32_t n;
+        uint32_t bucket[SIM_HIST_MAX + 1];
+} sim_hist_t;
+
+static struct netif sim_netif;
+static uint32_t sim_pbufs;              // allocated, a leak shows here
+static void (*sim_dropped)(sim_pbuf_t *sp);     // a frame freed without being delivered
+
+struct pbuf *pbuf_alloc(pbuf_layer layer, uint16_t length, pbuf_type type)
+{
+    sim_pbuf_t *sp;
+
+    if (length > SHAPER_QUANTUM || (sp = calloc(1, sizeof(sim_pbuf_t))) == NULL)
+        return NULL;
+    sp->p.payload = sp->data;
+    sp->p.len = sp->p.tot_len = length;
+    sp->p.type = type;
+    sp->p.ref = 1;
+    sim_pbufs++;
+    return &sp->p;
+}
+
+uint8_t pbuf_free(struct pbuf *p)
+{
+    if (--p->ref != 0)
+        return 0;
+    if (sim_dropped != NULL && !((sim_pbuf_t *)p)->delivered)
+        sim_dropped((sim_pbuf_t *)p);
+    free(p);
+    sim_pbufs--;
+    return 1;
+}
+
+void pbuf_ref(struct pbuf *p)
+{
+    p->ref++;
+}
+
+err_t pbuf_copy(struct pbuf *p_to, struct pbuf *p_from)
+{
+    sim_pbuf_t *to = (sim_pbuf_t *)p_to, *from = (sim_pbuf_t *)p_from;
+
+    if (p_to->tot_len < p_from->tot_len)
+        return ERR_ARG;
+    memcpy(p_to->payload, p_from->payload, p_from->len);
+    to->offered = from->offered;
+    to->station = from->station;
+    to->flow = from->flow;
+    return ERR_OK;
+}
+
+// A frame of a station: UDP, or TCP with len - 54 bytes of payload
+static struct pbuf *sim_frame(uint8_t station, uint16_t len, uint8_t proto, uint16_t port, uint64_t now)
+{
+    sim_pbuf_t *sp = (sim_pbuf_t *)pbuf_alloc(PBUF_RAW, len, PBUF_RAM);
+    struct eth_hdr *eth = (struct eth_hdr *)sp->data;
+    struct ip_hdr *iph = (struct ip_hdr *)(sp->data + SIZEOF_ETH_HDR);
+    struct udp_hdr *udph = (struct udp_hdr *)(sp->data + SIZEOF_ETH_HDR + IP_HLEN);
+    struct tcp_hdr *tcph = (struct tcp_hdr *)udph;
+
+    sp->offered = now;
+    sp->station = station;
+    memset(&eth->dest, 0x5e, 6);
+    memset(&eth->src, 0x02, 5);
+    eth->src.addr[5] = station;
+    eth->type = PP_HTONS(ETHTYPE_IP);
+    IPH_VHLTOS_SET(iph, 4, 5, 0);
+    IPH_LEN(iph) = htons(len - SIZEOF_ETH_HDR);
+    IPH_TTL_SET(iph, 64);
+    IPH_PROTO_SET(iph, proto);
+    iph->src.addr = htonl(0xc0a80402 + station);
+    iph->dest.addr = htonl(0x08080808);
+    udph->src = htons(40000 + station);
+    udph->dest = htons(port);
+    if (proto == IP_PROTO_TCP)
+        tcph->_hdrlen_rsvd_flags = htons((5 << 12) | TCP_ACK);
+    else
+        udph->len = htons(len - SIZEOF_ETH_HDR - IP_HLEN);
+    return &sp->p;
+}
+
+static sim_pbuf_t *sim_pbuf(struct pbuf *p)
+{
+    return (sim_pbuf_t *)p;
+}
+
+static void sim_hist_add(sim_hist_t *h, uint64_t us)
+{
+    uint64_t b = us / 100;
+
+    h->bucket[b > SIM_HIST_MAX ? SIM_HIST_MAX : b]++;
+    h->n++;
+}
+
+// The percentile in ms, the upper end of its bucket
+static double sim_hist_ms(const sim_hist_t *h, double pct)
+{
+    uint64_t want = (uint64_t)(h->n * pct / 100), sum = 0;
+    uint32_t b;
+
+    for (b = 0; b < SIM_HIST_MAX; b++)
+    {
+        sum += h->bucket[b];
+        if (sum > want)
+            break;
+    }
+    return (b + 1) / 10.0;
+}
+
+// Max-min fair share of each offered rate in a capacity, bytes/s
+static void sim_fair_share(const double *offered, double *share, int n, double capacity)
+{
+    bool done[SHAPER_STATIONS];
+    int i, left = n, min;
+
+    memset(done, 0, sizeof(done));
+    while (left > 0)
+    {
+        min = -1;
+        for (i = 0; i < n; i++)
+        {
+            if (!done[i] && (min < 0 || offered[i] < offered[min]))
+                min = i;
+        }
+        share[min] = offered[min] < capacity / left ? offered[min] : capacity / left;
+        capacity -= share[min];
+        done[min] = true;
+        left--;
+    }
+}
+
+// Jain's index of the throughputs relative to their fair shares, 1 if fair
+static double sim_jain(const double *got, const double *share, int n)
+{
+    double sum = 0, sum2 = 0, x;
+    int i;
+
+    for (i = 0; i < n; i++)
+    {
+        x = got[i] / share[i];
+        sum += x;
+        sum2 += x * x;
+    }
+    return sum * sum / (n * sum2);
+}
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef _TEST_H_
+#define _TEST_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+//
+// Minimal test helpers: CHECK() reports a failed condition and counts it,
+// the test returns test_result() from main.
+//
+
+static int test_failures;
+
+#define CHECK(c) \
+    do { \
+        if (!(c)) { \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #c); \
+            test_failures++; \
+        } \
+    } while (0)
+
+static inline int test_result(const char *name)
+{
+    printf("%s: %s\n", name, test_failures == 0 ? "ok" : "FAILED");
+    return test_failures == 0 ? 0 : 1;
+}
+
+// Monotonic time in ns, for the benchmarks
+static inline double test_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Time stamp counter for per cycle figures, ns where there is none
+static inline uint64_t test_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    return (uint64_t)test_now_ns();
+#endif
+}
+
+// xorshift32, the same sequence on every host
+static inline uint32_t test_rand(uint32_t *state)
+{
+    uint32_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+#endif
@@ -0,0 +1,74 @@
+#include "test.h"
+#include "acl_frame.h"
+
+//
+// acl: random rule lists over overlapping addresses, masks and ports,
+// every other one of rules for single hosts and small nets, and random
+// TCP, UDP and ICMP frames. Every decision of the compiled index must be
+// the one of the first matching rule in list order, and the hit counters
+// must follow.
+//
+
+#define LISTS           20000
+#define FRAMES          100
+
+int main(void)
+{
+    uint32_t seed = 20;
+    uint32_t hits[MAX_ACL_ENTRIES];
+    uint32_t frames = 0, errors = 0, count_errors = 0;
+    uint32_t allow = 0, deny = 0;
+    frame_t f;
+    int l, i, n, expect;
+    uint8_t acl_no;
+
+    acl_init();
+
+    // An empty list lets everything pass, ARP passes any list
+    frame_make(&f, &seed);
+    CHECK(acl_check_packet(FROM_STA, &f.p) == ACL_ALLOW);
+    acl_add(FROM_STA, 0, 0, 0, 0, ACL_ANY_PROTO, 0, 0, ACL_DENY);
+    CHECK(acl_check_packet(FROM_STA, &f.p) == ACL_DENY);
+    ((struct eth_hdr *)f.data)->type = PP_HTONS(ETHTYPE_ARP);
+    CHECK(acl_check_packet(FROM_STA, &f.p) == ACL_ALLOW);
+    f.p.len = SIZEOF_ETH_HDR - 1;
+    CHECK(acl_check_packet(FROM_STA, &f.p) == ACL_DENY);
+
+    for (l = 0; l < LISTS; l++)
+    {
+        acl_no = l % MAX_NO_ACLS;
+        n = 1 + test_rand(&seed) % MAX_ACL_ENTRIES;
+        if (l % 2 == 0)
+            rules_make(acl_no, n, &seed);
+        else
+            rules_make_hosts(acl_no, n, &seed);
+        acl_allow_count = acl_deny_count = 0;
+        allow = deny = 0;
+        memset(hits, 0, sizeof(hits));
+
+        for (i = 0; i < FRAMES; i++)
+        {
+            frame_make(&f, &seed);
+            expect = linear_match(acl_no, &f);
+            if (expect >= 0)
+                hits[expect]++;
+            if (expect >= 0 && (acl[acl_no][expect].allow & ACL_ALLOW))
+                allow++;
+            else
+                deny++;
+
+            if (acl_check_packet(acl_no, &f.p) != (expect >= 0 ? acl[acl_no][expect].allow : ACL_DENY))
+                errors++;
+            frames++;
+        }
+
+        for (i = 0; i < n; i++)
+            count_errors += acl_hits[acl_no][i] != hits[i];
+        count_errors += acl_allow_count != allow || acl_deny_count != deny;
+    }
+
+    printf("acl: %u lists, %u frames, %u decision and %u counter mismatches\n", LISTS, frames, errors, count_errors);
+    CHECK(errors == 0);
+    CHECK(count_errors == 0);
+    return test_result("test_acl");
+}
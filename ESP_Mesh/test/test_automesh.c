@@ -0,0 +1,888 @@
+#include <string.h>
+
+#include "c_types.h"
+#include "user_config.h"
+#include "automesh.h"
+#include "test.h"
+
+//
+// automesh: replays scan, connect and disconnect sequences through the
+// state machine. A small simulated world plays the SDK: it has a set of
+// APs, answers a connect with the connected and got IP events after
+// SIM_ASSOC and SIM_DHCP, or with NO_AP_FOUND if the AP is gone, and
+// delivers scan results after SIM_SCAN. Events of a connection the node
+// already left are dropped, as the SDK does. automesh_tick() runs every
+// second. Times are in ms.
+//
+
+#define SIM_ASSOC       300
+#define SIM_DHCP        400
+#define SIM_SCAN        2200
+#define SIM_SURVEY      150
+#define SIM_PING        20
+#define SIM_RETRY       1000    // SDK reconnect after a failed handshake
+
+#define SIM_APS         8
+#define SIM_EVENTS      32
+#define THRESHOLD       85
+
+#define REASON_ASSOC_LEAVE      8
+#define REASON_HANDSHAKE        15
+#define REASON_BEACON_TIMEOUT   200
+
+typedef struct {
+        uint8_t bssid[6];
+        uint8_t level;          // AUTOMESH_UNKNOWN: no IE, from the BSSID
+        int8_t rssi;
+        uint8_t load;
+        bool present;
+        bool reachable;         // the network beyond it answers
+        bool bad_password;
+} sim_ap_t;
+
+enum {
+        EV_SCAN_DONE,
+        EV_CONNECTED,
+        EV_GOT_IP,
+        EV_DISCONNECTED,
+        EV_REACHABLE
+};
+
+typedef struct {
+        bool used;
+        uint8_t type;
+        uint8_t reason;
+        uint8_t bssid[6];
+        uint32_t at;
+        uint32_t gen;           // 0: always delivered
+} sim_event_t;
+
+typedef struct {
+        automesh_t am;
+        uint32_t now;
+        uint32_t next_tick;
+        uint32_t gen;           // bumped by every connect and scan
+        bool associated;
+        uint8_t target[6];      // the AP the STA connects to
+        sim_ap_t ap[SIM_APS];
+        int n_ap;
+        sim_event_t ev[SIM_EVENTS];
+
+        int scans;
+        int surveys;
+        int connects;
+        int probes;
+        int persists;
+        int resets;
+        uint32_t got_ip_at;
+} sim_t;
+
+static void sim_post(sim_t *s, uint8_t type, uint32_t delay, uint32_t gen, const uint8_t *bssid, uint8_t reason)
+{
+    int i;
+
+    for (i = 0; i < SIM_EVENTS; i++)
+    {
+        if (!s->ev[i].used)
+        {
+            s->ev[i].used = true;
+            s->ev[i].type = type;
+            s->ev[i].at = s->now + delay;
+            s->ev[i].gen = gen;
+            s->ev[i].reason = reason;
+            if (bssid != NULL)
+                memcpy(s->ev[i].bssid, bssid, 6);
+            return;
+        }
+    }
+    CHECK(!"event queue full");
+}
+
+static sim_ap_t *sim_find(sim_t *s, const uint8_t *bssid)
+{
+    int i;
+
+    for (i = 0; i < s->n_ap; i++)
+    {
+        if (memcmp(s->ap[i].bssid, bssid, 6) == 0)
+            return &s->ap[i];
+    }
+    return NULL;
+}
+
+// Like wifi_station_disconnect(): the SDK reports the AP we leave
+static void sim_leave(sim_t *s)
+{
+    if (s->associated)
+        sim_post(s, EV_DISCONNECTED, 1, 0, s->target, REASON_ASSOC_LEAVE);
+    s->associated = false;
+    s->gen++;
+}
+
+static void op_scan(void *ctx)
+{
+    sim_t *s = ctx;
+
+    sim_leave(s);
+    s->scans++;
+    sim_post(s, EV_SCAN_DONE, SIM_SCAN, 0, NULL, 0);
+}
+
+static void op_survey(void *ctx)
+{
+    sim_t *s = ctx;
+
+    s->surveys++;
+    sim_post(s, EV_SCAN_DONE, SIM_SURVEY, 0, NULL, 0);
+}
+
+static void op_connect(void *ctx, const uint8_t *bssid, uint8_t level)
+{
+    sim_t *s = ctx;
+    sim_ap_t *ap = sim_find(s, bssid);
+
+    sim_leave(s);
+    s->connects++;
+    memcpy(s->target, bssid, 6);
+    if (ap == NULL || !ap->present)
+    {
+        sim_post(s, EV_DISCONNECTED, SIM_ASSOC, s->gen, bssid, AUTOMESH_NO_AP_FOUND);
+    }
+    else if (ap->bad_password)
+    {
+        sim_post(s, EV_DISCONNECTED, SIM_ASSOC, s->gen, bssid, REASON_HANDSHAKE);
+    }
+    else
+    {
+        sim_post(s, EV_CONNECTED, SIM_ASSOC, s->gen, bssid, 0);
+        sim_post(s, EV_GOT_IP, SIM_ASSOC + SIM_DHCP, s->gen, bssid, 0);
+    }
+}
+
+static void op_probe(void *ctx)
+{
+    sim_t *s = ctx;
+    sim_ap_t *ap = sim_find(s, s->target);
+
+    s->probes++;
+    if (s->associated && ap != NULL && ap->reachable)
+        sim_post(s, EV_REACHABLE, SIM_PING, s->gen, NULL, 0);
+}
+
+static void op_persist(void *ctx)
+{
+    ((sim_t *)ctx)->persists++;
+}
+
+static void op_factory_reset(void *ctx)
+{
+    ((sim_t *)ctx)->resets++;
+}
+
+static const automesh_ops_t sim_ops = {
+    op_scan, op_survey, op_connect, op_probe, op_persist, op_factory_reset};
+
+static void sim_scan_done(sim_t *s)
+{
+    automesh_bss_t bss[SIM_APS];
+    uint8_t n = 0;
+    int i;
+
+    for (i = 0; i < s->n_ap; i++)
+    {
+        if (!s->ap[i].present)
+            continue;
+        memset(&bss[n], 0, sizeof(automesh_bss_t));
+        memcpy(bss[n].bssid, s->ap[i].bssid, 6);
+        bss[n].rssi = s->ap[i].rssi;
+        bss[n].level = s->ap[i].level;
+        bss[n].load = s->ap[i].load;
+        bss[n].napt_free = AUTOMESH_UNKNOWN;
+        bss[n].channel = 1;
+        n++;
+    }
+    automesh_scan_result(&s->am, bss, n, s->now);
+}
+
+static void sim_deliver(sim_t *s, sim_event_t *e)
+{
+    sim_ap_t *ap;
+
+    e->used = false;
+    if (e->gen != 0 && e->gen != s->gen)
+        return;
+
+    switch (e->type)
+    {
+    case EV_SCAN_DONE:
+        sim_scan_done(s);
+        break;
+    case EV_CONNECTED:
+        s->associated = true;
+        automesh_connected(&s->am, e->bssid, s->now);
+        break;
+    case EV_GOT_IP:
+        s->got_ip_at = s->now;
+        automesh_got_ip(&s->am, s->now);
+        break;
+    case EV_DISCONNECTED:
+        // The SDK keeps retrying a wrong password by itself
+        ap = sim_find(s, e->bssid);
+        if (e->reason == REASON_HANDSHAKE && ap != NULL && ap->bad_password)
+            sim_post(s, EV_DISCONNECTED, SIM_RETRY, e->gen, e->bssid, REASON_HANDSHAKE);
+        automesh_disconnected(&s->am, e->bssid, e->reason, s->now);
+        break;
+    case EV_REACHABLE:
+        automesh_reachable(&s->am, s->now);
+        break;
+    }
+}
+
+// Delivers all events and ticks up to and including t, in time order
+static void sim_run(sim_t *s, uint32_t t)
+{
+    sim_event_t *e;
+    int i;
+
+    for (;;)
+    {
+        e = NULL;
+        for (i = 0; i < SIM_EVENTS; i++)
+        {
+            if (s->ev[i].used && (e == NULL || (int32_t)(s->ev[i].at - e->at) < 0))
+                e = &s->ev[i];
+        }
+
+        if (e != NULL && (int32_t)(e->at - s->next_tick) <= 0 && (int32_t)(e->at - t) <= 0)
+        {
+            s->now = e->at;
+            sim_deliver(s, e);
+        }
+        else if ((int32_t)(s->next_tick - t) <= 0)
+        {
+            s->now = s->next_tick;
+            s->next_tick += 1000;
+            automesh_tick(&s->am, s->now);
+        }
+        else
+        {
+            s->now = t;
+            return;
+        }
+    }
+}
+
+static sim_ap_t *sim_add(sim_t *s, uint8_t b2, uint8_t b5, uint8_t level, int8_t rssi)
+{
+    sim_ap_t *ap = &s->ap[s->n_ap++];
+
+    memset(ap, 0, sizeof(sim_ap_t));
+    ap->bssid[0] = 0x24;
+    ap->bssid[1] = 0x24;
+    ap->bssid[2] = b2;
+    ap->bssid[5] = b5;
+    ap->level = level;
+    ap->rssi = rssi;
+    ap->present = true;
+    ap->reachable = true;
+    return ap;
+}
+
+// The AP goes off the air, the node notices by a beacon timeout
+static void sim_remove(sim_t *s, sim_ap_t *ap)
+{
+    ap->present = false;
+    if (s->associated && memcmp(s->target, ap->bssid, 6) == 0)
+    {
+        s->associated = false;
+        s->gen++;
+        sim_post(s, EV_DISCONNECTED, 0, 0, ap->bssid, REASON_BEACON_TIMEOUT);
+    }
+}
+
+static void sim_init(sim_t *s, bool checked)
+{
+    static const uint8_t none[6];
+
+    memset(s, 0, sizeof(sim_t));
+    s->next_tick = 1000;
+    s->gen = 1;
+    automesh_init(&s->am, &sim_ops, s, false, none, 0, checked, THRESHOLD, 0);
+}
+
+static bool uplink_is(const sim_t *s, const sim_ap_t *ap)
+{
+    return memcmp(s->am.bssid, ap->bssid, 6) == 0;
+}
+
+// Scan, connect, IP, an answered probe, then persisted after the stable time
+static void test_join(void)
+{
+    sim_t s;
+    sim_ap_t *root, *node;
+
+    sim_init(&s, false);
+    root = sim_add(&s, 0x00, 1, 0, -60);
+    node = sim_add(&s, 0x01, 2, AUTOMESH_UNKNOWN, -40);
+
+    automesh_start(&s.am, 0);
+    CHECK(s.scans == 1);
+    sim_run(&s, SIM_SCAN - 1);
+    CHECK(s.am.state == AUTOMESH_SCANNING);
+
+    // The root is one level up but still cheaper than the level 1 node
+    sim_run(&s, SIM_SCAN);
+    CHECK(s.am.state == AUTOMESH_CONNECTING);
+    CHECK(uplink_is(&s, root));
+    CHECK(s.am.level == 0);
+
+    sim_run(&s, SIM_SCAN + SIM_ASSOC + SIM_DHCP);
+    CHECK(s.am.state == AUTOMESH_CONNECTED);
+    CHECK(s.am.checked);
+    CHECK(s.am.last_convergence == SIM_SCAN + SIM_ASSOC + SIM_DHCP);
+
+    // Probed on the next tick, the answer comes right back
+    sim_run(&s, 4000);
+    CHECK(s.probes == 1);
+    CHECK(s.am.reachable);
+
+    // Persisted once, after AUTOMESH_STABLE_TIME
+    sim_run(&s, s.got_ip_at + AUTOMESH_STABLE_TIME - 1000);
+    CHECK(s.am.state == AUTOMESH_CONNECTED);
+    CHECK(s.persists == 0);
+    sim_run(&s, s.got_ip_at + AUTOMESH_STABLE_TIME + 1000);
+    CHECK(s.am.state == AUTOMESH_STABLE);
+    CHECK(s.persists == 1);
+    sim_run(&s, 600000);
+    CHECK(s.persists == 1);
+    CHECK(s.probes == 1);
+    CHECK(s.connects == 1);
+    CHECK(s.scans == 1);
+    CHECK(s.am.switches == 0);
+    (void)node;
+}
+
+// An uplink that is gone for good: forgotten, rescan, the next best one
+static void test_lost(void)
+{
+    sim_t s;
+    sim_ap_t *a, *b;
+    uint32_t switches;
+
+    sim_init(&s, true);
+    a = sim_add(&s, 0x01, 1, 1, -50);
+    b = sim_add(&s, 0x02, 2, 2, -50);
+    automesh_start(&s.am, 0);
+    sim_run(&s, 60000);
+    CHECK(uplink_is(&s, a));
+    CHECK(s.am.state == AUTOMESH_STABLE);
+
+    // No backup upstream of us, so forget it and scan
+    switches = s.am.switches;
+    a->present = false;
+    automesh_disconnected(&s.am, a->bssid, AUTOMESH_NO_AP_FOUND, s.now);
+    CHECK(s.am.state == AUTOMESH_SCANNING);
+    CHECK(s.scans == 2);
+    sim_run(&s, s.now + SIM_SCAN + SIM_ASSOC + SIM_DHCP);
+    CHECK(uplink_is(&s, b));
+    CHECK(s.am.level == 2);
+    CHECK(s.am.state == AUTOMESH_CONNECTED);
+    CHECK(s.am.switches == switches + 1);
+    CHECK(s.am.dirty);
+
+    sim_run(&s, s.now + AUTOMESH_STABLE_TIME + 2000);
+    CHECK(s.persists == 2);
+}
+
+// The SDK went to another AP of the mesh on its own
+static void test_other_bssid(void)
+{
+    sim_t s;
+    sim_ap_t *a, *b;
+
+    sim_init(&s, true);
+    a = sim_add(&s, 0x01, 1, 1, -50);
+    b = sim_add(&s, 0x01, 2, 1, -70);
+    automesh_start(&s.am, 0);
+    sim_run(&s, SIM_SCAN + SIM_ASSOC);
+    CHECK(uplink_is(&s, a));
+
+    automesh_connected(&s.am, b->bssid, s.now);
+    CHECK(s.am.state == AUTOMESH_SCANNING);
+    CHECK(s.scans == 2);
+}
+
+// Without events the SDK's own reconnect is given AUTOMESH_CONNECT_TIMEOUT,
+// AUTOMESH_MAX_TRIES times
+static void test_connect_timeout(void)
+{
+    sim_t s;
+    sim_ap_t *a;
+
+    sim_init(&s, true);
+    a = sim_add(&s, 0x01, 1, 1, -50);
+    automesh_start(&s.am, 0);
+    sim_run(&s, SIM_SCAN);
+    CHECK(s.am.state == AUTOMESH_CONNECTING);
+
+    // Nothing comes back and the SDK stays silent
+    s.gen++;
+    sim_run(&s, SIM_SCAN + AUTOMESH_CONNECT_TIMEOUT * AUTOMESH_MAX_TRIES);
+    CHECK(s.am.state == AUTOMESH_CONNECTING);
+    CHECK(s.scans == 1);
+    sim_run(&s, SIM_SCAN + (AUTOMESH_CONNECT_TIMEOUT + 1000) * (AUTOMESH_MAX_TRIES + 1));
+    CHECK(s.scans == 2);
+    CHECK(s.resets == 0);
+    (void)a;
+}
+
+// Credentials that never worked: factory reset after AUTOMESH_MAX_TRIES
+static void test_bad_password(void)
+{
+    sim_t s;
+    sim_ap_t *a;
+
+    sim_init(&s, false);
+    a = sim_add(&s, 0x00, 1, 0, -50);
+    a->bad_password = true;
+    automesh_start(&s.am, 0);
+    sim_run(&s, SIM_SCAN + SIM_ASSOC + SIM_RETRY * (AUTOMESH_MAX_TRIES - 1));
+    CHECK(s.am.tries == AUTOMESH_MAX_TRIES);
+    CHECK(s.resets == 0);
+    sim_run(&s, SIM_SCAN + SIM_ASSOC + SIM_RETRY * AUTOMESH_MAX_TRIES);
+    CHECK(s.resets == 1);
+    CHECK(s.scans == 1);
+    CHECK(s.persists == 0);
+}
+
+static automesh_neighbor_t neighbor(uint8_t level, int8_t rssi, uint8_t load)
+{
+    automesh_neighbor_t nb;
+
+    memset(&nb, 0, sizeof(nb));
+    nb.used = 1;
+    nb.level = level;
+    nb.rssi = rssi * 16;
+    nb.load = load;
+    nb.napt_free = AUTOMESH_UNKNOWN;
+    return nb;
+}
+
+// Without load and RTT the cost orders as "lowest level, then best RSSI"
+static void test_cost(void)
+{
+    sim_t s;
+    automesh_neighbor_t a, b;
+    int la, lb, ra, rb;
+    uint32_t errors = 0;
+
+    sim_init(&s, true);
+    for (la = 0; la < 4; la++)
+    for (lb = 0; lb < 4; lb++)
+    for (ra = -THRESHOLD; ra < 0; ra += 3)
+    for (rb = -THRESHOLD; rb < 0; rb += 5)
+    {
+        a = neighbor(la, ra, AUTOMESH_UNKNOWN);
+        b = neighbor(lb, rb, AUTOMESH_UNKNOWN);
+        if ((la < lb || (la == lb && ra > rb)) != (automesh_cost(&s.am, &a) < automesh_cost(&s.am, &b)))
+            errors++;
+    }
+    CHECK(errors == 0);
+
+    // A weak link counts as one more level
+    a = neighbor(1, -THRESHOLD - 1, AUTOMESH_UNKNOWN);
+    b = neighbor(2, -THRESHOLD + 5, AUTOMESH_UNKNOWN);
+    CHECK(automesh_cost(&s.am, &a) > automesh_cost(&s.am, &b));
+
+    // Stations on the AP and advertised lack of NAPT room cost
+    a = neighbor(1, -60, 0);
+    b = neighbor(1, -60, 4);
+    CHECK(automesh_cost(&s.am, &b) == automesh_cost(&s.am, &a) + 4 * AUTOMESH_LOAD_COST);
+    b = neighbor(1, -60, 0);
+    b.napt_free = 0;
+    CHECK(automesh_cost(&s.am, &b) == automesh_cost(&s.am, &a) + AUTOMESH_LEVEL_COST);
+
+    // The measured RTT replaces the estimate for the uplink only
+    memcpy(a.bssid, "\x24\x24\x01\x00\x00\x01", 6);
+    memcpy(s.am.bssid, a.bssid, 6);
+    b = a;
+    b.bssid[5] = 2;
+    automesh_set_rtt(&s.am, 150);
+    CHECK(automesh_cost(&s.am, &b) == 100 + 60 + 2 * AUTOMESH_HOP_RTT / 2);
+    CHECK(automesh_cost(&s.am, &a) == 100 + 60 + (AUTOMESH_HOP_RTT + 150) / 2);
+}
+
+// A better uplink must save AUTOMESH_HYSTERESIS and wait for the dwell time
+static void test_hysteresis(void)
+{
+    sim_t s;
+    sim_ap_t *a, *b, *c;
+    uint32_t switches;
+
+    sim_init(&s, true);
+    a = sim_add(&s, 0x02, 1, 1, -70);
+    b = sim_add(&s, 0x02, 2, 1, -40);
+    c = sim_add(&s, 0x01, 3, 0, -45);
+    b->present = c->present = false;
+    automesh_start(&s.am, 0);
+    sim_run(&s, 40000);
+    CHECK(uplink_is(&s, a));
+    CHECK(s.am.state == AUTOMESH_STABLE);
+    switches = s.am.switches;
+
+    // Cheaper, but less than the hysteresis once we count ourselves in
+    b->present = true;
+    sim_run(&s, 250000);
+    CHECK(s.surveys >= 7);
+    CHECK(uplink_is(&s, a));
+    CHECK(s.am.held == 0);
+
+    // A level closer to the root, but not before the dwell time is up
+    c->present = true;
+    sim_run(&s, s.got_ip_at + AUTOMESH_MIN_DWELL - 1000);
+    CHECK(uplink_is(&s, a));
+    CHECK(s.am.held >= 1);
+    sim_run(&s, s.got_ip_at + AUTOMESH_MIN_DWELL + AUTOMESH_SURVEY_INTERVAL + SIM_SURVEY + 1000);
+    CHECK(uplink_is(&s, c));
+    CHECK(s.am.level == 0);
+    CHECK(s.am.switches == switches + 1);
+
+    // Settled there, no way back
+    sim_run(&s, s.now + 3600000);
+    CHECK(uplink_is(&s, c));
+    CHECK(s.am.switches == switches + 1);
+    CHECK(s.persists == 2);
+}
+
+// The weak link counts as a hop, so our AP is on level 3 and the APs of
+// our children on 4: never an uplink, however bad the current one is
+static void test_children(void)
+{
+    sim_t s;
+    sim_ap_t *a, *child;
+
+    sim_init(&s, true);
+    a = sim_add(&s, 0x02, 1, 1, -THRESHOLD - 5);
+    a->load = 30;
+    child = sim_add(&s, 0x04, 2, 4, -20);
+    child->present = false;
+    automesh_start(&s.am, 0);
+    sim_run(&s, 40000);
+    CHECK(uplink_is(&s, a));
+    CHECK(s.am.level == 2);
+
+    child->present = true;
+    sim_run(&s, s.got_ip_at + 2 * AUTOMESH_MIN_DWELL);
+    CHECK(uplink_is(&s, a));
+    CHECK(s.am.held == 0);
+    CHECK(s.am.backups == 0);
+}
+
+static automesh_bss_t bss(uint8_t b2, uint8_t b5, uint8_t level, int8_t rssi)
+{
+    automesh_bss_t b;
+
+    memset(&b, 0, sizeof(b));
+    b.bssid[0] = 0x24;
+    b.bssid[1] = 0x24;
+    b.bssid[2] = b2;
+    b.bssid[5] = b5;
+    b.level = level;
+    b.rssi = rssi;
+    b.load = AUTOMESH_UNKNOWN;
+    b.napt_free = AUTOMESH_UNKNOWN;
+    b.channel = 6;
+    return b;
+}
+
+static automesh_neighbor_t *neighbor_of(sim_t *s, const uint8_t *bssid)
+{
+    int i;
+
+    for (i = 0; i < AUTOMESH_NEIGHBORS; i++)
+    {
+        if (s->am.neighbor[i].used && memcmp(s->am.neighbor[i].bssid, bssid, 6) == 0)
+            return &s->am.neighbor[i];
+    }
+    return NULL;
+}
+
+// Averaged RSSI, the level from the BSSID without an IE, a full table
+// drops the neighbor not seen for the longest time, and aging
+static void test_neighbors(void)
+{
+    sim_t s;
+    automesh_bss_t b[AUTOMESH_NEIGHBORS + 1];
+    automesh_neighbor_t *nb;
+    int i;
+
+    sim_init(&s, true);
+    b[0] = bss(0x03, 1, AUTOMESH_UNKNOWN, -40);
+    automesh_neighbor_update(&s.am, b, 1, 0);
+    nb = neighbor_of(&s, b[0].bssid);
+    CHECK(nb != NULL && nb->rssi == -40 * 16 && nb->level == 3 && nb->channel == 6);
+    b[0].rssi = -80;
+    b[0].level = 1;
+    automesh_neighbor_update(&s.am, b, 1, 1000);
+    CHECK(nb->rssi == -50 * 16 && nb->level == 1 && nb->last_seen == 1000);
+
+    for (i = 1; i <= AUTOMESH_NEIGHBORS; i++)
+        b[i] = bss(0x01, i, 1, -60);
+    automesh_neighbor_update(&s.am, b + 1, AUTOMESH_NEIGHBORS - 1, 2000);
+    automesh_neighbor_update(&s.am, b, 1, 3000);
+    for (i = 0; i < AUTOMESH_NEIGHBORS; i++)
+        CHECK(neighbor_of(&s, b[i].bssid) != NULL);
+    automesh_neighbor_update(&s.am, b + AUTOMESH_NEIGHBORS, 1, 4000);
+    for (i = 0; i <= AUTOMESH_NEIGHBORS; i++)
+        CHECK((neighbor_of(&s, b[i].bssid) != NULL) == (i != 1));
+
+    // Just seen again, so the next one to go is b[2]
+    automesh_neighbor_update(&s.am, b + 2, 1, 5000);
+    automesh_neighbor_update(&s.am, b + 1, 1, 6000);
+    CHECK(neighbor_of(&s, b[3].bssid) == NULL);
+    CHECK(neighbor_of(&s, b[2].bssid) != NULL);
+
+    automesh_neighbor_expire(&s.am, 2000 + AUTOMESH_EXPIRE);
+    CHECK(neighbor_of(&s, b[4].bssid) != NULL);
+    automesh_neighbor_expire(&s.am, 2000 + AUTOMESH_EXPIRE + 1);
+    CHECK(neighbor_of(&s, b[4].bssid) == NULL);
+    CHECK(neighbor_of(&s, b[0].bssid) != NULL);
+    automesh_neighbor_expire(&s.am, 3000 + AUTOMESH_EXPIRE + 1);
+    CHECK(neighbor_of(&s, b[0].bssid) == NULL);
+    CHECK(neighbor_of(&s, b[2].bssid) != NULL);
+}
+
+// Neighbors not seen within AUTOMESH_FRESH are no candidates
+static void test_fresh(void)
+{
+    sim_t s;
+    sim_ap_t *a;
+    automesh_bss_t old = bss(0x00, 9, 0, -30);
+    uint32_t start;
+
+    for (start = AUTOMESH_FRESH - SIM_SCAN; start <= AUTOMESH_FRESH - SIM_SCAN + 1; start++)
+    {
+        sim_init(&s, true);
+        a = sim_add(&s, 0x01, 1, 1, -70);
+        automesh_neighbor_update(&s.am, &old, 1, 0);
+        sim_run(&s, start);
+        automesh_start(&s.am, s.now);
+        sim_run(&s, start + SIM_SCAN);
+        CHECK(s.connects == 1);
+        if (start + SIM_SCAN <= AUTOMESH_FRESH)
+            CHECK(memcmp(s.am.bssid, old.bssid, 6) == 0);
+        else
+            CHECK(uplink_is(&s, a));
+    }
+}
+
+// While stable, short scans every AUTOMESH_SURVEY_INTERVAL keep the
+// table fresh without leaving the uplink
+static void test_survey(void)
+{
+    sim_t s;
+    sim_ap_t *a, *b;
+    uint32_t stable_at;
+
+    sim_init(&s, true);
+    a = sim_add(&s, 0x01, 1, 0, -60);
+    b = sim_add(&s, 0x02, 2, 1, -60);
+    automesh_start(&s.am, 0);
+    sim_run(&s, s.now + SIM_SCAN + SIM_ASSOC + SIM_DHCP + AUTOMESH_STABLE_TIME + 1000);
+    CHECK(uplink_is(&s, a));
+    CHECK(s.am.state == AUTOMESH_STABLE);
+    CHECK(s.surveys == 0);
+    stable_at = s.am.since;
+
+    b->present = false;
+    sim_run(&s, stable_at + 20 * AUTOMESH_SURVEY_INTERVAL);
+    CHECK(s.surveys == 20);
+    CHECK(s.scans == 1);
+    CHECK(s.connects == 1);
+    CHECK(uplink_is(&s, a));
+    CHECK(s.am.state == AUTOMESH_STABLE);
+    CHECK(neighbor_of(&s, a->bssid) != NULL);
+    CHECK(neighbor_of(&s, b->bssid) == NULL);
+    CHECK(s.am.backups == 0);
+}
+
+// Backups are ranked by cost, only upstream of our AP: at most at the
+// level of the uplink
+static void test_backups(void)
+{
+    sim_t s;
+    sim_ap_t *u, *root, *v, *w, *x, *sibling, *child;
+
+    sim_init(&s, true);
+    u = sim_add(&s, 0x01, 1, 1, -40);
+    root = sim_add(&s, 0x00, 2, 0, -THRESHOLD - 5);
+    v = sim_add(&s, 0x01, 3, 1, -50);
+    w = sim_add(&s, 0x01, 4, 1, -60);
+    x = sim_add(&s, 0x01, 5, 1, -55);
+    sibling = sim_add(&s, 0x02, 6, 2, -30);
+    child = sim_add(&s, 0x03, 7, 3, -20);
+    automesh_start(&s.am, 0);
+    sim_run(&s, 10000);
+    CHECK(uplink_is(&s, u));
+    CHECK(s.am.backups == AUTOMESH_BACKUPS);
+    CHECK(memcmp(s.am.backup[0], v->bssid, 6) == 0);
+    CHECK(memcmp(s.am.backup[1], x->bssid, 6) == 0);
+    CHECK(memcmp(s.am.backup[2], w->bssid, 6) == 0);
+
+    // With fewer on the level of the uplink, the root comes in, but
+    // never a sibling or a child
+    v->present = w->present = false;
+    sim_run(&s, s.now + AUTOMESH_FRESH + 2 * AUTOMESH_SURVEY_INTERVAL);
+    CHECK(uplink_is(&s, u));
+    CHECK(s.am.backups == 2);
+    CHECK(memcmp(s.am.backup[0], x->bssid, 6) == 0);
+    CHECK(memcmp(s.am.backup[1], root->bssid, 6) == 0);
+    CHECK(neighbor_of(&s, sibling->bssid) != NULL);
+    CHECK(neighbor_of(&s, child->bssid) != NULL);
+}
+
+// ms from losing a stable uplink by a beacon timeout to the IP of the
+// replacement, the first gone backups off the air as well
+static uint32_t failover_time(int gone, bool backups)
+{
+    sim_t s;
+    sim_ap_t *u, *sibling, *b[AUTOMESH_BACKUPS];
+    uint32_t loss, scans;
+    int i;
+
+    sim_init(&s, true);
+    u = sim_add(&s, 0x01, 1, 1, -40);
+    for (i = 0; i < AUTOMESH_BACKUPS; i++)
+    {
+        b[i] = sim_add(&s, 0x01, 2 + i, 1, -50 - i);
+        b[i]->present = backups;
+    }
+    sibling = sim_add(&s, 0x02, 9, 2, -50);
+    automesh_start(&s.am, 0);
+    sim_run(&s, 60000);
+    CHECK(uplink_is(&s, u));
+    CHECK(s.am.state == AUTOMESH_STABLE);
+    CHECK(s.am.backups == (backups ? AUTOMESH_BACKUPS : 0));
+
+    for (i = 0; i < gone; i++)
+        b[i]->present = false;
+    loss = s.now;
+    scans = s.scans;
+    s.got_ip_at = 0;
+    sim_remove(&s, u);
+    sim_run(&s, loss + 120000);
+    CHECK(s.got_ip_at != 0);
+    if (backups)
+    {
+        CHECK(uplink_is(&s, b[gone]));
+        CHECK(s.am.level == 1);
+        CHECK(s.am.failovers == 1);
+        CHECK(s.am.last_failover == s.got_ip_at - loss);
+        CHECK(s.scans == scans);
+    }
+    else
+    {
+        CHECK(uplink_is(&s, sibling));
+        CHECK(s.am.failovers == 0);
+        CHECK(s.scans == scans + 1);
+    }
+    return s.got_ip_at - loss;
+}
+
+// The SDK stays silent after the beacon timeout, so without a backup the
+// node waits out AUTOMESH_MAX_TRIES connect timeouts before it scans
+static void test_failover(void)
+{
+    CHECK(failover_time(0, true) == SIM_ASSOC + SIM_DHCP);
+    CHECK(failover_time(1, true) == 2 * SIM_ASSOC + SIM_DHCP);
+    CHECK(failover_time(2, true) == 3 * SIM_ASSOC + SIM_DHCP);
+    CHECK(failover_time(0, false) ==
+          AUTOMESH_MAX_TRIES * AUTOMESH_CONNECT_TIMEOUT + SIM_SCAN + SIM_ASSOC + SIM_DHCP);
+}
+
+// No stable uplink and nothing persisted before a probe is answered, an
+// uplink that leads nowhere is left for a backup and skipped for a while
+static void test_unreachable(void)
+{
+    sim_t s;
+    sim_ap_t *u, *v;
+    automesh_neighbor_t *nb;
+    uint32_t ip;
+
+    sim_init(&s, false);
+    u = sim_add(&s, 0x01, 1, 1, -40);
+    v = sim_add(&s, 0x01, 2, 1, -45);
+    u->reachable = false;
+    automesh_start(&s.am, 0);
+    sim_run(&s, SIM_SCAN + SIM_ASSOC + SIM_DHCP);
+    CHECK(uplink_is(&s, u));
+    CHECK(s.am.state == AUTOMESH_CONNECTED);
+    ip = s.now;
+
+    sim_run(&s, ip + AUTOMESH_REACH_TIMEOUT - 1);
+    CHECK(uplink_is(&s, u));
+    CHECK(s.am.state == AUTOMESH_CONNECTED);
+    CHECK(s.probes == AUTOMESH_REACH_TIMEOUT / AUTOMESH_PROBE_INTERVAL);
+    CHECK(s.persists == 0);
+    CHECK(s.am.unreachable == 0);
+
+    sim_run(&s, ip + AUTOMESH_REACH_TIMEOUT + 1000);
+    CHECK(s.am.unreachable == 1);
+    CHECK(uplink_is(&s, v));
+    CHECK(s.scans == 1);
+    nb = neighbor_of(&s, u->bssid);
+    CHECK(nb != NULL && nb->blocked);
+    CHECK(s.am.backups == 0);
+
+    sim_run(&s, s.got_ip_at + AUTOMESH_STABLE_TIME + 1000);
+    CHECK(s.am.state == AUTOMESH_STABLE);
+    CHECK(s.persists == 1);
+
+    // Kept fresh by the surveys, but no candidate until AUTOMESH_EXPIRE
+    sim_run(&s, nb->blocked_since + AUTOMESH_EXPIRE);
+    CHECK(nb->used && nb->blocked);
+    sim_run(&s, nb->blocked_since + AUTOMESH_EXPIRE + 1000);
+    CHECK(nb->used && !nb->blocked);
+    sim_run(&s, s.now + AUTOMESH_SURVEY_INTERVAL + 1000);
+    CHECK(s.am.backups == 1);
+    CHECK(memcmp(s.am.backup[0], u->bssid, 6) == 0);
+
+    // Without a backup it scans, and leaves the blocked one out
+    sim_init(&s, true);
+    u = sim_add(&s, 0x01, 1, 1, -40);
+    u->reachable = false;
+    automesh_start(&s.am, 0);
+    sim_run(&s, SIM_SCAN + SIM_ASSOC + SIM_DHCP + AUTOMESH_REACH_TIMEOUT + 1000);
+    CHECK(s.am.unreachable == 1);
+    CHECK(s.am.state == AUTOMESH_SCANNING);
+    CHECK(s.scans == 2);
+    nb = neighbor_of(&s, u->bssid);
+    CHECK(nb != NULL && nb->blocked);
+    sim_run(&s, nb->blocked_since + AUTOMESH_EXPIRE);
+    CHECK(s.connects == 1);
+    CHECK(s.scans > 100);
+    sim_run(&s, nb->blocked_since + AUTOMESH_EXPIRE + 1000 + SIM_SCAN + SIM_ASSOC + SIM_DHCP);
+    CHECK(s.connects == 2);
+    CHECK(uplink_is(&s, u));
+    CHECK(s.am.state == AUTOMESH_CONNECTED);
+    CHECK(s.persists == 0);
+}
+
+int main(void)
+{
+    test_join();
+    test_lost();
+    test_other_bssid();
+    test_connect_timeout();
+    test_bad_password();
+    test_cost();
+    test_hysteresis();
+    test_children();
+    test_neighbors();
+    test_fresh();
+    test_survey();
+    test_backups();
+    test_failover();
+    test_unreachable();
+    return test_result("test_automesh");
+}
@@ -0,0 +1,421 @@
+#include <string.h>
+
+#include "c_types.h"
+#include "lwip/def.h"
+#include "lwip/ip.h"
+#include "lwip/netif.h"
+#include "lwip/pbuf.h"
+#include "lwip/tcp_impl.h"
+#include "lwip/udp.h"
+#include "netif/etharp.h"
+#include "user_config.h"
+#include "fastpath.h"
+#include "test.h"
+
+//
+// fastpath: NATed flows between a SoftAP and a STA netif. The slow path
+// is played by a model of the NAPT that maps each flow to a port of the
+// STA address and recomputes every checksum. The frames the cache
+// forwards must be the ones the slow path would have sent, with valid
+// checksums, in both directions. Also checked: the frames that must
+// take the slow path, the refresh, and that a frame leaving the STA
+// netif after the slow path dropped the client frame is not learned.
+//
+
+#define FLOWS           40
+#define EVENTS          200000
+#define FRAME_MAX       (SIZEOF_ETH_HDR + 24 + TCP_HLEN + 32)
+
+typedef struct {
+        struct pbuf p;
+        uint8_t data[FRAME_MAX];
+} frame_t;
+
+typedef struct {
+        uint8_t proto;
+        uint8_t hl;             // IP header words
+        uint32_t client_ip, remote_ip;
+        uint16_t client_port, remote_port, nat_port;
+        uint8_t client_mac[6];
+} flow_t;
+
+static const uint8_t gw_mac[6] = {0x24, 0x0a, 0xc4, 0x00, 0x00, 0x01};
+
+static struct netif ap_netif, sta_netif;
+static flow_t flows[FLOWS];
+
+static uint16_t csum_sum(const uint8_t *b, int len, uint32_t acc)
+{
+    int i;
+
+    for (i = 0; i + 1 < len; i += 2)
+        acc += (b[i] << 8) | b[i + 1];
+    if (len & 1)
+        acc += b[len - 1] << 8;
+    while (acc >> 16)
+        acc = (acc & 0xffff) + (acc >> 16);
+    return acc;
+}
+
+static struct ip_hdr *frame_ip(frame_t *f)
+{
+    return (struct ip_hdr *)(f->data + SIZEOF_ETH_HDR);
+}
+
+static uint8_t *frame_l4(frame_t *f)
+{
+    return (uint8_t *)frame_ip(f) + IPH_HL(frame_ip(f)) * 4;
+}
+
+static uint16_t *frame_l4_csum(frame_t *f)
+{
+    return IPH_PROTO(frame_ip(f)) == IP_PROTO_TCP ? &((struct tcp_hdr *)frame_l4(f))->chksum :
+                                                   &((struct udp_hdr *)frame_l4(f))->chksum;
+}
+
+// The L4 sum with the pseudo header
+static uint16_t frame_l4_sum(frame_t *f)
+{
+    struct ip_hdr *iph = frame_ip(f);
+    uint16_t len = f->p.len - SIZEOF_ETH_HDR - IPH_HL(iph) * 4;
+    uint32_t acc = IPH_PROTO(iph) + len;
+
+    acc += csum_sum((uint8_t *)&iph->src, 8, 0);
+    return csum_sum(frame_l4(f), len, acc);
+}
+
+// Recomputes both checksums, as the stack does on the slow path
+static void frame_csum(frame_t *f)
+{
+    struct ip_hdr *iph = frame_ip(f);
+    uint16_t *csum = frame_l4_csum(f);
+
+    IPH_CHKSUM(iph) = 0;
+    IPH_CHKSUM(iph) = htons(~csum_sum((uint8_t *)iph, IPH_HL(iph) * 4, 0));
+    if (IPH_PROTO(iph) == IP_PROTO_UDP && *csum == 0)
+        return;
+    *csum = 0;
+    *csum = htons(~frame_l4_sum(f));
+    if (IPH_PROTO(iph) == IP_PROTO_UDP && *csum == 0)
+        *csum = 0xffff;
+}
+
+static bool frame_csum_ok(frame_t *f)
+{
+    struct ip_hdr *iph = frame_ip(f);
+
+    if (csum_sum((uint8_t *)iph, IPH_HL(iph) * 4, 0) != 0xffff)
+        return false;
+    if (IPH_PROTO(iph) == IP_PROTO_UDP && *frame_l4_csum(f) == 0)
+        return true;
+    return frame_l4_sum(f) == 0xffff;
+}
+
+static void frame_make(frame_t *f, const flow_t *fl, bool reply, uint8_t flags, uint32_t *seed)
+{
+    struct eth_hdr *eth = (struct eth_hdr *)f->data;
+    struct ip_hdr *iph = frame_ip(f);
+    uint16_t *ports;
+    uint16_t l4_len = (fl->proto == IP_PROTO_TCP ? TCP_HLEN : UDP_HLEN) + test_rand(seed) % 33;
+    int i;
+
+    memset(f, 0, sizeof(frame_t));
+    f->p.payload = f->data;
+    f->p.len = f->p.tot_len = SIZEOF_ETH_HDR + fl->hl * 4 + l4_len;
+    eth->type = PP_HTONS(ETHTYPE_IP);
+    IPH_VHLTOS_SET(iph, 4, fl->hl, 0);
+    IPH_LEN(iph) = htons(fl->hl * 4 + l4_len);
+    IPH_OFFSET_SET(iph, (test_rand(seed) & 1) ? PP_HTONS(IP_DF) : 0);
+    IPH_TTL_SET(iph, 2 + test_rand(seed) % 254);
+    IPH_PROTO_SET(iph, fl->proto);
+    for (i = IP_HLEN; i < fl->hl * 4; i++)
+        ((uint8_t *)iph)[i] = 1;        // NOP options
+    for (i = 0; i < l4_len; i++)
+        frame_l4(f)[i] = test_rand(seed);
+
+    ports = (uint16_t *)frame_l4(f);
+    if (!reply)
+    {
+        memcpy(&eth->dest, ap_netif.hwaddr, 6);
+        memcpy(&eth->src, fl->client_mac, 6);
+        iph->src.addr = fl->client_ip;
+        iph->dest.addr = fl->remote_ip;
+        ports[0] = fl->client_port;
+        ports[1] = fl->remote_port;
+    }
+    else
+    {
+        memcpy(&eth->dest, sta_netif.hwaddr, 6);
+        memcpy(&eth->src, gw_mac, 6);
+        iph->src.addr = fl->remote_ip;
+        iph->dest.addr = sta_netif.ip_addr.addr;
+        ports[0] = fl->remote_port;
+        ports[1] = fl->nat_port;
+    }
+    if (fl->proto == IP_PROTO_TCP)
+    {
+        ((struct tcp_hdr *)ports)->_hdrlen_rsvd_flags = htons((5 << 12) | flags);
+    }
+    else
+    {
+        ((struct udp_hdr *)ports)->len = htons(l4_len);
+        if (test_rand(seed) % 4 == 0)
+            ((struct udp_hdr *)ports)->chksum = 0;
+        else
+            ((struct udp_hdr *)ports)->chksum = 1;
+    }
+    frame_csum(f);
+}
+
+// The frame as the NAPT of the slow path forwards it
+static void slow_path(frame_t *f, const flow_t *fl, bool reply)
+{
+    struct eth_hdr *eth = (struct eth_hdr *)f->data;
+    struct ip_hdr *iph = frame_ip(f);
+    uint16_t *ports = (uint16_t *)frame_l4(f);
+
+    if (!reply)
+    {
+        memcpy(&eth->dest, gw_mac, 6);
+        memcpy(&eth->src, sta_netif.hwaddr, 6);
+        iph->src.addr = sta_netif.ip_addr.addr;
+        ports[0] = fl->nat_port;
+    }
+    else
+    {
+        memcpy(&eth->dest, fl->client_mac, 6);
+        memcpy(&eth->src, ap_netif.hwaddr, 6);
+        iph->dest.addr = fl->client_ip;
+        ports[1] = fl->client_port;
+    }
+    IPH_TTL_SET(iph, IPH_TTL(iph) - 1);
+    frame_csum(f);
+}
+
+// Same frame, checksums may differ in the representation of zero
+static bool frame_same(frame_t *a, frame_t *b)
+{
+    struct ip_hdr *ia = frame_ip(a), *ib = frame_ip(b);
+    uint16_t ca = *frame_l4_csum(a), cb = *frame_l4_csum(b);
+    uint16_t ipa = IPH_CHKSUM(ia), ipb = IPH_CHKSUM(ib);
+    bool same;
+
+    if (a->p.len != b->p.len || !frame_csum_ok(a))
+        return false;
+    IPH_CHKSUM(ia) = IPH_CHKSUM(ib) = 0;
+    *frame_l4_csum(a) = *frame_l4_csum(b) = 0;
+    same = memcmp(a->data, b->data, a->p.len) == 0;
+    IPH_CHKSUM(ia) = ipa;
+    IPH_CHKSUM(ib) = ipb;
+    *frame_l4_csum(a) = ca;
+    *frame_l4_csum(b) = cb;
+    // UDP without checksum stays without
+    return same && (IPH_PROTO(ia) != IP_PROTO_UDP || (ca == 0) == (cb == 0));
+}
+
+static void netifs_init(void)
+{
+    static const uint8_t ap_mac[6] = {0x5e, 0xcf, 0x7f, 0x00, 0x00, 0x01};
+    static const uint8_t sta_mac[6] = {0x18, 0xfe, 0x34, 0x00, 0x00, 0x02};
+
+    memset(&ap_netif, 0, sizeof(ap_netif));
+    memset(&sta_netif, 0, sizeof(sta_netif));
+    IP4_ADDR(&ap_netif.ip_addr, 192, 168, 4, 1);
+    IP4_ADDR(&sta_netif.ip_addr, 10, 24, 1, 5);
+    memcpy(ap_netif.hwaddr, ap_mac, 6);
+    memcpy(sta_netif.hwaddr, sta_mac, 6);
+    ap_netif.hwaddr_len = sta_netif.hwaddr_len = 6;
+    ap_netif.napt = 1;
+}
+
+static void flows_init(uint32_t *seed)
+{
+    flow_t *fl;
+    int i;
+
+    for (i = 0; i < FLOWS; i++)
+    {
+        fl = &flows[i];
+        fl->proto = (test_rand(seed) & 1) ? IP_PROTO_TCP : IP_PROTO_UDP;
+        fl->hl = test_rand(seed) % 4 == 0 ? 6 : 5;
+        fl->client_ip = htonl(0xc0a80402 + i % 5);
+        fl->client_port = htons(1024 + test_rand(seed) % 60000);
+        fl->remote_ip = htonl(0x08080800 | (test_rand(seed) & 0xff));
+        fl->remote_port = htons(i % 3 == 0 ? 53 : 443);
+        fl->nat_port = htons(6000 + i);
+        memcpy(fl->client_mac, gw_mac, 6);
+        fl->client_mac[5] = 0x10 + i % 5;
+    }
+}
+
+// The slow path of a client frame: the NAPT sends it on the STA netif
+static void slow_out(frame_t *f, const flow_t *fl, uint32_t now)
+{
+    slow_path(f, fl, false);
+    fastpath_learn(&f->p, &sta_netif, now);
+    fastpath_learn_done();
+}
+
+// Frames that must take the slow path are neither forwarded nor remembered
+static void test_reject(uint32_t *seed)
+{
+    static const uint8_t tcp_flags[] = {TCP_SYN, TCP_FIN, TCP_RST, TCP_SYN | TCP_ACK, TCP_FIN | TCP_ACK};
+    flow_t fl = flows[0];
+    frame_t f, g;
+    uint32_t misses, learned;
+    int i;
+
+    fastpath_flush();
+    fl.proto = IP_PROTO_TCP;
+    fl.hl = 5;
+
+    // Learned once, so a frame that is not rejected would hit
+    frame_make(&f, &fl, false, TCP_ACK, seed);
+    CHECK(fastpath_out(&f.p, &ap_netif, 0) == NULL);
+    slow_out(&f, &fl, 0);
+
+    misses = fastpath_stats.misses;
+    learned = fastpath_stats.learned;
+    for (i = 0; i < 11 + sizeof(tcp_flags); i++)
+    {
+        frame_make(&f, &fl, false, TCP_ACK, seed);
+        switch (i)
+        {
+        case 0: IPH_VHLTOS_SET(frame_ip(&f), 4, 4, 0); break;
+        case 1: IPH_VHLTOS_SET(frame_ip(&f), 4, 0, 0); break;
+        case 2: IPH_VHLTOS_SET(frame_ip(&f), 4, 15, 0); f.p.len = SIZEOF_ETH_HDR + 40; break;
+        case 3: IPH_VHLTOS_SET(frame_ip(&f), 6, 5, 0); break;
+        case 4: IPH_OFFSET_SET(frame_ip(&f), PP_HTONS(IP_MF)); break;
+        case 5: IPH_OFFSET_SET(frame_ip(&f), PP_HTONS(185)); break;
+        case 6: IPH_TTL_SET(frame_ip(&f), 1); break;
+        case 7: IPH_PROTO_SET(frame_ip(&f), IP_PROTO_ICMP); break;
+        case 8: ((struct eth_hdr *)f.data)->type = PP_HTONS(ETHTYPE_ARP); break;
+        case 9: f.p.len = SIZEOF_ETH_HDR + IP_HLEN + TCP_HLEN - 1; break;
+        case 10: f.p.len = SIZEOF_ETH_HDR + IP_HLEN - 1; break;
+        default: ((struct tcp_hdr *)frame_l4(&f))->_hdrlen_rsvd_flags = htons((5 << 12) | tcp_flags[i - 11]); break;
+        }
+        g = f;
+        g.p.payload = g.data;
+        f.p.payload = f.data;
+        CHECK(fastpath_out(&f.p, &ap_netif, 1) == NULL);
+        CHECK(memcmp(f.data, g.data, sizeof(f.data)) == 0);
+        // A frame of the flow leaving the STA netif learns nothing
+        frame_make(&g, &fl, false, TCP_ACK, seed);
+        slow_path(&g, &fl, false);
+        fastpath_learn(&g.p, &sta_netif, 1);
+    }
+    CHECK(fastpath_stats.misses == misses);
+    CHECK(fastpath_stats.learned == learned);
+
+    // Still cached
+    frame_make(&f, &fl, false, TCP_ACK, seed);
+    CHECK(fastpath_out(&f.p, &ap_netif, 1) == &sta_netif);
+}
+
+// A client frame dropped on the slow path, then a frame of the router
+// itself to the same remote, must not map the flow to the router's port
+static void test_stale(uint32_t *seed)
+{
+    flow_t fl = flows[1], own = flows[1];
+    frame_t f;
+    uint32_t learned = fastpath_stats.learned;
+
+    fastpath_flush();
+    frame_make(&f, &fl, false, TCP_ACK, seed);
+    CHECK(fastpath_out(&f.p, &ap_netif, 0) == NULL);
+    fastpath_learn_done();
+
+    own.client_ip = sta_netif.ip_addr.addr;
+    own.client_port = own.nat_port = htons(50000);
+    frame_make(&f, &own, false, TCP_ACK, seed);
+    memcpy(&((struct eth_hdr *)f.data)->src, sta_netif.hwaddr, 6);
+    memcpy(&((struct eth_hdr *)f.data)->dest, gw_mac, 6);
+    fastpath_learn(&f.p, &sta_netif, 0);
+    CHECK(fastpath_stats.learned == learned);
+
+    frame_make(&f, &fl, false, TCP_ACK, seed);
+    CHECK(fastpath_out(&f.p, &ap_netif, 0) == NULL);
+}
+
+static void run(uint32_t seed)
+{
+    uint32_t now = 0, hits = 0, errors = 0, learned, i;
+    bool reply;
+    flow_t *fl;
+    frame_t f, g;
+    struct netif *nif;
+
+    fastpath_flush();
+    memset(&fastpath_stats, 0, sizeof(fastpath_stats));
+    flows_init(&seed);
+
+    for (i = 0; i < EVENTS; i++)
+    {
+        now += test_rand(&seed) % 20;
+        fl = &flows[test_rand(&seed) % FLOWS];
+        reply = test_rand(&seed) & 1;
+        frame_make(&f, fl, reply, TCP_ACK, &seed);
+        g = f;
+        g.p.payload = g.data;
+        slow_path(&g, fl, reply);
+
+        if (!reply)
+        {
+            nif = fastpath_out(&f.p, &ap_netif, now);
+            if (nif == NULL)
+            {
+                // The slow path learns it, the next frame of the flow hits
+                learned = fastpath_stats.learned;
+                slow_out(&f, fl, now);
+                if (fastpath_stats.learned != learned + 1)
+                    errors++;
+                frame_make(&f, fl, false, TCP_ACK, &seed);
+                g = f;
+                g.p.payload = g.data;
+                slow_path(&g, fl, false);
+                nif = fastpath_out(&f.p, &ap_netif, now);
+            }
+            if (nif != &sta_netif || !frame_same(&f, &g))
+                errors++;
+            hits++;
+        }
+        else
+        {
+            nif = fastpath_in(&f.p, now);
+            if (nif != NULL && (nif != &ap_netif || !frame_same(&f, &g)))
+                errors++;
+            hits += nif != NULL;
+        }
+    }
+
+    // Past the refresh every flow takes the slow path again
+    now += FASTPATH_REFRESH_MS;
+    for (i = 0; i < FLOWS; i++)
+    {
+        frame_make(&f, &flows[i], true, TCP_ACK, &seed);
+        if (fastpath_in(&f.p, now) != NULL)
+            errors++;
+        frame_make(&f, &flows[i], false, TCP_ACK, &seed);
+        if (fastpath_out(&f.p, &ap_netif, now) != NULL)
+            errors++;
+        fastpath_learn_done();
+    }
+
+    printf("fastpath: %u frames, %u forwarded, %u learned, %u out, %u in, %u errors\n",
+           EVENTS, hits, fastpath_stats.learned, fastpath_stats.hits_out, fastpath_stats.hits_in, errors);
+    CHECK(errors == 0);
+    CHECK(fastpath_stats.hits_in > EVENTS / 20);
+}
+
+int main(void)
+{
+    uint32_t seed = 13;
+
+    netifs_init();
+    flows_init(&seed);
+    test_reject(&seed);
+    test_stale(&seed);
+    run(14);
+    run(15);
+    return test_result("test_fastpath");
+}
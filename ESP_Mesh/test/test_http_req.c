@@ -0,0 +1,227 @@
+#include <string.h>
+
+#include "c_types.h"
+#include "http_req.h"
+#include "test.h"
+
+//
+// http_req: a corpus of requests, alone and pipelined, fed at once, one
+// byte at a time and in random splits, as web_config_client_recv_cb()
+// does: feed until the request is done, start the next one with the
+// rest, stop on an error. What the parser reports is written to a log,
+// which must be the expected one however the data is split. Random
+// byte soup must never overrun a field or hand out a parameter with a
+// NUL inside.
+//
+
+#define SPLITS          2000
+#define SOUP            20000
+#define SOUP_MAX        300
+#define LOG_MAX         8192
+
+typedef struct {
+        const char *in;
+        const char *log;        // [key=val] per parameter, "METHOD path ka=keep_alive" per request
+} corpus_t;
+
+static const corpus_t corpus[] = {
+    {"GET / HTTP/1.1\r\nHost: 192.168.4.1\r\n\r\n", "GET / ka=1\n"},
+    {"GET / HTTP/1.0\r\n\r\n", "GET / ka=0\n"},
+    {"GET / HTTP/1.0\r\nConnection: Keep-Alive\r\n\r\n", "GET / ka=1\n"},
+    {"GET /status.json HTTP/1.1\r\nCONNECTION:close\r\n\r\n", "GET /status.json ka=0\n"},
+    {"GET / HTTP/1.1\nConnection: close\n\n", "GET / ka=0\n"},
+    {"GET / HTTP/1.1\r\nConnection-Foo: close\r\nX-Connection: close\r\n\r\n", "GET / ka=1\n"},
+    {"GET /?ssid=My+AP&password=a%26b%3D%25&x&=v&y= HTTP/1.1\r\n\r\n",
+     "[ssid=My AP][password=a&b=%][x=][y=]GET / ka=1\n"},
+    {"GET /?ssid=%C3%a4%7e HTTP/1.1\r\n\r\n", "[ssid=\xc3\xa4~]GET / ka=1\n"},
+    {"GET /?k=0123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789"
+     "&key_longer_than_the_buffer=1 HTTP/1.1\r\n\r\n",
+     "[k=0123456789012345678901234567890123456789012345678901234567890123456789012345678]"
+     "[key_longer_than=1]GET / ka=1\n"},
+    {"GET /a/path/longer/than/the/thirty/two/bytes HTTP/1.1\r\n\r\n", "GET /a/path/longer/than/the/thirty/ ka=1\n"},
+    // Pipelined, with and without empty lines between the requests
+    {"GET /?a=1 HTTP/1.1\r\n\r\nGET /status.json HTTP/1.1\r\n\r\n\r\nGET /?b=2 HTTP/1.0\r\n\r\n",
+     "[a=1]GET / ka=1\nGET /status.json ka=1\n[b=2]GET / ka=0\n"},
+    {"GET / HTTP/1.1\r\n\r\nGET / HTTP/1.1\r\nHost: x", "GET / ka=1\n..."},
+    {"GET / HTTP/1.1\r\n\r\nGET /?a=%00 HTTP/1.1\r\n\r\nGET / HTTP/1.1\r\n\r\n", "GET / ka=1\nERROR\n"},
+    // Bad requests
+    {"GET /?password=abc%00def HTTP/1.1\r\n\r\n", "ERROR\n"},
+    {"GET /?a=1&b=%zz HTTP/1.1\r\n\r\n", "[a=1]ERROR\n"},
+    {"GET /?a=%4 HTTP/1.1\r\n\r\n", "ERROR\n"},
+    {"GET /?a=%\r\n\r\n", "ERROR\n"},
+    {"GET /?a=b\r\n\r\n", "ERROR\n"},
+    {"GET /\r\n\r\n", "ERROR\n"},
+    {"GETTINGLONG / HTTP/1.1\r\n\r\n", "ERROR\n"},
+    {"GET\r\n", "ERROR\n"},
+    {"GET / HTTP/1.1\r\n\rX\r\n", "ERROR\n"},
+};
+
+static char log_buf[LOG_MAX];
+static int log_len;
+static http_req_t req;
+
+static void log_add(const char *s)
+{
+    int n = strlen(s);
+
+    CHECK(log_len + n < LOG_MAX);
+    if (log_len + n < LOG_MAX)
+    {
+        memcpy(log_buf + log_len, s, n + 1);
+        log_len += n;
+    }
+}
+
+static void param(void *arg, char *key, char *val)
+{
+    // A NUL inside a key or value would hide the rest of it
+    CHECK(strlen(key) == req.key_len && strlen(key) < HTTP_MAX_KEY);
+    CHECK(req.state != HTTP_REQ_VAL || strlen(val) == req.len);
+    CHECK(strlen(val) < HTTP_MAX_VAL);
+    log_add("[");
+    log_add(key);
+    log_add("=");
+    log_add(val);
+    log_add("]");
+}
+
+// Feeds one segment, returns false once the connection would be closed
+static bool segment(const char *data, uint16_t length)
+{
+    char line[HTTP_MAX_METHOD + HTTP_MAX_PATH + 16];
+    uint16_t used = 0, n;
+
+    while (used < length)
+    {
+        n = http_req_feed(&req, data + used, length - used);
+        CHECK(n <= length - used);
+        used += n;
+        CHECK(strlen(req.method) < HTTP_MAX_METHOD && strlen(req.path) < HTTP_MAX_PATH);
+        CHECK(strlen(req.hdr) < HTTP_MAX_HDR);
+
+        if (req.state == HTTP_REQ_ERROR)
+        {
+            log_add("ERROR\n");
+            return false;
+        }
+        if (req.state == HTTP_REQ_DONE)
+        {
+            snprintf(line, sizeof(line), "%s %s ka=%d\n", req.method, req.path, req.keep_alive);
+            log_add(line);
+            http_req_init(&req, param, NULL);
+        }
+        else
+        {
+            // All of it is consumed unless the request ended
+            CHECK(used == length);
+        }
+    }
+    return true;
+}
+
+// Feeds in in segments of split(seed) bytes, 0 for all at once, returns the log
+static const char *run(const char *in, uint32_t len, int mode, uint32_t *seed)
+{
+    uint32_t at = 0, n;
+
+    log_len = 0;
+    log_buf[0] = 0;
+    http_req_init(&req, param, NULL);
+    while (at < len)
+    {
+        if (mode == 0)
+            n = len;
+        else if (mode == 1)
+            n = 1;
+        else
+            n = 1 + test_rand(seed) % (test_rand(seed) % 4 == 0 ? 64 : 8);
+        if (n > len - at)
+            n = len - at;
+        if (!segment(in + at, n))
+            return log_buf;
+        at += n;
+    }
+    if (req.state != HTTP_REQ_METHOD || req.len != 0)
+        log_add("...");
+    return log_buf;
+}
+
+static void check_log(const char *in, uint32_t len, const char *expect, int mode, uint32_t *seed)
+{
+    const char *got = run(in, len, mode, seed);
+
+    if (strcmp(got, expect) != 0)
+    {
+        fprintf(stderr, "http_req: split mode %d of \"%s\":\n  got    \"%s\"\n  wanted \"%s\"\n",
+                mode, in, got, expect);
+        CHECK(false);
+    }
+}
+
+static void test_corpus(uint32_t seed)
+{
+    int c, i;
+
+    for (c = 0; c < sizeof(corpus) / sizeof(corpus[0]); c++)
+    {
+        check_log(corpus[c].in, strlen(corpus[c].in), corpus[c].log, 0, NULL);
+        check_log(corpus[c].in, strlen(corpus[c].in), corpus[c].log, 1, NULL);
+        for (i = 0; i < SPLITS; i++)
+            check_log(corpus[c].in, strlen(corpus[c].in), corpus[c].log, 2, &seed);
+    }
+}
+
+// All the requests that end cleanly, pipelined on one connection
+static void test_pipelined(uint32_t seed)
+{
+    static char in[LOG_MAX], expect[LOG_MAX];
+    const char *log;
+    int c, i;
+
+    in[0] = expect[0] = 0;
+    for (c = 0; c < sizeof(corpus) / sizeof(corpus[0]); c++)
+    {
+        log = corpus[c].log;
+        if (strstr(log, "ERROR") != NULL || strstr(log, "...") != NULL)
+            continue;
+        strcat(in, corpus[c].in);
+        strcat(expect, log);
+    }
+    for (i = 0; i < SPLITS; i++)
+        check_log(in, strlen(in), expect, 2, &seed);
+    check_log(in, strlen(in), expect, 1, NULL);
+}
+
+// Byte soup: the log depends on the bytes only, not on the segments
+static void test_soup(uint32_t seed)
+{
+    static const char *tokens[] = {
+        "GET ", "/", "?", "&", "=", "%", "0", "4", "a", "z", "+", " ", "\r", "\n", "\r\n",
+        " HTTP/1.1\r\n", "Connection: ", "close", "keep-alive", "\r\n\r\n", "%00", "%41",
+        "abcdefghijklmnopqrstuvwxyz0123456789"};
+    static char in[SOUP_MAX + 64], whole[LOG_MAX];
+    uint32_t s, len, want;
+
+    for (s = 0; s < SOUP; s++)
+    {
+        in[0] = 0;
+        // Most of them start like a request, so the soup gets past the request line
+        if (test_rand(&seed) % 4 != 0)
+            strcat(in, "GET /?");
+        want = test_rand(&seed) % SOUP_MAX;
+        while (strlen(in) < want)
+            strcat(in, tokens[test_rand(&seed) % (sizeof(tokens) / sizeof(tokens[0]))]);
+        len = strlen(in);
+        strcpy(whole, run(in, len, 0, NULL));
+        check_log(in, len, whole, 1, NULL);
+        check_log(in, len, whole, 2, &seed);
+    }
+}
+
+int main(void)
+{
+    test_corpus(7);
+    test_pipelined(77);
+    test_soup(777);
+    return test_result("test_http_req");
+}
@@ -0,0 +1,183 @@
+#include <string.h>
+
+#include "c_types.h"
+#include "inet_csum.h"
+#include "test.h"
+
+//
+// inet_csum: random IPv4 TCP/UDP packets with valid checksums get their
+// source address and port rewritten and their TTL decremented, the way
+// the fast path does it. The incrementally updated IP and L4 checksums
+// must equal a full recomputation over the rewritten packet. Built once
+// per variant, see INET_CSUM_REFERENCE.
+//
+
+#define REWRITES        3000000
+#define MAX_PAYLOAD     64
+
+static uint16_t get16(const uint8_t *p)
+{
+    uint16_t v;
+
+    memcpy(&v, p, 2);
+    return v;
+}
+
+static void put16(uint8_t *p, uint16_t v)
+{
+    memcpy(p, &v, 2);
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, 4);
+    return v;
+}
+
+// One's complement sum of len bytes in network order, as a host value
+static uint32_t sum(uint32_t acc, const uint8_t *p, int len)
+{
+    while (len > 1)
+    {
+        acc += (p[0] << 8) | p[1];
+        p += 2;
+        len -= 2;
+    }
+    if (len > 0)
+        acc += p[0] << 8;
+    return acc;
+}
+
+static uint16_t fold(uint32_t acc)
+{
+    while (acc >> 16)
+        acc = (acc & 0xffff) + (acc >> 16);
+    return acc;
+}
+
+// Both checksums from scratch, in network order
+static uint16_t ip_csum(const uint8_t *ip, int hlen)
+{
+    uint8_t h[60];
+    uint16_t c;
+
+    memcpy(h, ip, hlen);
+    h[10] = h[11] = 0;
+    c = ~fold(sum(0, h, hlen));
+    return (c >> 8) | (c << 8);
+}
+
+static uint16_t l4_csum(const uint8_t *ip, int hlen, int l4_len)
+{
+    uint8_t l4[60 + MAX_PAYLOAD];
+    uint8_t proto = ip[9];
+    int off = proto == 6 ? 16 : 6;
+    uint32_t acc;
+    uint16_t c;
+
+    memcpy(l4, ip + hlen, l4_len);
+    l4[off] = l4[off + 1] = 0;
+    acc = sum(0, ip + 12, 8) + proto + l4_len;
+    c = ~fold(sum(acc, l4, l4_len));
+    if (proto == 17 && c == 0)
+        c = 0xffff;
+    return (c >> 8) | (c << 8);
+}
+
+// As fp_rewrite() in fastpath.c
+static void rewrite(uint8_t *ip, int hlen, uint32_t new_addr, uint16_t new_port)
+{
+    uint8_t *l4 = ip + hlen;
+    uint8_t *csum = l4 + (ip[9] == 6 ? 16 : 6);
+    uint16_t c = get16(csum);
+    uint16_t old_ttl_proto = get16(ip + 8);
+    uint32_t acc = inet_csum_replace32(0, get32(ip + 12), new_addr);
+
+    if (ip[9] == 6 || c != 0)
+    {
+        inet_csum_apply(&c, inet_csum_replace16(acc, get16(l4), new_port));
+        if (ip[9] == 17 && c == 0)
+            c = 0xffff;
+        put16(csum, c);
+    }
+
+    ip[8]--;
+    c = get16(ip + 10);
+    inet_csum_apply(&c, inet_csum_replace16(acc, old_ttl_proto, get16(ip + 8)));
+    put16(ip + 10, c);
+
+    memcpy(ip + 12, &new_addr, 4);
+    put16(l4, new_port);
+}
+
+int main(void)
+{
+    uint8_t pkt[60 + 60 + MAX_PAYLOAD];
+    uint32_t seed = 14;
+    uint32_t ip_errors = 0, l4_errors = 0, udp_none = 0;
+    uint32_t new_addr;
+    uint16_t new_port, c;
+    int i, j, hlen, l4_len;
+    bool tcp;
+
+    for (i = 0; i < REWRITES; i++)
+    {
+        for (j = 0; j < sizeof(pkt); j++)
+            pkt[j] = test_rand(&seed);
+
+        // Edge values are where one's complement arithmetic goes wrong
+        switch (i % 8)
+        {
+        case 0:
+            memset(pkt + 12, 0xff, 8);
+            break;
+        case 1:
+            memset(pkt + 12, 0, 8);
+            break;
+        }
+
+        tcp = test_rand(&seed) & 1;
+        hlen = 20 + 4 * (test_rand(&seed) % 11);
+        l4_len = (tcp ? 20 + 4 * (test_rand(&seed) % 11) : 8) + test_rand(&seed) % (MAX_PAYLOAD + 1);
+        pkt[0] = 0x40 | hlen / 4;
+        pkt[8] = 2 + test_rand(&seed) % 254;
+        pkt[9] = tcp ? 6 : 17;
+        put16(pkt + 10, ip_csum(pkt, hlen));
+        put16(pkt + hlen + (tcp ? 16 : 6), l4_csum(pkt, hlen, l4_len));
+
+        // UDP without a checksum must stay without one
+        if (!tcp && i % 16 == 3)
+            put16(pkt + hlen + 6, 0);
+
+        new_addr = test_rand(&seed);
+        new_port = test_rand(&seed);
+        if (i % 8 == 2)
+            new_addr = 0xffffffff;
+        if (i % 8 == 3)
+            new_addr = 0;
+
+        c = get16(pkt + hlen + 6);
+        rewrite(pkt, hlen, new_addr, new_port);
+
+        if (get16(pkt + 10) != ip_csum(pkt, hlen))
+            ip_errors++;
+        if (!tcp && c == 0)
+        {
+            if (get16(pkt + hlen + 6) != 0)
+                l4_errors++;
+            udp_none++;
+        }
+        else if (get16(pkt + hlen + (tcp ? 16 : 6)) != l4_csum(pkt, hlen, l4_len))
+        {
+            l4_errors++;
+        }
+    }
+
+    printf("inet_csum (%s): %u rewrites, %u without UDP checksum, %u IP and %u L4 mismatches\n",
+           INET_CSUM_REFERENCE ? "reference" : "32 bit", REWRITES, udp_none, ip_errors, l4_errors);
+    CHECK(ip_errors == 0);
+    CHECK(l4_errors == 0);
+    return test_result(INET_CSUM_REFERENCE ? "test_inet_csum_ref" : "test_inet_csum");
+}
@@ -0,0 +1,229 @@
+#include <string.h>
+
+#include "c_types.h"
+#include "user_config.h"
+#include "mesh_ie.h"
+#include "test.h"
+
+//
+// mesh_ie: encode and decode round trips, with and without the element
+// header, elements from the air that are short or not ours, and the
+// per BSSID cache with its eviction and expiry.
+//
+
+#define ROUNDS          100000
+
+static void ie_random(mesh_ie_t *ie, uint32_t *seed)
+{
+    uint32_t r = test_rand(seed);
+
+    ie->level = r;
+    ie->load = r >> 8;
+    ie->napt_free = r >> 16;
+    ie->uplink_rssi = (int8_t)(r >> 24);
+    r = test_rand(seed);
+    ie->firmware[0] = r;
+    ie->firmware[1] = r >> 8;
+    ie->firmware[2] = r >> 16;
+}
+
+static bool ie_equal(const mesh_ie_t *a, const mesh_ie_t *b)
+{
+    return a->level == b->level && a->load == b->load && a->napt_free == b->napt_free &&
+           a->uplink_rssi == b->uplink_rssi && memcmp(a->firmware, b->firmware, 3) == 0;
+}
+
+// The element as it is on the air: ID, length, OUI, payload
+static uint8_t element(uint8_t *buf, const mesh_ie_t *ie)
+{
+    buf[0] = MESH_IE_ELEMENT_ID;
+    buf[2] = MESH_IE_OUI0;
+    buf[3] = MESH_IE_OUI1;
+    buf[4] = MESH_IE_OUI2;
+    buf[1] = 3 + mesh_ie_encode(ie, buf + 5);
+    return buf[1] + 2;
+}
+
+static void test_round_trip(void)
+{
+    uint8_t buf[64];
+    mesh_ie_t in, out;
+    uint32_t seed = 23, errors = 0;
+    int i;
+
+    for (i = 0; i < ROUNDS; i++)
+    {
+        ie_random(&in, &seed);
+
+        memset(&out, 0, sizeof(out));
+        if (mesh_ie_encode(&in, buf) != MESH_IE_LEN || !mesh_ie_decode(buf, MESH_IE_LEN, &out) ||
+            !ie_equal(&in, &out))
+            errors++;
+
+        memset(&out, 0, sizeof(out));
+        if (element(buf, &in) != 5 + MESH_IE_LEN || !mesh_ie_decode(buf, 5 + MESH_IE_LEN, &out) ||
+            !ie_equal(&in, &out))
+            errors++;
+    }
+    CHECK(errors == 0);
+
+    // A newer version with more fields, read as far as known
+    ie_random(&in, &seed);
+    element(buf, &in);
+    buf[1] += 4;
+    buf[6] = MESH_IE_VERSION + 1;
+    memset(buf + 5 + MESH_IE_LEN, 0xee, 4);
+    CHECK(mesh_ie_decode(buf, 9 + MESH_IE_LEN, &out));
+    CHECK(ie_equal(&in, &out));
+    CHECK(mesh_ie_decode(buf + 5, 4 + MESH_IE_LEN, &out));
+    CHECK(ie_equal(&in, &out));
+}
+
+// Only the bytes the element and the buffer both cover may be read
+static void test_short(void)
+{
+    uint8_t buf[256];
+    mesh_ie_t in, out;
+    uint32_t seed = 5;
+    int elen, len;
+
+    ie_random(&in, &seed);
+    element(buf, &in);
+    memset(buf + 5 + MESH_IE_LEN, 0, sizeof(buf) - 5 - MESH_IE_LEN);
+
+    // Element lengths that do not cover the OUI or the payload, even
+    // with more bytes after it in the buffer
+    for (elen = 0; elen < 256; elen++)
+    {
+        buf[1] = elen;
+        for (len = 0; len < 256; len++)
+        {
+            bool ok = elen >= 3 + MESH_IE_LEN && len >= 5 + MESH_IE_LEN;
+
+            if (mesh_ie_decode(buf, len, &out) != ok)
+            {
+                CHECK(mesh_ie_decode(buf, len, &out) == ok);
+                fprintf(stderr, "element length %d, buffer %d\n", elen, len);
+                return;
+            }
+        }
+    }
+
+    // Payloads without the header
+    for (len = 0; len < MESH_IE_LEN; len++)
+        CHECK(!mesh_ie_decode(buf + 5, len, &out));
+}
+
+static void test_foreign(void)
+{
+    uint8_t buf[32];
+    mesh_ie_t in, out;
+    uint32_t seed = 7;
+    int i;
+
+    ie_random(&in, &seed);
+
+    // Another type or a version before the first
+    element(buf, &in);
+    buf[5] = MESH_IE_TYPE + 1;
+    CHECK(!mesh_ie_decode(buf, 5 + MESH_IE_LEN, &out));
+    CHECK(!mesh_ie_decode(buf + 5, MESH_IE_LEN, &out));
+    element(buf, &in);
+    buf[6] = 0;
+    CHECK(!mesh_ie_decode(buf, 5 + MESH_IE_LEN, &out));
+
+    // Another vendor, or not a vendor element: not our payload either
+    for (i = 0; i < 4; i++)
+    {
+        element(buf, &in);
+        if (i < 3)
+            buf[2 + i] ^= 0x01;
+        else
+            buf[0] = MESH_IE_ELEMENT_ID - 1;
+        CHECK(!mesh_ie_decode(buf, 5 + MESH_IE_LEN, &out));
+    }
+}
+
+static void test_version(void)
+{
+    uint8_t fw[3];
+
+    mesh_ie_version("V2.2.14", fw);
+    CHECK(fw[0] == 2 && fw[1] == 2 && fw[2] == 14);
+    mesh_ie_version("1.5", fw);
+    CHECK(fw[0] == 1 && fw[1] == 5 && fw[2] == 0);
+    mesh_ie_version("", fw);
+    CHECK(fw[0] == 0 && fw[1] == 0 && fw[2] == 0);
+}
+
+static void test_cache(void)
+{
+    static mesh_ie_cache_t c;
+    uint8_t sa[MESH_IE_CACHE + 1][6];
+    uint8_t buf[32], bad[32];
+    mesh_ie_t ie[MESH_IE_CACHE + 1];
+    const mesh_ie_t *got;
+    uint32_t seed = 16;
+    int i;
+
+    mesh_ie_cache_init(&c);
+    for (i = 0; i <= MESH_IE_CACHE; i++)
+    {
+        memset(sa[i], 0x24, 6);
+        sa[i][5] = i;
+        ie_random(&ie[i], &seed);
+    }
+
+    // Full, every entry seen at its own time
+    for (i = 0; i < MESH_IE_CACHE; i++)
+    {
+        element(buf, &ie[i]);
+        CHECK(mesh_ie_cache_input(&c, sa[i], buf, 5 + MESH_IE_LEN, 1000 + i));
+    }
+    for (i = 0; i < MESH_IE_CACHE; i++)
+    {
+        got = mesh_ie_cache_get(&c, sa[i], 2000);
+        CHECK(got != NULL && ie_equal(got, &ie[i]));
+    }
+
+    // A refresh updates the entry in place
+    ie_random(&ie[0], &seed);
+    element(buf, &ie[0]);
+    CHECK(mesh_ie_cache_input(&c, sa[0], buf, 5 + MESH_IE_LEN, 3000));
+    got = mesh_ie_cache_get(&c, sa[0], 3000);
+    CHECK(got != NULL && ie_equal(got, &ie[0]));
+
+    // A new one takes the oldest entry, now that of sa[1]
+    element(buf, &ie[MESH_IE_CACHE]);
+    CHECK(mesh_ie_cache_input(&c, sa[MESH_IE_CACHE], buf, 5 + MESH_IE_LEN, 4000));
+    CHECK(mesh_ie_cache_get(&c, sa[1], 4000) == NULL);
+    for (i = 0; i <= MESH_IE_CACHE; i++)
+    {
+        if (i != 1)
+            CHECK(mesh_ie_cache_get(&c, sa[i], 4000) != NULL);
+    }
+
+    // What does not decode leaves the cache alone
+    element(bad, &ie[1]);
+    bad[1] = 2;
+    CHECK(!mesh_ie_cache_input(&c, sa[1], bad, 5 + MESH_IE_LEN, 4000));
+    CHECK(mesh_ie_cache_get(&c, sa[1], 4000) == NULL);
+    CHECK(c.received == MESH_IE_CACHE + 2);
+    CHECK(c.errors == 1);
+
+    // Trusted for MESH_IE_MAX_AGE
+    CHECK(mesh_ie_cache_get(&c, sa[0], 3000 + MESH_IE_MAX_AGE - 1) != NULL);
+    CHECK(mesh_ie_cache_get(&c, sa[0], 3000 + MESH_IE_MAX_AGE) == NULL);
+    CHECK(mesh_ie_cache_get(&c, sa[2], 1002 + MESH_IE_MAX_AGE - 1) != NULL);
+    CHECK(mesh_ie_cache_get(&c, sa[2], 1002 + MESH_IE_MAX_AGE) == NULL);
+}
+
+int main(void)
+{
+    test_round_trip();
+    test_short();
+    test_foreign();
+    test_version();
+    test_cache();
+    return test_result("test_mesh_ie");
+}
@@ -0,0 +1,530 @@
+#include <string.h>
+
+#include "c_types.h"
+#include "lwip/def.h"
+#include "user_config.h"
+#include "mesh_route.h"
+#include "test.h"
+
+//
+// mesh_route: a mesh of nodes in one process. Nodes join below a random
+// node of the levels above, get a lease in the network of their parent
+// and run the protocol core; messages are delivered SIM_DELAY later,
+// mesh_route_tick() runs every second. A node that renumbers its AP
+// keeps its children until they lease again SIM_RELEASE later, as they
+// do after their uplink stopped answering. Stations that are no mesh
+// nodes send adverts too.
+//
+// After the mesh settled, every network must be unique where it is
+// routed and the answer to a packet from any network must find its way
+// back: down from the node that NATed it (the first one not routed,
+// at the latest the root) along the routes to the node of the network.
+//
+
+#define SIM_NODES       40
+#define SIM_LEVELS      4
+#define SIM_ROUTES      64
+#define SIM_MSGS        1024
+#define SIM_STEP        100
+#define SIM_DELAY       5
+#define SIM_RELEASE     60000
+#define SIM_ROGUES      3
+
+typedef struct {
+        mesh_route_t m;
+        int parent;             // -1: the root, its uplink is a plain AP
+        int children;           // leases handed out
+        bool up;
+        uint8_t bssid[6];
+        uint8_t level;          // of the AP, the root's is 1
+        uint32_t ap_ip;
+        uint32_t sta_ip;
+        uint32_t release;       // lease again at, 0 if not pending
+        bool nat;
+        struct {
+                uint32_t net;
+                uint32_t gw;
+                uint8_t len;
+        } routes[SIM_ROUTES];
+        int n_routes;
+} node_t;
+
+typedef struct {
+        int to;
+        uint32_t src;
+        uint32_t at;
+        uint16_t len;
+        uint8_t msg[MESH_ROUTE_MAX_LEN];
+} sim_msg_t;
+
+// A station on the AP of a node that is no mesh node
+typedef struct {
+        int node;
+        uint32_t ip;
+        uint8_t bssid[6];
+        bool leased;            // else a static address
+} rogue_t;
+
+static node_t nodes[SIM_NODES];
+static int n_nodes;
+static sim_msg_t msgs[SIM_MSGS];
+static int n_msgs;
+static rogue_t rogues[SIM_ROGUES];
+static int n_rogues;
+static uint32_t now;
+static uint32_t dropped;
+
+static int node_of(void *ctx)
+{
+    return (node_t *)ctx - nodes;
+}
+
+static uint32_t lease(int parent)
+{
+    return nodes[parent].ap_ip ^ htonl(1) ^ htonl(2 + nodes[parent].children++);
+}
+
+static void sim_send(void *ctx, uint32_t dst, const uint8_t *msg, uint16_t len)
+{
+    int from = node_of(ctx), to = -1, i;
+    sim_msg_t *s;
+
+    // Up to the uplink or down to a child, whatever still has the address
+    if (nodes[from].parent >= 0 && nodes[nodes[from].parent].ap_ip == dst)
+        to = nodes[from].parent;
+    for (i = 0; i < n_nodes && to < 0; i++)
+    {
+        if (nodes[i].up && nodes[i].parent == from && nodes[i].sta_ip == dst)
+            to = i;
+    }
+    if (to < 0 || n_msgs == SIM_MSGS)
+    {
+        dropped++;
+        return;
+    }
+    s = &msgs[n_msgs++];
+    s->to = to;
+    s->src = to == nodes[from].parent ? nodes[from].sta_ip : nodes[from].ap_ip;
+    s->at = now + SIM_DELAY;
+    s->len = len;
+    memcpy(s->msg, msg, len);
+}
+
+static bool sim_install(void *ctx, uint32_t net, uint8_t len, uint32_t gw)
+{
+    node_t *n = &nodes[node_of(ctx)];
+
+    if (n->n_routes == SIM_ROUTES)
+        return false;
+    n->routes[n->n_routes].net = net;
+    n->routes[n->n_routes].len = len;
+    n->routes[n->n_routes].gw = gw;
+    n->n_routes++;
+    return true;
+}
+
+static void sim_withdraw(void *ctx, uint32_t net, uint8_t len, uint32_t gw)
+{
+    node_t *n = &nodes[node_of(ctx)];
+    int i;
+
+    for (i = 0; i < n->n_routes; i++)
+    {
+        if (n->routes[i].net == net && n->routes[i].len == len)
+        {
+            n->routes[i] = n->routes[--n->n_routes];
+            return;
+        }
+    }
+    CHECK(false);
+}
+
+static void sim_set_nat(void *ctx, bool enable)
+{
+    nodes[node_of(ctx)].nat = enable;
+}
+
+// As the firmware: a leased station whose BSSID is a mesh AP one level below
+static bool sim_is_child(void *ctx, uint32_t src, const uint8_t *bssid)
+{
+    int self = node_of(ctx), i;
+    bool leased = false;
+
+    for (i = 0; i < n_nodes; i++)
+    {
+        if (nodes[i].up && nodes[i].parent == self && nodes[i].sta_ip == src)
+            leased = true;
+    }
+    for (i = 0; i < n_rogues; i++)
+    {
+        if (rogues[i].node == self && rogues[i].ip == src && rogues[i].leased)
+            leased = true;
+    }
+    if (!leased)
+        return false;
+    for (i = 0; i < n_nodes; i++)
+    {
+        if (nodes[i].up && memcmp(nodes[i].bssid, bssid, 6) == 0)
+            return nodes[i].level == nodes[self].level + 1;
+    }
+    return false;
+}
+
+static void sim_renumber(void *ctx, uint32_t net)
+{
+    int self = node_of(ctx), i;
+
+    nodes[self].ap_ip = net | htonl(1);
+    nodes[self].children = 0;
+    for (i = 0; i < n_nodes; i++)
+    {
+        if (nodes[i].up && nodes[i].parent == self)
+            nodes[i].release = now + SIM_RELEASE;
+    }
+}
+
+static const mesh_route_ops_t sim_ops = {sim_send, sim_install, sim_withdraw, sim_set_nat, sim_is_child,
+                                         sim_renumber};
+
+static uint32_t net_of(const node_t *n)
+{
+    return n->ap_ip & htonl(0xffffff00);
+}
+
+static void node_lease(int i)
+{
+    node_t *n = &nodes[i];
+
+    n->sta_ip = lease(n->parent);
+    n->release = 0;
+    // The firmware checks this on got IP
+    if (net_of(n) == net_of(&nodes[n->parent]))
+        mesh_route_renumber(&n->m, now);
+    mesh_route_set_uplink(&n->m, nodes[n->parent].ap_ip, now);
+}
+
+// A new node below parent, on the network of node clash if >= 0
+static int node_join(int parent, int clash, uint32_t *seed)
+{
+    int i = n_nodes++;
+    node_t *n = &nodes[i];
+    uint32_t r = test_rand(seed);
+
+    memset(n, 0, sizeof(node_t));
+    n->up = true;
+    n->parent = parent;
+    n->level = parent < 0 ? 1 : nodes[parent].level + 1;
+    n->bssid[0] = 0x24;
+    n->bssid[1] = 0x24;
+    n->bssid[2] = n->level;
+    n->bssid[3] = r;
+    n->bssid[4] = r >> 8;
+    n->bssid[5] = r >> 16;
+    n->ap_ip = (clash >= 0 ? net_of(&nodes[clash]) : mesh_route_subnet(n->bssid, 0)) | htonl(1);
+    n->nat = true;
+
+    mesh_route_init(&n->m, &sim_ops, n, now);
+    mesh_route_set_local(&n->m, n->bssid, net_of(n), 24, now);
+    if (parent >= 0)
+        node_lease(i);
+    return i;
+}
+
+static void run(uint32_t until)
+{
+    int i, j;
+
+    for (; now < until; now += SIM_STEP)
+    {
+        // In order, each message may send others
+        for (j = 0; j < n_msgs; j++)
+        {
+            if (msgs[j].at <= now)
+            {
+                sim_msg_t s = msgs[j];
+
+                memmove(&msgs[j], &msgs[j + 1], (n_msgs - j - 1) * sizeof(sim_msg_t));
+                n_msgs--;
+                j--;
+                mesh_route_input(&nodes[s.to].m, s.src, s.msg, s.len, now);
+            }
+        }
+        for (i = 0; i < n_nodes; i++)
+        {
+            if (nodes[i].up && nodes[i].release != 0 && nodes[i].release <= now)
+                node_lease(i);
+        }
+        if (now % 1000 == 0)
+        {
+            for (i = 0; i < n_nodes; i++)
+            {
+                if (nodes[i].up)
+                    mesh_route_tick(&nodes[i].m, now);
+            }
+        }
+    }
+}
+
+// The node whose AP has the network, following routes down from node at
+static int route_down(int at, uint32_t net)
+{
+    int hops, i, next;
+
+    for (hops = 0; hops < SIM_NODES; hops++)
+    {
+        if (net_of(&nodes[at]) == net)
+            return at;
+        for (i = 0, next = -1; i < nodes[at].n_routes && next < 0; i++)
+        {
+            if (nodes[at].routes[i].net == net && nodes[at].routes[i].len == 24)
+            {
+                int c;
+
+                for (c = 0; c < n_nodes; c++)
+                {
+                    if (nodes[c].up && nodes[c].parent == at && nodes[c].sta_ip == nodes[at].routes[i].gw)
+                        next = c;
+                }
+            }
+        }
+        if (next < 0)
+            return -1;
+        at = next;
+    }
+    return -1;
+}
+
+// The answer to a packet from the network of every node reaches it
+static int check_return(void)
+{
+    int i, at, lost = 0;
+
+    for (i = 0; i < n_nodes; i++)
+    {
+        if (!nodes[i].up)
+            continue;
+        // Up while the node does not NAT
+        for (at = i; !nodes[at].nat && nodes[at].parent >= 0; at = nodes[at].parent)
+            ;
+        if (route_down(at, net_of(&nodes[i])) != i)
+            lost++;
+    }
+    return lost;
+}
+
+// Networks that are routed to the root must be unique
+static int check_unique(void)
+{
+    int i, j, dups = 0;
+
+    for (i = 0; i < n_nodes; i++)
+    {
+        for (j = i + 1; j < n_nodes; j++)
+        {
+            if (nodes[i].up && nodes[j].up && net_of(&nodes[i]) == net_of(&nodes[j]))
+                dups++;
+        }
+    }
+    return dups;
+}
+
+static int count_routed(void)
+{
+    int i, routed = 0;
+
+    for (i = 0; i < n_nodes; i++)
+        routed += nodes[i].up && nodes[i].m.routed;
+    return routed;
+}
+
+static void counters(uint32_t *conflicts, uint32_t *renumbered, uint32_t *foreign)
+{
+    int i;
+
+    *conflicts = *renumbered = *foreign = 0;
+    for (i = 0; i < n_nodes; i++)
+    {
+        *conflicts += nodes[i].m.conflicts;
+        *renumbered += nodes[i].m.renumbered;
+        *foreign += nodes[i].m.foreign;
+    }
+}
+
+static void reset(void)
+{
+    memset(nodes, 0, sizeof(nodes));
+    n_nodes = n_msgs = n_rogues = 0;
+    now = 0;
+    dropped = 0;
+}
+
+// Up to MESH_ROUTE_LEARNED networks below the root, all are routed
+static void test_small(uint32_t seed, bool clash)
+{
+    uint32_t conflicts, renumbered, foreign;
+    int i, parent;
+
+    reset();
+    node_join(-1, -1, &seed);
+    for (i = 1; i <= MESH_ROUTE_LEARNED; i++)
+    {
+        do
+            parent = test_rand(&seed) % n_nodes;
+        while (nodes[parent].level >= SIM_LEVELS);
+        // Every third node starts on the network of an earlier one
+        node_join(parent, clash && i % 3 == 0 ? (int)(test_rand(&seed) % n_nodes) : -1, &seed);
+        run(now + (test_rand(&seed) % 4) * 1000);
+    }
+    run(now + 300000);
+
+    counters(&conflicts, &renumbered, &foreign);
+    printf("mesh_route: %2d nodes%s: %u conflicts, %u renumbered, %2d routed, %u dropped\n",
+           n_nodes, clash ? ", clashing" : "", conflicts, renumbered, count_routed(), dropped);
+    CHECK(check_unique() == 0);
+    CHECK(check_return() == 0);
+    // All but the root, it has no mesh uplink
+    CHECK(count_routed() == n_nodes - 1);
+    CHECK(nodes[0].nat);
+    if (clash)
+        CHECK(renumbered > 0);
+}
+
+// Cousins clash at the root, the conflict goes down to the later one;
+// siblings clash at their parent. Only the later ones move, the child
+// of a moved node keeps its network.
+static void test_clash(void)
+{
+    uint32_t seed = 55;
+    int i;
+
+    reset();
+    node_join(-1, -1, &seed);                   // 0
+    node_join(0, -1, &seed);                    // 1
+    node_join(0, -1, &seed);                    // 2
+    node_join(1, -1, &seed);                    // 3
+    run(now + 60000);
+    node_join(2, 3, &seed);                     // 4, cousin of 3
+    node_join(4, -1, &seed);                    // 5
+    run(now + 60000);
+    node_join(1, 3, &seed);                     // 6, sibling of 3
+    run(now + 300000);
+
+    printf("mesh_route: clash: %u conflicts at the root, %u at node 1, %u dropped\n",
+           nodes[0].m.conflicts, nodes[1].m.conflicts, dropped);
+    CHECK(nodes[0].m.conflicts > 0);
+    CHECK(nodes[1].m.conflicts > 0);
+    for (i = 0; i < n_nodes; i++)
+        CHECK(nodes[i].m.renumbered == (i == 4 || i == 6));
+    CHECK(check_unique() == 0);
+    CHECK(check_return() == 0);
+    CHECK(count_routed() == n_nodes - 1);
+}
+
+// More networks than a node learns: some stay NATed, none is lost
+static void test_large(uint32_t seed)
+{
+    uint32_t conflicts, renumbered, foreign;
+    int i, parent, leaf;
+
+    reset();
+    node_join(-1, -1, &seed);
+    for (i = 1; i < SIM_NODES; i++)
+    {
+        do
+            parent = test_rand(&seed) % n_nodes;
+        while (nodes[parent].level >= SIM_LEVELS);
+        node_join(parent, -1, &seed);
+        run(now + (test_rand(&seed) % 4) * 1000);
+    }
+    run(now + 300000);
+    counters(&conflicts, &renumbered, &foreign);
+    printf("mesh_route: %2d nodes: %u conflicts, %u renumbered, %2d routed, %u dropped\n",
+           n_nodes, conflicts, renumbered, count_routed(), dropped);
+    CHECK(check_return() == 0);
+
+    // A leaf goes away, its routes time out
+    for (leaf = n_nodes - 1; leaf > 0; leaf--)
+    {
+        for (i = 0; i < n_nodes && nodes[i].parent != leaf; i++)
+            ;
+        if (i == n_nodes)
+            break;
+    }
+    nodes[leaf].up = false;
+    run(now + (MESH_ROUTE_HOLD + 2 * MESH_ROUTE_INTERVAL / 1000) * 1000);
+    for (i = 0; i < n_nodes; i++)
+    {
+        if (nodes[i].up)
+            CHECK(route_down(i, net_of(&nodes[leaf])) != leaf || i == leaf);
+    }
+    CHECK(check_return() == 0);
+}
+
+// Adverts of stations that are no mesh nodes install nothing
+static void test_rogues(void)
+{
+    uint32_t seed = 77, conflicts, renumbered, foreign;
+    uint8_t msg[MESH_ROUTE_MAX_LEN];
+    uint32_t net = htonl(MESH_ROUTE_NET | (200 << 8));
+    int i, routes = 0;
+
+    reset();
+    node_join(-1, -1, &seed);
+    node_join(0, -1, &seed);
+    node_join(1, -1, &seed);
+    run(now + 60000);
+
+    // A station with a lease and an unknown BSSID, one with the BSSID of
+    // a mesh AP on the wrong level and one with a static address
+    rogues[0].node = 0;
+    rogues[0].ip = lease(0);
+    rogues[0].leased = true;
+    memset(rogues[0].bssid, 0x24, 6);
+    rogues[1] = rogues[0];
+    rogues[1].ip = lease(0);
+    memcpy(rogues[1].bssid, nodes[2].bssid, 6);
+    rogues[2] = rogues[0];
+    rogues[2].ip = lease(0) ^ htonl(0x40);
+    rogues[2].leased = false;
+    memcpy(rogues[2].bssid, nodes[1].bssid, 6);
+    n_rogues = 3;
+
+    for (i = 0; i < n_rogues; i++)
+    {
+        msg[0] = 'M';
+        msg[1] = 'R';
+        msg[2] = MESH_ROUTE_VERSION;
+        msg[3] = MESH_ROUTE_ADVERT;
+        msg[4] = 0;
+        msg[5] = 1;
+        msg[6] = 1;
+        msg[7] = MESH_ROUTE_HOLD;
+        memcpy(msg + MESH_ROUTE_HDR_LEN, rogues[i].bssid, 6);
+        memcpy(msg + MESH_ROUTE_HDR_LEN + 6, &net, 4);
+        msg[MESH_ROUTE_HDR_LEN + 10] = 24;
+        msg[MESH_ROUTE_HDR_LEN + 11] = 0;
+        mesh_route_input(&nodes[0].m, rogues[i].ip, msg, MESH_ROUTE_HDR_LEN + 6 + MESH_ROUTE_ENTRY_LEN, now);
+    }
+    for (i = 0; i < nodes[0].n_routes; i++)
+        routes += nodes[0].routes[i].net == net;
+
+    counters(&conflicts, &renumbered, &foreign);
+    CHECK(foreign == 3);
+    CHECK(routes == 0);
+    CHECK(nodes[1].m.routed && nodes[2].m.routed);
+    CHECK(check_return() == 0);
+}
+
+int main(void)
+{
+    uint32_t seed;
+
+    for (seed = 1; seed <= 3; seed++)
+        test_small(seed, false);
+    for (seed = 4; seed <= 6; seed++)
+        test_small(seed, true);
+    test_clash();
+    test_large(7);
+    test_rogues();
+    return test_result("test_mesh_route");
+}
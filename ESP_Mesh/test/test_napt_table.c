@@ -0,0 +1,235 @@
+#include <string.h>
+#include <unistd.h>
+
+#include "c_types.h"
+#include "lwip/ip.h"
+#include "napt_table.h"
+#include "test.h"
+
+//
+// napt_table: random inserts, lookups, refreshes, closes, removals and
+// expiry against a plain list of the same flows. The list keeps the
+// order in which each flow last joined its timeout class, so it tells
+// which flow expiry and eviction must take. The flows are drawn from a
+// small space so they collide in the index, and the table sizes are
+// small so probe runs wrap around its end.
+//
+
+#define OPS             400000
+#define MODEL_FLOWS     64
+
+typedef struct {
+        uint8_t proto;
+        uint32_t src, dst;
+        uint16_t sport, dport;
+        uint8_t queue;
+        uint32_t last;
+        uint32_t stamp;         // when it joined its class, the oldest is the tail
+} model_t;
+
+static const uint32_t timeouts[NAPT_QUEUES] = {2000, 200, 1000, 500};
+
+static model_t model[MODEL_FLOWS];
+static int model_n;
+static uint32_t stamp;
+
+static void flow_random(model_t *m, uint32_t *seed)
+{
+    static const uint8_t protos[] = {IP_PROTO_TCP, IP_PROTO_UDP, IP_PROTO_ICMP};
+    uint32_t r = test_rand(seed);
+
+    memset(m, 0, sizeof(model_t));
+    m->proto = protos[r % 3];
+    m->src = htonl(0x0a180200 | ((r >> 2) & 3));
+    m->dst = htonl(0x08080800 | ((r >> 4) & 3));
+    m->sport = htons(1024 + ((r >> 6) & 7));
+    m->dport = htons(((r >> 9) & 1) ? 53 : 443);
+    m->queue = m->proto == IP_PROTO_TCP ? NAPT_Q_TCP : (m->proto == IP_PROTO_UDP ? NAPT_Q_UDP : NAPT_Q_OTHER);
+}
+
+static model_t *model_find(const model_t *k)
+{
+    int i;
+
+    for (i = 0; i < model_n; i++)
+    {
+        if (model[i].proto == k->proto && model[i].src == k->src && model[i].dst == k->dst &&
+            model[i].sport == k->sport && model[i].dport == k->dport)
+            return &model[i];
+    }
+    return NULL;
+}
+
+// The tail of a class list
+static model_t *model_tail(uint8_t queue)
+{
+    model_t *tail = NULL;
+    int i;
+
+    for (i = 0; i < model_n; i++)
+    {
+        if (model[i].queue == queue && (tail == NULL || model[i].stamp < tail->stamp))
+            tail = &model[i];
+    }
+    return tail;
+}
+
+// Closing TCP flows first, then the own class, then the oldest tail
+static model_t *model_victim(uint8_t queue)
+{
+    model_t *victim, *m;
+    uint8_t q;
+
+    if ((victim = model_tail(NAPT_Q_TCP_FIN)) != NULL || (victim = model_tail(queue)) != NULL)
+        return victim;
+    for (q = 0; q < NAPT_QUEUES; q++)
+    {
+        m = model_tail(q);
+        if (m != NULL && (victim == NULL || (int32_t)(m->last - victim->last) < 0))
+            victim = m;
+    }
+    return victim;
+}
+
+static void model_remove(model_t *m)
+{
+    *m = model[--model_n];
+}
+
+static bool flow_is(const napt_flow_t *f, const model_t *m)
+{
+    return f->proto == m->proto && f->src == m->src && f->dst == m->dst &&
+           f->sport == m->sport && f->dport == m->dport;
+}
+
+static napt_flow_t *lookup(napt_table_t *t, const model_t *k)
+{
+    return napt_table_lookup(t, k->proto, k->src, k->sport, k->dst, k->dport);
+}
+
+static void run(uint16_t max_flows, uint32_t seed)
+{
+    napt_table_t t;
+    napt_flow_t *f;
+    model_t k, *m;
+    uint32_t now = 0, errors = 0, evicted = 0, expired = 0;
+    uint16_t max, n;
+    int i, op;
+    uint8_t q;
+
+    CHECK(napt_table_init(&t, max_flows));
+    for (q = 0; q < NAPT_QUEUES; q++)
+        napt_table_set_timeout(&t, q, timeouts[q]);
+    model_n = 0;
+
+    for (i = 0; i < OPS && errors == 0; i++)
+    {
+        op = test_rand(&seed) % 16;
+        flow_random(&k, &seed);
+        m = model_find(&k);
+        now += test_rand(&seed) % 50;
+
+        if (op < 6)
+        {
+            // A packet: refreshes the flow or adds it
+            if (m == NULL && model_n == max_flows)
+            {
+                model_remove(model_victim(k.queue));
+                evicted++;
+            }
+            if (m == NULL)
+            {
+                m = &model[model_n++];
+                *m = k;
+            }
+            m->last = now;
+            m->stamp = ++stamp;
+            f = napt_table_insert(&t, k.proto, k.src, k.sport, k.dst, k.dport, now);
+            if (f == NULL || !flow_is(f, &k) || f->last != now)
+                errors++;
+        }
+        else if (op < 10)
+        {
+            f = lookup(&t, &k);
+            if ((f != NULL) != (m != NULL) || (f != NULL && (!flow_is(f, &k) || f->queue != m->queue)))
+                errors++;
+        }
+        else if (op < 12)
+        {
+            if (m != NULL)
+            {
+                m->last = now;
+                m->stamp = ++stamp;
+                if ((f = lookup(&t, &k)) != NULL)
+                    napt_table_touch(&t, f, now);
+            }
+        }
+        else if (op < 13)
+        {
+            // FIN or RST
+            if (m != NULL && m->queue == NAPT_Q_TCP)
+            {
+                m->queue = NAPT_Q_TCP_FIN;
+                m->stamp = ++stamp;
+            }
+            if (m != NULL && (f = lookup(&t, &k)) != NULL)
+                napt_table_closing(&t, f);
+        }
+        else if (op < 14)
+        {
+            if ((f = lookup(&t, &k)) != NULL)
+                napt_table_remove(&t, f);
+            if (m != NULL)
+                model_remove(m);
+        }
+        else
+        {
+            // Each class from its tail, up to the first flow still in time
+            max = test_rand(&seed) % 8;
+            n = 0;
+            for (q = 0; q < NAPT_QUEUES; q++)
+            {
+                while (n < max && (m = model_tail(q)) != NULL && now - m->last > timeouts[q])
+                {
+                    model_remove(m);
+                    n++;
+                }
+            }
+            expired += n;
+            if (napt_table_expire(&t, now, max) != n)
+                errors++;
+        }
+
+        if (t.used != model_n || t.evicted != evicted || t.expired != expired)
+            errors++;
+    }
+
+    // Every flow of the model is still found
+    for (i = 0; errors == 0 && i < model_n; i++)
+    {
+        f = lookup(&t, &model[i]);
+        if (f == NULL || !flow_is(f, &model[i]) || f->last != model[i].last || f->queue != model[i].queue)
+            errors++;
+    }
+
+    printf("napt_table: %2u flows, %3u slots, %u evicted, %u expired, %u mismatches\n",
+           max_flows, t.index_mask + 1, evicted, expired, errors);
+    CHECK(errors == 0);
+    napt_table_free(&t);
+}
+
+int main(void)
+{
+    napt_table_t t;
+
+    // A broken index may never find an empty slot again
+    alarm(60);
+
+    CHECK(!napt_table_init(&t, 0));
+    CHECK(!napt_table_init(&t, NAPT_NIL / 2));
+
+    run(3, 11);
+    run(16, 12);
+    run(MODEL_FLOWS, 13);
+    return test_result("test_napt_table");
+}
@@ -0,0 +1,251 @@
+#include <string.h>
+
+#include "c_types.h"
+#include "lwip/def.h"
+#include "user_config.h"
+#include "route_trie.h"
+#include "test.h"
+
+//
+// route_trie: random adds, removals, flushes and lookups of static and
+// dynamic routes, checked against a linear longest prefix match over a
+// plain list of the same routes. The prefixes are drawn from a few
+// nested ranges so they overlap a lot, as mesh and static routes do.
+//
+
+#define OPS             200000
+#define MODEL_ROUTES    (ROUTE_TRIE_NODES / 2)  // a route needs up to two nodes
+
+typedef struct {
+        uint32_t key;           // host byte order
+        uint8_t len;
+        uint8_t flags;
+        uint32_t gw;
+} model_t;
+
+static model_t model[MODEL_ROUTES];
+static int model_n;
+
+static uint32_t mask_of(uint8_t len)
+{
+    return len == 0 ? 0 : 0xffffffff << (32 - len);
+}
+
+static model_t *model_find(uint32_t key, uint8_t len)
+{
+    int i;
+
+    for (i = 0; i < model_n; i++)
+    {
+        if (model[i].key == key && model[i].len == len)
+            return &model[i];
+    }
+    return NULL;
+}
+
+static void model_remove(model_t *m)
+{
+    *m = model[--model_n];
+}
+
+static int model_count(uint8_t flags)
+{
+    int i, n = 0;
+
+    for (i = 0; i < model_n; i++)
+        n += (model[i].flags & flags) != 0;
+    return n;
+}
+
+// The old linear scan, keeping the longest match
+static model_t *model_lookup(uint32_t addr)
+{
+    model_t *best = NULL;
+    int i;
+
+    for (i = 0; i < model_n; i++)
+    {
+        if (((addr ^ model[i].key) & mask_of(model[i].len)) == 0 && (best == NULL || model[i].len > best->len))
+            best = &model[i];
+    }
+    return best;
+}
+
+static uint32_t random_addr(uint32_t *seed)
+{
+    static const uint32_t base[] = {0x0a180000, 0x0a180100, 0x0a000000, 0xc0a80000, 0x00000000};
+    uint32_t r = test_rand(seed);
+
+    // Mostly within the mesh range, sometimes anywhere
+    return base[r % 5] | (test_rand(seed) & (r % 5 == 4 ? 0xffffffff : 0x0001ffff));
+}
+
+static uint8_t random_len(uint32_t *seed)
+{
+    static const uint8_t len[] = {0, 8, 16, 23, 24, 24, 25, 28, 32};
+
+    return len[test_rand(seed) % sizeof(len)];
+}
+
+static ip_addr_t ip(uint32_t host)
+{
+    ip_addr_t a;
+
+    a.addr = htonl(host);
+    return a;
+}
+
+// route_walk() must list every route once, in address order
+static uint32_t walk_prev_key;
+static uint8_t walk_prev_len;
+static int walk_count, walk_order_errors;
+
+static void walk_check(void *arg, struct route_entry *rt, uint8_t flags)
+{
+    uint32_t key = ntohl(rt->ip.addr);
+    uint8_t len = __builtin_popcount(rt->mask.addr);
+    model_t *m = model_find(key, len);
+
+    if (m == NULL || m->flags != flags || m->gw != rt->gw.addr)
+        walk_order_errors++;
+    if (walk_count > 0 && (key < walk_prev_key || (key == walk_prev_key && len <= walk_prev_len)))
+        walk_order_errors++;
+    walk_prev_key = key;
+    walk_prev_len = len;
+    walk_count++;
+}
+
+int main(void)
+{
+    uint32_t seed = 15;
+    uint32_t key, addr, gw;
+    uint32_t lookups = 0, lookup_errors = 0, op_errors = 0, walk_errors = 0;
+    struct route_entry *rt;
+    model_t *m;
+    uint8_t len, op;
+    bool ok;
+    int i;
+
+    route_trie_reload();
+
+    for (i = 0; i < OPS; i++)
+    {
+        key = random_addr(&seed);
+        len = random_len(&seed);
+        key &= mask_of(len);
+        gw = 0x0a180001 + test_rand(&seed) % 4;
+        m = model_find(key, len);
+        op = test_rand(&seed) % 16;
+
+        // Full: remove instead of adding
+        if (model_n == MODEL_ROUTES && op < 6 && m == NULL)
+            op = 6 + op % 2;
+
+        switch (op)
+        {
+        case 0: case 1: case 2: case 3: case 4:
+            ok = route_add_dynamic(ip(key), ip(mask_of(len)), ip(gw));
+            if (m != NULL && (m->flags & ROUTE_STATIC))
+            {
+                op_errors += ok;
+                break;
+            }
+            op_errors += !ok;
+            if (m == NULL)
+                m = &model[model_n++];
+            m->key = key;
+            m->len = len;
+            m->flags = ROUTE_DYNAMIC;
+            m->gw = htonl(gw);
+            break;
+
+        case 5:
+            ok = ip_add_route(ip(key), ip(mask_of(len)), ip(gw));
+            if ((m == NULL || !(m->flags & ROUTE_STATIC)) && model_count(ROUTE_STATIC) == MAX_ROUTES)
+            {
+                op_errors += ok;
+                break;
+            }
+            op_errors += !ok;
+            if (m == NULL)
+                m = &model[model_n++];
+            m->key = key;
+            m->len = len;
+            m->flags = ROUTE_STATIC;
+            m->gw = htonl(gw);
+            break;
+
+        case 6: case 7:
+            // An existing route, to hit more than the odd random one
+            if (model_n > 0)
+            {
+                m = &model[test_rand(&seed) % model_n];
+                key = m->key;
+                len = m->len;
+            }
+            if (m != NULL && (m->flags & ROUTE_STATIC))
+            {
+                op_errors += !ip_rm_route(ip(key), ip(mask_of(len)));
+                model_remove(m);
+            }
+            else
+            {
+                ok = route_rm_dynamic(ip(key), ip(mask_of(len)));
+                op_errors += ok != (m != NULL);
+                if (m != NULL)
+                    model_remove(m);
+            }
+            break;
+
+        case 8:
+            if (test_rand(&seed) % 64 == 0)
+            {
+                route_flush_dynamic(ip(gw));
+                for (m = model; m < model + model_n;)
+                {
+                    if ((m->flags & ROUTE_DYNAMIC) && m->gw == htonl(gw))
+                        model_remove(m);
+                    else
+                        m++;
+                }
+            }
+            break;
+
+        default:
+            addr = test_rand(&seed) % 4 == 0 ? random_addr(&seed) : key | (test_rand(&seed) & ~mask_of(len));
+            rt = ip_find_route(ip(addr));
+            m = model_lookup(addr);
+            lookups++;
+            if (m == NULL ? rt != NULL :
+                rt == NULL || ntohl(rt->ip.addr) != m->key || rt->mask.addr != htonl(mask_of(m->len)) || rt->gw.addr != m->gw)
+                lookup_errors++;
+            break;
+        }
+
+        // Two nodes per route at most, no leaks
+        if (route_trie_used() > 2 * model_n)
+            op_errors++;
+
+        if (i % 1000 == 0)
+        {
+            walk_count = walk_order_errors = 0;
+            route_walk(walk_check, NULL);
+            if (walk_count != model_n || walk_order_errors != 0)
+                walk_errors++;
+        }
+    }
+
+    // Everything gone, every node back in the pool
+    ip_delete_routes();
+    for (i = 0; i < 4; i++)
+        route_flush_dynamic(ip(0x0a180001 + i));
+    CHECK(route_trie_used() == 0);
+    CHECK(ip_find_route(ip(0x0a180101)) == NULL);
+
+    printf("route_trie: %u ops, %u lookups, %u op, %u lookup and %u walk mismatches\n",
+           OPS, lookups, op_errors, lookup_errors, walk_errors);
+    CHECK(op_errors == 0);
+    CHECK(lookup_errors == 0);
+    CHECK(walk_errors == 0);
+    return test_result("test_route_trie");
+}
@@ -0,0 +1,141 @@
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+
+#include "spscbuf.h"
+#include "test.h"
+
+//
+// spscbuf: the single threaded edge cases, then a producer and a consumer
+// thread moving a counting byte sequence through a small FIFO in random
+// chunk sizes. The consumer checks every byte, so a lost, duplicated or
+// reordered byte, or one read before it was written, fails the test.
+//
+
+#define STRESS_BYTES    (256u * 1024 * 1024)
+#define STRESS_SIZE     256
+#define STRESS_BYTE(i)  ((i) % 251)     // does not repeat with the FIFO size
+
+static void test_basic(void)
+{
+    spscbuf_t rb;
+    uint8_t in[600], out[600];
+    size_t i, n;
+
+    rb = spscbuf_new(100);
+    CHECK(rb != 0);
+    CHECK(spscbuf_capacity(rb) == 128);
+    CHECK(spscbuf_bytes_used(rb) == 0);
+    CHECK(spscbuf_bytes_free(rb) == 128);
+    CHECK(spscbuf_pop_n(out, rb, 10) == 0);
+
+    for (i = 0; i < sizeof(in); i++)
+        in[i] = i * 7;
+
+    // A full FIFO refuses data instead of overwriting it
+    CHECK(spscbuf_push_n(rb, in, 100) == 100);
+    CHECK(spscbuf_push_n(rb, in + 100, 100) == 28);
+    CHECK(spscbuf_push(rb, 0) == 0);
+    CHECK(spscbuf_bytes_free(rb) == 0);
+    CHECK(spscbuf_pop_n(out, rb, 200) == 128);
+    CHECK(memcmp(in, out, 128) == 0);
+
+    // Across the end of the buffer and across the 16 bit index wrap
+    for (i = 0; i < 70000; i += n)
+    {
+        n = 1 + i % 97;
+        CHECK(spscbuf_push_n(rb, in + i % 300, n) == n);
+        CHECK(spscbuf_bytes_used(rb) == n);
+        CHECK(spscbuf_pop_n(out, rb, sizeof(out)) == n);
+        CHECK(memcmp(in + i % 300, out, n) == 0);
+    }
+
+    CHECK(spscbuf_push(rb, 42) == 1);
+    spscbuf_reset(rb);
+    CHECK(spscbuf_bytes_used(rb) == 0);
+
+    spscbuf_free(&rb);
+    CHECK(rb == 0);
+    CHECK(spscbuf_new(0x8001) == 0);
+}
+
+static spscbuf_t stress_rb;
+
+static void *producer(void *arg)
+{
+    uint32_t seed = 1;
+    uint8_t chunk[STRESS_SIZE];
+    uint32_t sent = 0;
+    size_t n, i, done;
+
+    while (sent < STRESS_BYTES)
+    {
+        n = 1 + test_rand(&seed) % sizeof(chunk);
+        if (n > STRESS_BYTES - sent)
+            n = STRESS_BYTES - sent;
+        for (i = 0; i < n; i++)
+            chunk[i] = STRESS_BYTE(sent + i);
+
+        // Like the UART ISR: single bytes or a whole FIFO drain
+        if (n == 1)
+            done = spscbuf_push(stress_rb, chunk[0]);
+        else
+            done = spscbuf_push_n(stress_rb, chunk, n);
+        sent += done;
+        if (done == 0)
+            sched_yield();
+    }
+    return NULL;
+}
+
+static void *consumer(void *arg)
+{
+    uint32_t seed = 2;
+    uint8_t chunk[STRESS_SIZE];
+    uint32_t received = 0;
+    uint32_t *errors = arg;
+    size_t n, i;
+
+    while (received < STRESS_BYTES)
+    {
+        n = 1 + test_rand(&seed) % sizeof(chunk);
+        if (n > STRESS_BYTES - received)
+            n = STRESS_BYTES - received;
+        n = spscbuf_pop_n(chunk, stress_rb, n);
+        if (n == 0)
+            sched_yield();
+        for (i = 0; i < n; i++)
+        {
+            if (chunk[i] != STRESS_BYTE(received + i))
+                (*errors)++;
+        }
+        received += n;
+    }
+    return NULL;
+}
+
+static void test_stress(void)
+{
+    pthread_t p, c;
+    uint32_t errors = 0;
+
+    stress_rb = spscbuf_new(STRESS_SIZE);
+    CHECK(stress_rb != 0);
+
+    pthread_create(&c, NULL, consumer, &errors);
+    pthread_create(&p, NULL, producer, NULL);
+    pthread_join(p, NULL);
+    pthread_join(c, NULL);
+
+    printf("spscbuf: %u bytes through a %u byte FIFO, %u errors\n", STRESS_BYTES, STRESS_SIZE, errors);
+    CHECK(errors == 0);
+    CHECK(spscbuf_bytes_used(stress_rb) == 0);
+    spscbuf_free(&stress_rb);
+}
+
+int main(void)
+{
+    test_basic();
+    test_stress();
+    return test_result("test_spscbuf");
+}
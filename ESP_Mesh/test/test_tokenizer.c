@@ -0,0 +1,275 @@
+#include <string.h>
+
+#include "c_types.h"
+#include "tokenizer.h"
+#include "test.h"
+
+//
+// tokenizer: random command lines of blanks, quotes, escapes, %XX,
+// backspaces and NULs, split into two spans at every point the ring can
+// wrap, against a model that edits a list of tokens the way the command
+// line is typed. Tokens, count and error offset must match, the output
+// must stay inside buf, and the in-place parse_str_into_tokens() must
+// give the same as tokenizing into a separate buffer.
+//
+
+#define LINES           300000
+#define LINE_MAX        120
+#define BUF_MAX         (LINE_MAX + 8)
+#define MAX_TOKENS      9       // MAX_CMD_TOKENS
+#define GUARD           16
+
+typedef struct {
+        char tok[MAX_TOKENS][BUF_MAX];
+        int len[MAX_TOKENS];
+        int n;
+        bool open;              // the last token is still being typed
+        bool quoted;            // inside "" in the open token
+} model_t;
+
+// Bytes of buf the model's tokens take, the open one without its 0
+static size_t model_used(const model_t *m)
+{
+    size_t used = 0;
+    int i;
+
+    for (i = 0; i < m->n; i++)
+        used += m->len[i] + 1;
+    return used - (m->open ? 1 : 0);
+}
+
+static void model_drop(model_t *m)
+{
+    m->n--;
+    m->open = false;
+    m->quoted = false;
+}
+
+static int model_tokenize(model_t *m, const uint8_t *in, int len, size_t buf_len, int max_tokens, int *err)
+{
+    int i, escape = 0, hex = 0, hex_val = 0, quote_at = 0, d;
+    uint8_t c;
+
+    memset(m, 0, sizeof(*m));
+    for (i = 0; i < len && in[i] != 0; i++)
+    {
+        c = in[i];
+        if (model_used(m) + 1 >= buf_len)
+        {
+            *err = i;
+            return -1;
+        }
+        if (escape || hex)
+        {
+            d = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 :
+                c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+            if (hex && d < 0)
+            {
+                *err = i;
+                return -1;
+            }
+            if (hex == 1)
+            {
+                hex_val = d;
+                hex = 2;
+                continue;
+            }
+            m->tok[m->n - 1][m->len[m->n - 1]++] = escape ? c : hex_val << 4 | d;
+            escape = hex = 0;
+            continue;
+        }
+        if (c == 8)
+        {
+            // Deletes the last char, the blank after a token reopens it
+            if (m->open && m->len[m->n - 1] == 0)
+            {
+                model_drop(m);
+            }
+            else if (m->open)
+            {
+                if (--m->len[m->n - 1] == 0 && !m->quoted)
+                    model_drop(m);
+            }
+            else if (m->n > 0)
+            {
+                m->open = true;
+                m->quoted = false;
+                if (m->len[m->n - 1] == 0)
+                    model_drop(m);
+            }
+            continue;
+        }
+        if (!m->open && c > ' ')
+        {
+            if (m->n == max_tokens)
+                break;
+            m->len[m->n++] = 0;
+            m->open = true;
+            m->quoted = false;
+        }
+        if (c == '"')
+        {
+            m->quoted = !m->quoted;
+            quote_at = i;
+        }
+        else if (c == '\\')
+        {
+            escape = 1;
+        }
+        else if (c == '%')
+        {
+            hex = 1;
+        }
+        else if (c <= ' ' && !m->quoted)
+        {
+            m->open = false;
+        }
+        else
+        {
+            m->tok[m->n - 1][m->len[m->n - 1]++] = c;
+        }
+    }
+    // A sequence cut off at the end is reported before an open quote
+    if (escape || hex)
+    {
+        *err = i;
+        return -1;
+    }
+    if (m->open && m->quoted)
+    {
+        *err = quote_at;
+        return -1;
+    }
+    return m->n;
+}
+
+// Mostly words and blanks, valid %XX and "" pairs, now and then a stray
+// quote, escape or %, a backspace or a NUL
+static void random_line(uint8_t *line, int len, uint32_t *seed)
+{
+    static const char *units[] = {
+        " ", " ", "  ", "\t", "\r", "\b", "\b\b", "%4f", "%22", "%20", "\\\\", "\\ ", "\\\"", "\"a b\"", "\"\""};
+    static const char *strays[] = {"\"", "\\", "%", "%2", "%Zz"};
+    const char *u;
+    int i = 0, n;
+
+    while (i < len)
+    {
+        if (test_rand(seed) % 3 != 0)
+            line[i++] = 'a' + test_rand(seed) % 26;
+        else if (test_rand(seed) % 100 == 0)
+            line[i++] = 0;
+        else
+        {
+            if (test_rand(seed) % 16 == 0)
+                u = strays[test_rand(seed) % (sizeof(strays) / sizeof(strays[0]))];
+            else
+                u = units[test_rand(seed) % (sizeof(units) / sizeof(units[0]))];
+            for (n = 0; u[n] != 0 && i < len; n++)
+                line[i++] = u[n];
+        }
+    }
+}
+
+static void compare(const model_t *m, int want, int want_err, int got, int got_err, char **tokens,
+                    const uint8_t *line, int len)
+{
+    int i;
+    bool ok = got == want && (want >= 0 || got_err == want_err);
+
+    for (i = 0; ok && i < want; i++)
+        ok = strncmp(tokens[i], m->tok[i], m->len[i]) == 0 && strlen(tokens[i]) == strnlen(m->tok[i], m->len[i]);
+    if (!ok)
+    {
+        fprintf(stderr, "tokenizer: %d byte line \"%.*s\": %d tokens (error at %d), expected %d (error at %d)\n",
+                len, len, line, got, got_err, want, want_err);
+        CHECK(false);
+    }
+}
+
+static void test_random(uint32_t seed)
+{
+    uint8_t line[LINE_MAX], in_place[LINE_MAX + 1];
+    char buf[BUF_MAX + GUARD], *tokens[MAX_TOKENS];
+    struct ringbuf_span spans[2];
+    model_t m;
+    uint32_t l, split, errors = 0, tokens_total = 0, full = 0;
+    size_t buf_len;
+    int len, max_tokens, want, want_err = 0, got, got_err, i;
+
+    for (l = 0; l < LINES; l++)
+    {
+        len = test_rand(&seed) % LINE_MAX;
+        random_line(line, len, &seed);
+        max_tokens = 1 + test_rand(&seed) % MAX_TOKENS;
+        buf_len = test_rand(&seed) % 4 == 0 ? 1 + test_rand(&seed) % 40 : BUF_MAX;
+        want = model_tokenize(&m, line, len, buf_len, max_tokens, &want_err);
+        if (want < 0)
+            errors++;
+        else
+            tokens_total += want;
+        full += want < 0 && model_used(&m) + 1 >= buf_len;
+
+        // Wrapped anywhere in the ring, an empty span at either end included
+        split = test_rand(&seed) % (len + 1);
+        spans[0].data = line;
+        spans[0].len = split;
+        spans[1].data = line + split;
+        spans[1].len = len - split;
+        memset(buf, 0x55, sizeof(buf));
+        got_err = -2;
+        got = tokenize_spans(spans, 2, buf, buf_len, tokens, max_tokens, &got_err);
+        compare(&m, want, want_err, got, got_err, tokens, line, len);
+        for (i = 0; i < got; i++)
+            CHECK(tokens[i] >= buf && tokens[i] + strlen(tokens[i]) < buf + buf_len);
+        for (i = buf_len; i < sizeof(buf); i++)
+            CHECK(buf[i] == 0x55);
+
+        // In place, up to the first NUL, into a buffer of the line
+        want = model_tokenize(&m, line, len, strnlen((char *)line, len) + 1, max_tokens, &want_err);
+        memcpy(in_place, line, len);
+        in_place[len] = 0;
+        got = parse_str_into_tokens((char *)in_place, tokens, max_tokens);
+        compare(&m, want, want_err, got, want_err, tokens, line, len);
+    }
+    printf("tokenizer: %u lines, %u tokens, %u syntax errors (%u buffer full)\n", LINES, tokens_total, errors, full);
+}
+
+// The examples of the console
+static void test_lines(void)
+{
+    static const struct {
+            const char *line;
+            int n;
+            const char *tokens[3];
+    } lines[] = {
+        {"set ssid \"My AP\"\r", 3, {"set", "ssid", "My AP"}},
+        {"set password a\\ b%22c\r", 3, {"set", "password", "a b\"c"}},
+        {"set ssid \"\"\r", 3, {"set", "ssid", ""}},
+        {"show stats\b\b\b\b\bconfig\r", 2, {"show", "config"}},
+        {"show x\b\bstats", 1, {"showstats"}},
+        {"set ssid My\"AP\r", -1},
+        {"set password %2\r", -1},
+        {"set password abc\\", -1},
+    };
+    char buf[BUF_MAX], *tokens[MAX_TOKENS];
+    struct ringbuf_span span;
+    int i, j, n, err;
+
+    for (i = 0; i < sizeof(lines) / sizeof(lines[0]); i++)
+    {
+        span.data = (void *)lines[i].line;
+        span.len = strlen(lines[i].line);
+        n = tokenize_spans(&span, 1, buf, sizeof(buf), tokens, MAX_TOKENS, &err);
+        CHECK(n == lines[i].n);
+        for (j = 0; j < n && j < 3; j++)
+            CHECK(strcmp(tokens[j], lines[i].tokens[j]) == 0);
+    }
+}
+
+int main(void)
+{
+    test_lines();
+    test_random(6);
+    return test_result("test_tokenizer");
+}
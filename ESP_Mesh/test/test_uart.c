@@ -0,0 +1,221 @@
+#include <string.h>
+
+#include "uart_sim.h"
+
+//
+// new_uart: UART_Send() and the TXFIFO_EMPTY interrupt on a simulated
+// UART0, with the ISR landing anywhere in task level code. Output in
+// random chunks, sent on after a short send only once the tx ready
+// callback came, must appear on the line exactly, with the line never
+// idle while some of it is still queued and without an interrupt storm.
+// With the echo on, received chars take the line as well: the echo must
+// never overtake output queued before the char came in, and the output
+// must stay intact when the echo competes with a sender that keeps the
+// tx buffer full.
+//
+
+#define BULK            300000
+#define ECHOED          60000
+
+static ringbuf_t console_rx, console_tx;
+static uint8_t out[BULK];
+static volatile bool tx_ready;
+static uint32_t tx_ready_calls;
+
+static void tx_ready_cb(void)
+{
+    tx_ready = true;
+    tx_ready_calls++;
+}
+
+static void setup(bool echo)
+{
+    sim_reset();
+    if (console_rx == NULL)
+    {
+        console_rx = ringbuf_new(MAX_CON_CMD_SIZE);
+        console_tx = ringbuf_new(MAX_CON_SEND_SIZE);
+    }
+    UART_init_console(BIT_RATE_115200, 0, console_rx, console_tx);
+    UART_SetTxReadyCb(tx_ready_cb);
+    UART_SetEcho(echo);
+    tx_ready = false;
+    tx_ready_calls = 0;
+}
+
+// Lowercase and '\r' come in, so the echo tells from the uppercase output
+static void line_burst(uint32_t n)
+{
+    static uint32_t next;
+    uint8_t c;
+
+    while (n-- > 0)
+    {
+        c = ++next % 32 == 0 ? '\r' : 'a' + next % 26;
+        sim_line_add(&c, 1);
+    }
+}
+
+// The task: takes the complete lines off the console
+static void task(void)
+{
+    while (UART_RecvConsoleLine())
+        ringbuf_reset(console_rx);
+}
+
+// Sends out[] in chunks of up to max_chunk with pauses of up to max_pause
+// char times, rx bursts of up to max_burst now and then, returns how often
+// the sender was blocked
+static uint32_t send(uint32_t len, uint32_t max_chunk, uint32_t max_pause, uint32_t max_burst, uint32_t *seed)
+{
+    uint32_t sent = 0, blocks = 0, waited = 0, n;
+    int q;
+    bool blocked = false;
+
+    while (sent < len)
+    {
+        if (!blocked)
+        {
+            n = 1 + test_rand(seed) % max_chunk;
+            if (n > len - sent)
+                n = len - sent;
+            q = UART_Send(UART0, (char *)out + sent, n);
+            CHECK(q >= 0 && q <= n);
+            sent += q;
+            sim_queued += q;
+            if (q < n)
+            {
+                blocked = true;
+                blocks++;
+                waited = 0;
+            }
+        }
+        else if (tx_ready)
+        {
+            tx_ready = false;
+            blocked = false;
+        }
+        else if (++waited > 100 * UART_TX_BUFFER_SIZE)
+        {
+            // The callback got lost
+            CHECK(false);
+            return blocks;
+        }
+        if (max_burst > 0 && test_rand(seed) % 8 == 0 && sim_line_len + max_burst <= SIM_LINE_MAX)
+            line_burst(1 + test_rand(seed) % max_burst);
+        sim_ticks(test_rand(seed) % (max_pause + 1));
+        task();
+    }
+    return blocks;
+}
+
+static void random_out(uint32_t len, uint32_t *seed)
+{
+    uint32_t i;
+
+    for (i = 0; i < len; i++)
+        out[i] = 'A' + test_rand(seed) % 26;
+}
+
+// Splits the line into output and echo, true if the output is out[0..len)
+static bool split_wire(uint32_t len, uint8_t *echo, uint32_t *echo_len)
+{
+    uint32_t i, n = 0;
+    bool ok = true;
+
+    *echo_len = 0;
+    for (i = 0; i < sim_wire_len; i++)
+    {
+        if (sim_wire[i] >= 'A' && sim_wire[i] <= 'Z')
+            ok = ok && n < len && out[n++] == sim_wire[i];
+        else
+            echo[(*echo_len)++] = sim_wire[i];
+    }
+    return ok && n == len;
+}
+
+static void test_bulk(uint32_t seed)
+{
+    uint32_t blocks;
+
+    setup(false);
+    random_out(BULK, &seed);
+    blocks = send(BULK, 700, 40, 0, &seed);
+    sim_drain();
+
+    CHECK(sim_wire_len == BULK && memcmp(sim_wire, out, BULK) == 0);
+    CHECK(sim_idle_busy == 0);
+    CHECK(blocks > 0 && tx_ready_calls == blocks);
+    CHECK(sim_storms == 0 && sim_tx_overflows == 0);
+    // Nothing left to send, so the interrupt is off again
+    CHECK((sim_int_ena & UART_TXFIFO_EMPTY_INT_ENA) == 0);
+    printf("new_uart: %u bytes in %u char times, %u idle while busy, %u ISR calls, sender blocked %u times\n",
+           sim_wire_len, (unsigned)sim_now, sim_idle_busy, sim_isr_calls, blocks);
+    sim_now = 0;
+}
+
+// A sender with bursts beyond the HW FIFO but below the line rate: every
+// echo goes after the output that was queued when its char came in
+static void test_echo_order(uint32_t seed)
+{
+    static uint8_t echo[SIM_WIRE_MAX];
+    uint32_t echo_len, i, k, upper;
+
+    setup(true);
+    random_out(ECHOED, &seed);
+    // Never blocked, so no echo is left out
+    CHECK(send(ECHOED, 200, 800, 40, &seed) == 0);
+    sim_drain();
+    task();
+
+    CHECK(split_wire(ECHOED, echo, &echo_len));
+    CHECK(echo_len == sim_line_len && memcmp(echo, sim_line, echo_len) == 0);
+    CHECK(sim_storms == 0 && sim_tx_overflows == 0 && sim_rx_overflows == 0 && sim_rx_underflows == 0);
+
+    for (i = k = upper = 0; i < sim_wire_len; i++)
+    {
+        if (sim_wire[i] >= 'A' && sim_wire[i] <= 'Z')
+        {
+            upper++;
+        }
+        else if (upper < sim_line_at[k++])
+        {
+            fprintf(stderr, "new_uart: echo %u ahead of %u bytes of output\n", k - 1, sim_line_at[k - 1] - upper);
+            CHECK(false);
+            break;
+        }
+    }
+    CHECK(sim_posts[SIG_CONSOLE_RX] > 0);
+}
+
+// A sender that keeps the tx buffer full: the output stays intact, what
+// is echoed is the input with chars left out, none in the wrong place
+static void test_echo_busy(uint32_t seed)
+{
+    static uint8_t echo[SIM_WIRE_MAX];
+    uint32_t echo_len, i, j;
+
+    setup(true);
+    random_out(BULK, &seed);
+    send(BULK, 700, 40, 40, &seed);
+    sim_drain();
+    task();
+
+    CHECK(split_wire(BULK, echo, &echo_len));
+    for (i = j = 0; i < echo_len && j < sim_line_len; j++)
+    {
+        if (echo[i] == sim_line[j])
+            i++;
+    }
+    CHECK(i == echo_len);
+    CHECK(sim_storms == 0 && sim_tx_overflows == 0 && sim_rx_underflows == 0);
+    printf("new_uart: %u bytes of output with %u of %u input chars echoed\n", BULK, echo_len, sim_line_len);
+}
+
+int main(void)
+{
+    test_bulk(3);
+    test_echo_order(33);
+    test_echo_busy(333);
+    return test_result("test_uart");
+}
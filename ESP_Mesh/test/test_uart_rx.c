@@ -0,0 +1,272 @@
+#include <string.h>
+
+#include "uart_sim.h"
+
+//
+// new_uart: console line framing of uart_rx_drain_fifo() and
+// UART_RecvConsoleLine() on the simulated UART0. Only '\r' ends a line,
+// a '\n' stays in the line after it (the tokenizer takes it as a blank).
+// Random bursts of lines - short, exactly the console buffer, overlong,
+// with "\r", "\r\n" and "\n" - against a model that cuts the input at
+// every '\r' and drops lines longer than the buffer. The task runs some
+// time after a SIG_CONSOLE_RX only: never two may be waiting, no line
+// may be left behind without one, and a task slower than the burst must
+// see exactly one post per burst with a '\r' in it. A paste longer than
+// the rx FIFO without a '\r' loses chars, but must not take the console
+// with it.
+//
+
+#define BURSTS          20000
+#define LINE_MAX        (2 * MAX_CON_CMD_SIZE)
+#define LINES_MAX       64
+
+static ringbuf_t console_rx, console_tx;
+
+// What the task got
+static char got[LINES_MAX][MAX_CON_CMD_SIZE + 1];
+static uint32_t got_n, handled;
+
+static void setup(void)
+{
+    sim_reset();
+    if (console_rx == NULL)
+    {
+        console_rx = ringbuf_new(MAX_CON_CMD_SIZE);
+        console_tx = ringbuf_new(MAX_CON_SEND_SIZE);
+    }
+    ringbuf_reset(console_rx);
+    UART_init_console(BIT_RATE_115200, 0, console_rx, console_tx);
+    UART_SetEcho(false);
+    memset(&uart_rx_stats, 0, sizeof(uart_rx_stats));
+    got_n = handled = 0;
+}
+
+// The task on SIG_CONSOLE_RX, as in user_main.c
+static void task(void)
+{
+    size_t len;
+
+    handled++;
+    while (UART_RecvConsoleLine())
+    {
+        len = ringbuf_bytes_used(console_rx);
+        CHECK(len <= MAX_CON_CMD_SIZE);
+        if (got_n < LINES_MAX)
+        {
+            ringbuf_memcpy_from(got[got_n], console_rx, len);
+            got[got_n][len] = 0;
+        }
+        got_n++;
+        ringbuf_reset(console_rx);
+    }
+}
+
+static uint32_t pending(void)
+{
+    return sim_posts[SIG_CONSOLE_RX] - handled;
+}
+
+// Ticks until the line is quiet and the rx timeout has fired, the task
+// running after each post once delay ticks have passed
+static void receive(uint32_t delay)
+{
+    uint32_t quiet = 0, wait = 0;
+
+    while (quiet < 4 * SIM_FIFO || pending() > 0)
+    {
+        sim_tick();
+        CHECK(pending() <= 1);
+        quiet = sim_line_pos == sim_line_len ? quiet + 1 : 0;
+        if (pending() > 0 && ++wait > delay)
+        {
+            task();
+            wait = 0;
+        }
+    }
+}
+
+static void test_lines(void)
+{
+    static const struct {
+            const char *in;
+            uint32_t n;
+            const char *lines[2];
+    } cases[] = {
+        {"show stats\r", 1, {"show stats\r"}},
+        {"show config\r\n", 1, {"show config\r"}},
+        // The '\n' left over starts the next line
+        {"set a\r\nset b\r\n", 2, {"\nset a\r", "\nset b\r"}},
+        {"show\n", 0},
+        {"\r", 1, {"\nshow\n\r"}},
+        {"\r\r", 2, {"\r", "\r"}},
+    };
+    char line[MAX_CON_CMD_SIZE + 2];
+    int c, i;
+
+    setup();
+    for (c = 0; c < sizeof(cases) / sizeof(cases[0]); c++)
+    {
+        got_n = 0;
+        sim_posts[SIG_CONSOLE_RX] = handled = 0;
+        sim_line_add(cases[c].in, strlen(cases[c].in));
+        receive(0);
+        CHECK(got_n == cases[c].n);
+        CHECK(sim_posts[SIG_CONSOLE_RX] == (strchr(cases[c].in, '\r') != NULL));
+        for (i = 0; i < got_n && i < cases[c].n; i++)
+            CHECK(strcmp(got[i], cases[c].lines[i]) == 0);
+    }
+
+    // A line that fills the buffer exactly still comes through, one more char drops it
+    memset(line, 'x', sizeof(line));
+    line[MAX_CON_CMD_SIZE - 1] = '\r';
+    got_n = 0;
+    sim_line_add(line, MAX_CON_CMD_SIZE);
+    receive(0);
+    CHECK(got_n == 1 && strlen(got[0]) == MAX_CON_CMD_SIZE && uart_rx_stats.dropped_lines == 0);
+
+    line[MAX_CON_CMD_SIZE - 1] = 'x';
+    line[MAX_CON_CMD_SIZE] = '\r';
+    line[MAX_CON_CMD_SIZE + 1] = '\r';
+    got_n = 0;
+    sim_line_add(line, MAX_CON_CMD_SIZE + 2);
+    receive(0);
+    CHECK(got_n == 1 && strcmp(got[0], "\r") == 0 && uart_rx_stats.dropped_lines == 1);
+    CHECK(uart_rx_stats.overruns == 0 && uart_rx_stats.dropped == 0 && sim_rx_overflows == 0);
+}
+
+// A burst of lines, none or a part of one without its '\r' at the end,
+// into sim_line; returns the length
+static uint32_t random_burst(char *burst, uint32_t max, uint32_t *seed)
+{
+    static const char *ends[] = {"\r", "\r", "\r\n", "\n"};
+    uint32_t len = 0, n, i;
+    const char *e;
+
+    while (test_rand(seed) % 4 != 0)
+    {
+        n = test_rand(seed) % 8 == 0 ? test_rand(seed) % LINE_MAX : test_rand(seed) % 20;
+        e = ends[test_rand(seed) % 4];
+        if (len + n + strlen(e) > max)
+            break;
+        for (i = 0; i < n; i++)
+            burst[len++] = 'a' + test_rand(seed) % 26;
+        memcpy(burst + len, e, strlen(e));
+        len += strlen(e);
+    }
+    return len;
+}
+
+static void test_random(uint32_t seed)
+{
+    static char burst[RX_RING_BUFFER_SIZE], model[LINES_MAX][MAX_CON_CMD_SIZE + 1];
+    uint32_t b, i, len, n, model_len = 0, model_lines = 0, model_dropped = 0, posts, tail = 0, slow = 0;
+    bool has_cr, overlong = false;
+
+    setup();
+    for (b = 0; b < BURSTS; b++)
+    {
+        // What is left of the last line waits in the rx FIFO with the burst
+        len = random_burst(burst, sizeof(burst) - tail, &seed);
+        has_cr = memchr(burst, '\r', len) != NULL;
+
+        // The model: cut at '\r', drop what does not fit the console buffer
+        n = 0;
+        for (i = 0; i < len; i++)
+        {
+            if (model_len == MAX_CON_CMD_SIZE)
+                overlong = true;
+            if (!overlong)
+                model[n % LINES_MAX][model_len++] = burst[i];
+            tail++;
+            if (burst[i] != '\r')
+                continue;
+            if (overlong)
+            {
+                model_dropped++;
+            }
+            else
+            {
+                model[n % LINES_MAX][model_len] = 0;
+                n++;
+            }
+            model_len = tail = 0;
+            overlong = false;
+        }
+        model_lines += n;
+
+        posts = sim_posts[SIG_CONSOLE_RX];
+        got_n = 0;
+        sim_line_add(burst, len);
+        if (test_rand(&seed) % 2 == 0)
+        {
+            // The task only runs once the whole burst is in
+            receive(len + 4 * SIM_FIFO);
+            CHECK(sim_posts[SIG_CONSOLE_RX] - posts == has_cr);
+            slow++;
+        }
+        else
+        {
+            // Lines after the task ran are posted again
+            receive(test_rand(&seed) % (2 * SIM_FIFO));
+            CHECK(sim_posts[SIG_CONSOLE_RX] - posts >= has_cr);
+        }
+        CHECK(got_n == n);
+        for (i = 0; i < n && n < LINES_MAX; i++)
+        {
+            if (strcmp(got[i], model[i]) != 0)
+            {
+                fprintf(stderr, "new_uart: burst %u line %u: \"%s\", expected \"%s\"\n", b, i, got[i], model[i]);
+                CHECK(false);
+            }
+        }
+        // The start of the next line goes to the front
+        if (n > 0)
+            memmove(model[0], model[n % LINES_MAX], model_len);
+
+        // Reuses the line buffer
+        if (sim_line_len > SIM_LINE_MAX / 2)
+            sim_line_len = sim_line_pos = 0;
+    }
+
+    CHECK(uart_rx_stats.lines == model_lines);
+    CHECK(uart_rx_stats.dropped_lines == model_dropped);
+    CHECK(uart_rx_stats.overruns == 0 && sim_rx_overflows == 0);
+    // Nothing complete is left without a post
+    CHECK(!UART_RecvConsoleLine());
+    printf("new_uart: %u bursts (%u with a slow task), %u lines, %u overlong lines dropped, %u posts\n",
+           BURSTS, slow, model_lines, model_dropped, sim_posts[SIG_CONSOLE_RX]);
+}
+
+// A paste of more than the rx FIFO without a '\r': the excess is lost,
+// but the task is still woken to empty the FIFO, so the line after it
+// comes through
+static void test_paste(uint32_t seed)
+{
+    static char paste[4 * RX_RING_BUFFER_SIZE];
+    uint32_t i;
+
+    setup();
+    for (i = 0; i < sizeof(paste); i++)
+        paste[i] = 'a' + test_rand(&seed) % 26;
+    sim_line_add(paste, sizeof(paste));
+    // The task is slow, so the rx FIFO overruns
+    receive(sizeof(paste));
+    CHECK(uart_rx_stats.overruns > 0 && uart_rx_stats.dropped > 0);
+    CHECK(uart_rx_stats.bytes + uart_rx_stats.dropped == sizeof(paste));
+    CHECK(sim_rx_overflows == 0);
+
+    got_n = 0;
+    sim_line_add("\rshow stats\r", 12);
+    receive(0);
+    CHECK(got_n == 1 && strcmp(got[0], "show stats\r") == 0);
+    CHECK(uart_rx_stats.dropped_lines == 1);
+    printf("new_uart: %u byte paste, %u chars lost in the rx FIFO\n", (unsigned)sizeof(paste), uart_rx_stats.dropped);
+}
+
+int main(void)
+{
+    test_lines();
+    test_random(4);
+    test_paste(44);
+    return test_result("test_uart_rx");
+}
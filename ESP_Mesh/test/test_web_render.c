@@ -0,0 +1,263 @@
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "c_types.h"
+#include "web_render.h"
+#include "web.h"
+#include "test.h"
+
+//
+// web_render: the pages of web.h and random templates with placeholders,
+// "%%" and stray '%' at every chunk and window edge, args longer than a
+// window, and response headers of any length in the first window. The
+// windows put together must be what a plain expansion of the template
+// gives, and web_render_length() must be the sum of the windows. The
+// templates end right before an inaccessible page, rounded up to a word,
+// so a read past the last word of "flash" crashes the test.
+//
+
+#define TEMPLATES       20000
+#define TMPL_MAX        3000
+#define ARG_MAX         700
+#define OUT_MAX         (TMPL_MAX / 2 * ARG_MAX + TMPL_MAX + 512)
+
+typedef struct {
+        uint8_t *map;
+        size_t map_len;
+        uint8_t *tmpl;
+} guarded_t;
+
+static char out[OUT_MAX], expect[OUT_MAX];
+static char arg_buf[WEB_RENDER_MAX_ARGS][ARG_MAX + 1];
+
+// A copy of tmpl whose last word ends at an inaccessible page
+static void guarded_copy(guarded_t *g, const char *tmpl, uint32_t len)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    uint32_t words = (len + 3) & ~3;
+
+    g->map_len = (words + page - 1) / page * page + page;
+    g->map = mmap(NULL, g->map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    CHECK(g->map != MAP_FAILED);
+    mprotect(g->map + g->map_len - page, page, PROT_NONE);
+    g->tmpl = g->map + g->map_len - page - words;
+    memcpy(g->tmpl, tmpl, len);
+}
+
+static void guarded_free(guarded_t *g)
+{
+    munmap(g->map, g->map_len);
+}
+
+// What the page should be
+static uint32_t expand(const char *tmpl, uint32_t len, bool raw, const char **args, int nargs, char *dst)
+{
+    uint32_t n = 0, i;
+    int arg = 0;
+
+    for (i = 0; i < len; i++)
+    {
+        if (raw || tmpl[i] != '%')
+        {
+            dst[n++] = tmpl[i];
+        }
+        else if (i + 1 == len)
+        {
+            dst[n++] = '%';
+        }
+        else if (tmpl[i + 1] == 's' || tmpl[i + 1] == 'd')
+        {
+            if (arg < nargs)
+            {
+                strcpy(dst + n, args[arg]);
+                n += strlen(args[arg]);
+            }
+            arg++;
+            i++;
+        }
+        else if (tmpl[i + 1] == '%')
+        {
+            dst[n++] = '%';
+            i++;
+        }
+        else
+        {
+            dst[n++] = '%';
+            dst[n++] = tmpl[++i];
+        }
+    }
+    return n;
+}
+
+static uint16_t memspn(const char *p, char c, uint16_t n)
+{
+    uint16_t i;
+
+    for (i = 0; i < n && p[i] == c; i++)
+        ;
+    return i;
+}
+
+// Renders r after fill bytes of headers, returns the body length, -1 on a bad window
+static int64_t render(web_render_t *r, uint16_t fill, char *dst, uint32_t *windows)
+{
+    uint32_t n = 0;
+    uint16_t len;
+
+    memset(r->window, 'H', fill);
+    r->fill = fill;
+    *windows = 0;
+    while ((len = web_render_next(r)) != 0)
+    {
+        if (len > WEB_RENDER_WINDOW || (*windows == 0 && (len < fill || memspn(r->window, 'H', fill) != fill)))
+            return -1;
+        memcpy(dst + n, r->window + (*windows == 0 ? fill : 0), len - (*windows == 0 ? fill : 0));
+        n += len - (*windows == 0 ? fill : 0);
+        (*windows)++;
+        // Only the last window is not full
+        if (len < WEB_RENDER_WINDOW && web_render_next(r) != 0)
+            return -1;
+        if (len < WEB_RENDER_WINDOW)
+            break;
+    }
+    return n;
+}
+
+// Renders tmpl with args and compares with the expansion, returns the body length
+static uint32_t check(const char *tmpl, uint32_t len, bool raw, const char **args, int nargs, uint16_t fill)
+{
+    web_render_t *r = malloc(sizeof(web_render_t));
+    guarded_t g;
+    uint32_t want, length, windows;
+    int64_t got;
+    int i;
+
+    guarded_copy(&g, tmpl, len);
+    web_render_init(r, g.tmpl, len);
+    r->raw = raw;
+    for (i = 0; i < nargs; i++)
+        web_render_arg(r, args[i]);
+
+    want = expand(tmpl, len, raw, args, nargs, expect);
+    length = web_render_length(r);
+    got = render(r, fill, out, &windows);
+    if (got != want || length != want || memcmp(out, expect, want) != 0)
+    {
+        fprintf(stderr, "web_render: %u byte template, fill %u: rendered %lld, length %u, expected %u\n",
+                len, fill, (long long)got, length, want);
+        CHECK(false);
+    }
+    CHECK(windows == (fill + want + WEB_RENDER_WINDOW - 1) / WEB_RENDER_WINDOW);
+    guarded_free(&g);
+    free(r);
+    return want;
+}
+
+static void random_arg(char *dst, uint32_t *seed)
+{
+    static const char chars[] = "abc%sd<>' ";
+    uint32_t n = test_rand(seed) % 4 == 0 ? test_rand(seed) % (ARG_MAX + 1) : test_rand(seed) % 40, i;
+
+    for (i = 0; i < n; i++)
+        dst[i] = chars[test_rand(seed) % (sizeof(chars) - 1)];
+    dst[n] = 0;
+}
+
+static void test_pages(void)
+{
+    static const char config_page[] = CONFIG_PAGE, lock_page[] = LOCK_PAGE;
+    const char *args[] = {
+        "My very long SSID with 32 chars!", "%s%d%%x 63 chars of password, which are not expanded again...",
+        "checked", "MyAP", "", " selected", "", "10", "24", "1", "0"};
+    uint32_t len;
+    uint16_t fill;
+
+    for (fill = 0; fill < 200; fill++)
+    {
+        len = check(config_page, sizeof(config_page) - 1, false, args, 11, fill);
+        check(lock_page, sizeof(lock_page) - 1, false, NULL, 0, fill);
+    }
+    printf("web_render: config page %u bytes from a %u byte template in %u byte windows, %u bytes of state "
+           "(was %u bytes in two buffers)\n",
+           len, (unsigned)sizeof(config_page) - 1, WEB_RENDER_WINDOW, (unsigned)sizeof(web_render_t),
+           (unsigned)(((sizeof(config_page) + 4) & ~3) * 2 + 200));
+}
+
+// '%' and what follows it on both sides of every chunk and window edge
+static void test_edges(void)
+{
+    static const char *follow[] = {"s", "d", "%", "x", ""};
+    char tmpl[3 * WEB_RENDER_WINDOW];
+    const char *args[] = {"ARG"};
+    uint32_t at, f;
+    uint16_t fill;
+
+    for (at = 1; at < 2 * WEB_RENDER_WINDOW + 8; at++)
+    {
+        for (f = 0; f < sizeof(follow) / sizeof(follow[0]); f++)
+        {
+            memset(tmpl, 'a', at);
+            tmpl[at - 1] = '%';
+            strcpy(tmpl + at, follow[f]);
+            strcat(tmpl, "tail");
+            for (fill = 0; fill < 3; fill++)
+            {
+                check(tmpl, strlen(tmpl), false, args, 1, fill);
+                check(tmpl, at, false, args, 1, fill);
+            }
+        }
+    }
+}
+
+static void test_random(uint32_t seed)
+{
+    static const char chars[] = "%%%sdxa<";
+    static char tmpl[TMPL_MAX];
+    const char *args[WEB_RENDER_MAX_ARGS];
+    uint32_t t, i, len;
+    int nargs;
+
+    for (t = 0; t < TEMPLATES; t++)
+    {
+        len = test_rand(&seed) % TMPL_MAX;
+        for (i = 0; i < len; i++)
+            tmpl[i] = test_rand(&seed) % 4 == 0 ? chars[test_rand(&seed) % (sizeof(chars) - 1)] : 'a' + i % 26;
+        nargs = test_rand(&seed) % (WEB_RENDER_MAX_ARGS + 1);
+        for (i = 0; i < nargs; i++)
+        {
+            random_arg(arg_buf[i], &seed);
+            args[i] = arg_buf[i];
+        }
+        check(tmpl, len, test_rand(&seed) % 8 == 0, args, nargs, test_rand(&seed) % 300);
+    }
+}
+
+static void test_int_args(void)
+{
+    web_render_t *r = malloc(sizeof(web_render_t));
+    static const char tmpl[] = "%d.%d.%d.%d.%d";
+    guarded_t g;
+    uint32_t windows;
+    int i;
+
+    guarded_copy(&g, tmpl, sizeof(tmpl) - 1);
+    web_render_init(r, g.tmpl, sizeof(tmpl) - 1);
+    // Four of the longest fit into the scratch space, the fifth is dropped
+    for (i = 0; i < 5; i++)
+        web_render_arg_int(r, -2147483647 - 1);
+    CHECK(r->nargs == 4);
+    CHECK(web_render_length(r) == 4 * 11 + 4);
+    CHECK(render(r, 0, out, &windows) == 48 && memcmp(out, "-2147483648.-2147483648.-2147483648.-2147483648.", 48) == 0);
+    guarded_free(&g);
+    free(r);
+}
+
+int main(void)
+{
+    test_pages();
+    test_edges();
+    test_random(8);
+    test_int_args();
+    return test_result("test_web_render");
+}
@@ -0,0 +1,534 @@
+#include <string.h>
+
+#include "c_types.h"
+#include "user_interface.h"
+#include "lwip/app/espconn.h"
+#include "web_session.h"
+#include "test.h"
+
+//
+// web_session: the session pool of the web config server over a fake
+// espconn, requests parsed by http_req. A fifth client is refused and
+// gets the slot once one is free, also when the disconnect callback
+// comes with another espconn for the connection. Requests on a kept
+// alive connection each get their own, cleared transaction and their
+// response in order, "Connection: close" ends it once everything is
+// sent, the request after WEB_MAX_QUEUED pipelined ones or an out of
+// memory page closes it. Then random clients connecting, pipelining,
+// hanging up and acking their windows late: never more than
+// WEB_MAX_INFLIGHT windows in flight, one per connection, nothing sent
+// on a closed one, every response as requested, and once the acks are
+// in nobody is left waiting.
+//
+
+#define CLIENTS         8
+#define EVENTS          300000
+#define OUT_MAX         (128 * 1024)
+#define IN_MAX          4096
+#define EXPECT_MAX      64
+#define PAGE_LEN        1300    // three windows with the headers
+#define STATUS_BODY     "{\"status\":\"ok\"}"
+
+typedef struct {
+        char params[64];
+} txn_t;
+
+typedef struct {
+        struct espconn conn;
+        esp_tcp tcp;
+        espconn_recv_callback recv;
+        espconn_sent_callback sent;
+        espconn_connect_callback discon;
+        espconn_reconnect_callback recon;
+        bool open;              // connected, the pool not told otherwise yet
+        bool refused;
+        bool disconnect;        // espconn_disconnect() called, its callback is due
+        bool bye;               // sent its last request
+        uint8_t unacked;        // windows the sent callback is due for
+        char out[OUT_MAX];      // what came in on the connection
+        uint32_t out_len, out_pos;
+        char in[IN_MAX];        // requests, in_pos sent of them
+        uint32_t in_len, in_pos;
+        uint8_t expect[EXPECT_MAX];     // response of each request
+        uint32_t n_req, n_seen, n_resp;
+} client_t;
+
+static client_t clients[CLIENTS];
+static txn_t txns[WEB_MAX_SESSIONS];
+static uint32_t page_words[(PAGE_LEN + 3) / 4];     // "flash", word aligned
+static uint32_t inflight, max_inflight, next_port = 1024, no_memory, responses;
+static int send_order[16], n_sends;
+
+static client_t *client_of(struct espconn *pespconn)
+{
+    client_t *c = (client_t *)pespconn;
+
+    CHECK(c >= clients && c < &clients[CLIENTS]);
+    return c;
+}
+
+sint8 espconn_send(struct espconn *espconn, uint8 *psent, uint16 length)
+{
+    client_t *c = client_of(espconn);
+
+    CHECK(c->open && !c->refused && !c->disconnect);
+    CHECK(c->unacked == 0);
+    CHECK(c->out_len + length <= OUT_MAX);
+    if (c->out_len + length <= OUT_MAX)
+    {
+        memcpy(c->out + c->out_len, psent, length);
+        c->out_len += length;
+    }
+    c->unacked++;
+    if (++inflight > max_inflight)
+        max_inflight = inflight;
+    if (n_sends < 16)
+        send_order[n_sends++] = c - clients;
+    return 0;
+}
+
+sint8 espconn_disconnect(struct espconn *espconn)
+{
+    client_t *c = client_of(espconn);
+
+    CHECK(c->open);
+    c->disconnect = true;
+    return 0;
+}
+
+sint8 espconn_regist_recvcb(struct espconn *espconn, espconn_recv_callback recv_cb)
+{
+    client_of(espconn)->recv = recv_cb;
+    return 0;
+}
+
+sint8 espconn_regist_sentcb(struct espconn *espconn, espconn_sent_callback sent_cb)
+{
+    client_of(espconn)->sent = sent_cb;
+    return 0;
+}
+
+sint8 espconn_regist_disconcb(struct espconn *espconn, espconn_connect_callback discon_cb)
+{
+    client_of(espconn)->discon = discon_cb;
+    return 0;
+}
+
+sint8 espconn_regist_reconcb(struct espconn *espconn, espconn_reconnect_callback recon_cb)
+{
+    client_of(espconn)->recon = recon_cb;
+    return 0;
+}
+
+uint32 system_get_free_heap_size(void)
+{
+    return 40000;
+}
+
+// Ops as in user_main.c: the path picks the response
+
+static void param(void *arg, char *key, char *val)
+{
+    txn_t *txn = (txn_t *)arg;
+    size_t len = strlen(txn->params);
+
+    snprintf(txn->params + len, sizeof(txn->params) - len, "[%s=%s]", key, val);
+}
+
+// The request carries its client and number, the transaction must be its own
+static uint8_t request(struct espconn *pespconn, http_req_t *req, void *txn)
+{
+    client_t *c = client_of(pespconn);
+    char want[64];
+
+    snprintf(want, sizeof(want), "[c=%d][n=%u]", (int)(c - clients), c->n_seen++);
+    if (strcmp(((txn_t *)txn)->params, want) != 0)
+    {
+        fprintf(stderr, "web_session: client %d: params \"%s\", expected \"%s\"\n",
+                (int)(c - clients), ((txn_t *)txn)->params, want);
+        CHECK(false);
+    }
+    if (strcmp(req->path, "/") == 0)
+        return WEB_RESP_PAGE;
+    if (strcmp(req->path, "/status.json") == 0)
+        return WEB_RESP_STATUS;
+    return WEB_RESP_NOT_FOUND;
+}
+
+static const char *page_start(web_page_t *page, uint8_t kind)
+{
+    if (no_memory > 0)
+    {
+        no_memory--;
+        return NULL;
+    }
+    if (kind == WEB_RESP_STATUS)
+    {
+        page->body = strdup(STATUS_BODY);
+        web_render_init(&page->render, (uint8_t *)page->body, strlen(page->body));
+        page->render.raw = 1;
+        return "application/json";
+    }
+    web_render_init(&page->render, (uint8_t *)page_words, PAGE_LEN);
+    page->render.raw = 1;
+    return "text/html";
+}
+
+static const web_session_ops_t ops = {param, request, page_start};
+
+// The client side
+
+static void setup(void)
+{
+    int i;
+
+    memset(clients, 0, sizeof(clients));
+    for (i = 0; i < CLIENTS; i++)
+    {
+        clients[i].conn.proto.tcp = &clients[i].tcp;
+        clients[i].tcp.remote_ip[0] = 192;
+        clients[i].tcp.remote_ip[1] = 168;
+        clients[i].tcp.remote_ip[2] = 4;
+        clients[i].tcp.remote_ip[3] = 10 + i;
+    }
+    web_session_init(&ops, txns, sizeof(txn_t));
+    inflight = max_inflight = 0;
+    n_sends = 0;
+}
+
+// Connects, true if the pool took it
+static bool client_connect(client_t *c)
+{
+    int n = c - clients;
+
+    memset(c, 0, sizeof(client_t));
+    c->conn.proto.tcp = &c->tcp;
+    c->tcp.remote_ip[0] = 192;
+    c->tcp.remote_ip[1] = 168;
+    c->tcp.remote_ip[2] = 4;
+    c->tcp.remote_ip[3] = 10 + n;
+    c->tcp.remote_port = next_port++;
+    c->open = true;
+    web_session_open(&c->conn);
+    c->refused = c->recv == NULL;
+    CHECK(c->refused == c->disconnect);
+    return !c->refused;
+}
+
+// Queues a request with its client and number, close for the last one
+static void client_request(client_t *c, const char *path, bool close)
+{
+    static const char *versions[] = {"HTTP/1.1\r\nConnection: close", "HTTP/1.0"};
+    uint8_t kind = strcmp(path, "/") == 0 ? WEB_RESP_PAGE :
+                   strcmp(path, "/status.json") == 0 ? WEB_RESP_STATUS : WEB_RESP_NOT_FOUND;
+    int n;
+
+    n = snprintf(c->in + c->in_len, IN_MAX - c->in_len, "GET %s?c=%d&n=%u %s\r\nHost: 192.168.4.1\r\n\r\n",
+                 path, (int)(c - clients), c->n_req, close ? versions[c->n_req % 2] : "HTTP/1.1");
+    CHECK(c->in_len + n < IN_MAX && c->n_req < EXPECT_MAX);
+    c->in_len += n;
+    c->expect[c->n_req++] = kind | (close ? WEB_RESP_CLOSE : 0);
+    c->bye = close;
+}
+
+// Sends up to n bytes of the queued requests
+static void client_send(client_t *c, uint32_t n)
+{
+    if (n > c->in_len - c->in_pos)
+        n = c->in_len - c->in_pos;
+    if (n == 0 || c->recv == NULL || !c->open)
+        return;
+    c->in_pos += n;
+    c->recv(&c->conn, c->in + c->in_pos - n, n);
+}
+
+// The SDK is done with a window
+static void client_ack(client_t *c)
+{
+    if (c->unacked == 0)
+        return;
+    c->unacked--;
+    inflight--;
+    if (c->sent != NULL)
+        c->sent(&c->conn);
+}
+
+// The connection is gone, on either side: the SDK acks nothing after it
+static void client_gone(client_t *c, struct espconn *pespconn, bool error)
+{
+    inflight -= c->unacked;
+    c->unacked = 0;
+    c->open = false;
+    if (error && c->recon != NULL)
+        c->recon(pespconn, -11);
+    else if (c->discon != NULL)
+        c->discon(pespconn);
+}
+
+// The end of the response header from p on, NULL if it is not complete
+static char *header_end(char *p, char *end)
+{
+    for (; p + 4 <= end; p++)
+    {
+        if (memcmp(p, "\r\n\r\n", 4) == 0)
+            return p;
+    }
+    return NULL;
+}
+
+// Takes the complete responses off the connection, each must be the expected one
+static void client_parse(client_t *c)
+{
+    char *hdr, *end, conn[16];
+    int status, len;
+    uint8_t want;
+
+    while ((end = header_end(c->out + c->out_pos, c->out + c->out_len)) != NULL)
+    {
+        hdr = c->out + c->out_pos;
+        *end = 0;
+        len = -1;
+        if (sscanf(hdr, "HTTP/1.1 %d", &status) != 1 || strstr(hdr, "Content-Length: ") == NULL ||
+            sscanf(strstr(hdr, "Content-Length: "), "Content-Length: %d", &len) != 1 ||
+            strstr(hdr, "Connection: ") == NULL ||
+            sscanf(strstr(hdr, "Connection: "), "Connection: %15s", conn) != 1)
+        {
+            fprintf(stderr, "web_session: bad response header \"%s\"\n", hdr);
+            CHECK(false);
+            c->out_pos = c->out_len;
+            return;
+        }
+        *end = '\r';
+        end += 4;
+        if (end + len > c->out + c->out_len)
+            return;
+
+        CHECK(c->n_resp < c->n_req);
+        want = c->expect[c->n_resp++ % EXPECT_MAX];
+        responses++;
+        CHECK(strcmp(conn, (want & WEB_RESP_CLOSE) ? "close" : "keep-alive") == 0);
+        switch (want & WEB_RESP_KIND)
+        {
+        case WEB_RESP_PAGE:
+            CHECK(status == 200 && len == PAGE_LEN && memcmp(end, page_words, PAGE_LEN) == 0);
+            break;
+        case WEB_RESP_STATUS:
+            CHECK(status == 200 && len == strlen(STATUS_BODY) && memcmp(end, STATUS_BODY, len) == 0);
+            break;
+        default:
+            CHECK(status == 404 && len == 0);
+        }
+        c->out_pos = end + len - c->out;
+    }
+}
+
+// Acks every window and completes every disconnect until nothing happens any more
+static void settle(void)
+{
+    bool busy = true;
+    int i;
+
+    while (busy)
+    {
+        busy = false;
+        for (i = 0; i < CLIENTS; i++)
+        {
+            client_t *c = &clients[i];
+
+            if (c->unacked > 0)
+            {
+                client_ack(c);
+                busy = true;
+            }
+            else if (c->open && c->disconnect)
+            {
+                client_gone(c, &c->conn, false);
+                busy = true;
+            }
+            client_parse(c);
+        }
+    }
+}
+
+// Four clients get a slot, the fifth not until one of them is gone
+static void test_pool(void)
+{
+    struct espconn other;
+    esp_tcp other_tcp;
+    int i;
+
+    setup();
+    for (i = 0; i < WEB_MAX_SESSIONS; i++)
+    {
+        CHECK(client_connect(&clients[i]));
+        client_request(&clients[i], "/", false);
+    }
+    CHECK(!client_connect(&clients[4]));
+    settle();
+    CHECK(!clients[4].open);
+
+    // The windows go round robin, the first of every client before a second one
+    for (i = 0; i < WEB_MAX_SESSIONS; i++)
+        client_send(&clients[i], IN_MAX);
+    CHECK(n_sends == WEB_MAX_INFLIGHT);
+    settle();
+    CHECK(n_sends >= 2 * WEB_MAX_SESSIONS);
+    for (i = 0; i < WEB_MAX_SESSIONS; i++)
+        CHECK(send_order[i] == i && send_order[WEB_MAX_SESSIONS + i] == i);
+    CHECK(max_inflight == WEB_MAX_INFLIGHT);
+    for (i = 0; i < WEB_MAX_SESSIONS; i++)
+        CHECK(clients[i].open && clients[i].n_resp == 1);
+
+    // The client hangs up, its slot is free again
+    client_gone(&clients[0], &clients[0].conn, false);
+    CHECK(client_connect(&clients[4]));
+    CHECK(!client_connect(&clients[5]));
+    settle();
+
+    // The disconnect callback with another espconn for the connection frees the slot as well
+    other_tcp = clients[1].tcp;
+    other.proto.tcp = &other_tcp;
+    other.reverse = NULL;
+    clients[1].open = false;
+    clients[1].discon(&other);
+    CHECK(client_connect(&clients[5]));
+
+    // A connection error as well
+    client_gone(&clients[2], &clients[2].conn, true);
+    CHECK(client_connect(&clients[6]));
+    CHECK(!client_connect(&clients[7]));
+    settle();
+}
+
+// One connection kept alive for several requests
+static void test_keep_alive(void)
+{
+    static const char *paths[] = {"/", "/status.json", "/nope"};
+    client_t *c = &clients[0];
+    int i;
+
+    setup();
+    CHECK(client_connect(c));
+    for (i = 0; i < 3; i++)
+    {
+        // One after the other, the next one only once the response is in
+        client_request(c, paths[i], false);
+        client_send(c, IN_MAX);
+        settle();
+        CHECK(c->open && !c->disconnect && c->n_seen == i + 1 && c->n_resp == i + 1);
+    }
+
+    // Pipelined, split anywhere
+    for (i = 0; i < WEB_MAX_QUEUED; i++)
+        client_request(c, i % 2 == 0 ? "/status.json" : "/", i == WEB_MAX_QUEUED - 1);
+    for (i = 0; c->in_pos < c->in_len; i++)
+        client_send(c, 1 + i % 37);
+    settle();
+    CHECK(c->n_resp == c->n_req && !c->open);
+
+    // The request after WEB_MAX_QUEUED pipelined ones closes the connection
+    CHECK(client_connect(c));
+    for (i = 0; i <= WEB_MAX_QUEUED; i++)
+        client_request(c, "/", false);
+    client_send(c, IN_MAX);
+    CHECK(c->disconnect && c->n_seen == WEB_MAX_QUEUED);
+    settle();
+    CHECK(!c->open && c->out_len == 0);
+
+    // As does a page that does not get the memory
+    CHECK(client_connect(c));
+    client_request(c, "/status.json", false);
+    client_request(c, "/", false);
+    no_memory = 1;
+    client_send(c, IN_MAX);
+    CHECK(c->disconnect);
+    settle();
+    CHECK(!c->open && c->n_resp == 0 && max_inflight <= 1);
+
+    // And a bad request
+    CHECK(client_connect(c));
+    c->in_len = snprintf(c->in, IN_MAX, "GET /?a=%%zz HTTP/1.1\r\n\r\n");
+    client_send(c, IN_MAX);
+    CHECK(c->disconnect);
+    settle();
+}
+
+static void test_random(uint32_t seed)
+{
+    static const char *paths[] = {"/", "/", "/status.json", "/nope"};
+    uint32_t e, i, active, accepted = 0, refused = 0, hangups = 0, requests = 0;
+    client_t *c;
+
+    setup();
+    responses = 0;
+    for (e = 0; e < EVENTS; e++)
+    {
+        c = &clients[test_rand(&seed) % CLIENTS];
+        switch (test_rand(&seed) % 8)
+        {
+        case 0:
+            if (c->open)
+                break;
+            for (i = active = 0; i < CLIENTS; i++)
+                active += clients[i].open && !clients[i].refused;
+            CHECK(client_connect(c) == (active < WEB_MAX_SESSIONS));
+            if (c->refused)
+                refused++;
+            else
+                accepted++;
+            break;
+        case 1:
+        case 2:
+            // Pipelines up to WEB_MAX_QUEUED requests, so the queue never overflows
+            if (!c->open || c->refused || c->disconnect || c->bye || c->n_req - c->n_resp >= WEB_MAX_QUEUED ||
+                c->n_req == EXPECT_MAX || c->in_len > IN_MAX - 128)
+                break;
+            client_request(c, paths[test_rand(&seed) % 4], test_rand(&seed) % 16 == 0 || c->n_req == EXPECT_MAX - 1);
+            requests++;
+            break;
+        case 3:
+        case 4:
+            client_send(c, 1 + test_rand(&seed) % 100);
+            break;
+        case 5:
+        case 6:
+            client_ack(c);
+            break;
+        default:
+            if (c->open && (c->disconnect || test_rand(&seed) % 32 == 0))
+            {
+                hangups += !c->disconnect;
+                client_gone(c, &c->conn, test_rand(&seed) % 2 == 0);
+            }
+        }
+        client_parse(c);
+        CHECK(inflight <= WEB_MAX_INFLIGHT);
+
+        // Once the acks are in, every request that was sent is answered
+        if (e % 1000 == 999)
+        {
+            settle();
+            for (i = 0; i < CLIENTS; i++)
+            {
+                c = &clients[i];
+                if (c->open && !c->refused)
+                    CHECK(c->n_resp == c->n_seen && c->out_pos == c->out_len);
+            }
+        }
+    }
+    CHECK(max_inflight == WEB_MAX_INFLIGHT);
+    printf("web_session: %u events, %u sessions, %u refused, %u hang-ups, %u requests, %u responses\n",
+           EVENTS, accepted, refused, hangups, requests, responses);
+}
+
+int main(void)
+{
+    int i;
+
+    for (i = 0; i < PAGE_LEN; i++)
+        ((char *)page_words)[i] = 'a' + i % 26;
+    test_pool();
+    test_keep_alive();
+    test_random(9);
+    return test_result("test_web_session");
+}
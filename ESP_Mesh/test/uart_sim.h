@@ -0,0 +1,266 @@
+#ifndef _UART_SIM_H_
+#define _UART_SIM_H_
+
+#include <string.h>
+
+#include "c_types.h"
+#include "ets_sys.h"
+#include "os_type.h"
+#include "driver/uart.h"
+#include "user_config.h"
+#include "test.h"
+
+//
+// Host simulation of UART0 for the driver in ../driver/new_uart.c: the
+// 128 byte HW FIFOs, the interrupt status as the chip derives it from
+// the FIFO levels and thresholds in CONF1, the interrupt mask, and the
+// line, which moves one char per tick each way. UART1 registers are
+// only stored.
+//
+// The ISR is taken on every tick it is pending and not masked, also
+// when task level code touches a register or is half way through an
+// os_memcpy() (a random share of them) - so it can land wherever the
+// SDK's could.
+//
+
+#define SIM_FIFO        128             // UART_FIFO_LEN
+#define SIM_WIRE_MAX    (1 << 20)
+#define SIM_LINE_MAX    (1 << 16)
+#define SIM_ISR_MAX     1000            // calls in a row that mean an interrupt storm
+
+UartDevice UartDev;
+
+static uint8_t sim_tx[SIM_FIFO], sim_rx[SIM_FIFO];
+static int sim_tx_cnt, sim_tx_rd, sim_rx_cnt, sim_rx_rd;
+static uint32_t sim_int_ena, sim_latched, sim_conf1, sim_regs[2][64];
+static uint32_t sim_rx_idle;            // ticks since the last char came in
+
+static host_isr_t sim_isr;
+static void *sim_isr_arg;
+static bool sim_masked = true, sim_in_isr;
+static uint32_t sim_seed = 3;
+
+// What went out on the line, and what comes in: one char per tick from
+// sim_line[sim_line_pos] up to sim_line_len
+static uint8_t sim_wire[SIM_WIRE_MAX], sim_line[SIM_LINE_MAX];
+static uint32_t sim_wire_len, sim_line_len, sim_line_pos;
+static uint32_t sim_line_at[SIM_LINE_MAX];      // sim_queued when each char came in
+
+static uint64_t sim_now;
+static uint32_t sim_queued;             // bytes UART_Send() took, counted by the test
+static uint32_t sim_idle_busy;          // ticks the line was idle although some of them were not out
+static uint32_t sim_isr_calls, sim_storms, sim_tx_overflows, sim_rx_overflows, sim_rx_underflows;
+static uint32_t sim_posts[SIG_LOOPBACK + 1];
+
+static uint32_t sim_raw(void)
+{
+    uint32_t raw = sim_latched;
+
+    if (sim_tx_cnt < ((sim_conf1 >> UART_TXFIFO_EMPTY_THRHD_S) & UART_TXFIFO_EMPTY_THRHD))
+        raw |= UART_TXFIFO_EMPTY_INT_RAW;
+    if (sim_rx_cnt >= ((sim_conf1 >> UART_RXFIFO_FULL_THRHD_S) & UART_RXFIFO_FULL_THRHD))
+        raw |= UART_RXFIFO_FULL_INT_RAW;
+    return raw;
+}
+
+static void sim_isr_run(void)
+{
+    uint32_t n = 0;
+
+    if (sim_masked || sim_in_isr || sim_isr == NULL)
+        return;
+    while ((sim_raw() & sim_int_ena) != 0)
+    {
+        if (++n > SIM_ISR_MAX)
+        {
+            sim_storms++;
+            break;
+        }
+        sim_in_isr = true;
+        sim_isr_calls++;
+        sim_isr(sim_isr_arg);
+        sim_in_isr = false;
+    }
+}
+
+// One char time on the line
+static void sim_tick(void)
+{
+    uint32_t tout = (sim_conf1 >> UART_RX_TOUT_THRHD_S) & UART_RX_TOUT_THRHD;
+
+    if (sim_tx_cnt > 0)
+    {
+        CHECK(sim_wire_len < SIM_WIRE_MAX);
+        sim_wire[sim_wire_len++ % SIM_WIRE_MAX] = sim_tx[sim_tx_rd];
+        sim_tx_rd = (sim_tx_rd + 1) % SIM_FIFO;
+        sim_tx_cnt--;
+    }
+    else if (sim_wire_len < sim_queued)
+    {
+        // Only meaningful without echo, which takes the line as well
+        sim_idle_busy++;
+    }
+
+    if (sim_line_pos < sim_line_len)
+    {
+        sim_line_at[sim_line_pos] = sim_queued;
+        if (sim_rx_cnt == SIM_FIFO)
+        {
+            sim_latched |= UART_RXFIFO_OVF_INT_RAW;
+            sim_rx_overflows++;
+        }
+        else
+        {
+            sim_rx[(sim_rx_rd + sim_rx_cnt++) % SIM_FIFO] = sim_line[sim_line_pos];
+        }
+        sim_line_pos++;
+        sim_rx_idle = 0;
+    }
+    else if (++sim_rx_idle == tout && sim_rx_cnt > 0 && (sim_conf1 & UART_RX_TOUT_EN))
+    {
+        sim_latched |= UART_RXFIFO_TOUT_INT_RAW;
+    }
+    sim_now++;
+    sim_isr_run();
+}
+
+static void sim_ticks(uint32_t n)
+{
+    while (n-- > 0)
+        sim_tick();
+}
+
+// Task level code may be interrupted here
+static void sim_preempt(void)
+{
+    if (!sim_in_isr && test_rand(&sim_seed) % 4 == 0)
+        sim_tick();
+}
+
+uint32 host_reg_read(uint32 addr)
+{
+    uint32_t val;
+
+    sim_preempt();
+    if (addr == UART_FIFO(UART0))
+    {
+        if (sim_rx_cnt == 0)
+        {
+            sim_rx_underflows++;
+            return 0;
+        }
+        val = sim_rx[sim_rx_rd];
+        sim_rx_rd = (sim_rx_rd + 1) % SIM_FIFO;
+        sim_rx_cnt--;
+        return val;
+    }
+    if (addr == UART_STATUS(UART0))
+        return (sim_tx_cnt << UART_TXFIFO_CNT_S) | (sim_rx_cnt << UART_RXFIFO_CNT_S);
+    if (addr == UART_INT_RAW(UART0))
+        return sim_raw();
+    if (addr == UART_INT_ST(UART0))
+        return sim_raw() & sim_int_ena;
+    if (addr == UART_INT_ENA(UART0))
+        return sim_int_ena;
+    if (addr == UART_CONF1(UART0))
+        return sim_conf1;
+    return sim_regs[addr >= REG_UART_BASE(UART1)][(addr & 0xff) / 4];
+}
+
+void host_reg_write(uint32 addr, uint32 val)
+{
+    sim_preempt();
+    if (addr == UART_FIFO(UART0))
+    {
+        if (sim_tx_cnt == SIM_FIFO)
+            sim_tx_overflows++;
+        else
+            sim_tx[(sim_tx_rd + sim_tx_cnt++) % SIM_FIFO] = val;
+    }
+    else if (addr == UART_INT_ENA(UART0))
+    {
+        sim_int_ena = val;
+    }
+    else if (addr == UART_INT_CLR(UART0))
+    {
+        sim_latched &= ~val;
+    }
+    else if (addr == UART_CONF1(UART0))
+    {
+        sim_conf1 = val;
+    }
+    else
+    {
+        if (addr == UART_CONF0(UART0) && (val & UART_TXFIFO_RST))
+            sim_tx_cnt = 0;
+        if (addr == UART_CONF0(UART0) && (val & UART_RXFIFO_RST))
+            sim_rx_cnt = 0;
+        sim_regs[addr >= REG_UART_BASE(UART1)][(addr & 0xff) / 4] = val;
+    }
+}
+
+void host_isr_attach(host_isr_t isr, void *arg)
+{
+    sim_isr = isr;
+    sim_isr_arg = arg;
+}
+
+// A pending interrupt is taken as soon as it is unmasked
+void host_isr_mask(bool masked)
+{
+    sim_masked = masked;
+    sim_isr_run();
+}
+
+void *host_memcpy(void *dst, const void *src, size_t n)
+{
+    memcpy(dst, src, n / 2);
+    sim_preempt();
+    memcpy((uint8_t *)dst + n / 2, (const uint8_t *)src + n / 2, n - n / 2);
+    return dst;
+}
+
+void uart_div_modify(uint8 uart_no, uint32 div)
+{
+}
+
+bool system_os_post(uint8 prio, os_signal_t sig, os_param_t par)
+{
+    if (sig <= SIG_LOOPBACK)
+        sim_posts[sig]++;
+    return true;
+}
+
+// Chars that come in on the line from the next tick on
+static void sim_line_add(const void *data, uint32_t len)
+{
+    CHECK(sim_line_len + len <= SIM_LINE_MAX);
+    memcpy(sim_line + sim_line_len, data, len);
+    sim_line_len += len;
+}
+
+// Ticks until the line has been quiet for a while
+static void sim_drain(void)
+{
+    uint32_t quiet = 0, len;
+
+    while (quiet < 4 * SIM_FIFO)
+    {
+        len = sim_wire_len;
+        sim_tick();
+        quiet = sim_wire_len == len && sim_line_pos == sim_line_len ? quiet + 1 : 0;
+    }
+}
+
+// Back to a fresh chip and line, before UART_init_console()
+static void sim_reset(void)
+{
+    sim_tx_cnt = sim_rx_cnt = sim_tx_rd = sim_rx_rd = 0;
+    sim_int_ena = sim_latched = sim_conf1 = 0;
+    sim_masked = true;
+    sim_wire_len = sim_line_len = sim_line_pos = sim_queued = sim_idle_busy = 0;
+    sim_isr_calls = sim_storms = sim_tx_overflows = sim_rx_overflows = sim_rx_underflows = 0;
+    memset(sim_posts, 0, sizeof(sim_posts));
+}
+
+#endif
@@ -0,0 +1,401 @@
+#include "c_types.h"
+#include "mem.h"
+#include "osapi.h"
+#include "lwip/def.h"
+#include "lwip/ip.h"
+#include "lwip/udp.h"
+#include "lwip/tcp_impl.h"
+#include "netif/etharp.h"
+
+#include "user_config.h"
+#include "acl.h"
+
+#if ACLS
+
+#define GROUP_TCP       0
+#define GROUP_UDP       1
+#define GROUP_OTHER     2
+#define GROUPS          3
+
+// Up to this many rules a list is checked in order, an index costs more
+#define ACL_LINEAR_MAX  4
+
+// An index on port or address is only kept if none of its sets has more
+// than this share of the rules, else looking it up costs more than the
+// rules it saves
+#define ACL_SPLIT_DIV   2
+
+// One bit per rule of a list, the first rule in bit 0
+typedef uint16_t acl_set_t;
+
+#if MAX_ACL_ENTRIES > 16
+#error "acl_set_t has a bit per rule, MAX_ACL_ENTRIES must be 16 at most"
+#endif
+
+typedef struct {
+        uint16_t port;          // destination port, 0 for all other ports
+        acl_set_t rules;        // those that can match it (that port or any)
+} acl_bucket_t;
+
+typedef struct {
+        uint32_t start;         // host byte order, up to the start of the next range
+        acl_set_t rules;        // those whose prefix covers the range
+} acl_range_t;
+
+typedef struct {
+        uint8_t first_bucket[GROUPS];
+        uint8_t n_buckets[GROUPS];      // the first is always the one for port 0
+        uint8_t n_src, n_dest;          // 0 if the addresses are not indexed
+        bool by_port;           // false if the ports are not indexed
+        acl_range_t *src, *dest;        // one block with the buckets, NULL for none
+        acl_bucket_t *buckets;
+} acl_compiled_t;
+
+acl_entry acl[MAX_NO_ACLS][MAX_ACL_ENTRIES];
+uint8_t acl_freep[MAX_NO_ACLS];
+uint32_t acl_hits[MAX_NO_ACLS][MAX_ACL_ENTRIES];
+uint32_t acl_allow_count;
+uint32_t acl_deny_count;
+
+static acl_compiled_t acl_compiled[MAX_NO_ACLS];
+
+static bool ICACHE_FLASH_ATTR in_group(acl_entry *r, uint8_t group)
+{
+    switch (group)
+    {
+    case GROUP_TCP:
+        return r->proto == ACL_ANY_PROTO || r->proto == IP_PROTO_TCP;
+    case GROUP_UDP:
+        return r->proto == ACL_ANY_PROTO || r->proto == IP_PROTO_UDP;
+    default:
+        // Other protocols have no ports, rules with a port never match them
+        return r->proto != IP_PROTO_TCP && r->proto != IP_PROTO_UDP && r->s_port == 0 && r->d_port == 0;
+    }
+}
+
+// Inserts v into the sorted distinct values[0..n), returns the new n
+static uint8_t ICACHE_FLASH_ATTR insert_sorted(uint32_t *values, uint8_t n, uint32_t v)
+{
+    int j;
+
+    for (j = n; j > 0 && values[j - 1] > v; j--)
+        ;
+    if (j > 0 && values[j - 1] == v)
+        return n;
+    os_memmove(&values[j + 1], &values[j], (n - j) * sizeof(uint32_t));
+    values[j] = v;
+    return n + 1;
+}
+
+// The buckets of a group, by destination port, counts only if buckets is NULL
+static uint8_t ICACHE_FLASH_ATTR compile_group(uint8_t acl_no, uint8_t group, acl_bucket_t *buckets)
+{
+    uint32_t ports[MAX_ACL_ENTRIES + 1];
+    uint8_t n = 0, b;
+    int i;
+
+    n = insert_sorted(ports, n, 0);
+    for (i = 0; i < acl_freep[acl_no]; i++)
+    {
+        if (in_group(&acl[acl_no][i], group))
+            n = insert_sorted(ports, n, acl[acl_no][i].d_port);
+    }
+
+    for (b = 0; buckets != NULL && b < n; b++)
+    {
+        buckets[b].port = ports[b];
+        buckets[b].rules = 0;
+        for (i = 0; i < acl_freep[acl_no]; i++)
+        {
+            acl_entry *r = &acl[acl_no][i];
+
+            if (in_group(r, group) && (r->d_port == 0 || r->d_port == ports[b]))
+                buckets[b].rules |= 1 << i;
+        }
+    }
+    return n;
+}
+
+// Cuts the address space where a prefix of a rule starts or ends, counts
+// only if ranges is NULL
+static uint8_t ICACHE_FLASH_ATTR compile_ranges(uint8_t acl_no, bool src, acl_range_t *ranges)
+{
+    uint32_t starts[2 * MAX_ACL_ENTRIES + 1], lo, hi;
+    uint8_t n = 0, k;
+    int i;
+
+    n = insert_sorted(starts, n, 0);
+    for (i = 0; i < acl_freep[acl_no]; i++)
+    {
+        acl_entry *r = &acl[acl_no][i];
+
+        lo = ntohl(src ? r->src : r->dest);
+        hi = lo | ~ntohl(src ? r->s_mask : r->d_mask);
+        n = insert_sorted(starts, n, lo);
+        if (hi != 0xffffffff)
+            n = insert_sorted(starts, n, hi + 1);
+    }
+
+    for (k = 0; ranges != NULL && k < n; k++)
+    {
+        ranges[k].start = starts[k];
+        ranges[k].rules = 0;
+        for (i = 0; i < acl_freep[acl_no]; i++)
+        {
+            acl_entry *r = &acl[acl_no][i];
+            uint32_t mask = ntohl(src ? r->s_mask : r->d_mask);
+
+            if (((starts[k] ^ ntohl(src ? r->src : r->dest)) & mask) == 0)
+                ranges[k].rules |= 1 << i;
+        }
+    }
+    return n;
+}
+
+static void ICACHE_FLASH_ATTR acl_compile(uint8_t acl_no)
+{
+    acl_compiled_t *c = &acl_compiled[acl_no];
+    uint8_t nb = 0, group, k, split = acl_freep[acl_no] / ACL_SPLIT_DIV;
+
+    if (c->src != NULL)
+        os_free(c->src);
+    os_memset(c, 0, sizeof(acl_compiled_t));
+    if (acl_freep[acl_no] <= ACL_LINEAR_MAX)
+        return;
+
+    // First count, then fill one block of the exact size
+    for (group = 0; group < GROUPS; group++)
+    {
+        c->first_bucket[group] = nb;
+        c->n_buckets[group] = compile_group(acl_no, group, NULL);
+        nb += c->n_buckets[group];
+    }
+    c->n_src = compile_ranges(acl_no, true, NULL);
+    c->n_dest = compile_ranges(acl_no, false, NULL);
+
+    c->src = (acl_range_t *)os_malloc((c->n_src + c->n_dest) * sizeof(acl_range_t) + nb * sizeof(acl_bucket_t));
+    if (c->src == NULL)
+    {
+        os_memset(c, 0, sizeof(acl_compiled_t));
+        return;
+    }
+    c->dest = &c->src[c->n_src];
+    c->buckets = (acl_bucket_t *)&c->dest[c->n_dest];
+
+    for (group = 0; group < GROUPS; group++)
+        compile_group(acl_no, group, &c->buckets[c->first_bucket[group]]);
+    compile_ranges(acl_no, true, c->src);
+    compile_ranges(acl_no, false, c->dest);
+
+    // Only what splits the list is looked up
+    c->by_port = true;
+    for (k = 0; k < nb; k++)
+    {
+        if (__builtin_popcount(c->buckets[k].rules) > split)
+            c->by_port = false;
+    }
+    for (k = 0; k < c->n_src; k++)
+    {
+        if (__builtin_popcount(c->src[k].rules) > split)
+            c->n_src = 0;
+    }
+    for (k = 0; k < c->n_dest; k++)
+    {
+        if (__builtin_popcount(c->dest[k].rules) > split)
+            c->n_dest = 0;
+    }
+    if (!c->by_port && c->n_src == 0 && c->n_dest == 0)
+    {
+        os_free(c->src);
+        os_memset(c, 0, sizeof(acl_compiled_t));
+    }
+}
+
+static bool ICACHE_FLASH_ATTR rule_match(acl_entry *r, uint8_t proto, uint32_t src, uint16_t s_port, uint32_t dest, uint16_t d_port)
+{
+    return (r->proto == ACL_ANY_PROTO || r->proto == proto) &&
+           ((src ^ r->src) & r->s_mask) == 0 && ((dest ^ r->dest) & r->d_mask) == 0 &&
+           (r->s_port == 0 || r->s_port == s_port) && (r->d_port == 0 || r->d_port == d_port);
+}
+
+static uint8_t ICACHE_FLASH_ATTR acl_decide(uint8_t acl_no, int rule)
+{
+    if (rule < 0)
+    {
+        acl_deny_count++;
+        return ACL_DENY;
+    }
+    acl_hits[acl_no][rule]++;
+    if (acl[acl_no][rule].allow & ACL_ALLOW)
+        acl_allow_count++;
+    else
+        acl_deny_count++;
+    return acl[acl_no][rule].allow;
+}
+
+// The rules of the range addr is in: the last one that starts at or
+// below addr, halving the ranges left without a branch on the address
+static acl_set_t ICACHE_FLASH_ATTR range_rules(const acl_range_t *ranges, uint8_t n, uint32_t addr)
+{
+    uint8_t lo = 0, half;
+
+    // The first range starts at 0
+    while (n > 1)
+    {
+        half = n / 2;
+        lo = ranges[lo + half].start <= addr ? lo + half : lo;
+        n -= half;
+    }
+    return ranges[lo].rules;
+}
+
+// The first of rules that matches decides, in list order
+static uint8_t ICACHE_FLASH_ATTR acl_first_match(uint8_t acl_no, acl_set_t rules, uint8_t proto,
+                                                 uint32_t src, uint16_t s_port, uint32_t dest, uint16_t d_port)
+{
+    int i;
+
+    while (rules != 0)
+    {
+        i = __builtin_ctz(rules);
+        if (rule_match(&acl[acl_no][i], proto, src, s_port, dest, d_port))
+            return acl_decide(acl_no, i);
+        rules &= rules - 1;
+    }
+    return acl_decide(acl_no, -1);
+}
+
+static uint8_t ICACHE_FLASH_ATTR acl_check(uint8_t acl_no, uint8_t proto, uint32_t src, uint16_t s_port, uint32_t dest, uint16_t d_port)
+{
+    acl_compiled_t *c = &acl_compiled[acl_no];
+    acl_bucket_t *buckets;
+    acl_set_t rules;
+    uint8_t group, at, b;
+
+    // All of the list, unless an index leaves out some of it
+    rules = (1 << acl_freep[acl_no]) - 1;
+
+    if (c->by_port)
+    {
+        group = proto == IP_PROTO_TCP ? GROUP_TCP : (proto == IP_PROTO_UDP ? GROUP_UDP : GROUP_OTHER);
+        buckets = &c->buckets[c->first_bucket[group]];
+
+        // Bucket of the port, the first one (any other port) if there is none
+        at = 0;
+        for (b = 1; b < c->n_buckets[group]; b++)
+        {
+            if (buckets[b].port == d_port)
+            {
+                at = b;
+                break;
+            }
+        }
+        rules = buckets[at].rules;
+    }
+    if (c->n_src > 0 && rules != 0)
+        rules &= range_rules(c->src, c->n_src, ntohl(src));
+    if (c->n_dest > 0 && rules != 0)
+        rules &= range_rules(c->dest, c->n_dest, ntohl(dest));
+    return acl_first_match(acl_no, rules, proto, src, s_port, dest, d_port);
+}
+
+void ICACHE_FLASH_ATTR acl_init(void)
+{
+    int i;
+
+    acl_allow_count = acl_deny_count = 0;
+    for (i = 0; i < MAX_NO_ACLS; i++)
+        acl_clear(i);
+}
+
+void ICACHE_FLASH_ATTR acl_reload(void)
+{
+    int i;
+
+    for (i = 0; i < MAX_NO_ACLS; i++)
+    {
+        if (acl_freep[i] > MAX_ACL_ENTRIES)
+            acl_freep[i] = 0;
+        acl_clear_stats(i);
+        acl_compile(i);
+    }
+}
+
+bool ICACHE_FLASH_ATTR acl_is_empty(uint8_t acl_no)
+{
+    return acl_no >= MAX_NO_ACLS || acl_freep[acl_no] == 0;
+}
+
+void ICACHE_FLASH_ATTR acl_clear(uint8_t acl_no)
+{
+    if (acl_no >= MAX_NO_ACLS)
+        return;
+    acl_freep[acl_no] = 0;
+    acl_clear_stats(acl_no);
+    acl_compile(acl_no);
+}
+
+void ICACHE_FLASH_ATTR acl_clear_stats(uint8_t acl_no)
+{
+    if (acl_no >= MAX_NO_ACLS)
+        return;
+    os_memset(acl_hits[acl_no], 0, sizeof(acl_hits[acl_no]));
+}
+
+bool ICACHE_FLASH_ATTR acl_add(uint8_t acl_no, uint32_t src, uint32_t s_mask, uint32_t dest, uint32_t d_mask,
+                               uint8_t proto, uint16_t s_port, uint16_t d_port, uint8_t allow)
+{
+    acl_entry *r;
+
+    if (acl_no >= MAX_NO_ACLS || acl_freep[acl_no] >= MAX_ACL_ENTRIES)
+        return false;
+
+    r = &acl[acl_no][acl_freep[acl_no]++];
+    r->src = src & s_mask;
+    r->s_mask = s_mask;
+    r->dest = dest & d_mask;
+    r->d_mask = d_mask;
+    r->proto = proto;
+    r->s_port = s_port;
+    r->d_port = d_port;
+    r->allow = allow;
+    acl_hits[acl_no][acl_freep[acl_no] - 1] = 0;
+
+    acl_compile(acl_no);
+    return true;
+}
+
+uint8_t ICACHE_FLASH_ATTR acl_check_packet(uint8_t acl_no, struct pbuf *p)
+{
+    struct eth_hdr *eth = (struct eth_hdr *)p->payload;
+    struct ip_hdr *iph = (struct ip_hdr *)((uint8_t *)p->payload + SIZEOF_ETH_HDR);
+    uint16_t hlen, s_port = 0, d_port = 0;
+    uint8_t proto;
+
+    if (acl_is_empty(acl_no))
+        return ACL_ALLOW;
+    if (p->len < SIZEOF_ETH_HDR)
+        return ACL_DENY;
+    if (eth->type == PP_HTONS(ETHTYPE_ARP))
+        return ACL_ALLOW;
+    if (eth->type != PP_HTONS(ETHTYPE_IP) || p->len < SIZEOF_ETH_HDR + IP_HLEN)
+        return ACL_DENY;
+
+    proto = IPH_PROTO(iph);
+    hlen = IPH_HL(iph) * 4;
+
+    // Only the first fragment has the ports
+    if ((proto == IP_PROTO_TCP || proto == IP_PROTO_UDP) &&
+        (IPH_OFFSET(iph) & PP_HTONS(IP_OFFMASK)) == 0 && p->len >= SIZEOF_ETH_HDR + hlen + UDP_HLEN)
+    {
+        // The ports are at the same place in both headers
+        struct udp_hdr *l4 = (struct udp_hdr *)((uint8_t *)iph + hlen);
+
+        s_port = ntohs(l4->src);
+        d_port = ntohs(l4->dest);
+    }
+
+    return acl_check(acl_no, proto, iph->src.addr, s_port, iph->dest.addr, d_port);
+}
+
+#endif /* ACLS */
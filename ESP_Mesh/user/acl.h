@@ -0,0 +1,80 @@
+#ifndef _ACL_H_
+#define _ACL_H_
+
+#include "c_types.h"
+#include "lwip/pbuf.h"
+
+//
+// Access control lists for the SoftAP and the STA interface
+//
+// The rules of a list are checked in order, the first match decides, a
+// packet that matches no rule of a non-empty list is denied. The rules
+// live in acl (persisted with the config), for the packet checks every
+// list of more than a few rules is compiled into a decision structure
+// whenever it changes: the rules are grouped by protocol (TCP, UDP,
+// other) and within a group by destination port, and the source and
+// destination address spaces are each cut into ranges where a prefix of
+// a rule starts or ends. Every bucket and range has the set of rules
+// that can match in it. A packet finds its bucket and its two ranges and
+// only checks the rules in all three sets, in list order, instead of the
+// whole list. Ports or addresses that do not split the list - a bucket or
+// range with more than half of the rules - are not looked up, a list
+// that none of them splits is checked as it is.
+//
+// The hit counters are kept apart from the rules, in RAM only, so
+// counting never dirties the config.
+//
+// Addresses and masks are in network byte order, ports in host byte
+// order, 0 is any port.
+//
+
+#define MAX_NO_ACLS     4
+#define MAX_ACL_ENTRIES 16
+
+// Lists
+#define FROM_STA        0       // from the SoftAP clients
+#define TO_STA          1       // to the SoftAP clients
+#define FROM_AP         2       // from the uplink
+#define TO_AP           3       // to the uplink
+
+// Actions
+#define ACL_DENY        0x00
+#define ACL_ALLOW       0x01
+
+#define ACL_ANY_PROTO   0
+
+typedef struct {
+        uint32_t src;
+        uint32_t s_mask;
+        uint32_t dest;
+        uint32_t d_mask;
+        uint16_t s_port;
+        uint16_t d_port;
+        uint8_t proto;
+        uint8_t allow;
+} acl_entry;
+
+extern acl_entry acl[MAX_NO_ACLS][MAX_ACL_ENTRIES];
+extern uint8_t acl_freep[MAX_NO_ACLS];
+extern uint32_t acl_hits[MAX_NO_ACLS][MAX_ACL_ENTRIES];
+extern uint32_t acl_allow_count;
+extern uint32_t acl_deny_count;
+
+// Clears all lists
+void acl_init(void);
+
+// Recompiles all lists, after acl was loaded from the config
+void acl_reload(void);
+
+bool acl_is_empty(uint8_t acl_no);
+void acl_clear(uint8_t acl_no);
+void acl_clear_stats(uint8_t acl_no);
+
+// Appends a rule, false if the list is full
+bool acl_add(uint8_t acl_no, uint32_t src, uint32_t s_mask, uint32_t dest, uint32_t d_mask,
+             uint8_t proto, uint16_t s_port, uint16_t d_port, uint8_t allow);
+
+// The action for an ethernet frame, ACL_ALLOW for an empty list
+uint8_t acl_check_packet(uint8_t acl_no, struct pbuf *p);
+
+#endif
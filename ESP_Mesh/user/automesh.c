@@ -0,0 +1,502 @@
+#include "c_types.h"
+#include "osapi.h"
+
+#include "user_config.h"
+#include "automesh.h"
+
+static void ICACHE_FLASH_ATTR set_state(automesh_t *a, automesh_state_t state, uint32_t now)
+{
+    a->state = state;
+    a->since = now;
+}
+
+static void ICACHE_FLASH_ATTR rescan(automesh_t *a, uint32_t now)
+{
+    if (a->state != AUTOMESH_SCANNING)
+        a->scan_start = now;
+    a->failing_over = false;
+    set_state(a, AUTOMESH_SCANNING, now);
+    a->scans++;
+    a->ops->scan(a->ctx);
+}
+
+// Mesh level of an AP, if it does not tell: mesh nodes have BSSIDs 24:24:<level>:...
+static uint8_t ICACHE_FLASH_ATTR bss_level(const automesh_bss_t *bss)
+{
+    if (bss->level != AUTOMESH_UNKNOWN)
+        return bss->level;
+    if (bss->bssid[0] == 0x24 && bss->bssid[1] == 0x24)
+        return bss->bssid[2];
+    return 0;
+}
+
+static bool ICACHE_FLASH_ATTR has_uplink(const automesh_t *a)
+{
+    return a->bssid[0] != 0 || a->bssid[1] != 0 || a->bssid[2] != 0 ||
+           a->bssid[3] != 0 || a->bssid[4] != 0 || a->bssid[5] != 0;
+}
+
+uint16_t ICACHE_FLASH_ATTR automesh_cost(const automesh_t *a, const automesh_neighbor_t *nb)
+{
+    uint8_t level = nb->level;
+    int16_t rssi = nb->rssi / 16;
+    uint32_t rtt;
+    uint32_t cost;
+
+    cost = level * AUTOMESH_LEVEL_COST;
+
+    // If it is bad quality, give it a handicap of one level
+    if (rssi < -a->threshold)
+        cost += AUTOMESH_LEVEL_COST;
+    if (rssi < 0)
+        cost -= rssi;
+
+    if (nb->load != AUTOMESH_UNKNOWN)
+        cost += nb->load * AUTOMESH_LOAD_COST;
+
+    // New flows would be dropped there
+    if (nb->napt_free == 0)
+        cost += AUTOMESH_LEVEL_COST;
+
+    // The hops above the uplink plus the one to it, measured if it is ours
+    if (a->rtt != 0 && os_memcmp(nb->bssid, a->bssid, 6) == 0)
+        rtt = level * AUTOMESH_HOP_RTT + a->rtt;
+    else
+        rtt = (level + 1) * AUTOMESH_HOP_RTT;
+    if (rtt > AUTOMESH_MAX_RTT)
+        rtt = AUTOMESH_MAX_RTT;
+    cost += rtt / 2;
+
+    return cost > 0xffff ? 0xffff : cost;
+}
+
+static automesh_neighbor_t * ICACHE_FLASH_ATTR neighbor_find(automesh_t *a, const uint8_t *bssid)
+{
+    int i;
+
+    for (i = 0; i < AUTOMESH_NEIGHBORS; i++)
+    {
+        if (a->neighbor[i].used && os_memcmp(a->neighbor[i].bssid, bssid, 6) == 0)
+            return &a->neighbor[i];
+    }
+    return NULL;
+}
+
+// A free slot or the one not seen for the longest time
+static automesh_neighbor_t * ICACHE_FLASH_ATTR neighbor_alloc(automesh_t *a, const uint8_t *bssid)
+{
+    automesh_neighbor_t *nb = &a->neighbor[0];
+    int i;
+
+    for (i = 1; i < AUTOMESH_NEIGHBORS && nb->used; i++)
+    {
+        if (!a->neighbor[i].used || (int32_t)(a->neighbor[i].last_seen - nb->last_seen) < 0)
+            nb = &a->neighbor[i];
+    }
+    os_memset(nb, 0, sizeof(automesh_neighbor_t));
+    os_memcpy(nb->bssid, bssid, 6);
+    nb->used = 1;
+    return nb;
+}
+
+// RSSI is averaged over the sightings to ride out single bad scans
+void ICACHE_FLASH_ATTR automesh_neighbor_update(automesh_t *a, const automesh_bss_t *bss, uint8_t n, uint32_t now)
+{
+    automesh_neighbor_t *nb;
+    int i;
+
+    for (i = 0; i < n; i++)
+    {
+        nb = neighbor_find(a, bss[i].bssid);
+        if (nb != NULL)
+        {
+            nb->rssi += (bss[i].rssi * 16 - nb->rssi) / 4;
+        }
+        else
+        {
+            nb = neighbor_alloc(a, bss[i].bssid);
+            nb->rssi = bss[i].rssi * 16;
+        }
+        nb->channel = bss[i].channel;
+        nb->level = bss_level(&bss[i]);
+        nb->load = bss[i].load;
+        nb->napt_free = bss[i].napt_free;
+        nb->uplink_rssi = bss[i].uplink_rssi;
+        nb->last_seen = now;
+    }
+}
+
+void ICACHE_FLASH_ATTR automesh_neighbor_expire(automesh_t *a, uint32_t now)
+{
+    int i;
+
+    for (i = 0; i < AUTOMESH_NEIGHBORS; i++)
+    {
+        if (a->neighbor[i].used && now - a->neighbor[i].last_seen > AUTOMESH_EXPIRE)
+            a->neighbor[i].used = 0;
+        if (a->neighbor[i].blocked && now - a->neighbor[i].blocked_since > AUTOMESH_EXPIRE)
+            a->neighbor[i].blocked = false;
+    }
+}
+
+// The cheapest neighbor seen recently
+static automesh_neighbor_t * ICACHE_FLASH_ATTR neighbor_best(automesh_t *a, uint32_t now)
+{
+    automesh_neighbor_t *best = NULL;
+    uint16_t best_cost = 0xffff;
+    uint16_t cost;
+    int i;
+
+    for (i = 0; i < AUTOMESH_NEIGHBORS; i++)
+    {
+        if (!a->neighbor[i].used || a->neighbor[i].blocked || now - a->neighbor[i].last_seen > AUTOMESH_FRESH)
+            continue;
+
+        // Our own children are one level below our AP, never go there
+        if (has_uplink(a) && a->neighbor[i].level > a->level + 1)
+            continue;
+
+        cost = automesh_cost(a, &a->neighbor[i]);
+        if (best == NULL || cost < best_cost)
+        {
+            best = &a->neighbor[i];
+            best_cost = cost;
+        }
+    }
+    return best;
+}
+
+// The best neighbors after the current uplink, to fall back to when it is
+// lost. Only APs upstream of our AP: a sibling most likely hangs off the
+// same parent, and our own children would close a loop.
+static void ICACHE_FLASH_ATTR rank_backups(automesh_t *a, uint32_t now)
+{
+    uint16_t cost[AUTOMESH_BACKUPS];
+    uint16_t c;
+    int i, j;
+
+    a->backups = 0;
+    for (i = 0; i < AUTOMESH_NEIGHBORS; i++)
+    {
+        automesh_neighbor_t *nb = &a->neighbor[i];
+
+        if (!nb->used || nb->blocked || now - nb->last_seen > AUTOMESH_FRESH ||
+            nb->level > a->level || os_memcmp(nb->bssid, a->bssid, 6) == 0)
+            continue;
+
+        // Insert sorted, the last one drops out if the list is full
+        c = automesh_cost(a, nb);
+        for (j = a->backups; j > 0 && cost[j - 1] > c; j--)
+        {
+            if (j < AUTOMESH_BACKUPS)
+            {
+                cost[j] = cost[j - 1];
+                os_memcpy(a->backup[j], a->backup[j - 1], 6);
+            }
+        }
+        if (j < AUTOMESH_BACKUPS)
+        {
+            cost[j] = c;
+            os_memcpy(a->backup[j], nb->bssid, 6);
+            if (a->backups < AUTOMESH_BACKUPS)
+                a->backups++;
+        }
+    }
+}
+
+static void ICACHE_FLASH_ATTR connect(automesh_t *a, const automesh_neighbor_t *nb, uint32_t now)
+{
+    uint8_t level = nb->level;
+
+    // The level as seen by our children, a weak link counts as one more hop
+    if (nb->rssi / 16 < -a->threshold)
+        level++;
+
+    if (os_memcmp(a->bssid, nb->bssid, 6) != 0 || a->level != level)
+    {
+        if (a->checked)
+            a->switches++;
+        a->dirty = true;
+        a->rtt = 0;
+    }
+    os_memcpy(a->bssid, nb->bssid, 6);
+    a->level = level;
+    a->tries = 0;
+    set_state(a, AUTOMESH_CONNECTING, now);
+    a->ops->connect(a->ctx, a->bssid, a->level);
+}
+
+// Connects to the next backup that is still known, false if none is left
+static bool ICACHE_FLASH_ATTR failover(automesh_t *a, uint32_t now)
+{
+    automesh_neighbor_t *nb;
+
+    while (a->backup_next < a->backups)
+    {
+        nb = neighbor_find(a, a->backup[a->backup_next++]);
+        if (nb == NULL)
+            continue;
+        a->failing_over = true;
+        connect(a, nb, now);
+        return true;
+    }
+    a->failing_over = false;
+    return false;
+}
+
+// Leaves an uplink that got us an IP but leads nowhere. It is skipped
+// until AUTOMESH_EXPIRE, even if it was not in a scan yet (the saved
+// uplink after a restart).
+static void ICACHE_FLASH_ATTR unreachable(automesh_t *a, uint32_t now)
+{
+    automesh_neighbor_t *nb = neighbor_find(a, a->bssid);
+
+    if (nb == NULL)
+    {
+        nb = neighbor_alloc(a, a->bssid);
+        nb->level = a->level;
+        nb->last_seen = now;
+    }
+    nb->blocked = true;
+    nb->blocked_since = now;
+    a->unreachable++;
+
+    a->scan_start = now;
+    a->failover_start = now;
+    a->backup_next = 0;
+    if (!failover(a, now))
+        rescan(a, now);
+}
+
+void ICACHE_FLASH_ATTR automesh_init(automesh_t *a, const automesh_ops_t *ops, void *ctx, bool operational,
+                                     const uint8_t *bssid, uint8_t level, bool checked, int8_t threshold, uint32_t now)
+{
+    os_memset(a, 0, sizeof(automesh_t));
+    a->ops = ops;
+    a->ctx = ctx;
+    a->threshold = threshold;
+    a->checked = checked;
+    a->scan_start = now;
+
+    // The SDK connects to the saved uplink by itself
+    if (operational)
+    {
+        os_memcpy(a->bssid, bssid, 6);
+        a->level = level;
+        set_state(a, AUTOMESH_CONNECTING, now);
+    }
+    else
+    {
+        set_state(a, AUTOMESH_SCANNING, now);
+    }
+}
+
+void ICACHE_FLASH_ATTR automesh_start(automesh_t *a, uint32_t now)
+{
+    if (a->state == AUTOMESH_SCANNING)
+    {
+        a->scans++;
+        a->ops->scan(a->ctx);
+    }
+}
+
+void ICACHE_FLASH_ATTR automesh_scan_result(automesh_t *a, const automesh_bss_t *bss, uint8_t n, uint32_t now)
+{
+    automesh_neighbor_t *best, *current, joined;
+    bool survey = a->surveying;
+
+    a->surveying = false;
+    automesh_neighbor_update(a, bss, n, now);
+    best = neighbor_best(a, now);
+    if (a->state != AUTOMESH_CONNECTING)
+        rank_backups(a, now);
+
+    if (a->state == AUTOMESH_SCANNING)
+    {
+        if (best == NULL)
+        {
+            a->scans++;
+            a->ops->scan(a->ctx);
+            return;
+        }
+        connect(a, best, now);
+        return;
+    }
+
+    if (!survey || (a->state != AUTOMESH_CONNECTED && a->state != AUTOMESH_STABLE))
+        return;
+
+    // Move only for a clear gain, and not right after the last move
+    current = neighbor_find(a, a->bssid);
+    if (best == NULL || best == current || current == NULL)
+        return;
+
+    // We would add to the load there
+    joined = *best;
+    if (joined.load < AUTOMESH_UNKNOWN - 1)
+        joined.load++;
+    if (automesh_cost(a, &joined) + AUTOMESH_HYSTERESIS >= automesh_cost(a, current))
+        return;
+    if (now - a->uplink_since < AUTOMESH_MIN_DWELL)
+    {
+        a->held++;
+        return;
+    }
+
+    a->scan_start = now;
+    connect(a, best, now);
+}
+
+void ICACHE_FLASH_ATTR automesh_connected(automesh_t *a, const uint8_t *bssid, uint32_t now)
+{
+    if (a->state == AUTOMESH_SCANNING)
+        return;
+
+    // The SDK picked another AP of the mesh
+    if (os_memcmp(a->bssid, bssid, 6) != 0)
+        rescan(a, now);
+}
+
+void ICACHE_FLASH_ATTR automesh_got_ip(automesh_t *a, uint32_t now)
+{
+    if (a->state != AUTOMESH_CONNECTING)
+        return;
+
+    if (a->failing_over)
+    {
+        a->failing_over = false;
+        a->failovers++;
+        a->last_failover = now - a->failover_start;
+    }
+    a->tries = 0;
+    a->last_convergence = now - a->scan_start;
+    a->uplink_since = now;
+    a->next_survey = now + AUTOMESH_SURVEY_INTERVAL;
+    a->reachable = false;
+    a->next_probe = now;
+    set_state(a, AUTOMESH_CONNECTED, now);
+    rank_backups(a, now);
+
+    // The credentials work, saved with the uplink once it is stable
+    if (!a->checked)
+    {
+        a->checked = true;
+        a->dirty = true;
+    }
+}
+
+void ICACHE_FLASH_ATTR automesh_disconnected(automesh_t *a, const uint8_t *bssid, uint8_t reason, uint32_t now)
+{
+    // Our own disconnect before a scan
+    if (a->state == AUTOMESH_SCANNING)
+        return;
+
+    // From the uplink we just left for another one
+    if (bssid != NULL && os_memcmp(bssid, a->bssid, 6) != 0)
+        return;
+
+    // Lost a working uplink, take the best backup without scanning
+    if (a->checked && (a->state == AUTOMESH_CONNECTED || a->state == AUTOMESH_STABLE))
+    {
+        a->scan_start = now;
+        a->failover_start = now;
+        a->backup_next = 0;
+        if (failover(a, now))
+            return;
+    }
+    else if (a->failing_over)
+    {
+        // That backup did not work either
+        if (failover(a, now))
+            return;
+        rescan(a, now);
+        return;
+    }
+
+    if (a->state != AUTOMESH_CONNECTING)
+        a->scan_start = now;
+    a->tries++;
+    set_state(a, AUTOMESH_CONNECTING, now);
+
+    if (!a->checked)
+    {
+        // Wrong password or the like, nothing a new uplink would fix
+        if (a->tries > AUTOMESH_MAX_TRIES)
+            a->ops->factory_reset(a->ctx);
+        return;
+    }
+
+    // The uplink is gone, no use waiting for the SDK to reconnect
+    if (reason == AUTOMESH_NO_AP_FOUND || a->tries > AUTOMESH_MAX_TRIES)
+    {
+        automesh_neighbor_t *nb = neighbor_find(a, a->bssid);
+
+        // Until a scan shows it again
+        if (nb != NULL)
+            nb->used = 0;
+        rescan(a, now);
+    }
+}
+
+void ICACHE_FLASH_ATTR automesh_reachable(automesh_t *a, uint32_t now)
+{
+    // A late answer for an uplink we already left
+    if (a->state != AUTOMESH_CONNECTED)
+        return;
+    a->reachable = true;
+}
+
+void ICACHE_FLASH_ATTR automesh_set_rtt(automesh_t *a, uint32_t rtt)
+{
+    a->rtt = rtt;
+}
+
+void ICACHE_FLASH_ATTR automesh_tick(automesh_t *a, uint32_t now)
+{
+    automesh_neighbor_expire(a, now);
+
+    switch (a->state)
+    {
+    case AUTOMESH_CONNECTING:
+        if (now - a->since >= (a->failing_over ? AUTOMESH_FAILOVER_TIMEOUT : AUTOMESH_CONNECT_TIMEOUT))
+            automesh_disconnected(a, NULL, 0, now);
+        break;
+
+    case AUTOMESH_CONNECTED:
+        if (!a->reachable)
+        {
+            if (now - a->since >= AUTOMESH_REACH_TIMEOUT)
+            {
+                unreachable(a, now);
+                break;
+            }
+            if ((int32_t)(now - a->next_probe) >= 0)
+            {
+                a->next_probe = now + AUTOMESH_PROBE_INTERVAL;
+                a->ops->probe(a->ctx);
+            }
+            break;
+        }
+        if (now - a->since < AUTOMESH_STABLE_TIME)
+            break;
+        set_state(a, AUTOMESH_STABLE, now);
+        if (a->dirty)
+        {
+            a->dirty = false;
+            a->ops->persist(a->ctx);
+        }
+        break;
+
+    case AUTOMESH_STABLE:
+        if (a->surveying || (int32_t)(now - a->next_survey) < 0)
+            break;
+        a->next_survey = now + AUTOMESH_SURVEY_INTERVAL;
+        a->surveying = true;
+        a->scans++;
+        a->ops->survey(a->ctx);
+        break;
+
+    default:
+        break;
+    }
+}
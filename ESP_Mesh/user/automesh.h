@@ -0,0 +1,195 @@
+#ifndef _AUTOMESH_H_
+#define _AUTOMESH_H_
+
+#include "c_types.h"
+
+//
+// Automesh uplink state machine
+//
+// Picks the uplink from scan results, follows the connection and decides
+// when to look for a new uplink - all without a restart. The node
+// switches in place: the ops connect to the new BSSID and move the
+// SoftAP to the matching level and network. The choice is persisted only
+// after the uplink has been up for AUTOMESH_STABLE_TIME, so flapping
+// uplinks cost no flash erases.
+//
+// An IP from the uplink does not mean it leads anywhere: after a lost
+// parent, two of its children may connect to each other. So the ops
+// probe the network beyond the uplink every AUTOMESH_PROBE_INTERVAL
+// until an answer comes in, and only then the uplink can become stable
+// and be persisted. Without an answer within AUTOMESH_REACH_TIMEOUT the
+// uplink is skipped for AUTOMESH_EXPIRE and the node moves on, as if it
+// had lost it.
+//
+// Candidates are ranked by a cost, lower is better:
+//   level * AUTOMESH_LEVEL_COST        mesh level from the beacon IE or,
+//                                      of nodes without it, the
+//                                      24:24:<level> BSSID
+//   + AUTOMESH_LEVEL_COST              if the smoothed RSSI is below -threshold
+//   - smoothed RSSI                    dBm, averaged over the scans
+//   + load * AUTOMESH_LOAD_COST        stations on the AP, if advertised
+//   + AUTOMESH_LEVEL_COST              if it advertises no free NAPT flows
+//   + RTT / 2                          ms, measured for the current uplink,
+//                                      estimated per hop for the others
+// Without load and RTT this is the old "lowest level, then best RSSI".
+//
+// All APs of the mesh that were seen are kept in a neighbor table, RSSI
+// averaged over the sightings, and aged by time. Full scans only happen
+// while the node has no uplink. While connected, a short scan of the own
+// channel - all of the mesh shares the channel of the root AP, so the
+// radio never leaves it - refreshes the table every
+// AUTOMESH_SURVEY_INTERVAL. The node moves only if the best neighbor is
+// cheaper by AUTOMESH_HYSTERESIS and it has stayed AUTOMESH_MIN_DWELL on
+// the current uplink, so similar parents do not make it flap.
+//
+// After each scan the next AUTOMESH_BACKUPS best neighbors are ranked as
+// backup uplinks. Only APs upstream of our own AP (at most at the level
+// of the uplink) qualify: siblings usually hang off the same parent and
+// would be lost with it. When the uplink is lost, the node connects to
+// the first backup right away, without a scan, and on to the next one if
+// that does not give an IP within AUTOMESH_FAILOVER_TIMEOUT. Only when
+// all backups failed does it scan again. A backup on the level of the
+// lost uplink leaves the SoftAP alone, its stations and DHCP leases stay.
+//
+// The core has no SDK dependencies, everything happens via the ops, so
+// event sequences can be replayed on a host. Times are in ms.
+//
+
+#define AUTOMESH_MAX_BSS        16      // APs per scan
+#define AUTOMESH_NEIGHBORS      16      // size of the neighbor table
+#define AUTOMESH_MAX_TRIES      3       // disconnects before a new scan
+#define AUTOMESH_CONNECT_TIMEOUT 15000  // from connect to IP
+#define AUTOMESH_STABLE_TIME    30000   // uplink up before it is persisted
+
+#define AUTOMESH_LEVEL_COST     100     // one mesh level
+#define AUTOMESH_LOAD_COST      8       // one station on the uplink
+#define AUTOMESH_HOP_RTT        10      // ms per hop if not measured
+#define AUTOMESH_MAX_RTT        200     // ms, longer counts as this
+#define AUTOMESH_HYSTERESIS     50      // a switch must save this much
+#define AUTOMESH_MIN_DWELL      300000  // min time on an uplink before a voluntary switch
+#define AUTOMESH_SURVEY_INTERVAL 30000  // own channel scans while connected
+#define AUTOMESH_FRESH          35000   // neighbors seen since are uplink candidates
+#define AUTOMESH_EXPIRE         300000  // neighbors not seen since are dropped
+#define AUTOMESH_BACKUPS        3       // ranked backup uplinks
+#define AUTOMESH_FAILOVER_TIMEOUT 5000  // from connect to IP on a backup
+#define AUTOMESH_PROBE_INTERVAL 5000    // reachability probes until one is answered
+#define AUTOMESH_REACH_TIMEOUT  60000   // from IP to an answered probe
+
+#define AUTOMESH_UNKNOWN        0xff    // level, load or NAPT flows not advertised
+#define AUTOMESH_NO_AP_FOUND    201     // disconnect reason
+
+typedef enum {
+        AUTOMESH_SCANNING = 0,  // looking for an uplink
+        AUTOMESH_CONNECTING,    // uplink chosen, waiting for the IP
+        AUTOMESH_CONNECTED,     // got an IP, not yet stable
+        AUTOMESH_STABLE         // persisted
+} automesh_state_t;
+
+// One scan result
+typedef struct {
+        uint8_t bssid[6];
+        int8_t rssi;
+        uint8_t level;          // AUTOMESH_UNKNOWN: taken from the BSSID
+        uint8_t load;           // stations
+        uint8_t napt_free;      // free NAPT flows
+        uint8_t channel;
+        int8_t uplink_rssi;     // dBm, 0 if not advertised
+} automesh_bss_t;
+
+// An AP of the mesh, remembered across scans
+typedef struct {
+        uint8_t bssid[6];
+        uint8_t used;
+        uint8_t channel;
+        int16_t rssi;           // smoothed, dBm * 16
+        uint8_t level;
+        uint8_t load;
+        uint8_t napt_free;
+        int8_t uplink_rssi;
+        bool blocked;           // led nowhere, no candidate for AUTOMESH_EXPIRE
+        uint32_t last_seen;
+        uint32_t blocked_since;
+} automesh_neighbor_t;
+
+typedef struct {
+        // Drops the uplink (if any) and starts a scan
+        void (*scan)(void *ctx);
+        // Starts a short scan of the own channel and keeps the uplink
+        void (*survey)(void *ctx);
+        // Connects to the uplink and moves the SoftAP to level + 1
+        void (*connect)(void *ctx, const uint8_t *bssid, uint8_t level);
+        // Checks that the network beyond the uplink answers, an answer
+        // goes to automesh_reachable()
+        void (*probe)(void *ctx);
+        // The uplink is stable, save the config
+        void (*persist)(void *ctx);
+        // The credentials never worked
+        void (*factory_reset)(void *ctx);
+} automesh_ops_t;
+
+typedef struct {
+        const automesh_ops_t *ops;
+        void *ctx;
+        automesh_state_t state;
+        uint8_t bssid[6];       // current uplink
+        uint8_t level;          // mesh level of the uplink
+        int8_t threshold;       // RSSI below -threshold is weak
+        uint8_t tries;          // disconnects since the last IP
+        bool checked;           // the credentials have worked once
+        bool dirty;             // the uplink differs from the saved one
+        bool surveying;         // a survey scan is running
+        bool failing_over;      // connecting to a backup
+        bool reachable;         // a probe beyond the uplink was answered
+        uint32_t since;         // time of the last state change
+        uint32_t uplink_since;  // time of the last IP
+        uint32_t next_survey;
+        uint32_t next_probe;
+        uint32_t rtt;           // ms to the current uplink, 0 if unknown
+        automesh_neighbor_t neighbor[AUTOMESH_NEIGHBORS];
+        uint8_t backup[AUTOMESH_BACKUPS][6];    // best first
+        uint8_t backups;
+        uint8_t backup_next;    // next one to try while failing over
+
+        uint32_t scans;
+        uint32_t switches;      // uplink changes without restart
+        uint32_t held;          // better uplinks ignored due to hysteresis or dwell time
+        uint32_t failovers;     // uplinks lost and replaced by a backup
+        uint32_t last_failover; // ms from the loss to the IP of the backup
+        uint32_t failover_start;
+        uint32_t unreachable;   // uplinks left as no probe was answered
+        uint32_t last_convergence;      // ms from scan start to IP
+        uint32_t scan_start;
+} automesh_t;
+
+// operational: the config has an uplink (bssid, level) the SDK connects to
+void automesh_init(automesh_t *a, const automesh_ops_t *ops, void *ctx, bool operational,
+                   const uint8_t *bssid, uint8_t level, bool checked, int8_t threshold, uint32_t now);
+
+// Starts scanning if no uplink is known, when the system is up
+void automesh_start(automesh_t *a, uint32_t now);
+
+void automesh_scan_result(automesh_t *a, const automesh_bss_t *bss, uint8_t n, uint32_t now);
+void automesh_connected(automesh_t *a, const uint8_t *bssid, uint32_t now);
+void automesh_got_ip(automesh_t *a, uint32_t now);
+// bssid: of the AP the SDK lost, events for an AP we already left are ignored
+void automesh_disconnected(automesh_t *a, const uint8_t *bssid, uint8_t reason, uint32_t now);
+
+// A probe beyond the uplink was answered
+void automesh_reachable(automesh_t *a, uint32_t now);
+
+// Measured round trip time to the current uplink in ms, 0 if unknown
+void automesh_set_rtt(automesh_t *a, uint32_t rtt);
+
+// Cost of a neighbor as used for the uplink choice, lower is better
+uint16_t automesh_cost(const automesh_t *a, const automesh_neighbor_t *nb);
+
+// Merges scan results into the neighbor table, done by automesh_scan_result()
+void automesh_neighbor_update(automesh_t *a, const automesh_bss_t *bss, uint8_t n, uint32_t now);
+
+// Drops neighbors not seen for AUTOMESH_EXPIRE, done by automesh_tick()
+void automesh_neighbor_expire(automesh_t *a, uint32_t now);
+
+// Call about once per second: connect timeout, probes, persisting, surveys, aging
+void automesh_tick(automesh_t *a, uint32_t now);
+
+#endif
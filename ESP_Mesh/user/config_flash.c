@@ -2,6 +2,7 @@
 #include "lwip/ip.h"
 #include "lwip/lwip_napt.h"
 #include "config_flash.h"
+#include "route_trie.h"
 
 
 /*     From the document 99A-SDK-Espressif IOT Flash RW Operation_v0.2      *
@@ -82,6 +83,7 @@ uint32_t reg0, reg1, reg3;
     config->automesh_checked		= 0;
     config->automesh_tries		= 0;
     config->automesh_threshold		= 85;
+    config->automesh_level		= 0;
     config->am_scan_time		= 0;
     config->am_sleep_time		= 0;
 
@@ -204,10 +206,12 @@ int ICACHE_FLASH_ATTR config_load(sysconfig_p config)
 
     ip_route_max = config->no_routes;
     os_memcpy(ip_rt_table, config->rt_table, sizeof(ip_rt_table));
+    route_trie_reload();
 
 #if ACLS
     os_memcpy(&acl, &(config->acl), sizeof(acl));
     os_memcpy(&acl_freep, &(config->acl_freep), sizeof(acl_freep));
+    acl_reload();
 #endif
     return 0;
 }
@@ -68,6 +68,7 @@ typedef struct {
         uint8_t automesh_checked; // Flag that it has worked once
         uint8_t automesh_tries; // Counter of disconnects
         int8_t automesh_threshold; // RSSI limit
+        uint8_t automesh_level; // Mesh level of the uplink, ours is one more
         uint32_t am_scan_time; // Seconds for scanning
         uint32_t am_sleep_time; // Seconds for sleeping
 
@@ -0,0 +1,23 @@
+#include "c_types.h"
+#include "osapi.h"
+
+#include "console_cmd.h"
+
+const console_cmd_t * ICACHE_FLASH_ATTR console_cmd_find(const console_cmd_t *table, uint8_t len, const char *name)
+{
+    int lo = 0, hi = len - 1;
+
+    while (lo <= hi)
+    {
+        int mid = (lo + hi) / 2;
+        int cmp = os_strcmp(name, table[mid].name);
+
+        if (cmp == 0)
+            return &table[mid];
+        if (cmp < 0)
+            hi = mid - 1;
+        else
+            lo = mid + 1;
+    }
+    return NULL;
+}
@@ -0,0 +1,39 @@
+#ifndef _CONSOLE_CMD_H_
+#define _CONSOLE_CMD_H_
+
+#include "c_types.h"
+#include "lwip/app/espconn.h"
+
+//
+// Table driven console dispatch
+//
+// Each table is sorted by name (strcmp order) and searched binary.
+// The argument count (including the command words) and the lock
+// state are checked once by the dispatcher, not by every handler.
+//
+
+// Handler results
+#define CMD_DONE    0   // response is complete, send it
+#define CMD_ASYNC   1   // response is sent later from a callback
+
+// Flags
+#define CMD_CFG     0x01    // changes the config, refused while locked
+
+typedef int (*console_cmd_fn)(struct espconn *pespconn, char **tokens, int nTokens, char *response);
+
+typedef struct console_cmd {
+        const char *name;
+        uint8_t min_tokens;     // including the command word(s)
+        uint8_t max_tokens;
+        uint8_t flags;
+        console_cmd_fn fn;      // NULL if sub is used
+        const struct console_cmd *sub;  // table for the next token, e.g. "set <param>"
+        uint8_t sub_len;
+} console_cmd_t;
+
+#define CMD_TABLE_LEN(t) (sizeof(t) / sizeof((t)[0]))
+
+// Binary search of name in a sorted table, NULL if not found
+const console_cmd_t *console_cmd_find(const console_cmd_t *table, uint8_t len, const char *name);
+
+#endif
@@ -0,0 +1,223 @@
+#include "c_types.h"
+#include "osapi.h"
+#include "lwip/ip.h"
+#include "lwip/udp.h"
+#include "lwip/tcp_impl.h"
+#include "netif/etharp.h"
+
+#include "user_config.h"
+#include "fastpath.h"
+#include "inet_csum.h"
+
+#if FASTPATH
+
+typedef struct {
+        uint32_t client_ip;     // all in network byte order
+        uint32_t remote_ip;
+        uint32_t nat_ip;
+        uint16_t client_port;
+        uint16_t remote_port;
+        uint16_t nat_port;
+        uint8_t proto;          // 0 if unused
+        uint8_t client_mac[6];
+        uint8_t gw_mac[6];
+        struct netif *ap_netif;
+        struct netif *sta_netif;
+        uint32_t learned;       // ms
+} fp_entry_t;
+
+// Direct mapped, a colliding flow replaces the entry
+static fp_entry_t fp_cache[FASTPATH_ENTRIES];
+// Entry refs + 1 by the key of the uplink direction, 0 if none
+static uint8_t fp_in_index[FASTPATH_ENTRIES];
+
+// The last frame from a SoftAP client that took the slow path
+static fp_entry_t fp_pending;
+
+fastpath_stats_t fastpath_stats;
+
+static uint8_t ICACHE_FLASH_ATTR fp_hash(uint8_t proto, uint32_t ip, uint16_t port, uint32_t ip2, uint16_t port2)
+{
+    uint32_t h = ip ^ ip2 ^ (((uint32_t)port << 16) | port2) ^ proto;
+
+    h *= 0x9e3779b1;
+    return (h >> 24) % FASTPATH_ENTRIES;
+}
+
+void ICACHE_FLASH_ATTR fastpath_flush(void)
+{
+    os_memset(fp_cache, 0, sizeof(fp_cache));
+    os_memset(fp_in_index, 0, sizeof(fp_in_index));
+    fp_pending.proto = 0;
+}
+
+// Parsed frame, all pointers into the first pbuf
+typedef struct {
+    struct eth_hdr *eth;
+    struct ip_hdr *ip;
+    uint16_t *ports;    // src, dst
+    uint16_t *csum;     // L4 checksum
+    uint8_t proto;
+} fp_frame_t;
+
+// Checks that the frame is an unfragmented TCP/UDP packet that may take the fast path.
+// The TTL is checked by the callers that forward, the NAPT may send a TTL of 1.
+static bool ICACHE_FLASH_ATTR fp_parse(struct pbuf *p, fp_frame_t *fr)
+{
+    uint8_t *l4;
+    uint16_t hlen;
+
+    if (p->len < SIZEOF_ETH_HDR + IP_HLEN)
+        return false;
+
+    fr->eth = (struct eth_hdr *)p->payload;
+    fr->ip = (struct ip_hdr *)((uint8_t *)p->payload + SIZEOF_ETH_HDR);
+    if (fr->eth->type != PP_HTONS(ETHTYPE_IP) || IPH_V(fr->ip) != 4)
+        return false;
+    if ((IPH_OFFSET(fr->ip) & PP_HTONS(IP_OFFMASK | IP_MF)) != 0)
+        return false;
+
+    hlen = IPH_HL(fr->ip) * 4;
+    if (hlen < IP_HLEN || p->len < SIZEOF_ETH_HDR + hlen)
+        return false;
+    l4 = (uint8_t *)fr->ip + hlen;
+    fr->proto = IPH_PROTO(fr->ip);
+    fr->ports = (uint16_t *)l4;
+
+    if (fr->proto == IP_PROTO_TCP)
+    {
+        if (p->len < SIZEOF_ETH_HDR + hlen + TCP_HLEN)
+            return false;
+        if (TCPH_FLAGS((struct tcp_hdr *)l4) & (TCP_SYN | TCP_FIN | TCP_RST))
+            return false;
+        fr->csum = &((struct tcp_hdr *)l4)->chksum;
+    }
+    else if (fr->proto == IP_PROTO_UDP)
+    {
+        if (p->len < SIZEOF_ETH_HDR + hlen + UDP_HLEN)
+            return false;
+        fr->csum = &((struct udp_hdr *)l4)->chksum;
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+// Rewrites one address and port of the frame, decrements the TTL
+static void ICACHE_FLASH_ATTR fp_rewrite(fp_frame_t *fr, ip_addr_p_t *addr, uint16_t *port,
+                                         uint32_t new_addr, uint16_t new_port)
+{
+    uint16_t *ttl_proto = (uint16_t *)&fr->ip->_ttl;
+    uint16_t old_ttl_proto = *ttl_proto;
+    uint32_t acc = inet_csum_replace32(0, addr->addr, new_addr);
+
+    // L4 checksum covers the pseudo header address and the port, 0 means none for UDP
+    if (fr->proto == IP_PROTO_TCP || *fr->csum != 0)
+    {
+        inet_csum_apply(fr->csum, inet_csum_replace16(acc, *port, new_port));
+        if (fr->proto == IP_PROTO_UDP && *fr->csum == 0)
+            *fr->csum = 0xffff;
+    }
+
+    IPH_TTL_SET(fr->ip, IPH_TTL(fr->ip) - 1);
+    inet_csum_apply(&fr->ip->_chksum, inet_csum_replace16(acc, old_ttl_proto, *ttl_proto));
+
+    addr->addr = new_addr;
+    *port = new_port;
+}
+
+struct netif * ICACHE_FLASH_ATTR fastpath_out(struct pbuf *p, struct netif *inp, uint32_t now)
+{
+    fp_frame_t fr;
+    fp_entry_t *e;
+
+    fp_pending.proto = 0;
+    if (!fp_parse(p, &fr) || IPH_TTL(fr.ip) <= 1)
+        return NULL;
+
+    e = &fp_cache[fp_hash(fr.proto, fr.ip->src.addr, fr.ports[0], fr.ip->dest.addr, fr.ports[1])];
+    if (e->proto != fr.proto || e->client_ip != fr.ip->src.addr || e->client_port != fr.ports[0] ||
+        e->remote_ip != fr.ip->dest.addr || e->remote_port != fr.ports[1] || now - e->learned >= FASTPATH_REFRESH_MS)
+    {
+        // Slow path, learn the mapping when the frame leaves the STA netif
+        fp_pending.proto = fr.proto;
+        fp_pending.client_ip = fr.ip->src.addr;
+        fp_pending.client_port = fr.ports[0];
+        fp_pending.remote_ip = fr.ip->dest.addr;
+        fp_pending.remote_port = fr.ports[1];
+        os_memcpy(fp_pending.client_mac, &fr.eth->src, 6);
+        fp_pending.ap_netif = inp;
+        fastpath_stats.misses++;
+        return NULL;
+    }
+
+    os_memcpy(&fr.eth->dest, e->gw_mac, 6);
+    os_memcpy(&fr.eth->src, e->sta_netif->hwaddr, 6);
+    fp_rewrite(&fr, &fr.ip->src, &fr.ports[0], e->nat_ip, e->nat_port);
+    fastpath_stats.hits_out++;
+    return e->sta_netif;
+}
+
+void ICACHE_FLASH_ATTR fastpath_learn(struct pbuf *p, struct netif *outp, uint32_t now)
+{
+    fp_frame_t fr;
+    fp_entry_t *e;
+    uint8_t ref, in;
+
+    if (fp_pending.proto == 0)
+        return;
+    if (!fp_parse(p, &fr) || fr.proto != fp_pending.proto ||
+        fr.ip->dest.addr != fp_pending.remote_ip || fr.ports[1] != fp_pending.remote_port ||
+        fr.ip->src.addr != outp->ip_addr.addr)
+        return;
+
+    ref = fp_hash(fp_pending.proto, fp_pending.client_ip, fp_pending.client_port,
+                  fp_pending.remote_ip, fp_pending.remote_port);
+    e = &fp_cache[ref];
+    *e = fp_pending;
+    e->nat_ip = fr.ip->src.addr;
+    e->nat_port = fr.ports[0];
+    os_memcpy(e->gw_mac, &fr.eth->dest, 6);
+    e->sta_netif = outp;
+    e->learned = now;
+
+    in = fp_hash(e->proto, e->remote_ip, e->remote_port, e->nat_ip, e->nat_port);
+    fp_in_index[in] = ref + 1;
+
+    fp_pending.proto = 0;
+    fastpath_stats.learned++;
+}
+
+void ICACHE_FLASH_ATTR fastpath_learn_done(void)
+{
+    fp_pending.proto = 0;
+}
+
+struct netif * ICACHE_FLASH_ATTR fastpath_in(struct pbuf *p, uint32_t now)
+{
+    fp_frame_t fr;
+    fp_entry_t *e;
+    uint8_t ref;
+
+    if (!fp_parse(p, &fr) || IPH_TTL(fr.ip) <= 1)
+        return NULL;
+
+    ref = fp_in_index[fp_hash(fr.proto, fr.ip->src.addr, fr.ports[0], fr.ip->dest.addr, fr.ports[1])];
+    if (ref == 0)
+        return NULL;
+
+    e = &fp_cache[ref - 1];
+    if (e->proto != fr.proto || e->remote_ip != fr.ip->src.addr || e->remote_port != fr.ports[0] ||
+        e->nat_ip != fr.ip->dest.addr || e->nat_port != fr.ports[1] || now - e->learned >= FASTPATH_REFRESH_MS)
+        return NULL;
+
+    os_memcpy(&fr.eth->dest, e->client_mac, 6);
+    os_memcpy(&fr.eth->src, e->ap_netif->hwaddr, 6);
+    fp_rewrite(&fr, &fr.ip->dest, &fr.ports[1], e->client_ip, e->client_port);
+    fastpath_stats.hits_in++;
+    return e->ap_netif;
+}
+
+#endif /* FASTPATH */
@@ -0,0 +1,53 @@
+#ifndef _FASTPATH_H_
+#define _FASTPATH_H_
+
+#include "c_types.h"
+#include "lwip/pbuf.h"
+#include "lwip/netif.h"
+
+//
+// Forwarding cache for NATed TCP/UDP flows between the SoftAP and the STA
+//
+// The NAPT of the prebuilt lwIP picks the mapped port of a flow. The
+// cache learns it by pairing a frame from a SoftAP client with the
+// rewritten frame that leaves the STA interface in the same call chain.
+// Later frames of the flow are rewritten in place (MACs, address, port,
+// TTL, incrementally updated checksums) and passed straight to the other
+// interface without ip_input, route lookup and NAPT.
+//
+// An entry is used for FASTPATH_REFRESH_MS only. After that it is dropped
+// and the next frame takes the slow path, which keeps the NAPT entry of
+// the flow alive and relearns the mapping. TCP SYN/FIN/RST, fragments,
+// expiring TTLs and anything else unusual always take the slow path.
+//
+
+#define FASTPATH_REFRESH_MS 1000    // below the shortest NAPT timeout (UDP, 2 s)
+
+typedef struct {
+        uint32_t hits_out;      // frames forwarded SoftAP -> STA
+        uint32_t hits_in;       // frames forwarded STA -> SoftAP
+        uint32_t learned;
+        uint32_t misses;
+} fastpath_stats_t;
+
+extern fastpath_stats_t fastpath_stats;
+
+void fastpath_flush(void);
+
+// Frame from a SoftAP client. If the flow is cached, rewrites it and returns
+// the STA netif to send it on, else remembers it for learning and returns NULL.
+struct netif *fastpath_out(struct pbuf *p, struct netif *inp, uint32_t now);
+
+// Frame leaving the STA netif, learns the mapping of the remembered frame
+void fastpath_learn(struct pbuf *p, struct netif *outp, uint32_t now);
+
+// The remembered frame has been through the slow path, forgets it so that
+// a later frame leaving the STA netif (a reply of the router itself, a
+// frame of another flow) is not paired with it
+void fastpath_learn_done(void);
+
+// Frame from the uplink. If the flow is cached, rewrites it and returns
+// the SoftAP netif to send it on, else NULL.
+struct netif *fastpath_in(struct pbuf *p, uint32_t now);
+
+#endif
@@ -0,0 +1,232 @@
+#include "c_types.h"
+#include "osapi.h"
+
+#include "http_req.h"
+
+void ICACHE_FLASH_ATTR http_req_init(http_req_t *req, http_param_cb param_cb, void *arg)
+{
+    os_memset(req, 0, sizeof(http_req_t));
+    req->state = HTTP_REQ_METHOD;
+    req->param_cb = param_cb;
+    req->arg = arg;
+}
+
+static int ICACHE_FLASH_ATTR hex_val(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+// Appends c to buf, silently truncating at size - 1
+static void ICACHE_FLASH_ATTR append(char *buf, uint8_t size, uint8_t *len, char c)
+{
+    if (*len < size - 1)
+        buf[(*len)++] = c;
+    buf[*len] = 0;
+}
+
+// URL decodes c into the current key or value, false on a bad %XX. A
+// %00 is refused, it would silently cut a password or SSID short.
+static bool ICACHE_FLASH_ATTR decode(http_req_t *req, char c)
+{
+    char *buf = req->state == HTTP_REQ_KEY ? req->key : req->val;
+    uint8_t size = req->state == HTTP_REQ_KEY ? HTTP_MAX_KEY : HTTP_MAX_VAL;
+    int d;
+
+    if (req->pct != 0)
+    {
+        if ((d = hex_val(c)) < 0)
+            return false;
+        req->pct_val = (req->pct_val << 4) | d;
+        if (++req->pct == 3)
+        {
+            if (req->pct_val == 0)
+                return false;
+            req->pct = 0;
+            append(buf, size, &req->len, req->pct_val);
+        }
+        return true;
+    }
+
+    if (c == '%')
+    {
+        req->pct = 1;
+        req->pct_val = 0;
+    }
+    else
+    {
+        append(buf, size, &req->len, c == '+' ? ' ' : c);
+    }
+    return true;
+}
+
+static void ICACHE_FLASH_ATTR param_done(http_req_t *req)
+{
+    if (req->state == HTTP_REQ_KEY)
+    {
+        req->key_len = req->len;
+        req->val[0] = 0;
+    }
+    if (req->key_len != 0 && req->param_cb != NULL)
+        req->param_cb(req->arg, req->key, req->val);
+    req->key[0] = req->val[0] = 0;
+    req->len = req->key_len = 0;
+}
+
+uint16_t ICACHE_FLASH_ATTR http_req_feed(http_req_t *req, const char *data, uint16_t len)
+{
+    uint16_t i;
+
+    for (i = 0; i < len; i++)
+    {
+        char c = data[i];
+
+        switch (req->state)
+        {
+        case HTTP_REQ_METHOD:
+            if (c == ' ')
+            {
+                req->len = 0;
+                req->state = HTTP_REQ_PATH;
+            }
+            else if (c == '\r' || c == '\n')
+            {
+                // tolerate empty lines between pipelined requests
+                if (req->len != 0)
+                    req->state = HTTP_REQ_ERROR;
+            }
+            else if (req->len < HTTP_MAX_METHOD - 1)
+            {
+                append(req->method, HTTP_MAX_METHOD, &req->len, c);
+            }
+            else
+            {
+                req->state = HTTP_REQ_ERROR;
+            }
+            break;
+
+        case HTTP_REQ_PATH:
+            if (c == '?' || c == ' ')
+            {
+                req->len = 0;
+                req->state = c == '?' ? HTTP_REQ_KEY : HTTP_REQ_VERSION;
+            }
+            else if (c == '\r' || c == '\n')
+            {
+                req->state = HTTP_REQ_ERROR;
+            }
+            else
+            {
+                append(req->path, HTTP_MAX_PATH, &req->len, c);
+            }
+            break;
+
+        case HTTP_REQ_KEY:
+        case HTTP_REQ_VAL:
+            if (c == '=' && req->state == HTTP_REQ_KEY && req->pct == 0)
+            {
+                req->key_len = req->len;
+                req->len = 0;
+                req->state = HTTP_REQ_VAL;
+            }
+            else if ((c == '&' || c == ' ') && req->pct == 0)
+            {
+                param_done(req);
+                req->state = c == '&' ? HTTP_REQ_KEY : HTTP_REQ_VERSION;
+            }
+            else if (c == '\r' || c == '\n' || !decode(req, c))
+            {
+                req->state = HTTP_REQ_ERROR;
+            }
+            break;
+
+        case HTTP_REQ_VERSION:
+            // "HTTP/1.x\r\n", only the minor version is of interest
+            if (c == '\n')
+            {
+                req->keep_alive = req->http_minor >= 1;
+                req->state = HTTP_REQ_HDR_START;
+            }
+            else if (c >= '0' && c <= '9')
+            {
+                req->http_minor = c - '0';
+            }
+            break;
+
+        case HTTP_REQ_HDR_START:
+            req->len = 0;
+            req->hdr[0] = 0;
+            req->hdr_is_conn = 0;
+            if (c == '\r')
+            {
+                req->state = HTTP_REQ_HDR_END;
+                break;
+            }
+            if (c == '\n')
+            {
+                req->state = HTTP_REQ_DONE;
+                return i + 1;
+            }
+            req->state = HTTP_REQ_HDR_NAME;
+            // fall through
+
+        case HTTP_REQ_HDR_NAME:
+            if (c == ':')
+            {
+                req->hdr_is_conn = os_strcmp(req->hdr, "connection") == 0;
+                req->len = 0;
+                req->val[0] = 0;
+                req->state = HTTP_REQ_HDR_VAL;
+            }
+            else if (c == '\n')
+            {
+                req->state = HTTP_REQ_HDR_START;
+            }
+            else
+            {
+                append(req->hdr, HTTP_MAX_HDR, &req->len, c >= 'A' && c <= 'Z' ? c + 'a' - 'A' : c);
+            }
+            break;
+
+        case HTTP_REQ_HDR_VAL:
+            if (c == '\n')
+            {
+                if (req->hdr_is_conn)
+                {
+                    if (os_strstr(req->val, "close") != NULL)
+                        req->keep_alive = 0;
+                    else if (os_strstr(req->val, "keep-alive") != NULL)
+                        req->keep_alive = 1;
+                }
+                req->val[0] = 0;
+                req->state = HTTP_REQ_HDR_START;
+            }
+            else if (req->hdr_is_conn && c != ' ' && c != '\r')
+            {
+                append(req->val, HTTP_MAX_VAL, &req->len, c >= 'A' && c <= 'Z' ? c + 'a' - 'A' : c);
+            }
+            break;
+
+        case HTTP_REQ_HDR_END:
+            if (c != '\n')
+            {
+                req->state = HTTP_REQ_ERROR;
+                return i;
+            }
+            req->state = HTTP_REQ_DONE;
+            return i + 1;
+
+        case HTTP_REQ_DONE:
+            return i;
+
+        case HTTP_REQ_ERROR:
+            return i;
+        }
+    }
+    return i;
+}
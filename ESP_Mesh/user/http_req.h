@@ -0,0 +1,56 @@
+#ifndef _HTTP_REQ_H_
+#define _HTTP_REQ_H_
+
+#include "c_types.h"
+
+//
+// Incremental HTTP/1.x request parser
+//
+// Consumes the request line and headers of a request in any number of
+// segments. Query parameters are URL decoded (%XX and '+') on the fly
+// and handed to a callback one by one. The body is not parsed, the
+// config pages only use GET.
+//
+
+#define HTTP_MAX_METHOD 8
+#define HTTP_MAX_PATH   32
+#define HTTP_MAX_KEY    16
+#define HTTP_MAX_VAL    80
+#define HTTP_MAX_HDR    12  // only short header names are of interest
+
+typedef enum {
+        HTTP_REQ_METHOD = 0, HTTP_REQ_PATH, HTTP_REQ_KEY, HTTP_REQ_VAL, HTTP_REQ_VERSION,
+        HTTP_REQ_HDR_START, HTTP_REQ_HDR_NAME, HTTP_REQ_HDR_VAL, HTTP_REQ_HDR_END,
+        HTTP_REQ_DONE, HTTP_REQ_ERROR
+} http_req_state;
+
+// Called for each query parameter, val is "" for a key without '='
+typedef void (*http_param_cb)(void *arg, char *key, char *val);
+
+typedef struct {
+        http_req_state state;
+        uint8_t pct;            // 0, or 1/2 while reading the digits of a %XX
+        uint8_t pct_val;
+        uint8_t http_minor;     // 0 for HTTP/1.0, 1 for HTTP/1.1
+        uint8_t keep_alive;     // the client wants the connection kept open
+        uint8_t hdr_is_conn;    // current header is "Connection"
+        uint8_t len;            // length of the token being collected
+        uint8_t key_len;
+        char method[HTTP_MAX_METHOD];
+        char path[HTTP_MAX_PATH];
+        char key[HTTP_MAX_KEY];
+        char val[HTTP_MAX_VAL];
+        char hdr[HTTP_MAX_HDR];
+        http_param_cb param_cb;
+        void *arg;
+} http_req_t;
+
+// (Re-)initializes the parser for a new request
+void http_req_init(http_req_t *req, http_param_cb param_cb, void *arg);
+
+// Feeds len bytes. Returns the number of bytes consumed, which is less than
+// len if the request ended (state HTTP_REQ_DONE) inside the data - the rest
+// belongs to the next (pipelined) request. Stops on HTTP_REQ_ERROR.
+uint16_t http_req_feed(http_req_t *req, const char *data, uint16_t len);
+
+#endif
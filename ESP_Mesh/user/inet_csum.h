@@ -0,0 +1,80 @@
+#ifndef _INET_CSUM_H_
+#define _INET_CSUM_H_
+
+#include "c_types.h"
+
+//
+// Incremental Internet checksum updates (RFC 1624, eqn. 3)
+//
+//      HC' = ~(~HC + ~m + m')
+//
+// Start with acc = 0, add every replaced field with inet_csum_replace16/32()
+// and fold the result into each checksum that covers these fields with
+// inet_csum_apply(). Values are taken as they are in the packet (network
+// byte order), the one's complement sum does not depend on the byte order.
+//
+// The default implementation keeps a 32 bit one's complement accumulator
+// and replaces addresses a word at a time with an end around carry, so a
+// rewrite costs a few adds and a single fold - the LX106 has no carry
+// flag and no 16 bit arithmetic, this avoids splitting words into halves.
+// Define INET_CSUM_REFERENCE to 1 for the straightforward 16 bit version.
+//
+
+#ifndef INET_CSUM_REFERENCE
+#define INET_CSUM_REFERENCE 0
+#endif
+
+#if INET_CSUM_REFERENCE
+
+static inline uint32_t inet_csum_replace16(uint32_t acc, uint16_t from, uint16_t to)
+{
+    return acc + (uint16_t)~from + to;
+}
+
+static inline uint32_t inet_csum_replace32(uint32_t acc, uint32_t from, uint32_t to)
+{
+    acc = inet_csum_replace16(acc, from >> 16, to >> 16);
+    return inet_csum_replace16(acc, from & 0xffff, to & 0xffff);
+}
+
+static inline uint16_t inet_csum_fold(uint32_t acc)
+{
+    while (acc >> 16)
+        acc = (acc & 0xffff) + (acc >> 16);
+    return acc;
+}
+
+#else
+
+// One's complement 32 bit add
+static inline uint32_t inet_csum_add32(uint32_t acc, uint32_t x)
+{
+    acc += x;
+    return acc + (acc < x);
+}
+
+static inline uint32_t inet_csum_replace16(uint32_t acc, uint16_t from, uint16_t to)
+{
+    return inet_csum_add32(acc, (uint16_t)~from + (uint32_t)to);
+}
+
+static inline uint32_t inet_csum_replace32(uint32_t acc, uint32_t from, uint32_t to)
+{
+    return inet_csum_add32(inet_csum_add32(acc, ~from), to);
+}
+
+static inline uint16_t inet_csum_fold(uint32_t acc)
+{
+    acc = (acc & 0xffff) + (acc >> 16);
+    return acc + (acc >> 16);
+}
+
+#endif
+
+// Applies the accumulated replacements to a checksum field
+static inline void inet_csum_apply(uint16_t *csum, uint32_t acc)
+{
+    *csum = ~inet_csum_fold(inet_csum_replace16(acc, *csum, 0));
+}
+
+#endif
@@ -0,0 +1,169 @@
+#include "c_types.h"
+#include "osapi.h"
+
+#include "json_writer.h"
+
+static const char hex[] = "0123456789abcdef";
+
+static void ICACHE_FLASH_ATTR put(json_writer_t *w, char c)
+{
+    // Keep one byte for the terminating 0
+    if (w->len + 1 < w->size)
+        w->buf[w->len] = c;
+    w->len++;
+}
+
+static void ICACHE_FLASH_ATTR put_str(json_writer_t *w, const char *s)
+{
+    while (*s != 0)
+        put(w, *s++);
+}
+
+static void ICACHE_FLASH_ATTR put_quoted(json_writer_t *w, const char *s)
+{
+    uint8_t c;
+
+    put(w, '"');
+    while ((c = *s++) != 0)
+    {
+        if (c == '"' || c == '\\')
+        {
+            put(w, '\\');
+            put(w, c);
+        }
+        else if (c < 0x20)
+        {
+            put_str(w, "\\u00");
+            put(w, hex[c >> 4]);
+            put(w, hex[c & 0xf]);
+        }
+        else
+        {
+            put(w, c);
+        }
+    }
+    put(w, '"');
+}
+
+// Separator and key of the next member
+static void ICACHE_FLASH_ATTR member(json_writer_t *w, const char *key)
+{
+    if (w->first & (1 << w->depth))
+        w->first &= ~(1 << w->depth);
+    else
+        put(w, ',');
+
+    if (key != NULL)
+    {
+        put_quoted(w, key);
+        put(w, ':');
+    }
+}
+
+void ICACHE_FLASH_ATTR json_init(json_writer_t *w, char *buf, uint16_t size)
+{
+    w->buf = buf;
+    w->size = buf != NULL ? size : 0;
+    w->len = 0;
+    w->depth = 0;
+    w->first = 1;
+}
+
+void ICACHE_FLASH_ATTR json_object_begin(json_writer_t *w, const char *key)
+{
+    member(w, key);
+    put(w, '{');
+    if (w->depth < 7)
+        w->depth++;
+    w->first |= 1 << w->depth;
+}
+
+void ICACHE_FLASH_ATTR json_object_end(json_writer_t *w)
+{
+    put(w, '}');
+    if (w->depth > 0)
+        w->depth--;
+}
+
+void ICACHE_FLASH_ATTR json_array_begin(json_writer_t *w, const char *key)
+{
+    member(w, key);
+    put(w, '[');
+    if (w->depth < 7)
+        w->depth++;
+    w->first |= 1 << w->depth;
+}
+
+void ICACHE_FLASH_ATTR json_array_end(json_writer_t *w)
+{
+    put(w, ']');
+    if (w->depth > 0)
+        w->depth--;
+}
+
+static void ICACHE_FLASH_ATTR put_uint(json_writer_t *w, uint64_t val)
+{
+    char digits[20];
+    int n = 0;
+
+    // os_sprintf() has no 64 bit conversion
+    do
+    {
+        digits[n++] = '0' + val % 10;
+        val /= 10;
+    } while (val != 0);
+
+    while (n > 0)
+        put(w, digits[--n]);
+}
+
+void ICACHE_FLASH_ATTR json_uint(json_writer_t *w, const char *key, uint64_t val)
+{
+    member(w, key);
+    put_uint(w, val);
+}
+
+void ICACHE_FLASH_ATTR json_int(json_writer_t *w, const char *key, int32_t val)
+{
+    member(w, key);
+    if (val < 0)
+    {
+        put(w, '-');
+        put_uint(w, -(int64_t)val);
+    }
+    else
+    {
+        put_uint(w, val);
+    }
+}
+
+void ICACHE_FLASH_ATTR json_string(json_writer_t *w, const char *key, const char *val)
+{
+    member(w, key);
+    put_quoted(w, val);
+}
+
+void ICACHE_FLASH_ATTR json_mac(json_writer_t *w, const char *key, const uint8_t *mac)
+{
+    int i;
+
+    member(w, key);
+    put(w, '"');
+    for (i = 0; i < 6; i++)
+    {
+        if (i > 0)
+            put(w, ':');
+        put(w, hex[mac[i] >> 4]);
+        put(w, hex[mac[i] & 0xf]);
+    }
+    put(w, '"');
+}
+
+bool ICACHE_FLASH_ATTR json_finish(json_writer_t *w)
+{
+    if (w->size == 0)
+        return false;
+
+    w->buf[w->len < w->size ? w->len : w->size - 1] = 0;
+    return w->len < w->size;
+}
@@ -0,0 +1,41 @@
+#ifndef _JSON_WRITER_H_
+#define _JSON_WRITER_H_
+
+#include "c_types.h"
+
+//
+// Allocation free JSON writer
+//
+// Writes into a caller supplied buffer and never allocates. The length
+// of the complete output is counted even if it does not fit, so a
+// writer without a buffer (NULL, 0) can be used to measure the output
+// before writing it, e.g. for a Content-Length header.
+//
+
+typedef struct {
+        char *buf;
+        uint16_t size;
+        uint16_t len;           // length of the complete output
+        uint8_t depth;
+        uint8_t first;          // bit n: nothing written yet at nesting level n
+} json_writer_t;
+
+void json_init(json_writer_t *w, char *buf, uint16_t size);
+
+// Opens/closes an object, key is NULL for the top level object
+void json_object_begin(json_writer_t *w, const char *key);
+void json_object_end(json_writer_t *w);
+
+// Opens/closes an array, its members are written with key NULL
+void json_array_begin(json_writer_t *w, const char *key);
+void json_array_end(json_writer_t *w);
+
+void json_uint(json_writer_t *w, const char *key, uint64_t val);
+void json_int(json_writer_t *w, const char *key, int32_t val);
+void json_string(json_writer_t *w, const char *key, const char *val);
+void json_mac(json_writer_t *w, const char *key, const uint8_t *mac);
+
+// 0-terminates the buffer (truncating if needed), returns true if all of it fit
+bool json_finish(json_writer_t *w);
+
+#endif
@@ -0,0 +1,118 @@
+#include "c_types.h"
+#include "osapi.h"
+
+#include "user_config.h"
+#include "mesh_ie.h"
+
+#if MESH_IE
+
+uint8_t ICACHE_FLASH_ATTR mesh_ie_encode(const mesh_ie_t *ie, uint8_t *buf)
+{
+    buf[0] = MESH_IE_TYPE;
+    buf[1] = MESH_IE_VERSION;
+    buf[2] = ie->level;
+    buf[3] = ie->load;
+    buf[4] = ie->napt_free;
+    buf[5] = (uint8_t)ie->uplink_rssi;
+    buf[6] = ie->firmware[0];
+    buf[7] = ie->firmware[1];
+    buf[8] = ie->firmware[2];
+    return MESH_IE_LEN;
+}
+
+bool ICACHE_FLASH_ATTR mesh_ie_decode(const uint8_t *ie, uint8_t len, mesh_ie_t *out)
+{
+    // Skip the element header, if the SDK left it in. The element length
+    // comes from the air, it must cover the OUI and our payload.
+    if (len >= 5 && ie[0] == MESH_IE_ELEMENT_ID &&
+        ie[2] == MESH_IE_OUI0 && ie[3] == MESH_IE_OUI1 && ie[4] == MESH_IE_OUI2)
+    {
+        if (ie[1] < 3 + MESH_IE_LEN)
+            return false;
+        if (ie[1] - 3 < len - 5)
+            len = ie[1] - 3;
+        else
+            len -= 5;
+        ie += 5;
+    }
+
+    if (len < MESH_IE_LEN || ie[0] != MESH_IE_TYPE || ie[1] < MESH_IE_VERSION)
+        return false;
+
+    out->level = ie[2];
+    out->load = ie[3];
+    out->napt_free = ie[4];
+    out->uplink_rssi = (int8_t)ie[5];
+    out->firmware[0] = ie[6];
+    out->firmware[1] = ie[7];
+    out->firmware[2] = ie[8];
+    return true;
+}
+
+void ICACHE_FLASH_ATTR mesh_ie_version(const char *s, uint8_t *firmware)
+{
+    int i;
+
+    os_memset(firmware, 0, 3);
+    for (i = 0; i < 3 && *s != '\0'; i++)
+    {
+        while (*s != '\0' && (*s < '0' || *s > '9'))
+            s++;
+        while (*s >= '0' && *s <= '9')
+            firmware[i] = firmware[i] * 10 + *s++ - '0';
+    }
+}
+
+void ICACHE_FLASH_ATTR mesh_ie_cache_init(mesh_ie_cache_t *c)
+{
+    os_memset(c, 0, sizeof(mesh_ie_cache_t));
+}
+
+bool ICACHE_FLASH_ATTR mesh_ie_cache_input(mesh_ie_cache_t *c, const uint8_t *sa, const uint8_t *ie, uint8_t len, uint32_t now)
+{
+    mesh_ie_t decoded;
+    mesh_ie_entry_t *e, *slot = NULL;
+    int i;
+
+    if (!mesh_ie_decode(ie, len, &decoded))
+    {
+        c->errors++;
+        return false;
+    }
+    c->received++;
+
+    // The entry of sa, else a free one, else the oldest
+    for (i = 0; i < MESH_IE_CACHE; i++)
+    {
+        e = &c->entry[i];
+        if (e->used && os_memcmp(e->sa, sa, 6) == 0)
+        {
+            slot = e;
+            break;
+        }
+        if (slot == NULL || (slot->used && (!e->used || (int32_t)(e->seen - slot->seen) < 0)))
+            slot = e;
+    }
+
+    os_memcpy(slot->sa, sa, 6);
+    slot->used = 1;
+    slot->seen = now;
+    slot->ie = decoded;
+    return true;
+}
+
+const mesh_ie_t * ICACHE_FLASH_ATTR mesh_ie_cache_get(const mesh_ie_cache_t *c, const uint8_t *sa, uint32_t now)
+{
+    const mesh_ie_entry_t *e;
+    int i;
+
+    for (i = 0; i < MESH_IE_CACHE; i++)
+    {
+        e = &c->entry[i];
+        if (e->used && os_memcmp(e->sa, sa, 6) == 0)
+            return now - e->seen < MESH_IE_MAX_AGE ? &e->ie : NULL;
+    }
+    return NULL;
+}
+
+#endif /* MESH_IE */
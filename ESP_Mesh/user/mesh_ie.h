@@ -0,0 +1,77 @@
+#ifndef _MESH_IE_H_
+#define _MESH_IE_H_
+
+#include "c_types.h"
+#include "user_config.h"
+
+//
+// Mesh metadata in beacons
+//
+// Every automesh node adds a vendor specific IE to its beacons and probe
+// responses with its level, its load and the state of its uplink, so a
+// node looking for an uplink learns more than the BSSID can encode and
+// needs no extra traffic for it. The SDK hands the vendor IEs of received
+// frames to a callback, not to the scan results, so they are kept per
+// BSSID in a small cache and looked up when a scan completes.
+//
+// Nodes with the IE keep the MAC of their SoftAP when their level
+// changes. Nodes without it (older firmware) are still ranked by the
+// level in their 24:24:<level> BSSID.
+//
+// Payload after the OUI:
+//   0  type(1) version(1) level(1) load(1)
+//   4  napt_free(1) uplink_rssi(1, dBm) firmware(3, major.minor.patch)
+// Newer versions may append fields, a decoder reads what it knows.
+//
+
+#define MESH_IE_OUI0            0x18    // Espressif OUI
+#define MESH_IE_OUI1            0xfe
+#define MESH_IE_OUI2            0x34
+#define MESH_IE_TYPE            0x24
+#define MESH_IE_VERSION         1
+#define MESH_IE_LEN             9
+
+#define MESH_IE_ELEMENT_ID      221     // vendor specific
+#define MESH_IE_MAX_AGE         60000   // ms a cached IE is trusted
+#define MESH_IE_REFRESH         10000   // ms between updates of our own IE
+#define MESH_IE_UNKNOWN         0xff
+
+typedef struct {
+        uint8_t level;          // of the node's AP, as in the BSSID
+        uint8_t load;           // stations on the AP
+        uint8_t napt_free;      // free NAPT flows, MESH_IE_UNKNOWN if not tracked
+        int8_t uplink_rssi;     // dBm, 0 if not connected
+        uint8_t firmware[3];
+} mesh_ie_t;
+
+typedef struct {
+        uint8_t sa[6];
+        uint8_t used;
+        uint32_t seen;
+        mesh_ie_t ie;
+} mesh_ie_entry_t;
+
+typedef struct {
+        mesh_ie_entry_t entry[MESH_IE_CACHE];
+        uint32_t received;
+        uint32_t errors;        // IEs with our OUI that did not decode
+} mesh_ie_cache_t;
+
+// Returns the length written to buf (MESH_IE_LEN)
+uint8_t mesh_ie_encode(const mesh_ie_t *ie, uint8_t *buf);
+
+// ie may start with the element header (221, len, OUI) or with the payload
+bool mesh_ie_decode(const uint8_t *ie, uint8_t len, mesh_ie_t *out);
+
+// "V2.2.14" -> {2, 2, 14}
+void mesh_ie_version(const char *s, uint8_t *firmware);
+
+void mesh_ie_cache_init(mesh_ie_cache_t *c);
+
+// Decodes and stores the IE of sa, returns false if it is not ours
+bool mesh_ie_cache_input(mesh_ie_cache_t *c, const uint8_t *sa, const uint8_t *ie, uint8_t len, uint32_t now);
+
+// The IE of sa, NULL if none was received within MESH_IE_MAX_AGE
+const mesh_ie_t *mesh_ie_cache_get(const mesh_ie_cache_t *c, const uint8_t *sa, uint32_t now);
+
+#endif
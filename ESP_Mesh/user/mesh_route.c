@@ -0,0 +1,432 @@
+#include "c_types.h"
+#include "osapi.h"
+#include "lwip/def.h"
+
+#include "user_config.h"
+#include "mesh_route.h"
+
+#if MESH_ROUTING
+
+#define LATER(a, b) ((int32_t)((a) - (b)) > 0)
+
+static uint32_t ICACHE_FLASH_ATTR prefix_mask(uint8_t len)
+{
+    return len == 0 ? 0 : htonl(0xffffffff << (32 - len));
+}
+
+// True if one prefix contains the other
+static bool ICACHE_FLASH_ATTR prefix_overlap(uint32_t a, uint8_t alen, uint32_t b, uint8_t blen)
+{
+    return ((a ^ b) & prefix_mask(alen < blen ? alen : blen)) == 0;
+}
+
+static void ICACHE_FLASH_ATTR learned_drop(mesh_route_t *m, mesh_learned_t *l)
+{
+    m->ops->withdraw(m->ctx, l->net, l->len, l->gw);
+    l->gw = 0;
+    m->triggered = true;
+}
+
+static void ICACHE_FLASH_ATTR learned_drop_gw(mesh_route_t *m, uint32_t gw)
+{
+    int i;
+
+    for (i = 0; i < MESH_ROUTE_LEARNED; i++)
+    {
+        if (m->learned[i].gw == gw)
+            learned_drop(m, &m->learned[i]);
+    }
+}
+
+static mesh_learned_t * ICACHE_FLASH_ATTR learned_find(mesh_route_t *m, uint32_t net, uint8_t len)
+{
+    int i;
+
+    for (i = 0; i < MESH_ROUTE_LEARNED; i++)
+    {
+        mesh_learned_t *l = &m->learned[i];
+
+        if (l->gw != 0 && l->net == net && l->len == len)
+            return l;
+    }
+    return NULL;
+}
+
+static void ICACHE_FLASH_ATTR set_routed(mesh_route_t *m, bool routed)
+{
+    if (m->routed == routed)
+        return;
+    m->routed = routed;
+    m->ops->set_nat(m->ctx, !routed);
+}
+
+static void ICACHE_FLASH_ATTR put_header(uint8_t *msg, uint8_t type, uint16_t seq, uint8_t count)
+{
+    msg[0] = 'M';
+    msg[1] = 'R';
+    msg[2] = MESH_ROUTE_VERSION;
+    msg[3] = type;
+    msg[4] = seq >> 8;
+    msg[5] = seq & 0xff;
+    msg[6] = count;
+    msg[7] = MESH_ROUTE_HOLD;
+}
+
+static uint8_t * ICACHE_FLASH_ATTR put_entry(uint8_t *p, uint32_t net, uint8_t len, uint8_t metric)
+{
+    os_memcpy(p, &net, 4);
+    p[4] = len;
+    p[5] = metric;
+    return p + MESH_ROUTE_ENTRY_LEN;
+}
+
+static void ICACHE_FLASH_ATTR send_advert(mesh_route_t *m, uint32_t now)
+{
+    uint8_t msg[MESH_ROUTE_MAX_LEN];
+    uint8_t *p = msg + MESH_ROUTE_HDR_LEN + MESH_ROUTE_BSSID_LEN;
+    uint8_t count = 0;
+    bool complete = true;
+    int i;
+
+    os_memcpy(msg + MESH_ROUTE_HDR_LEN, m->bssid, MESH_ROUTE_BSSID_LEN);
+    if (m->local_len != 0)
+    {
+        p = put_entry(p, m->local_net, m->local_len, 0);
+        count++;
+    }
+    for (i = 0; i < MESH_ROUTE_LEARNED; i++)
+    {
+        mesh_learned_t *l = &m->learned[i];
+
+        if (l->gw == 0)
+            continue;
+        if (l->metric >= MESH_ROUTE_MAX_METRIC || count == MESH_ROUTE_MAX_PREFIXES)
+        {
+            complete = false;
+            continue;
+        }
+        p = put_entry(p, l->net, l->len, l->metric + 1);
+        count++;
+    }
+
+    // Traffic from the missing networks must still be NATed here, the
+    // uplink has no route back to them
+    if (!complete)
+        set_routed(m, false);
+    m->complete = complete;
+
+    m->seq++;
+    put_header(msg, MESH_ROUTE_ADVERT, m->seq, count);
+    m->ops->send(m->ctx, m->uplink, msg, p - msg);
+
+    m->adverts_sent++;
+    m->triggered = false;
+    m->last_advert = now;
+    m->next_advert = now + MESH_ROUTE_INTERVAL;
+}
+
+static void ICACHE_FLASH_ATTR send_ack(mesh_route_t *m, uint32_t dst, uint16_t seq, uint8_t status,
+                                       uint32_t net, uint8_t len)
+{
+    uint8_t msg[MESH_ROUTE_HDR_LEN + MESH_ROUTE_ENTRY_LEN];
+
+    put_header(msg, MESH_ROUTE_ACK, seq, status);
+    if (status == MESH_ROUTE_CONFLICT)
+    {
+        put_entry(msg + MESH_ROUTE_HDR_LEN, net, len, 0);
+        m->ops->send(m->ctx, dst, msg, sizeof(msg));
+    }
+    else
+    {
+        m->ops->send(m->ctx, dst, msg, MESH_ROUTE_HDR_LEN);
+    }
+}
+
+// Checks an advert before anything is installed: only mesh networks no
+// shorter than ours and enough free slots. A prefix of another child or
+// of our own network is a conflict, *net and *len tell which one.
+static uint8_t ICACHE_FLASH_ATTR advert_check(mesh_route_t *m, uint32_t src, const uint8_t *p, uint8_t count,
+                                              uint32_t *net, uint8_t *len)
+{
+    uint16_t avail = 0;
+    int i;
+
+    for (i = 0; i < MESH_ROUTE_LEARNED; i++)
+    {
+        if (m->learned[i].gw == 0 || m->learned[i].gw == src)
+            avail++;
+    }
+    if (count > avail)
+        return MESH_ROUTE_REJECTED;
+
+    for (i = 0; i < count; i++, p += MESH_ROUTE_ENTRY_LEN)
+    {
+        mesh_learned_t *l;
+
+        os_memcpy(net, p, 4);
+        *len = p[4];
+        if (*len > 32 || (*net & ~prefix_mask(*len)) != 0)
+            return MESH_ROUTE_REJECTED;
+        if (*len < MESH_ROUTE_NET_LEN || *len < m->local_len ||
+            (*net & prefix_mask(MESH_ROUTE_NET_LEN)) != htonl(MESH_ROUTE_NET))
+            return MESH_ROUTE_REJECTED;
+        if (m->local_len != 0 && prefix_overlap(*net, *len, m->local_net, m->local_len))
+            return MESH_ROUTE_CONFLICT;
+        l = learned_find(m, *net, *len);
+        if (l != NULL && l->gw != src)
+            return MESH_ROUTE_CONFLICT;
+    }
+    return MESH_ROUTE_ACCEPTED;
+}
+
+static void ICACHE_FLASH_ATTR advert_input(mesh_route_t *m, uint32_t src, const uint8_t *msg, uint8_t count, uint32_t now)
+{
+    const uint8_t *bssid = msg + MESH_ROUTE_HDR_LEN;
+    const uint8_t *entries = bssid + MESH_ROUTE_BSSID_LEN;
+    const uint8_t *p;
+    uint32_t hold = (msg[7] != 0 ? msg[7] : MESH_ROUTE_HOLD) * 1000;
+    uint16_t seq = (msg[4] << 8) | msg[5];
+    uint32_t net = 0;
+    uint8_t len = 0, status;
+    int i, j;
+
+    // Not even worth a reject, anyone on the AP may send this
+    if (!m->ops->is_child(m->ctx, src, bssid))
+    {
+        m->foreign++;
+        return;
+    }
+    m->adverts_rcvd++;
+
+    status = advert_check(m, src, entries, count, &net, &len);
+    if (status != MESH_ROUTE_ACCEPTED)
+        goto reject;
+    status = MESH_ROUTE_REJECTED;
+
+    // The advert is the complete list of the sender, drop what is gone
+    for (i = 0; i < MESH_ROUTE_LEARNED; i++)
+    {
+        mesh_learned_t *l = &m->learned[i];
+
+        if (l->gw != src)
+            continue;
+        for (j = 0, p = entries; j < count; j++, p += MESH_ROUTE_ENTRY_LEN)
+        {
+            os_memcpy(&net, p, 4);
+            if (net == l->net && p[4] == l->len)
+                break;
+        }
+        if (j == count)
+            learned_drop(m, l);
+    }
+
+    for (j = 0, p = entries; j < count; j++, p += MESH_ROUTE_ENTRY_LEN)
+    {
+        mesh_learned_t *l;
+
+        os_memcpy(&net, p, 4);
+        l = learned_find(m, net, p[4]);
+        if (l == NULL)
+        {
+            for (i = 0; i < MESH_ROUTE_LEARNED && m->learned[i].gw != 0; i++)
+                ;
+            // Duplicates in the advert may have used up the slots
+            if (i == MESH_ROUTE_LEARNED)
+                goto reject;
+            // Fails on a static route or a full routing table
+            if (!m->ops->install(m->ctx, net, p[4], src))
+                goto reject;
+            l = &m->learned[i];
+            l->net = net;
+            l->len = p[4];
+            l->gw = src;
+            l->metric = p[5];
+            m->triggered = true;
+        }
+        else if (l->metric != p[5])
+        {
+            l->metric = p[5];
+            m->triggered = true;
+        }
+        l->expires = now + hold;
+        l->seq = seq;
+    }
+
+    send_ack(m, src, seq, MESH_ROUTE_ACCEPTED, 0, 0);
+    return;
+
+reject:
+    // The sender keeps its NAT, none of its networks are routed here
+    learned_drop_gw(m, src);
+    m->rejected++;
+    if (status == MESH_ROUTE_CONFLICT)
+        m->conflicts++;
+    send_ack(m, src, seq, status, net, len);
+}
+
+static void ICACHE_FLASH_ATTR conflict_input(mesh_route_t *m, const uint8_t *p, uint32_t now)
+{
+    mesh_learned_t *l;
+    uint32_t net, gw;
+
+    os_memcpy(&net, p, 4);
+    if (m->local_len != 0 && net == m->local_net && p[4] == m->local_len)
+    {
+        mesh_route_renumber(m, now);
+        return;
+    }
+
+    // Learned from a child: the conflict is further down, its routes go
+    // until the owner of the prefix has moved
+    l = learned_find(m, net, p[4]);
+    if (l == NULL)
+        return;
+    gw = l->gw;
+    send_ack(m, gw, l->seq, MESH_ROUTE_CONFLICT, net, p[4]);
+    learned_drop_gw(m, gw);
+}
+
+static void ICACHE_FLASH_ATTR ack_input(mesh_route_t *m, uint32_t src, const uint8_t *msg, uint16_t len, uint32_t now)
+{
+    uint16_t seq = (msg[4] << 8) | msg[5];
+
+    // Only the answer to the latest advert counts
+    if (src != m->uplink || seq != m->seq)
+        return;
+
+    m->last_ack = now;
+    // Round trip to the uplink, a quarter of each new sample
+    if (m->rtt == 0)
+        m->rtt = now - m->last_advert + 1;
+    else
+        m->rtt = (m->rtt * 3 + now - m->last_advert + 1) / 4;
+    set_routed(m, msg[6] == MESH_ROUTE_ACCEPTED && m->complete);
+    if (msg[6] == MESH_ROUTE_CONFLICT && len >= MESH_ROUTE_HDR_LEN + MESH_ROUTE_ENTRY_LEN)
+        conflict_input(m, msg + MESH_ROUTE_HDR_LEN, now);
+}
+
+void ICACHE_FLASH_ATTR mesh_route_init(mesh_route_t *m, const mesh_route_ops_t *ops, void *ctx, uint32_t now)
+{
+    os_memset(m, 0, sizeof(mesh_route_t));
+    m->ops = ops;
+    m->ctx = ctx;
+    m->next_advert = now;
+}
+
+uint32_t ICACHE_FLASH_ATTR mesh_route_subnet(const uint8_t *bssid, uint8_t n)
+{
+    uint32_t h = 2166136261u;
+    int i;
+
+    // FNV-1a of the BSSID and n
+    for (i = 0; i < 6; i++)
+        h = (h ^ bssid[i]) * 16777619u;
+    h = (h ^ n) * 16777619u;
+    return htonl(MESH_ROUTE_NET | ((1 + (h >> 8) % 254) << 8));
+}
+
+void ICACHE_FLASH_ATTR mesh_route_set_local(mesh_route_t *m, const uint8_t *bssid, uint32_t net, uint8_t len, uint32_t now)
+{
+    net &= prefix_mask(len);
+    if (os_memcmp(m->bssid, bssid, 6) != 0)
+    {
+        os_memcpy(m->bssid, bssid, 6);
+        m->subnet = 0;
+        m->triggered = true;
+    }
+    if (m->local_net == net && m->local_len == len)
+        return;
+    m->local_net = net;
+    m->local_len = len;
+    m->triggered = true;
+}
+
+void ICACHE_FLASH_ATTR mesh_route_renumber(mesh_route_t *m, uint32_t now)
+{
+    uint32_t net;
+    int i;
+
+    // The next candidate that is another network
+    do
+        net = mesh_route_subnet(m->bssid, ++m->subnet);
+    while (net == m->local_net);
+
+    m->local_net = net;
+    m->local_len = 24;
+    m->renumbered++;
+    m->triggered = true;
+    // Nothing behind the old network is routed upstream any more, the
+    // children lease again and their routes come back with new gateways
+    for (i = 0; i < MESH_ROUTE_LEARNED; i++)
+    {
+        if (m->learned[i].gw != 0)
+            learned_drop(m, &m->learned[i]);
+    }
+    set_routed(m, false);
+    m->ops->renumber(m->ctx, net);
+}
+
+void ICACHE_FLASH_ATTR mesh_route_set_uplink(mesh_route_t *m, uint32_t uplink, uint32_t now)
+{
+    if (m->uplink == uplink)
+        return;
+
+    // The new uplink knows nothing about us yet
+    set_routed(m, false);
+    m->uplink = uplink;
+    m->rtt = 0;
+    m->triggered = true;
+    m->next_advert = now;
+}
+
+void ICACHE_FLASH_ATTR mesh_route_input(mesh_route_t *m, uint32_t src, const uint8_t *msg, uint16_t len, uint32_t now)
+{
+    if (len < MESH_ROUTE_HDR_LEN || msg[0] != 'M' || msg[1] != 'R' || msg[2] != MESH_ROUTE_VERSION)
+    {
+        m->errors++;
+        return;
+    }
+
+    switch (msg[3])
+    {
+    case MESH_ROUTE_ADVERT:
+        if (msg[6] > MESH_ROUTE_MAX_PREFIXES ||
+            len != MESH_ROUTE_HDR_LEN + MESH_ROUTE_BSSID_LEN + msg[6] * MESH_ROUTE_ENTRY_LEN)
+        {
+            m->errors++;
+            return;
+        }
+        advert_input(m, src, msg, msg[6], now);
+        break;
+
+    case MESH_ROUTE_ACK:
+        ack_input(m, src, msg, len, now);
+        break;
+
+    default:
+        m->errors++;
+    }
+}
+
+void ICACHE_FLASH_ATTR mesh_route_tick(mesh_route_t *m, uint32_t now)
+{
+    int i;
+
+    for (i = 0; i < MESH_ROUTE_LEARNED; i++)
+    {
+        if (m->learned[i].gw != 0 && LATER(now, m->learned[i].expires))
+            learned_drop(m, &m->learned[i]);
+    }
+
+    // The uplink stopped answering (e.g. it restarted), it may have lost our routes
+    if (m->routed && LATER(now, m->last_ack + 3 * MESH_ROUTE_INTERVAL))
+        set_routed(m, false);
+
+    if (m->uplink == 0)
+        return;
+    if (!LATER(m->next_advert, now) ||
+        (m->triggered && !LATER(m->last_advert + MESH_ROUTE_TRIGGER_GAP, now)))
+        send_advert(m, now);
+}
+
+#endif /* MESH_ROUTING */
@@ -0,0 +1,142 @@
+#ifndef _MESH_ROUTE_H_
+#define _MESH_ROUTE_H_
+
+#include "c_types.h"
+#include "user_config.h"
+
+//
+// Mesh route advertisements
+//
+// Every node sends the subnets behind it (its own AP network and what its
+// children announced) to its uplink via UDP, periodically and shortly
+// after a change. The uplink installs them as routes via the sender and
+// answers with an ACK. Once its advert is fully accepted, a node stops
+// NATing on its AP interface: the uplink can route back to its clients.
+// Without ACKs (e.g. the root, whose uplink is a plain AP) NAT stays on,
+// so a node never depends on routes that are not installed upstream.
+//
+// Adverts are taken only from mesh children: the sender must have a
+// DHCP lease on our AP and the advert names the BSSID of its own AP,
+// which the ops check against the mesh IEs heard from the neighbors.
+// Each prefix must lie within MESH_ROUTE_NET/MESH_ROUTE_NET_LEN and must
+// not be shorter than the own network, so no advert can pull in a
+// default route or other foreign traffic.
+//
+// Every node derives its AP /24 from its AP MAC (mesh_route_subnet()).
+// A prefix that is already announced by another child or that overlaps
+// our own network is a conflict: the advert is rejected and the ACK
+// names the prefix. The node that owns it picks the next subnet of its
+// MAC and renumbers its AP (ops->renumber), a node that only learned it
+// passes the conflict on to the child it came from. Conflicts are found
+// where the two prefixes meet, at the lowest node routing both.
+//
+// The protocol core has no espconn or netif dependencies, the node talks
+// to the outside only via mesh_route_ops_t, so several nodes can be run
+// and wired together in one process. All addresses are in network byte
+// order, times are in ms.
+//
+// Wire format (all fields in network byte order):
+//   0  'M' 'R' version type
+//   4  seq(2) count/status(1) hold(1, s)
+//   8  advert: bssid(6) count * { net(4) len(1) metric(1) }
+//      ack: status conflict: the prefix { net(4) len(1) metric(1) }
+//
+
+#define MESH_ROUTE_PORT         24240
+#define MESH_ROUTE_VERSION      2
+#define MESH_ROUTE_ADVERT       1
+#define MESH_ROUTE_ACK          2
+
+#define MESH_ROUTE_ACCEPTED     0
+#define MESH_ROUTE_REJECTED     1
+#define MESH_ROUTE_CONFLICT     2
+
+#define MESH_ROUTE_HDR_LEN      8
+#define MESH_ROUTE_BSSID_LEN    6
+#define MESH_ROUTE_ENTRY_LEN    6
+#define MESH_ROUTE_MAX_PREFIXES 16
+#define MESH_ROUTE_MAX_LEN      (MESH_ROUTE_HDR_LEN + MESH_ROUTE_BSSID_LEN + \
+                                 MESH_ROUTE_MAX_PREFIXES * MESH_ROUTE_ENTRY_LEN)
+#define MESH_ROUTE_MAX_METRIC   15
+
+#define MESH_ROUTE_NET          0x0a180000      // 10.24.0.0, host byte order
+#define MESH_ROUTE_NET_LEN      16
+
+#define MESH_ROUTE_INTERVAL     30000   // periodic adverts
+#define MESH_ROUTE_HOLD         90      // s until routes of a silent child are dropped
+#define MESH_ROUTE_TRIGGER_GAP  1000    // min time between triggered adverts
+
+typedef struct {
+        uint32_t net;
+        uint32_t gw;            // 0 if the slot is free
+        uint32_t expires;
+        uint16_t seq;           // of the last advert it was in
+        uint8_t len;
+        uint8_t metric;
+} mesh_learned_t;
+
+typedef struct {
+        // Sends a message to a neighbor
+        void (*send)(void *ctx, uint32_t dst, const uint8_t *msg, uint16_t len);
+        // Installs/removes a route, install returns false if there is no room
+        bool (*install)(void *ctx, uint32_t net, uint8_t len, uint32_t gw);
+        void (*withdraw)(void *ctx, uint32_t net, uint8_t len, uint32_t gw);
+        // NAT on the AP interface on/off
+        void (*set_nat)(void *ctx, bool enable);
+        // True if src is a station on our AP and bssid the AP of a mesh
+        // node below ours
+        bool (*is_child)(void *ctx, uint32_t src, const uint8_t *bssid);
+        // The own network conflicts with another one, the AP moves to net/24
+        void (*renumber)(void *ctx, uint32_t net);
+} mesh_route_ops_t;
+
+typedef struct {
+        const mesh_route_ops_t *ops;
+        void *ctx;
+        uint8_t bssid[6];       // of the own AP
+        uint32_t local_net;     // own AP network
+        uint8_t local_len;
+        uint8_t subnet;         // which subnet of the BSSID, see mesh_route_subnet()
+        uint32_t uplink;        // where adverts go, 0 if not connected
+        uint16_t seq;           // of the last advert
+        bool routed;            // the uplink accepted our advert, NAT is off
+        bool complete;          // the last advert contained all our networks
+        bool triggered;         // something changed, advert soon
+        uint32_t next_advert;
+        uint32_t last_advert;
+        uint32_t last_ack;
+        uint32_t rtt;           // ms from advert to ACK, smoothed, 0 if unknown
+        mesh_learned_t learned[MESH_ROUTE_LEARNED];
+
+        uint32_t adverts_sent;
+        uint32_t adverts_rcvd;
+        uint32_t rejected;      // adverts of children we rejected
+        uint32_t conflicts;     // of them for a prefix in use
+        uint32_t renumbered;    // own network moved after a conflict
+        uint32_t foreign;       // adverts of non mesh stations, ignored
+        uint32_t errors;        // malformed messages
+} mesh_route_t;
+
+void mesh_route_init(mesh_route_t *m, const mesh_route_ops_t *ops, void *ctx, uint32_t now);
+
+// The n-th candidate for the AP /24 of the AP with the BSSID, within
+// MESH_ROUTE_NET, e.g. 10.24.<1..254>.0
+uint32_t mesh_route_subnet(const uint8_t *bssid, uint8_t n);
+
+// Sets the own AP and its network
+void mesh_route_set_local(mesh_route_t *m, const uint8_t *bssid, uint32_t net, uint8_t len, uint32_t now);
+
+// Moves the own network to the next subnet of the BSSID, e.g. when it is
+// that of the uplink, and tells ops->renumber
+void mesh_route_renumber(mesh_route_t *m, uint32_t now);
+
+// The uplink gateway changed, 0 if disconnected (turns NAT back on)
+void mesh_route_set_uplink(mesh_route_t *m, uint32_t uplink, uint32_t now);
+
+// A message from src
+void mesh_route_input(mesh_route_t *m, uint32_t src, const uint8_t *msg, uint16_t len, uint32_t now);
+
+// Call about once per second: adverts, route expiry, ACK timeout
+void mesh_route_tick(mesh_route_t *m, uint32_t now);
+
+#endif
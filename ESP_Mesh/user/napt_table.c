@@ -0,0 +1,267 @@
+#include "c_types.h"
+#include "osapi.h"
+#include "mem.h"
+
+#include "lwip/ip.h"
+
+#include "napt_table.h"
+
+static uint16_t ICACHE_FLASH_ATTR hash(napt_table_t *t, uint8_t proto,
+                                       uint32_t src, uint16_t sport, uint32_t dst, uint16_t dport)
+{
+    uint32_t h = src ^ ((dst << 7) | (dst >> 25)) ^ (((uint32_t)sport << 16) | dport) ^ proto;
+
+    // Fibonacci hashing, the high bits are the best mixed ones
+    h *= 0x9e3779b1;
+    return (h >> 16) & t->index_mask;
+}
+
+static bool ICACHE_FLASH_ATTR match(const napt_flow_t *f, uint8_t proto,
+                                    uint32_t src, uint16_t sport, uint32_t dst, uint16_t dport)
+{
+    return f->src == src && f->dst == dst && f->sport == sport && f->dport == dport && f->proto == proto;
+}
+
+bool ICACHE_FLASH_ATTR napt_table_init(napt_table_t *t, uint16_t max_flows)
+{
+    uint32_t slots = 4;
+    uint16_t i;
+
+    os_memset(t, 0, sizeof(napt_table_t));
+    if (max_flows == 0 || max_flows >= NAPT_NIL / 2)
+        return false;
+
+    while (slots < 2 * (uint32_t)max_flows)
+        slots <<= 1;
+
+    t->flows = (napt_flow_t *)os_zalloc(max_flows * sizeof(napt_flow_t));
+    t->index = (uint16_t *)os_malloc(slots * sizeof(uint16_t));
+    if (t->flows == NULL || t->index == NULL)
+    {
+        napt_table_free(t);
+        return false;
+    }
+
+    t->max_flows = max_flows;
+    t->index_mask = slots - 1;
+    os_memset(t->index, 0xff, slots * sizeof(uint16_t));
+
+    for (i = 0; i < max_flows; i++)
+    {
+        t->flows[i].queue = NAPT_Q_FREE;
+        t->flows[i].next = i + 1 < max_flows ? i + 1 : NAPT_NIL;
+    }
+    t->free_list = 0;
+
+    for (i = 0; i < NAPT_QUEUES; i++)
+        t->head[i] = t->tail[i] = NAPT_NIL;
+    return true;
+}
+
+void ICACHE_FLASH_ATTR napt_table_set_timeout(napt_table_t *t, uint8_t queue, uint32_t ms)
+{
+    if (queue < NAPT_QUEUES)
+        t->timeout[queue] = ms;
+}
+
+void ICACHE_FLASH_ATTR napt_table_free(napt_table_t *t)
+{
+    if (t->flows != NULL)
+        os_free(t->flows);
+    if (t->index != NULL)
+        os_free(t->index);
+    os_memset(t, 0, sizeof(napt_table_t));
+}
+
+// Index slot of the flow or of the empty slot ending its probe sequence
+static uint16_t ICACHE_FLASH_ATTR find_slot(napt_table_t *t, uint8_t proto,
+                                            uint32_t src, uint16_t sport, uint32_t dst, uint16_t dport)
+{
+    uint16_t slot = hash(t, proto, src, sport, dst, dport);
+    uint16_t ref;
+
+    while ((ref = t->index[slot]) != NAPT_NIL)
+    {
+        if (match(&t->flows[ref], proto, src, sport, dst, dport))
+            break;
+        slot = (slot + 1) & t->index_mask;
+    }
+    return slot;
+}
+
+napt_flow_t * ICACHE_FLASH_ATTR napt_table_lookup(napt_table_t *t, uint8_t proto,
+                                                  uint32_t src, uint16_t sport, uint32_t dst, uint16_t dport)
+{
+    uint16_t ref;
+
+    if (t->index == NULL)
+        return NULL;
+
+    ref = t->index[find_slot(t, proto, src, sport, dst, dport)];
+    return ref != NAPT_NIL ? &t->flows[ref] : NULL;
+}
+
+static void ICACHE_FLASH_ATTR queue_unlink(napt_table_t *t, napt_flow_t *f)
+{
+    if (f->prev != NAPT_NIL)
+        t->flows[f->prev].next = f->next;
+    else
+        t->head[f->queue] = f->next;
+
+    if (f->next != NAPT_NIL)
+        t->flows[f->next].prev = f->prev;
+    else
+        t->tail[f->queue] = f->prev;
+}
+
+static void ICACHE_FLASH_ATTR queue_push(napt_table_t *t, napt_flow_t *f, uint8_t queue)
+{
+    uint16_t ref = f - t->flows;
+
+    f->queue = queue;
+    f->prev = NAPT_NIL;
+    f->next = t->head[queue];
+    if (f->next != NAPT_NIL)
+        t->flows[f->next].prev = ref;
+    else
+        t->tail[queue] = ref;
+    t->head[queue] = ref;
+}
+
+// Least recently used flow to give up for a new flow of class queue
+static napt_flow_t * ICACHE_FLASH_ATTR evict_candidate(napt_table_t *t, uint8_t queue)
+{
+    napt_flow_t *oldest = NULL;
+    uint8_t q;
+
+    if (t->tail[NAPT_Q_TCP_FIN] != NAPT_NIL)
+        return &t->flows[t->tail[NAPT_Q_TCP_FIN]];
+    if (t->tail[queue] != NAPT_NIL)
+        return &t->flows[t->tail[queue]];
+
+    for (q = 0; q < NAPT_QUEUES; q++)
+    {
+        napt_flow_t *f;
+
+        if (t->tail[q] == NAPT_NIL)
+            continue;
+        f = &t->flows[t->tail[q]];
+        if (oldest == NULL || (int32_t)(f->last - oldest->last) < 0)
+            oldest = f;
+    }
+    return oldest;
+}
+
+napt_flow_t * ICACHE_FLASH_ATTR napt_table_insert(napt_table_t *t, uint8_t proto,
+                                                  uint32_t src, uint16_t sport, uint32_t dst, uint16_t dport, uint32_t now)
+{
+    uint8_t queue = proto == IP_PROTO_TCP ? NAPT_Q_TCP : (proto == IP_PROTO_UDP ? NAPT_Q_UDP : NAPT_Q_OTHER);
+    napt_flow_t *f;
+    uint16_t slot, ref;
+
+    if (t->index == NULL)
+        return NULL;
+
+    slot = find_slot(t, proto, src, sport, dst, dport);
+    if (t->index[slot] != NAPT_NIL)
+    {
+        f = &t->flows[t->index[slot]];
+        napt_table_touch(t, f, now);
+        return f;
+    }
+
+    if (t->free_list == NAPT_NIL)
+    {
+        if ((f = evict_candidate(t, queue)) == NULL)
+            return NULL;
+        napt_table_remove(t, f);
+        t->evicted++;
+        // The removal may have shifted our probe sequence
+        slot = find_slot(t, proto, src, sport, dst, dport);
+    }
+
+    ref = t->free_list;
+    f = &t->flows[ref];
+    t->free_list = f->next;
+    f->src = src;
+    f->dst = dst;
+    f->sport = sport;
+    f->dport = dport;
+    f->proto = proto;
+    f->last = now;
+    queue_push(t, f, queue);
+
+    t->index[slot] = ref;
+    t->used++;
+    return f;
+}
+
+void ICACHE_FLASH_ATTR napt_table_touch(napt_table_t *t, napt_flow_t *f, uint32_t now)
+{
+    f->last = now;
+    if (t->head[f->queue] == f - t->flows)
+        return;
+    queue_unlink(t, f);
+    queue_push(t, f, f->queue);
+}
+
+void ICACHE_FLASH_ATTR napt_table_closing(napt_table_t *t, napt_flow_t *f)
+{
+    if (f->queue != NAPT_Q_TCP)
+        return;
+    queue_unlink(t, f);
+    queue_push(t, f, NAPT_Q_TCP_FIN);
+}
+
+void ICACHE_FLASH_ATTR napt_table_remove(napt_table_t *t, napt_flow_t *f)
+{
+    uint16_t ref = f - t->flows;
+    uint16_t slot, next, home;
+
+    if (f->queue >= NAPT_QUEUES)
+        return;
+
+    slot = find_slot(t, f->proto, f->src, f->sport, f->dst, f->dport);
+    t->index[slot] = NAPT_NIL;
+
+    // Backward shift: move up entries of the probe run that can no longer be reached
+    for (next = (slot + 1) & t->index_mask; t->index[next] != NAPT_NIL; next = (next + 1) & t->index_mask)
+    {
+        napt_flow_t *n = &t->flows[t->index[next]];
+
+        home = hash(t, n->proto, n->src, n->sport, n->dst, n->dport);
+        // Stays if its home lies cyclically in (slot, next]
+        if (((next - home) & t->index_mask) < ((next - slot) & t->index_mask))
+            continue;
+        t->index[slot] = t->index[next];
+        t->index[next] = NAPT_NIL;
+        slot = next;
+    }
+
+    queue_unlink(t, f);
+    f->queue = NAPT_Q_FREE;
+    f->next = t->free_list;
+    t->free_list = ref;
+    t->used--;
+}
+
+uint16_t ICACHE_FLASH_ATTR napt_table_expire(napt_table_t *t, uint32_t now, uint16_t max)
+{
+    uint16_t expired = 0;
+    uint8_t q;
+
+    for (q = 0; q < NAPT_QUEUES; q++)
+    {
+        while (expired < max && t->tail[q] != NAPT_NIL)
+        {
+            napt_flow_t *f = &t->flows[t->tail[q]];
+
+            if (now - f->last <= t->timeout[q])
+                break;
+            napt_table_remove(t, f);
+            expired++;
+        }
+    }
+    t->expired += expired;
+    return expired;
+}
@@ -0,0 +1,96 @@
+#ifndef _NAPT_TABLE_H_
+#define _NAPT_TABLE_H_
+
+#include "c_types.h"
+
+//
+// Hashed NAPT connection table
+//
+// Flows (proto, src ip/port, dst ip/port) of a NAPT interface. The NAPT
+// of the firmware is compiled into liblwip_open_napt.a with its own flat
+// table, which only a rebuild of ip.o could replace, so this table is
+// not linked into the firmware yet. It is the one such a rebuild would
+// use and is tested and benchmarked on the host (test/).
+//
+// The flows live in a fixed array, an open addressing index
+// (linear probing, backward shift deletion, no tombstones) of 16 bit
+// flow refs finds them, so lookups do not get slower with more active
+// connections. The index has at least twice as many slots as there
+// are flows. Addresses and ports are in network byte order.
+//
+// Each timeout class (TCP, closing TCP, UDP, ICMP/other) keeps its
+// flows in a list ordered by the last packet. As all flows of a class
+// share one timeout, the tail of the list is always the next to expire
+// and the least recently used one: refreshing a flow moves it to the
+// head, expiry only looks at the tails and eviction takes a tail, all
+// in O(1).
+//
+
+#define NAPT_NIL    0xffff  // empty index slot / end of a list
+
+// Timeout classes
+#define NAPT_Q_TCP      0
+#define NAPT_Q_TCP_FIN  1   // TCP FIN or RST seen, shorter timeout
+#define NAPT_Q_UDP      2
+#define NAPT_Q_OTHER    3   // ICMP
+#define NAPT_QUEUES     4
+#define NAPT_Q_FREE     0xff
+
+typedef struct {
+        uint32_t src;
+        uint32_t dst;
+        uint16_t sport;
+        uint16_t dport;
+        uint8_t proto;
+        uint8_t queue;          // timeout class, NAPT_Q_FREE if unused
+        uint16_t prev;          // towards the head of the class list
+        uint16_t next;          // towards the tail, or the free list
+        uint32_t last;          // time of the last packet in ms
+} napt_flow_t;
+
+typedef struct {
+        napt_flow_t *flows;
+        uint16_t *index;
+        uint16_t max_flows;
+        uint16_t index_mask;    // index size - 1, the size is a power of 2
+        uint16_t used;
+        uint16_t free_list;
+        uint16_t head[NAPT_QUEUES];
+        uint16_t tail[NAPT_QUEUES];
+        uint32_t timeout[NAPT_QUEUES];  // ms
+        uint32_t expired;       // flows removed after their timeout
+        uint32_t evicted;       // flows removed to make room for new ones
+} napt_table_t;
+
+bool napt_table_init(napt_table_t *t, uint16_t max_flows);
+void napt_table_free(napt_table_t *t);
+
+void napt_table_set_timeout(napt_table_t *t, uint8_t queue, uint32_t ms);
+
+// NULL if the flow is not in the table
+napt_flow_t *napt_table_lookup(napt_table_t *t, uint8_t proto,
+                               uint32_t src, uint16_t sport, uint32_t dst, uint16_t dport);
+
+// Finds the flow or adds it and marks it as used at now (ms). If the
+// table is full, the least recently used flow is evicted: a closing TCP
+// flow first, then one of the same class, then the oldest one at all.
+napt_flow_t *napt_table_insert(napt_table_t *t, uint8_t proto,
+                               uint32_t src, uint16_t sport, uint32_t dst, uint16_t dport, uint32_t now);
+
+// A packet of the flow was seen at now (ms)
+void napt_table_touch(napt_table_t *t, napt_flow_t *f, uint32_t now);
+
+// The TCP flow is closing, moves it to the shorter timeout
+void napt_table_closing(napt_table_t *t, napt_flow_t *f);
+
+void napt_table_remove(napt_table_t *t, napt_flow_t *f);
+
+// Removes up to max flows idle for longer than their class timeout,
+// returns the number of removed flows. Only expired flows are visited.
+uint16_t napt_table_expire(napt_table_t *t, uint32_t now, uint16_t max);
+
+// Memory used per flow, including its share of the index
+#define NAPT_TABLE_ENTRY_SIZE(t) \
+        (sizeof(napt_flow_t) + ((t)->index_mask + 1) * sizeof(uint16_t) / (t)->max_flows)
+
+#endif
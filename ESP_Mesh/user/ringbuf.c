@@ -248,3 +248,59 @@ ringbuf_copy(ringbuf_t dst, ringbuf_t src, size_t count)
     return dst->head;
 }
 
+/*
+ * Advance a pointer p within rb's contiguous buffer by n bytes,
+ * wrapping at the end. n must not exceed the buffer size.
+ */
+static uint8_t *
+ringbuf_advance(ringbuf_t rb, uint8_t *p, size_t n)
+{
+    const uint8_t *bufend = ringbuf_end(rb);
+
+    assert(n <= ringbuf_buffer_size(rb));
+    if (n >= (size_t)(bufend - p))
+        return p + n - ringbuf_buffer_size(rb);
+    return p + n;
+}
+
+size_t
+ringbuf_peek(const struct ringbuf_t *rb, struct ringbuf_span spans[2])
+{
+    size_t used = ringbuf_bytes_used(rb);
+    size_t n = MIN((size_t)(ringbuf_end(rb) - rb->tail), used);
+
+    spans[0].data = n ? rb->tail : 0;
+    spans[0].len = n;
+    spans[1].data = used - n ? rb->buf : 0;
+    spans[1].len = used - n;
+
+    return used;
+}
+
+void *
+ringbuf_consume(ringbuf_t rb, size_t count)
+{
+    rb->tail = ringbuf_advance(rb, rb->tail, MIN(count, ringbuf_bytes_used(rb)));
+    return rb->tail;
+}
+
+size_t
+ringbuf_reserve(ringbuf_t rb, struct ringbuf_span spans[2])
+{
+    size_t nfree = ringbuf_bytes_free(rb);
+    size_t n = MIN((size_t)(ringbuf_end(rb) - rb->head), nfree);
+
+    spans[0].data = n ? rb->head : 0;
+    spans[0].len = n;
+    spans[1].data = nfree - n ? rb->buf : 0;
+    spans[1].len = nfree - n;
+
+    return nfree;
+}
+
+void *
+ringbuf_commit(ringbuf_t rb, size_t count)
+{
+    rb->head = ringbuf_advance(rb, rb->head, MIN(count, ringbuf_bytes_free(rb)));
+    return rb->head;
+}
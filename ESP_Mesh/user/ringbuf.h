@@ -31,6 +31,18 @@
 
 typedef struct ringbuf_t *ringbuf_t;
 
+/*
+ * A contiguous region inside a ring buffer's internal buffer, as
+ * returned by ringbuf_peek and ringbuf_reserve. Because the buffer
+ * wraps, any range of bytes in the ring buffer can be described by at
+ * most two spans.
+ */
+struct ringbuf_span
+{
+    void *data;
+    size_t len;
+};
+
 /*
  * Create a new ring buffer with the given capacity (usable
  * bytes). Note that the actual internal buffer size may be one or
@@ -163,5 +175,49 @@ ringbuf_memcpy_from(void *dst, ringbuf_t src, size_t count);
 void *
 ringbuf_copy(ringbuf_t dst, ringbuf_t src, size_t count);
 
+/*
+ * Zero-copy read access. Fill spans[0] (and, if the used region
+ * wraps around the end of the internal buffer, spans[1]) with the
+ * bytes currently stored in the ring buffer, starting from its tail
+ * pointer. Unused spans are set to { 0, 0 }. Returns the total
+ * number of bytes described, which equals ringbuf_bytes_used.
+ *
+ * The ring buffer is not modified; call ringbuf_consume once the
+ * caller is done with the data (e.g., after the send completed). The
+ * spans stay valid as long as no bytes are consumed and the buffer is
+ * not overflowed by a writer.
+ */
+size_t
+ringbuf_peek(const struct ringbuf_t *rb, struct ringbuf_span spans[2]);
+
+/*
+ * Release count bytes at the tail of the ring buffer, i.e. advance
+ * the tail pointer as ringbuf_memcpy_from would, but without copying.
+ * count is clipped to the number of bytes used. Returns the new tail
+ * pointer.
+ */
+void *
+ringbuf_consume(ringbuf_t rb, size_t count);
+
+/*
+ * Zero-copy write access. Fill spans[0] (and, if the free region
+ * wraps, spans[1]) with the free space following the head pointer.
+ * Returns the total number of bytes described, which equals
+ * ringbuf_bytes_free.
+ *
+ * Data written into the spans becomes visible to readers only after
+ * ringbuf_commit has been called.
+ */
+size_t
+ringbuf_reserve(ringbuf_t rb, struct ringbuf_span spans[2]);
+
+/*
+ * Make count bytes written into the spans returned by ringbuf_reserve
+ * part of the ring buffer, i.e. advance the head pointer. count is
+ * clipped to the number of free bytes. Returns the new head pointer.
+ */
+void *
+ringbuf_commit(ringbuf_t rb, size_t count);
+
 #endif /* INCLUDED_RINGBUF_H */
 
@@ -0,0 +1,418 @@
+#include "c_types.h"
+#include "osapi.h"
+#include "mem.h"
+#include "lwip/def.h"
+
+#include "user_config.h"
+#include "route_trie.h"
+
+#define NIL 0xffff
+
+// Nodes per heap allocation, a node with a few routes takes no more than that
+#define ROUTE_TRIE_CHUNK 32
+
+#if ROUTE_TRIE_NODES % ROUTE_TRIE_CHUNK != 0 || ROUTE_TRIE_NODES >= NIL
+#error "ROUTE_TRIE_NODES must be a multiple of ROUTE_TRIE_CHUNK below 0xffff"
+#endif
+
+typedef struct {
+        uint32_t key;           // prefix in host byte order, bits beyond len are 0
+        uint8_t len;            // prefix length
+        uint8_t flags;          // ROUTE_*, 0 for a branch node without a route
+        uint16_t child[2];      // by the bit after the prefix, child[0] links the free list
+        struct route_entry rt;  // valid if flags != 0
+} rt_node_t;
+
+// The pool grows a chunk at a time and never shrinks, so node pointers stay valid
+static rt_node_t *rt_chunks[ROUTE_TRIE_NODES / ROUTE_TRIE_CHUNK];
+static uint16_t rt_allocated;
+static uint16_t rt_root = NIL;
+static uint16_t rt_free;
+static uint16_t rt_used;
+static bool rt_ready;
+
+// The static routes, persisted with the config
+struct route_entry ip_rt_table[MAX_ROUTES];
+int ip_route_max;
+
+static uint32_t ICACHE_FLASH_ATTR prefix_mask(uint8_t len)
+{
+    return len == 0 ? 0 : 0xffffffff << (32 - len);
+}
+
+static uint8_t ICACHE_FLASH_ATTR mask_len(ip_addr_t mask)
+{
+    uint32_t m = ntohl(mask.addr);
+    uint8_t len = 0;
+
+    while (len < 32 && (m & 0x80000000))
+    {
+        m <<= 1;
+        len++;
+    }
+    return len;
+}
+
+static uint8_t ICACHE_FLASH_ATTR bit(uint32_t key, uint8_t pos)
+{
+    return (key >> (31 - pos)) & 1;
+}
+
+// Number of leading bits a and b have in common, at most max
+static uint8_t ICACHE_FLASH_ATTR common_len(uint32_t a, uint32_t b, uint8_t max)
+{
+    uint32_t x = a ^ b;
+    uint8_t len = x == 0 ? 32 : __builtin_clz(x);
+
+    return len < max ? len : max;
+}
+
+#define NODE(ref) (&rt_chunks[(ref) / ROUTE_TRIE_CHUNK][(ref) % ROUTE_TRIE_CHUNK])
+
+static void ICACHE_FLASH_ATTR rt_init(void)
+{
+    rt_free = NIL;
+    rt_root = NIL;
+    rt_used = 0;
+    rt_ready = true;
+}
+
+// Adds a chunk of nodes to the free list, false at ROUTE_TRIE_NODES or without heap
+static bool ICACHE_FLASH_ATTR rt_grow(void)
+{
+    rt_node_t *chunk;
+    uint16_t i;
+
+    if (rt_allocated == ROUTE_TRIE_NODES)
+        return false;
+    chunk = (rt_node_t *)os_malloc(ROUTE_TRIE_CHUNK * sizeof(rt_node_t));
+    if (chunk == NULL)
+        return false;
+
+    for (i = 0; i < ROUTE_TRIE_CHUNK; i++)
+    {
+        chunk[i].flags = 0;
+        chunk[i].child[0] = i + 1 < ROUTE_TRIE_CHUNK ? rt_allocated + i + 1 : rt_free;
+    }
+    rt_chunks[rt_allocated / ROUTE_TRIE_CHUNK] = chunk;
+    rt_free = rt_allocated;
+    rt_allocated += ROUTE_TRIE_CHUNK;
+    return true;
+}
+
+static uint16_t ICACHE_FLASH_ATTR node_new(uint32_t key, uint8_t len)
+{
+    uint16_t ref;
+    rt_node_t *n;
+
+    if (rt_free == NIL && !rt_grow())
+        return NIL;
+
+    ref = rt_free;
+    n = NODE(ref);
+    rt_free = n->child[0];
+    os_memset(n, 0, sizeof(rt_node_t));
+    n->key = key & prefix_mask(len);
+    n->len = len;
+    n->child[0] = n->child[1] = NIL;
+    rt_used++;
+    return ref;
+}
+
+static void ICACHE_FLASH_ATTR node_free(uint16_t ref)
+{
+    NODE(ref)->flags = 0;
+    NODE(ref)->child[0] = rt_free;
+    rt_free = ref;
+    rt_used--;
+}
+
+// Finds or creates the node of a prefix, NULL if the pool is exhausted
+static rt_node_t * ICACHE_FLASH_ATTR trie_insert(uint32_t key, uint8_t len)
+{
+    uint16_t *link = &rt_root;
+    uint16_t ref, branch, leaf;
+    rt_node_t *n;
+    uint8_t cpl;
+
+    if (!rt_ready)
+        rt_init();
+    key &= prefix_mask(len);
+
+    for (;;)
+    {
+        if ((ref = *link) == NIL)
+        {
+            if ((leaf = node_new(key, len)) == NIL)
+                return NULL;
+            *link = leaf;
+            return NODE(leaf);
+        }
+
+        n = NODE(ref);
+        cpl = common_len(key, n->key, len < n->len ? len : n->len);
+
+        if (cpl == n->len)
+        {
+            if (n->len == len)
+                return n;
+            link = &n->child[bit(key, n->len)];
+            continue;
+        }
+
+        // The prefix ends or forks above n
+        if (cpl == len)
+        {
+            if ((leaf = node_new(key, len)) == NIL)
+                return NULL;
+            NODE(leaf)->child[bit(n->key, len)] = ref;
+            *link = leaf;
+            return NODE(leaf);
+        }
+
+        if ((branch = node_new(key, cpl)) == NIL)
+            return NULL;
+        if ((leaf = node_new(key, len)) == NIL)
+        {
+            node_free(branch);
+            return NULL;
+        }
+        NODE(branch)->child[bit(n->key, cpl)] = ref;
+        NODE(branch)->child[bit(key, cpl)] = leaf;
+        *link = branch;
+        return NODE(leaf);
+    }
+}
+
+// Drops a node that has no route and less than two children
+static void ICACHE_FLASH_ATTR trie_compact(uint16_t *link)
+{
+    rt_node_t *n = NODE(*link);
+    uint16_t ref = *link;
+
+    if (n->flags != 0 || (n->child[0] != NIL && n->child[1] != NIL))
+        return;
+
+    *link = n->child[0] != NIL ? n->child[0] : n->child[1];
+    node_free(ref);
+}
+
+// Removes the route of a prefix if it has one of flags
+static bool ICACHE_FLASH_ATTR trie_remove(uint32_t key, uint8_t len, uint8_t flags)
+{
+    uint16_t *link = &rt_root;
+    uint16_t *parent = NULL;
+    rt_node_t *n;
+
+    key &= prefix_mask(len);
+    while (*link != NIL)
+    {
+        n = NODE(*link);
+        if (n->len > len || ((key ^ n->key) & prefix_mask(n->len)) != 0)
+            return false;
+        if (n->len == len)
+            break;
+        parent = link;
+        link = &n->child[bit(key, n->len)];
+    }
+    if (*link == NIL || !(n->flags & flags))
+        return false;
+
+    n->flags = 0;
+    if (n->child[0] == NIL && n->child[1] == NIL)
+    {
+        // A leaf goes, its parent may have become a pass-through branch
+        node_free(*link);
+        *link = NIL;
+        if (parent != NULL)
+            trie_compact(parent);
+    }
+    else
+    {
+        trie_compact(link);
+    }
+    return true;
+}
+
+static bool ICACHE_FLASH_ATTR trie_add(ip_addr_t ip, ip_addr_t mask, ip_addr_t gw, uint8_t flags)
+{
+    uint8_t len = mask_len(mask);
+    rt_node_t *n = trie_insert(ntohl(ip.addr), len);
+
+    if (n == NULL)
+        return false;
+
+    // A static route is never replaced by a dynamic one
+    if ((n->flags & ROUTE_STATIC) && !(flags & ROUTE_STATIC))
+        return false;
+
+    n->flags = flags;
+    n->rt.ip.addr = htonl(n->key);
+    n->rt.mask.addr = htonl(prefix_mask(len));
+    n->rt.gw = gw;
+    return true;
+}
+
+struct route_entry * ICACHE_FLASH_ATTR ip_find_route(ip_addr_t ip)
+{
+    uint32_t key = ntohl(ip.addr);
+    uint16_t ref = rt_root;
+    rt_node_t *best = NULL;
+    rt_node_t *n;
+
+    if (!rt_ready)
+        return NULL;
+
+    // Branch nodes only steer, a wrong turn there fails at the next route
+    while (ref != NIL)
+    {
+        n = NODE(ref);
+        if (n->flags != 0)
+        {
+            if (((key ^ n->key) & prefix_mask(n->len)) != 0)
+                break;
+            best = n;
+            if (n->len == 32)
+                break;
+        }
+        ref = n->child[bit(key, n->len)];
+    }
+    return best != NULL ? &best->rt : NULL;
+}
+
+bool ICACHE_FLASH_ATTR ip_add_route(ip_addr_t ip, ip_addr_t mask, ip_addr_t gw)
+{
+    int i;
+
+    ip.addr &= mask.addr;
+    for (i = 0; i < ip_route_max; i++)
+    {
+        if (ip_rt_table[i].ip.addr == ip.addr && ip_rt_table[i].mask.addr == mask.addr)
+            break;
+    }
+    if (i == MAX_ROUTES)
+        return false;
+
+    if (!trie_add(ip, mask, gw, ROUTE_STATIC))
+        return false;
+
+    ip_rt_table[i].ip = ip;
+    ip_rt_table[i].mask = mask;
+    ip_rt_table[i].gw = gw;
+    if (i == ip_route_max)
+        ip_route_max++;
+    return true;
+}
+
+bool ICACHE_FLASH_ATTR ip_rm_route(ip_addr_t ip, ip_addr_t mask)
+{
+    int i;
+
+    ip.addr &= mask.addr;
+    for (i = 0; i < ip_route_max; i++)
+    {
+        if (ip_rt_table[i].ip.addr == ip.addr && ip_rt_table[i].mask.addr == mask.addr)
+            break;
+    }
+    if (i == ip_route_max)
+        return false;
+
+    trie_remove(ntohl(ip.addr), mask_len(mask), ROUTE_STATIC);
+
+    ip_route_max--;
+    os_memmove(&ip_rt_table[i], &ip_rt_table[i + 1], (ip_route_max - i) * sizeof(struct route_entry));
+    return true;
+}
+
+void ICACHE_FLASH_ATTR ip_delete_routes(void)
+{
+    int i;
+
+    for (i = 0; i < ip_route_max; i++)
+        trie_remove(ntohl(ip_rt_table[i].ip.addr), mask_len(ip_rt_table[i].mask), ROUTE_STATIC);
+    ip_route_max = 0;
+}
+
+bool ICACHE_FLASH_ATTR ip_get_route(uint32_t no, ip_addr_t *ip, ip_addr_t *mask, ip_addr_t *gw)
+{
+    if (no >= ip_route_max)
+        return false;
+
+    *ip = ip_rt_table[no].ip;
+    *mask = ip_rt_table[no].mask;
+    *gw = ip_rt_table[no].gw;
+    return true;
+}
+
+void ICACHE_FLASH_ATTR route_trie_reload(void)
+{
+    uint16_t i;
+
+    if (!rt_ready)
+        rt_init();
+
+    for (i = 0; i < rt_allocated; i++)
+    {
+        if (NODE(i)->flags & ROUTE_STATIC)
+            trie_remove(NODE(i)->key, NODE(i)->len, ROUTE_STATIC);
+    }
+
+    if (ip_route_max > MAX_ROUTES)
+        ip_route_max = MAX_ROUTES;
+    for (i = 0; i < ip_route_max; i++)
+        trie_add(ip_rt_table[i].ip, ip_rt_table[i].mask, ip_rt_table[i].gw, ROUTE_STATIC);
+}
+
+bool ICACHE_FLASH_ATTR route_add_dynamic(ip_addr_t ip, ip_addr_t mask, ip_addr_t gw)
+{
+    ip.addr &= mask.addr;
+    return trie_add(ip, mask, gw, ROUTE_DYNAMIC);
+}
+
+bool ICACHE_FLASH_ATTR route_rm_dynamic(ip_addr_t ip, ip_addr_t mask)
+{
+    if (!rt_ready)
+        return false;
+    return trie_remove(ntohl(ip.addr), mask_len(mask), ROUTE_DYNAMIC);
+}
+
+void ICACHE_FLASH_ATTR route_flush_dynamic(ip_addr_t gw)
+{
+    uint16_t i;
+
+    if (!rt_ready)
+        return;
+
+    for (i = 0; i < rt_allocated; i++)
+    {
+        rt_node_t *n = NODE(i);
+
+        if ((n->flags & ROUTE_DYNAMIC) && n->rt.gw.addr == gw.addr)
+            trie_remove(n->key, n->len, ROUTE_DYNAMIC);
+    }
+}
+
+static void ICACHE_FLASH_ATTR walk(uint16_t ref, route_walk_fn fn, void *arg)
+{
+    rt_node_t *n;
+
+    // Depth is bounded by the 33 prefix lengths
+    if (ref == NIL)
+        return;
+    n = NODE(ref);
+    if (n->flags != 0)
+        fn(arg, &n->rt, n->flags);
+    walk(n->child[0], fn, arg);
+    walk(n->child[1], fn, arg);
+}
+
+void ICACHE_FLASH_ATTR route_walk(route_walk_fn fn, void *arg)
+{
+    if (rt_ready)
+        walk(rt_root, fn, arg);
+}
+
+uint16_t ICACHE_FLASH_ATTR route_trie_used(void)
+{
+    return rt_used;
+}
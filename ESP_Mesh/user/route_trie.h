@@ -0,0 +1,46 @@
+#ifndef _ROUTE_TRIE_H_
+#define _ROUTE_TRIE_H_
+
+#include "c_types.h"
+#include "lwip/ip_addr.h"
+#include "lwip/ip_route.h"
+
+//
+// Longest prefix match routing table
+//
+// Implements the lwIP routing API of ip_route.h (which replaces the
+// linear scan of ip_rt_table in the prebuilt library) on top of a path
+// compressed binary trie. A lookup visits at most one node per prefix
+// length on the way down, independent of the number of routes.
+//
+// Static routes are kept in ip_rt_table as before, so they are still
+// persisted with the config. Dynamic routes (e.g. learned from the mesh)
+// only live in the trie and are not saved. The trie nodes come from a
+// pool of up to ROUTE_TRIE_NODES that grows on the heap as routes come
+// in, each route needs up to two of them.
+//
+
+// Route flags
+#define ROUTE_STATIC    0x01
+#define ROUTE_DYNAMIC   0x02
+
+// Rebuilds the trie from ip_rt_table, after it was loaded from the config
+void route_trie_reload(void);
+
+// Adds or replaces a dynamic route, true on success
+bool route_add_dynamic(ip_addr_t ip, ip_addr_t mask, ip_addr_t gw);
+
+// Removes a dynamic route, true on success
+bool route_rm_dynamic(ip_addr_t ip, ip_addr_t mask);
+
+// Removes all dynamic routes via gw
+void route_flush_dynamic(ip_addr_t gw);
+
+// Calls fn for every route, in address order
+typedef void (*route_walk_fn)(void *arg, struct route_entry *rt, uint8_t flags);
+void route_walk(route_walk_fn fn, void *arg);
+
+// Nodes in use / free
+uint16_t route_trie_used(void);
+
+#endif
@@ -0,0 +1,545 @@
+#include "c_types.h"
+#include "osapi.h"
+#include "lwip/def.h"
+#include "lwip/ip.h"
+#include "lwip/udp.h"
+#include "lwip/tcp_impl.h"
+#include "netif/etharp.h"
+
+#include "user_config.h"
+#include "shaper.h"
+
+#if TOKENBUCKET
+
+// DSCP code points
+#define DSCP_CS1    8
+#define DSCP_CS5    40
+#define DSCP_EF     46
+#define DSCP_CS6    48
+#define DSCP_CS7    56
+
+static const uint8_t class_budget[SHAPER_CLASSES] = {
+    SHAPER_INTERACTIVE_QUEUED, SHAPER_NORMAL_QUEUED, SHAPER_BULK_QUEUED};
+
+static bool ICACHE_FLASH_ATTR interactive_port(uint16_t port)
+{
+    // DNS, DHCP, NTP
+    return port == PP_HTONS(53) || port == PP_HTONS(67) || port == PP_HTONS(68) || port == PP_HTONS(123);
+}
+
+static uint8_t ICACHE_FLASH_ATTR classify(struct pbuf *p)
+{
+    struct eth_hdr *eth = (struct eth_hdr *)p->payload;
+    struct ip_hdr *iph = (struct ip_hdr *)((uint8_t *)p->payload + SIZEOF_ETH_HDR);
+    bool small = p->tot_len <= SHAPER_SMALL;
+    uint16_t hlen;
+    uint8_t dscp;
+    uint8_t *l4;
+
+    // ARP and the like
+    if (eth->type != PP_HTONS(ETHTYPE_IP))
+        return small ? SHAPER_INTERACTIVE : SHAPER_NORMAL;
+    if (p->len < SIZEOF_ETH_HDR + IP_HLEN)
+        return SHAPER_NORMAL;
+
+    dscp = IPH_TOS(iph) >> 2;
+    if (dscp == DSCP_CS1)
+        return SHAPER_BULK;
+    if (dscp == DSCP_EF || dscp == DSCP_CS6 || dscp == DSCP_CS7)
+        return small ? SHAPER_INTERACTIVE : SHAPER_NORMAL;
+
+    hlen = IPH_HL(iph) * 4;
+    l4 = (uint8_t *)iph + hlen;
+
+    // Only the first fragment has the ports
+    if ((IPH_OFFSET(iph) & PP_HTONS(IP_OFFMASK)) != 0)
+        return p->tot_len >= SHAPER_BULK_LEN ? SHAPER_BULK : SHAPER_NORMAL;
+
+    switch (IPH_PROTO(iph))
+    {
+    case IP_PROTO_ICMP:
+        return small ? SHAPER_INTERACTIVE : SHAPER_NORMAL;
+
+    case IP_PROTO_UDP:
+        if (p->len < SIZEOF_ETH_HDR + hlen + UDP_HLEN)
+            return SHAPER_NORMAL;
+        if (small && (interactive_port(((struct udp_hdr *)l4)->src) || interactive_port(((struct udp_hdr *)l4)->dest)))
+            return SHAPER_INTERACTIVE;
+        break;
+
+    case IP_PROTO_TCP:
+        if (p->len < SIZEOF_ETH_HDR + hlen + TCP_HLEN)
+            return SHAPER_NORMAL;
+        // ACKs, SYNs and FINs without data
+        if (ntohs(IPH_LEN(iph)) == hlen + TCPH_HDRLEN((struct tcp_hdr *)l4) * 4)
+            return SHAPER_INTERACTIVE;
+        break;
+
+    default:
+        return SHAPER_NORMAL;
+    }
+
+    if (dscp > DSCP_CS1 && dscp <= DSCP_CS5)
+        return SHAPER_NORMAL;
+    return p->tot_len >= SHAPER_BULK_LEN ? SHAPER_BULK : SHAPER_NORMAL;
+}
+
+static uint32_t ICACHE_FLASH_ATTR isqrt(uint64_t x)
+{
+    uint64_t r = 0, bit = 1ULL << 62;
+
+    while (bit > x)
+        bit >>= 2;
+    while (bit != 0)
+    {
+        if (x >= r + bit)
+        {
+            x -= r + bit;
+            r = (r >> 1) + bit;
+        }
+        else
+        {
+            r >>= 1;
+        }
+        bit >>= 2;
+    }
+    return (uint32_t)r;
+}
+
+// Time of the next drop: interval / sqrt(count) after t
+static uint32_t ICACHE_FLASH_ATTR control_law(uint32_t t, uint16_t count)
+{
+    uint32_t gap = isqrt((uint64_t)SHAPER_CODEL_INTERVAL * SHAPER_CODEL_INTERVAL * 1000000 / count);
+
+    return t + (gap + 999) / 1000;
+}
+
+// RFC 8289 ok_to_drop(): the head of q has waited sojourn ms
+static bool ICACHE_FLASH_ATTR codel_above(shaper_dir_t *d, shaper_queue_t *q, uint16_t sojourn, uint32_t now)
+{
+    // A single frame is no standing queue
+    if (sojourn < d->target || q->bytes <= SHAPER_QUANTUM)
+    {
+        q->first_above = 0;
+        return false;
+    }
+    if (q->first_above == 0)
+    {
+        q->first_above = (now + SHAPER_CODEL_INTERVAL) | 1;
+        return false;
+    }
+    return (int32_t)(now - q->first_above) >= 0;
+}
+
+// Decides if the head of q, which has waited sojourn ms, is dropped
+static bool ICACHE_FLASH_ATTR codel_drop(shaper_dir_t *d, shaper_queue_t *q, uint16_t sojourn, uint32_t now)
+{
+    bool above = codel_above(d, q, sojourn, now);
+    uint16_t delta;
+
+    if (q->dropping)
+    {
+        if (!above)
+        {
+            q->dropping = false;
+            return false;
+        }
+        if ((int32_t)(now - q->drop_next) < 0)
+            return false;
+        q->count++;
+        q->drop_next = control_law(q->drop_next, q->count);
+        return true;
+    }
+
+    if (!above)
+        return false;
+
+    // Dropping again soon after the last time: start where it ended
+    q->dropping = true;
+    delta = q->count - q->last_count;
+    if (delta > 1 && (int32_t)(now - q->drop_next) < 16 * SHAPER_CODEL_INTERVAL)
+        q->count = delta;
+    else
+        q->count = 1;
+    q->last_count = q->count;
+    q->drop_next = control_law(now, q->count);
+    return true;
+}
+
+static void ICACHE_FLASH_ATTR refill(shaper_dir_t *d, uint64_t now)
+{
+    uint64_t add;
+
+    if (d->rate == 0)
+        return;
+
+    // In millionths of a byte, the rest of a byte is kept for the next refill
+    add = (now - d->t_refill) * d->rate + d->fraction;
+    d->t_refill = now;
+    d->fraction = add % 1000000;
+    add /= 1000000;
+    if (d->tokens + add >= d->burst)
+    {
+        d->tokens = d->burst;
+        d->fraction = 0;
+    }
+    else
+    {
+        d->tokens += add;
+    }
+}
+
+static struct pbuf * ICACHE_FLASH_ATTR queue_pop(shaper_dir_t *d, uint8_t c, shaper_queue_t *q)
+{
+    struct pbuf *p = q->ring[q->head];
+
+    q->head = (q->head + 1) % SHAPER_QUEUE;
+    q->len--;
+    q->bytes -= p->tot_len;
+    d->cls[c].queued--;
+    d->queued--;
+    if (q->len == 0)
+    {
+        q->first_above = 0;
+        q->dropping = false;
+    }
+    return p;
+}
+
+// Drops the oldest frame of a station queue
+static void ICACHE_FLASH_ATTR queue_drop(shaper_t *s, uint8_t dir, uint8_t c, shaper_station_t *st)
+{
+    pbuf_free(queue_pop(&s->dir[dir], c, &st->q[dir][c]));
+    st->drops[dir]++;
+    s->dir[dir].cls[c].drops++;
+}
+
+// Received frames still sit in one of the few rx buffers of the driver,
+// holding them in a queue would stall the reception. Queued frames are
+// moved to the heap, NULL if there is no room.
+static struct pbuf * ICACHE_FLASH_ATTR queue_copy(struct pbuf *p)
+{
+    struct pbuf *q;
+
+    if (p->type == PBUF_RAM)
+        return p;
+
+    q = pbuf_alloc(PBUF_RAW, p->tot_len, PBUF_RAM);
+    if (q != NULL && pbuf_copy(q, p) != ERR_OK)
+    {
+        pbuf_free(q);
+        q = NULL;
+    }
+    pbuf_free(p);
+    return q;
+}
+
+static void ICACHE_FLASH_ATTR deliver(shaper_dir_t *d, struct pbuf *p)
+{
+    bool busy = d->busy;
+
+    d->busy = true;
+    d->deliver(p, d->nif);
+    d->busy = busy;
+}
+
+// The station a frame belongs to, a new entry for an unknown MAC (taking
+// over the longest idle one without queued frames), NULL if none is free
+static shaper_station_t * ICACHE_FLASH_ATTR station_get(shaper_t *s, uint8_t dir, struct pbuf *p, uint64_t now)
+{
+    struct eth_hdr *eth = (struct eth_hdr *)p->payload;
+    struct ip_hdr *iph = (struct ip_hdr *)((uint8_t *)p->payload + SIZEOF_ETH_HDR);
+    uint8_t *mac = dir == SHAPER_UP ? eth->src.addr : eth->dest.addr;
+    shaper_station_t *st, *victim = NULL;
+    int i, j;
+
+    if (p->len < SIZEOF_ETH_HDR || (mac[0] & 0x01) != 0)
+        return NULL;
+
+    for (i = 0; i < SHAPER_STATIONS; i++)
+    {
+        st = &s->stations[i];
+        if (st->used && os_memcmp(st->mac, mac, 6) == 0)
+            break;
+        if (!st->used)
+        {
+            if (victim == NULL || victim->used)
+                victim = st;
+            continue;
+        }
+        for (j = 0; j < SHAPER_CLASSES; j++)
+        {
+            if (st->q[SHAPER_UP][j].len != 0 || st->q[SHAPER_DOWN][j].len != 0)
+                break;
+        }
+        if (j == SHAPER_CLASSES && (victim == NULL || (victim->used && st->last_seen < victim->last_seen)))
+            victim = st;
+    }
+    if (i == SHAPER_STATIONS)
+    {
+        if (victim == NULL)
+            return NULL;
+        st = victim;
+        os_memset(st, 0, sizeof(shaper_station_t));
+        st->used = true;
+        os_memcpy(st->mac, mac, 6);
+    }
+
+    st->last_seen = now;
+    if (eth->type == PP_HTONS(ETHTYPE_IP) && p->len >= SIZEOF_ETH_HDR + IP_HLEN)
+        st->ip.addr = dir == SHAPER_UP ? iph->src.addr : iph->dest.addr;
+    return st;
+}
+
+// Makes room for a frame of st in class c, false if the frame itself
+// has to be dropped
+static bool ICACHE_FLASH_ATTR make_room(shaper_t *s, uint8_t dir, uint8_t c, shaper_station_t *st)
+{
+    shaper_dir_t *d = &s->dir[dir];
+    shaper_station_t *fat = st;
+    int i;
+
+    if (st->q[dir][c].len < SHAPER_QUEUE && d->cls[c].queued < class_budget[c])
+        return true;
+
+    if (st->q[dir][c].len < SHAPER_QUEUE)
+    {
+        for (i = 0; i < SHAPER_STATIONS; i++)
+        {
+            if (s->stations[i].q[dir][c].bytes > fat->q[dir][c].bytes)
+                fat = &s->stations[i];
+        }
+    }
+    if (fat == st && c != SHAPER_BULK)
+        return false;
+
+    queue_drop(s, dir, c, fat);
+    return true;
+}
+
+// The station queue of class c whose head frame is next, by deficit
+// round robin between the stations
+static shaper_queue_t * ICACHE_FLASH_ATTR class_next(shaper_t *s, uint8_t dir, uint8_t c)
+{
+    shaper_class_t *cls = &s->dir[dir].cls[c];
+    shaper_queue_t *q;
+
+    for (;;)
+    {
+        q = &s->stations[cls->rr].q[dir][c];
+        if (q->len == 0)
+        {
+            q->deficit = 0;
+        }
+        else
+        {
+            if (cls->fresh)
+            {
+                q->deficit += SHAPER_QUANTUM;
+                cls->fresh = false;
+            }
+            if (q->ring[q->head]->tot_len <= q->deficit)
+                return q;
+        }
+        cls->rr = (cls->rr + 1) % SHAPER_STATIONS;
+        cls->fresh = true;
+    }
+}
+
+void ICACHE_FLASH_ATTR shaper_init(shaper_t *s, shaper_deliver_fn up, shaper_deliver_fn down)
+{
+    os_memset(s, 0, sizeof(shaper_t));
+    s->dir[SHAPER_UP].deliver = up;
+    s->dir[SHAPER_DOWN].deliver = down;
+    s->dir[SHAPER_UP].weighted = s->dir[SHAPER_DOWN].weighted = SHAPER_NORMAL;
+    s->dir[SHAPER_UP].target = s->dir[SHAPER_DOWN].target = SHAPER_CODEL_TARGET;
+}
+
+void ICACHE_FLASH_ATTR shaper_set_rate(shaper_t *s, uint8_t dir, uint32_t rate, uint32_t burst, uint64_t now)
+{
+    shaper_dir_t *d = &s->dir[dir];
+
+    // A bucket smaller than a frame would never let it pass
+    if (burst < SHAPER_QUANTUM)
+        burst = SHAPER_QUANTUM;
+    if (d->rate == rate && d->burst == burst)
+        return;
+
+    refill(d, now);
+    d->rate = rate;
+    d->burst = burst;
+    d->target = SHAPER_CODEL_TARGET;
+    if (rate != 0 && SHAPER_QUANTUM * 1000 / rate > d->target)
+        d->target = SHAPER_QUANTUM * 1000 / rate;
+    if (d->tokens > burst)
+        d->tokens = burst;
+    d->t_refill = now;
+    d->fraction = 0;
+
+    // Unlimited now, nothing must wait any longer
+    if (rate == 0 && !d->busy)
+        shaper_service(s, dir, now);
+}
+
+uint32_t ICACHE_FLASH_ATTR shaper_input(shaper_t *s, uint8_t dir, struct pbuf *p, struct netif *nif, uint64_t now)
+{
+    shaper_dir_t *d = &s->dir[dir];
+    shaper_station_t *st = station_get(s, dir, p, now);
+    shaper_queue_t *q;
+    uint8_t c;
+
+    d->nif = nif;
+    refill(d, now);
+
+    if (st == NULL)
+    {
+        if (d->rate != 0 && p->tot_len > d->tokens)
+        {
+            pbuf_free(p);
+            d->drops++;
+            return shaper_service(s, dir, now);
+        }
+        if (d->rate != 0)
+            d->tokens -= p->tot_len;
+        deliver(d, p);
+        return shaper_service(s, dir, now);
+    }
+
+    // Nothing waiting, no need to queue
+    if (d->queued == 0 && (d->rate == 0 || p->tot_len <= d->tokens))
+    {
+        if (d->rate != 0)
+            d->tokens -= p->tot_len;
+        st->sent[dir] += p->tot_len;
+        deliver(d, p);
+        return 0;
+    }
+
+    c = classify(p);
+    if (!make_room(s, dir, c, st))
+    {
+        pbuf_free(p);
+        st->drops[dir]++;
+        d->cls[c].drops++;
+        return shaper_service(s, dir, now);
+    }
+    if ((p = queue_copy(p)) == NULL)
+    {
+        st->drops[dir]++;
+        d->cls[c].drops++;
+        return shaper_service(s, dir, now);
+    }
+
+    q = &st->q[dir][c];
+    q->ring[(q->head + q->len) % SHAPER_QUEUE] = p;
+    q->stamp[(q->head + q->len) % SHAPER_QUEUE] = (uint16_t)(now / 1000);
+    q->len++;
+    q->bytes += p->tot_len;
+    d->cls[c].queued++;
+    d->queued++;
+
+    return shaper_service(s, dir, now);
+}
+
+uint32_t ICACHE_FLASH_ATTR shaper_service(shaper_t *s, uint8_t dir, uint64_t now)
+{
+    shaper_dir_t *d = &s->dir[dir];
+    shaper_class_t *cls;
+    shaper_queue_t *q;
+    struct pbuf *p;
+    uint32_t now_ms = (uint32_t)(now / 1000);
+    uint16_t sojourn;
+    uint8_t c;
+
+    // A delivered frame may come back here, the outer call goes on
+    if (d->busy)
+        return 0;
+
+    refill(d, now);
+    while (d->queued > 0)
+    {
+        // Interactive first, then normal and bulk by weighted round robin
+        c = SHAPER_INTERACTIVE;
+        if (d->cls[c].queued == 0)
+        {
+            c = d->weighted;
+            cls = &d->cls[c];
+            if (cls->queued == 0)
+            {
+                cls->deficit = 0;
+                d->weighted = c == SHAPER_NORMAL ? SHAPER_BULK : SHAPER_NORMAL;
+                d->weighted_fresh = true;
+                continue;
+            }
+            if (d->weighted_fresh)
+            {
+                cls->deficit += c == SHAPER_NORMAL ? SHAPER_NORMAL_WEIGHT * SHAPER_QUANTUM : SHAPER_QUANTUM;
+                d->weighted_fresh = false;
+            }
+        }
+        cls = &d->cls[c];
+
+        q = class_next(s, dir, c);
+        p = q->ring[q->head];
+        if (c != SHAPER_INTERACTIVE && p->tot_len > cls->deficit)
+        {
+            d->weighted = c == SHAPER_NORMAL ? SHAPER_BULK : SHAPER_NORMAL;
+            d->weighted_fresh = true;
+            continue;
+        }
+        if (d->rate != 0 && p->tot_len > d->tokens)
+            return (uint32_t)((uint64_t)(p->tot_len - d->tokens) * 1000000 / d->rate) + 1;
+
+        sojourn = (uint16_t)now_ms - q->stamp[q->head];
+        if (c != SHAPER_INTERACTIVE && codel_drop(d, q, sojourn, now_ms))
+        {
+            pbuf_free(queue_pop(d, c, q));
+            s->stations[cls->rr].drops[dir]++;
+            cls->aqm_drops++;
+            continue;
+        }
+        cls->delay += sojourn - (cls->delay >> 3);
+
+        queue_pop(d, c, q);
+        if (d->rate != 0)
+            d->tokens -= p->tot_len;
+        q->deficit -= p->tot_len;
+        if (c != SHAPER_INTERACTIVE)
+            cls->deficit -= p->tot_len;
+        cls->sent++;
+        s->stations[cls->rr].sent[dir] += p->tot_len;
+        if (q->len == 0)
+        {
+            q->deficit = 0;
+            cls->rr = (cls->rr + 1) % SHAPER_STATIONS;
+            cls->fresh = true;
+        }
+        deliver(d, p);
+    }
+    return 0;
+}
+
+void ICACHE_FLASH_ATTR shaper_station_gone(shaper_t *s, const uint8_t *mac)
+{
+    int i, dir, c;
+
+    for (i = 0; i < SHAPER_STATIONS; i++)
+    {
+        shaper_station_t *st = &s->stations[i];
+
+        if (!st->used || os_memcmp(st->mac, mac, 6) != 0)
+            continue;
+        for (dir = 0; dir < SHAPER_DIRS; dir++)
+        {
+            for (c = 0; c < SHAPER_CLASSES; c++)
+            {
+                while (st->q[dir][c].len > 0)
+                    queue_drop(s, dir, c, st);
+                st->q[dir][c].deficit = 0;
+            }
+        }
+        st->used = false;
+    }
+}
+
+#endif /* TOKENBUCKET */
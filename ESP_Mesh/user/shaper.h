@@ -0,0 +1,154 @@
+#ifndef _SHAPER_H_
+#define _SHAPER_H_
+
+#include "c_types.h"
+#include "lwip/pbuf.h"
+#include "lwip/netif.h"
+#include "lwip/ip_addr.h"
+#include "user_config.h"
+
+//
+// Per station traffic shaper for the SoftAP
+//
+// Each direction has one token bucket for the configured rate. It is
+// refilled from the time of the last refill whenever a frame arrives or
+// is sent, with the remainder of a byte carried over, so the rate does
+// not depend on the timer period.
+//
+// Frames that cannot be sent right away wait in a small queue of their
+// station (keyed by the MAC of the client, which also covers routed
+// mesh children with many addresses). The queues are served by deficit
+// round robin: every station with a backlog gets up to one quantum of
+// bytes per round, so one heavy client cannot starve the others, no
+// matter how fast it sends. Drops are counted per station. The stations
+// share the one bucket instead of having a bucket each: what an idle
+// station leaves goes to the busy ones (test/bench_shaper_fairness.c).
+//
+// Within a direction the frames are classified (DSCP, protocol, ports,
+// size) into three classes. Interactive frames (DNS, ICMP, DHCP, NTP,
+// TCP segments without payload, EF/CS6/CS7 - all only if small) are
+// always sent first. Normal and bulk (large TCP/UDP frames, CS1) share
+// the rest by weighted round robin. The station round robin runs
+// within each class.
+//
+// Each class has its own budget of queued frames. When it is used up,
+// the station with the most queued bytes in the class loses its oldest
+// frame. If that is the station of the new frame, or its queue is full,
+// interactive and normal drop the new frame instead. Bulk drops the
+// oldest frame of the station (head drop), so TCP notices the loss a
+// queue length earlier.
+//
+// Normal and bulk queues are managed like CoDel (RFC 8289): every frame
+// is stamped when queued. While the frames of a station queue have
+// waited longer than the target delay for a whole interval, the queue
+// drops frames at its head, with the gaps shrinking by the square root
+// of the number of drops, until the delay is below the target again. So
+// a standing queue is drained early, one flow at a time, instead of
+// running out of buffers and tail dropping everything at once. The
+// target is at least the time to send one full frame at the rate.
+//
+// Broadcasts and frames of stations that do not fit into the table are
+// not queued: they are sent if there are enough tokens and dropped
+// otherwise.
+//
+// The shaper owns the pbufs given to it, the deliver callback gets the
+// ownership of a sent frame. A frame that has to wait is copied to a
+// PBUF_RAM first (unless it is one already), so the queues never hold
+// the rx buffers of the driver. Times are in us (get_long_systime()).
+//
+
+#define SHAPER_UP       0       // from the SoftAP clients
+#define SHAPER_DOWN     1       // to the SoftAP clients
+#define SHAPER_DIRS     2
+
+#define SHAPER_QUANTUM  1514    // bytes per round, one full frame
+
+// Traffic classes
+#define SHAPER_INTERACTIVE  0   // strict priority
+#define SHAPER_NORMAL       1
+#define SHAPER_BULK         2
+#define SHAPER_CLASSES      3
+
+#define SHAPER_SMALL        256     // max frame size of the interactive class
+#define SHAPER_BULK_LEN     576     // min frame size of bulk TCP/UDP
+#define SHAPER_NORMAL_WEIGHT 3      // quanta of normal per quantum of bulk
+
+#define SHAPER_CODEL_TARGET   5     // ms
+#define SHAPER_CODEL_INTERVAL 100   // ms
+
+typedef void (*shaper_deliver_fn)(struct pbuf *p, struct netif *nif);
+
+typedef struct {
+        struct pbuf *ring[SHAPER_QUEUE];
+        uint16_t stamp[SHAPER_QUEUE];   // time queued, ms
+        uint8_t head;
+        uint8_t len;
+        uint16_t bytes;
+        int32_t deficit;
+        // CoDel state, times in ms
+        bool dropping;
+        uint16_t count;
+        uint16_t last_count;
+        uint32_t first_above;   // 0 if below the target
+        uint32_t drop_next;
+} shaper_queue_t;
+
+typedef struct {
+        bool used;
+        uint8_t mac[6];
+        ip_addr_t ip;           // last address seen, for display only
+        uint64_t last_seen;
+        shaper_queue_t q[SHAPER_DIRS][SHAPER_CLASSES];
+        uint32_t drops[SHAPER_DIRS];
+        uint64_t sent[SHAPER_DIRS];     // bytes
+} shaper_station_t;
+
+typedef struct {
+        uint16_t queued;        // frames in all station queues of the class
+        uint8_t rr;             // station served by the round robin
+        bool fresh;             // rr has not got its quantum yet
+        int32_t deficit;        // of the weighted round robin between classes
+        uint32_t sent;          // frames sent from the queues
+        uint32_t drops;         // frames that did not fit
+        uint32_t aqm_drops;     // frames dropped by CoDel
+        uint32_t delay;         // mean time in the queue, ms * 8
+} shaper_class_t;
+
+typedef struct {
+        shaper_deliver_fn deliver;
+        struct netif *nif;
+        uint32_t rate;          // bytes/s, 0 if unlimited
+        uint32_t burst;         // bucket size in bytes
+        uint32_t tokens;
+        uint64_t t_refill;
+        uint32_t fraction;      // of a token, in millionths
+        uint32_t target;        // CoDel target in ms
+        uint16_t queued;        // frames in all queues
+        shaper_class_t cls[SHAPER_CLASSES];
+        uint8_t weighted;       // class served by the weighted round robin
+        bool weighted_fresh;
+        bool busy;              // delivering, do not reenter
+        uint32_t drops;         // frames that do not belong to a station
+} shaper_dir_t;
+
+typedef struct {
+        shaper_station_t stations[SHAPER_STATIONS];
+        shaper_dir_t dir[SHAPER_DIRS];
+} shaper_t;
+
+void shaper_init(shaper_t *s, shaper_deliver_fn up, shaper_deliver_fn down);
+
+// Sets the rate of a direction (0: unlimited, queued frames are sent)
+void shaper_set_rate(shaper_t *s, uint8_t dir, uint32_t rate, uint32_t burst, uint64_t now);
+
+// Sends, queues or drops an ethernet frame, returns the time in us
+// until shaper_service() should be called again, 0 if nothing is queued
+uint32_t shaper_input(shaper_t *s, uint8_t dir, struct pbuf *p, struct netif *nif, uint64_t now);
+
+// Sends what the tokens allow, same return value as shaper_input()
+uint32_t shaper_service(shaper_t *s, uint8_t dir, uint64_t now);
+
+// A station left the SoftAP, drops its frames and frees its entry
+void shaper_station_gone(shaper_t *s, const uint8_t *mac);
+
+#endif
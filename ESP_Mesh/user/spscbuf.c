@@ -0,0 +1,136 @@
+/*
+ * spscbuf.c - single-producer/single-consumer byte FIFO.
+ */
+
+#include "spscbuf.h"
+
+#include <sys/param.h>
+
+#include "c_types.h"
+#include "osapi.h"
+#include "mem.h"
+
+/*
+ * Keeps the compiler from moving buffer accesses across an index
+ * update. The LX106 is single core and in-order, so this is all the
+ * ordering needed between an ISR and the task level.
+ */
+#define spscbuf_barrier() __asm__ __volatile__("" ::: "memory")
+
+struct spscbuf_t
+{
+    uint8_t *buf;
+    uint16_t mask;
+    volatile uint16_t head; /* written by the producer only */
+    volatile uint16_t tail; /* written by the consumer only */
+};
+
+spscbuf_t ICACHE_FLASH_ATTR
+spscbuf_new(size_t capacity)
+{
+    size_t size = 1;
+
+    if (capacity > 0x8000)
+        return 0;
+    while (size < capacity)
+        size <<= 1;
+
+    spscbuf_t rb = (spscbuf_t)os_malloc(sizeof(struct spscbuf_t));
+    if (rb) {
+        rb->buf = (uint8_t *)os_malloc(size);
+        if (rb->buf == 0) {
+            os_free(rb);
+            return 0;
+        }
+        rb->mask = size - 1;
+        spscbuf_reset(rb);
+    }
+    return rb;
+}
+
+void ICACHE_FLASH_ATTR
+spscbuf_free(spscbuf_t *rb)
+{
+    os_free((*rb)->buf);
+    os_free(*rb);
+    *rb = 0;
+}
+
+void ICACHE_FLASH_ATTR
+spscbuf_reset(spscbuf_t rb)
+{
+    rb->head = rb->tail = 0;
+}
+
+size_t
+spscbuf_capacity(const struct spscbuf_t *rb)
+{
+    return (size_t)rb->mask + 1;
+}
+
+size_t
+spscbuf_bytes_used(const struct spscbuf_t *rb)
+{
+    /* free-running 16 bit indices, the difference wraps correctly */
+    return (uint16_t)(rb->head - rb->tail);
+}
+
+size_t
+spscbuf_bytes_free(const struct spscbuf_t *rb)
+{
+    return spscbuf_capacity(rb) - spscbuf_bytes_used(rb);
+}
+
+int
+spscbuf_push(spscbuf_t rb, uint8_t ch)
+{
+    uint16_t head = rb->head;
+
+    if ((uint16_t)(head - rb->tail) > rb->mask)
+        return 0;
+
+    rb->buf[head & rb->mask] = ch;
+    spscbuf_barrier();
+    rb->head = head + 1;
+    return 1;
+}
+
+size_t
+spscbuf_push_n(spscbuf_t rb, const void *src, size_t count)
+{
+    const uint8_t *u8src = src;
+    uint16_t head = rb->head;
+    uint16_t tail = rb->tail;
+    size_t n, first;
+
+    spscbuf_barrier();
+    n = MIN(count, spscbuf_capacity(rb) - (uint16_t)(head - tail));
+    first = MIN(n, spscbuf_capacity(rb) - (head & rb->mask));
+
+    os_memcpy(rb->buf + (head & rb->mask), u8src, first);
+    os_memcpy(rb->buf, u8src + first, n - first);
+
+    spscbuf_barrier();
+    rb->head = head + n;
+    return n;
+}
+
+size_t
+spscbuf_pop_n(void *dst, spscbuf_t rb, size_t count)
+{
+    uint8_t *u8dst = dst;
+    uint16_t tail = rb->tail;
+    uint16_t head = rb->head;
+    size_t n, first;
+
+    spscbuf_barrier();
+    n = MIN(count, (uint16_t)(head - tail));
+    first = MIN(n, spscbuf_capacity(rb) - (tail & rb->mask));
+
+    os_memcpy(u8dst, rb->buf + (tail & rb->mask), first);
+    os_memcpy(u8dst + first, rb->buf, n - first);
+
+    spscbuf_barrier();
+    rb->tail = tail + n;
+    return n;
+}
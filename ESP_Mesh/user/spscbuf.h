@@ -0,0 +1,87 @@
+#ifndef INCLUDED_SPSCBUF_H
+#define INCLUDED_SPSCBUF_H
+
+/*
+ * spscbuf.h - single-producer/single-consumer byte FIFO.
+ *
+ * A companion to ringbuf.h for handing data from an interrupt handler
+ * to a task (or vice versa). The capacity is a power of two and the
+ * head and tail indices run freely, so all index arithmetic is a mask
+ * instead of a modulus, and "full" and "empty" are distinguished
+ * without sacrificing a byte.
+ *
+ * The producer only ever writes the head index, the consumer only
+ * ever writes the tail index. As long as there is exactly one of each
+ * (e.g., the UART ISR and the console task) no interrupt locking is
+ * needed. Unlike ringbuf_memcpy_into, a push never overwrites unread
+ * data; what does not fit is refused and counted by the caller.
+ *
+ * All accessors are placed in IRAM so they can be used from ISRs.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct spscbuf_t *spscbuf_t;
+
+/*
+ * Create a new FIFO with at least the given capacity; the capacity is
+ * rounded up to the next power of two (max. 32768).
+ *
+ * Returns the new FIFO object, or 0 if there's not enough memory.
+ */
+spscbuf_t
+spscbuf_new(size_t capacity);
+
+/*
+ * Deallocate a FIFO, and, as a side effect, set the pointer to 0.
+ */
+void
+spscbuf_free(spscbuf_t *rb);
+
+/*
+ * Discard all data. Only safe while neither producer nor consumer is
+ * active (e.g., with the ISR disabled).
+ */
+void
+spscbuf_reset(spscbuf_t rb);
+
+/*
+ * The usable capacity of the FIFO, in bytes (a power of two).
+ */
+size_t
+spscbuf_capacity(const struct spscbuf_t *rb);
+
+/*
+ * The number of bytes currently stored, resp. free. Either side may
+ * call these; the result is a snapshot that can only grow (used, for
+ * the consumer; free, for the producer) until that side acts.
+ */
+size_t
+spscbuf_bytes_used(const struct spscbuf_t *rb);
+
+size_t
+spscbuf_bytes_free(const struct spscbuf_t *rb);
+
+/*
+ * Producer side. Append one byte; returns 1 on success, 0 if full.
+ */
+int
+spscbuf_push(spscbuf_t rb, uint8_t ch);
+
+/*
+ * Producer side. Append up to count bytes from src in one go. Returns
+ * the number of bytes actually stored, which is less than count if
+ * the FIFO filled up.
+ */
+size_t
+spscbuf_push_n(spscbuf_t rb, const void *src, size_t count);
+
+/*
+ * Consumer side. Remove up to count bytes into dst. Returns the number
+ * of bytes actually removed.
+ */
+size_t
+spscbuf_pop_n(void *dst, spscbuf_t rb, size_t count);
+
+#endif /* INCLUDED_SPSCBUF_H */
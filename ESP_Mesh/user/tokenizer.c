@@ -0,0 +1,207 @@
+#include "c_types.h"
+#include "osapi.h"
+
+#include "tokenizer.h"
+
+typedef enum {
+        TOK_BLANK = 0, TOK_WORD, TOK_QUOTED, TOK_ESCAPE, TOK_HEX1, TOK_HEX2
+} tok_state;
+
+static int ICACHE_FLASH_ATTR hex_digit(uint8_t c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+// Chars copied as they are, without a change of state
+static bool ICACHE_FLASH_ATTR plain_char(uint8_t c, tok_state state)
+{
+    if (c == '"' || c == '\\' || c == '%')
+        return false;
+    return state == TOK_QUOTED ? c != 0 && c != 8 : c > ' ';
+}
+
+int ICACHE_FLASH_ATTR tokenize_spans(const struct ringbuf_span *spans, int nspans, char *buf, size_t buf_len,
+                                     char **tokens, int max_tokens, int *err_offset)
+{
+    tok_state state = TOK_BLANK;
+    tok_state resume = TOK_BLANK;  // state after an escape or hex sequence
+    char *q = buf;
+    char *buf_end = buf + buf_len;
+    uint8_t hex = 0;
+    int token_count = 0;
+    int offset = 0;
+    int quote_offset = 0;
+    int i;
+    size_t j;
+
+    for (i = 0; i < nspans; i++)
+    {
+        const uint8_t *p = spans[i].data;
+
+        for (j = 0; j < spans[i].len; j++, offset++)
+        {
+            uint8_t c = p[j];
+            int d;
+
+            if (c == 0)
+                goto done;
+
+            // keep room for the terminating 0 of the current token
+            if (q + 1 >= buf_end)
+                goto error;
+
+            switch (state)
+            {
+            case TOK_ESCAPE:
+                *q++ = c;
+                state = resume;
+                continue;
+
+            case TOK_HEX1:
+                if ((d = hex_digit(c)) < 0)
+                    goto error;
+                hex = d << 4;
+                state = TOK_HEX2;
+                continue;
+
+            case TOK_HEX2:
+                if ((d = hex_digit(c)) < 0)
+                    goto error;
+                *q++ = hex | d;
+                state = resume;
+                continue;
+
+            default:
+                break;
+            }
+
+            if (c == 8)
+            {
+                // backspace - delete previous char, reopen the last token if needed
+                if (state != TOK_BLANK && q == tokens[token_count - 1])
+                {
+                    // nothing in the token yet, e.g. right after a quote
+                    token_count--;
+                    state = TOK_BLANK;
+                    continue;
+                }
+                if (q == buf)
+                    continue;
+                if (state == TOK_BLANK)
+                {
+                    if (token_count == 0)
+                        continue;
+                    state = TOK_WORD;
+                }
+                q--;
+                if (state == TOK_WORD && q == tokens[token_count - 1])
+                {
+                    token_count--;
+                    state = TOK_BLANK;
+                }
+                continue;
+            }
+
+            if (state == TOK_BLANK && c > ' ')
+            {
+                if (token_count == max_tokens)
+                    goto done;
+                tokens[token_count++] = q;
+                state = TOK_WORD;
+            }
+
+            if (c == '"')
+            {
+                if (state == TOK_QUOTED)
+                {
+                    state = TOK_WORD;
+                }
+                else
+                {
+                    state = TOK_QUOTED;
+                    quote_offset = offset;
+                }
+            }
+            else if (c == '\\')
+            {
+                resume = state;
+                state = TOK_ESCAPE;
+            }
+            else if (c == '%')
+            {
+                if (j + 2 < spans[i].len)
+                {
+                    // both digits in this span, decode them right away
+                    int hi = hex_digit(p[j + 1]);
+                    int lo = hex_digit(p[j + 2]);
+
+                    if (hi < 0 || lo < 0)
+                    {
+                        offset += hi < 0 ? 1 : 2;
+                        goto error;
+                    }
+                    *q++ = hi << 4 | lo;
+                    j += 2;
+                    offset += 2;
+                    continue;
+                }
+                resume = state;
+                state = TOK_HEX1;
+            }
+            else if (c <= ' ' && state != TOK_QUOTED)
+            {
+                if (state == TOK_WORD)
+                {
+                    *q++ = 0;
+                    state = TOK_BLANK;
+                }
+            }
+            else
+            {
+                // copy a run of plain chars in one go, as far as buf allows
+                size_t n = 1;
+                size_t max = spans[i].len - j;
+
+                if (max > (size_t)(buf_end - q - 1))
+                    max = buf_end - q - 1;
+                while (n < max && plain_char(p[j + n], state))
+                    n++;
+                os_memcpy(q, p + j, n);
+                q += n;
+                j += n - 1;
+                offset += n - 1;
+            }
+        }
+    }
+
+done:
+    if (state == TOK_QUOTED)
+    {
+        offset = quote_offset;
+        goto error;
+    }
+    if (state == TOK_ESCAPE || state == TOK_HEX1 || state == TOK_HEX2)
+        goto error;
+    *q = 0;
+    return token_count;
+
+error:
+    if (err_offset != NULL)
+        *err_offset = offset;
+    return -1;
+}
+
+int ICACHE_FLASH_ATTR parse_str_into_tokens(char *str, char **tokens, int max_tokens)
+{
+    struct ringbuf_span span;
+
+    span.data = str;
+    span.len = os_strlen(str);
+    return tokenize_spans(&span, 1, str, span.len + 1, tokens, max_tokens, NULL);
+}
@@ -0,0 +1,33 @@
+#ifndef _TOKENIZER_H_
+#define _TOKENIZER_H_
+
+#include "c_types.h"
+#include "ringbuf.h"
+
+//
+// Single pass command line tokenizer
+//
+// Unescapes and splits in one go:
+//   %XX        hex quoted char
+//   \c         c taken literally (also blanks and quotes)
+//   "a b"      quoted string, blanks kept, may be empty; any bare '"'
+//              opens one, so a literal quote needs \" or %22
+//   backspace  deletes the previous char
+//   <= ' '     separates tokens
+//
+// Returns the number of tokens, or -1 on a syntax error (bad hex digit,
+// unterminated quote or escape, or output buffer too small). In that case
+// err_offset (if not NULL) is set to the byte offset of the offending
+// input char.
+//
+
+// Tokenizes the concatenation of nspans input spans into buf (buf_len bytes).
+// The tokens point into buf. Input and buf may be the same memory, as the
+// output never overtakes the input.
+int tokenize_spans(const struct ringbuf_span *spans, int nspans, char *buf, size_t buf_len,
+                   char **tokens, int max_tokens, int *err_offset);
+
+// In place tokenizing of a 0-terminated string
+int parse_str_into_tokens(char *str, char **tokens, int max_tokens);
+
+#endif
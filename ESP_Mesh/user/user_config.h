@@ -20,6 +20,8 @@
 //
 #define		MAX_CON_SEND_SIZE 1500
 #define		MAX_CON_CMD_SIZE 80
+#define		MAX_CON_BACKLOG 4096    // heap for output that does not fit into the send buffer
+#define		MAX_CON_TCP_RX_SIZE 256 // received lines of the console connection
 
 //
 // Defines the default GPIO pin if you have a status LED connected to a GPIO pin
@@ -94,6 +96,43 @@
 #define		TOKENBUCKET 1
 // Burst size (token bucket size) in seconds of average bitrate
 #define		MAX_TOKEN_RATIO 4
+// Stations with their own queue, frames per station and class, and frames queued per direction
+// in the interactive, normal and bulk class. Queued upstream frames hold WiFi receive buffers,
+// so keep the totals small.
+#define		SHAPER_STATIONS MAX_CLIENTS
+#define		SHAPER_QUEUE 8
+#define		SHAPER_INTERACTIVE_QUEUED 4
+#define		SHAPER_NORMAL_QUEUED 8
+#define		SHAPER_BULK_QUEUED 8
+
+//
+// Define this to 1 if established NATed TCP/UDP flows should bypass the IP stack
+// (forwarding cache with FASTPATH_ENTRIES flows, ~48 bytes each).
+//
+#define		FASTPATH 1
+#define		FASTPATH_ENTRIES 16
+
+//
+// Nodes of the routing trie (~24 bytes each), a route needs up to two of them.
+// Bounds the number of static and mesh routes together. Taken from the heap
+// 32 at a time as routes come in, the full pool is ~12 KB.
+//
+#define		ROUTE_TRIE_NODES 512
+
+//
+// Define this to 1 if mesh nodes should announce their AP networks to their uplink
+// (routes instead of NAT between the levels, up to MESH_ROUTE_LEARNED prefixes learned from children).
+// Only used in operational automesh mode. Children are recognized by their MESH_IE beacons.
+//
+#define		MESH_ROUTING 1
+#define		MESH_ROUTE_LEARNED 16
+
+//
+// Define this to 1 if automesh nodes should announce level, load and uplink state
+// in a vendor IE of their beacons (MESH_IE_CACHE neighbors remembered, ~20 bytes each).
+//
+#define		MESH_IE 1
+#define		MESH_IE_CACHE 16
 
 //
 // Define this to 1 if you want to offer monitoring access to all transmitted data between the soft AP and all STAs.
@@ -29,6 +29,15 @@
 #include "ringbuf.h"
 #include "user_config.h"
 #include "config_flash.h"
+#include "console_cmd.h"
+#include "tokenizer.h"
+#include "json_writer.h"
+#include "fastpath.h"
+#include "route_trie.h"
+#include "mesh_route.h"
+#include "shaper.h"
+#include "automesh.h"
+#include "mesh_ie.h"
 #include "sys_time.h"
 #include "sntp.h"
 
@@ -36,6 +45,9 @@
 
 #if WEB_CONFIG
 #include "web.h"
+#include "http_req.h"
+#include "web_render.h"
+#include "web_session.h"
 #endif
 
 
@@ -69,14 +81,19 @@ uint64_t Bytes_in, Bytes_out, Bytes_in_last, Bytes_out_last;
 uint32_t Packets_in, Packets_out, Packets_in_last, Packets_out_last;
 uint64_t t_old;
 
+// Active flows and table size of the NAPT in liblwip_open_napt.a (ip.o),
+// not in lwip_napt.h
+extern int nr_active_napt_tcp, nr_active_napt_udp, nr_active_napt_icmp;
+extern u16_t ip_napt_max;
+
 #if DAILY_LIMIT
 uint64_t Bytes_per_day;
 uint8_t last_date;
 #endif
 
 #if TOKENBUCKET
-uint64_t t_old_tb;
-uint32_t token_bucket_ds, token_bucket_us;
+static shaper_t shaper;
+static os_timer_t shaper_timer[SHAPER_DIRS];
 #endif
 
 /* Hold the system wide configuration */
@@ -84,6 +101,19 @@ sysconfig_t config;
 
 static ringbuf_t console_rx_buffer, console_tx_buffer;
 
+// Bytes of console_tx_buffer handed to espconn_send, released in console_send_done()
+static uint16_t console_inflight;
+// Output that did not fit into console_tx_buffer, follows it from console_send_done()
+static uint8_t *console_backlog;
+static uint16_t console_backlog_len;
+
+#if REMOTE_CONFIG
+// Bytes of the console connection, the task takes them line by line
+static ringbuf_t console_tcp_rx;
+static bool console_tcp_posted;     // SIG_CONSOLE_RX in the task queue
+static bool console_tcp_discard;    // the rest of a line that did not fit
+#endif
+
 static ip_addr_t my_ip;
 static ip_addr_t dns_ip;
 bool connected;
@@ -96,6 +126,17 @@ static ip_addr_t resolve_ip;
 uint8_t mesh_level;
 uint8_t uplink_bssid[6];
 
+// Uplink selection, when automesh is on
+static automesh_t automesh;
+
+#if MESH_IE
+// Mesh IEs of the neighbors and our own
+static mesh_ie_cache_t mesh_ie_cache;
+static uint8_t mesh_ie_oui[3] = {MESH_IE_OUI0, MESH_IE_OUI1, MESH_IE_OUI2};
+static uint8_t mesh_ie_buf[MESH_IE_LEN];
+static uint32_t mesh_ie_next;
+#endif
+
 static netif_input_fn orig_input_ap, orig_input_sta;
 static netif_linkoutput_fn orig_output_ap, orig_output_sta;
 
@@ -109,10 +150,67 @@ struct espconn *currentconn;
 void ICACHE_FLASH_ATTR user_set_softap_wifi_config(void);
 void ICACHE_FLASH_ATTR user_set_softap_ip_config(void);
 void ICACHE_FLASH_ATTR user_set_station_config(void);
+void ICACHE_FLASH_ATTR automesh_scan_done(void *arg, STATUS status);
+
+// The bytes of a send from the ring in flight and those not sent yet
+// must not be overwritten: what does not fit waits in the backlog, up
+// to MAX_CON_BACKLOG, and everything written later queues behind it
+static void ICACHE_FLASH_ATTR console_write(const void *data, size_t len)
+{
+    size_t n = len;
+    uint8_t *backlog;
+
+    if (console_backlog_len == 0)
+    {
+        if (n > ringbuf_bytes_free(console_tx_buffer))
+            n = ringbuf_bytes_free(console_tx_buffer);
+        ringbuf_memcpy_into(console_tx_buffer, data, n);
+        if (n == len)
+            return;
+    }
+    else
+    {
+        n = 0;
+    }
+
+    len -= n;
+    if (len > MAX_CON_BACKLOG - console_backlog_len)
+        len = MAX_CON_BACKLOG - console_backlog_len;
+    if (len == 0 || (backlog = (uint8_t *)os_malloc(console_backlog_len + len)) == NULL)
+        return;
+    os_memcpy(backlog, console_backlog, console_backlog_len);
+    os_memcpy(backlog + console_backlog_len, (const uint8_t *)data + n, len);
+    if (console_backlog != NULL)
+        os_free(console_backlog);
+    console_backlog = backlog;
+    console_backlog_len += len;
+}
+
+// Moves what the ring has room for from the backlog into it
+static void ICACHE_FLASH_ATTR console_backlog_drain(void)
+{
+    size_t n = ringbuf_bytes_free(console_tx_buffer);
+
+    if (console_backlog_len == 0)
+        return;
+    if (n > console_backlog_len)
+        n = console_backlog_len;
+    ringbuf_memcpy_into(console_tx_buffer, console_backlog, n);
+    console_backlog_len -= n;
+    if (console_backlog_len == 0)
+    {
+        os_free(console_backlog);
+        console_backlog = NULL;
+    }
+    else
+    {
+        os_memmove(console_backlog, console_backlog + n, console_backlog_len);
+    }
+}
 
 void ICACHE_FLASH_ATTR to_console(char *str)
 {
-    ringbuf_memcpy_into(console_tx_buffer, str, os_strlen(str));
+    console_write(str, os_strlen(str));
 }
 
 void ICACHE_FLASH_ATTR mac_2_buff(char *buf, uint8_t mac[6])
@@ -224,107 +322,327 @@ static void ICACHE_FLASH_ATTR patch_netif(ip_addr_t netif_ip, netif_input_fn ifn
     }
 }
 
-int ICACHE_FLASH_ATTR parse_str_into_tokens(char *str, char **tokens, int max_tokens)
+err_t ICACHE_FLASH_ATTR my_output_sta(struct netif *outp, struct pbuf *p);
+err_t ICACHE_FLASH_ATTR my_output_ap(struct netif *outp, struct pbuf *p);
+
+// Packets from the SoftAP clients, after shaping
+static void ICACHE_FLASH_ATTR ap_input_forward(struct pbuf *p, struct netif *inp)
 {
-    char *p, *q, *end;
-    int token_count = 0;
-    bool in_token = false;
+#if FASTPATH
+    struct netif *nif;
+#endif
+
+    Bytes_in += p->tot_len;
+    Packets_in++;
+#if DAILY_LIMIT
+    Bytes_per_day += p->tot_len;
+#endif
 
-    // preprocessing
-    for (p = q = str; *p != 0; p++)
+#if FASTPATH
+    if (inp->napt && (nif = fastpath_out(p, inp, (uint32_t)(get_long_systime() / 1000))) != NULL)
     {
-        if (*(p) == '%' && *(p + 1) != 0 && *(p + 2) != 0)
-        {
-            // quoted hex
-            uint8_t a;
-            p++;
-            if (*p <= '9')
-                a = *p - '0';
-            else
-                a = toupper(*p) - 'A' + 10;
-            a <<= 4;
-            p++;
-            if (*p <= '9')
-                a += *p - '0';
-            else
-                a += toupper(*p) - 'A' + 10;
-            *q++ = a;
-        }
-        else if (*p == '\\' && *(p + 1) != 0)
-        {
-            // next char is quoted - just copy it, skip this one
-            *q++ = *++p;
-        }
-        else if (*p == 8)
-        {
-            // backspace - delete previous char
-            if (q != str)
-                q--;
-        }
-        else if (*p <= ' ')
-        {
-            // mark this as whitespace
-            *q++ = 0;
-        }
-        else
-        {
-            *q++ = *p;
-        }
+        my_output_sta(nif, p);
+        pbuf_free(p);
+        return;
+    }
+#endif
+
+    orig_input_ap(p, inp);
+#if FASTPATH
+    fastpath_learn_done();
+#endif
+}
+
+// Packets to the SoftAP clients, after shaping
+static void ICACHE_FLASH_ATTR ap_output_forward(struct pbuf *p, struct netif *outp)
+{
+    Bytes_out += p->tot_len;
+    Packets_out++;
+#if DAILY_LIMIT
+    Bytes_per_day += p->tot_len;
+#endif
+
+    orig_output_ap(outp, p);
+    pbuf_free(p);
+}
+
+#if TOKENBUCKET
+static void ICACHE_FLASH_ATTR shaper_arm(uint8_t dir, uint32_t wait);
+
+static void ICACHE_FLASH_ATTR shaper_timer_cb(void *arg)
+{
+    uint8_t dir = (uint32_t)arg;
+
+    shaper_arm(dir, shaper_service(&shaper, dir, get_long_systime()));
+}
+
+// Wakes up the shaper when the tokens for the next queued frame are there
+static void ICACHE_FLASH_ATTR shaper_arm(uint8_t dir, uint32_t wait)
+{
+    if (wait == 0)
+        return;
+    os_timer_disarm(&shaper_timer[dir]);
+    os_timer_setfn(&shaper_timer[dir], shaper_timer_cb, (void *)(uint32_t)dir);
+    os_timer_arm(&shaper_timer[dir], (wait + 999) / 1000, 0);
+}
+#endif
+
+err_t ICACHE_FLASH_ATTR my_input_ap(struct pbuf *p, struct netif *inp)
+{
+#if ACLS
+    if (!(acl_check_packet(FROM_STA, p) & ACL_ALLOW))
+    {
+        pbuf_free(p);
+        return ERR_OK;
+    }
+#endif
+#if DAILY_LIMIT
+    if (config.daily_limit != 0 && Bytes_per_day / 1024 >= config.daily_limit)
+    {
+        pbuf_free(p);
+        return ERR_OK;
     }
+#endif
+
+#if TOKENBUCKET
+    shaper_arm(SHAPER_UP, shaper_input(&shaper, SHAPER_UP, p, inp, get_long_systime()));
+#else
+    ap_input_forward(p, inp);
+#endif
+    return ERR_OK;
+}
+
+err_t ICACHE_FLASH_ATTR my_output_ap(struct netif *outp, struct pbuf *p)
+{
+#if ACLS
+    if (!(acl_check_packet(TO_STA, p) & ACL_ALLOW))
+        return ERR_OK;
+#endif
+
+    // The frame is only lent to us, keep it until it is sent
+    pbuf_ref(p);
+#if TOKENBUCKET
+    shaper_arm(SHAPER_DOWN, shaper_input(&shaper, SHAPER_DOWN, p, outp, get_long_systime()));
+#else
+    ap_output_forward(p, outp);
+#endif
+    return ERR_OK;
+}
 
-    end = q;
-    *q = 0;
+err_t ICACHE_FLASH_ATTR my_input_sta(struct pbuf *p, struct netif *inp)
+{
+#if FASTPATH
+    struct netif *nif;
+#endif
 
-    // cut into tokens
-    for (p = str; p != end; p++)
+#if ACLS
+    if (!(acl_check_packet(FROM_AP, p) & ACL_ALLOW))
     {
-        if (*p == 0)
-        {
-            if (in_token)
-            {
-                in_token = false;
-            }
-        }
-        else
+        pbuf_free(p);
+        return ERR_OK;
+    }
+#endif
+
+#if FASTPATH
+    nif = fastpath_in(p, (uint32_t)(get_long_systime() / 1000));
+    if (nif != NULL)
+    {
+        my_output_ap(nif, p);
+        pbuf_free(p);
+        return ERR_OK;
+    }
+#endif
+
+    return orig_input_sta(p, inp);
+}
+
+err_t ICACHE_FLASH_ATTR my_output_sta(struct netif *outp, struct pbuf *p)
+{
+#if ACLS
+    if (!(acl_check_packet(TO_AP, p) & ACL_ALLOW))
+        return ERR_OK;
+#endif
+
+#if FASTPATH
+    fastpath_learn(p, outp, (uint32_t)(get_long_systime() / 1000));
+#endif
+
+    return orig_output_sta(outp, p);
+}
+
+#if MESH_ROUTING
+static mesh_route_t mesh_route;
+static struct espconn *mesh_route_conn;
+// Our uplink routes to the AP network, it is not NATed
+static bool mesh_routed;
+
+static void ICACHE_FLASH_ATTR mesh_route_send(void *ctx, uint32_t dst, const uint8_t *msg, uint16_t len)
+{
+    if (mesh_route_conn == NULL)
+        return;
+    os_memcpy(mesh_route_conn->proto.udp->remote_ip, &dst, 4);
+    mesh_route_conn->proto.udp->remote_port = MESH_ROUTE_PORT;
+    espconn_sendto(mesh_route_conn, (uint8_t *)msg, len);
+}
+
+static bool ICACHE_FLASH_ATTR mesh_route_install(void *ctx, uint32_t net, uint8_t len, uint32_t gw)
+{
+    ip_addr_t ip, mask, gw_ip;
+
+    ip.addr = net;
+    mask.addr = len == 0 ? 0 : htonl(0xffffffff << (32 - len));
+    gw_ip.addr = gw;
+    return route_add_dynamic(ip, mask, gw_ip);
+}
+
+static void ICACHE_FLASH_ATTR mesh_route_withdraw(void *ctx, uint32_t net, uint8_t len, uint32_t gw)
+{
+    ip_addr_t ip, mask;
+
+    ip.addr = net;
+    mask.addr = len == 0 ? 0 : htonl(0xffffffff << (32 - len));
+    route_rm_dynamic(ip, mask);
+}
+
+static void ICACHE_FLASH_ATTR mesh_route_set_nat(void *ctx, bool enable)
+{
+    ip_addr_t ap_ip = config.network_addr;
+
+    os_printf("Mesh routing %s, NAT %s\r\n", enable ? "off" : "on", config.nat_enable && enable ? "on" : "off");
+    mesh_routed = !enable;
+    ip4_addr4(&ap_ip) = 1;
+    patch_netif(ap_ip, NULL, NULL, NULL, NULL, config.nat_enable && enable);
+#if FASTPATH
+    fastpath_flush();
+#endif
+}
+
+// Only automesh nodes on our AP may announce routes: src must hold a
+// DHCP lease of a station on our AP, and the BSSID of its AP must be one
+// level below ours (ours is mesh_level + 1) in the mesh IEs of the surveys.
+// Without the IEs no child can be told from a station.
+static bool ICACHE_FLASH_ATTR mesh_route_is_child(void *ctx, uint32_t src, const uint8_t *bssid)
+{
+    struct station_info *station;
+    bool leased = false;
+#if MESH_IE
+    const mesh_ie_t *ie;
+#endif
+
+    for (station = wifi_softap_get_station_info(); station != NULL; station = STAILQ_NEXT(station, next))
+    {
+        if (station->ip.addr == src)
         {
-            if (!in_token)
-            {
-                tokens[token_count++] = p;
-                if (token_count == max_tokens)
-                    return token_count;
-                in_token = true;
-            }
+            leased = true;
+            break;
         }
     }
-    return token_count;
+    wifi_softap_free_station_info();
+    if (!leased)
+        return false;
+
+#if MESH_IE
+    ie = mesh_ie_cache_get(&mesh_ie_cache, bssid, (uint32_t)(get_long_systime() / 1000));
+    return ie != NULL && ie->level == mesh_level + 2;
+#else
+    return false;
+#endif
+}
+
+// Our network is in use elsewhere in the mesh, move the AP in place
+static void ICACHE_FLASH_ATTR mesh_route_renumber_ap(void *ctx, uint32_t net)
+{
+    config.network_addr.addr = net;
+    ip4_addr4(&config.network_addr) = 1;
+    os_printf("Mesh network in use, AP moves to " IPSTR "/24\r\n", IP2STR(&config.network_addr));
+    do_ip_config = true;
+}
+
+static const mesh_route_ops_t mesh_route_ops = {
+    mesh_route_send, mesh_route_install, mesh_route_withdraw, mesh_route_set_nat, mesh_route_is_child,
+    mesh_route_renumber_ap};
+
+static void ICACHE_FLASH_ATTR mesh_route_recv_cb(void *arg, char *data, unsigned short len)
+{
+    struct espconn *pespconn = (struct espconn *)arg;
+    remot_info *premot = NULL;
+    uint32_t src;
+
+    if (espconn_get_connection_info(pespconn, &premot, 0) != ESPCONN_OK)
+        return;
+    os_memcpy(&src, premot->remote_ip, 4);
+    mesh_route_input(&mesh_route, src, (uint8_t *)data, len, (uint32_t)(get_long_systime() / 1000));
+}
+
+static void ICACHE_FLASH_ATTR mesh_route_start(void)
+{
+    ip_addr_t ap_net = config.network_addr;
+
+    mesh_route_init(&mesh_route, &mesh_route_ops, NULL, (uint32_t)(get_long_systime() / 1000));
+    ip4_addr4(&ap_net) = 0;
+    mesh_route_set_local(&mesh_route, config.AP_MAC_address, ap_net.addr, 24, (uint32_t)(get_long_systime() / 1000));
+
+    mesh_route_conn = (struct espconn *)os_zalloc(sizeof(struct espconn));
+    mesh_route_conn->type = ESPCONN_UDP;
+    mesh_route_conn->state = ESPCONN_NONE;
+    mesh_route_conn->proto.udp = (esp_udp *)os_zalloc(sizeof(esp_udp));
+    mesh_route_conn->proto.udp->local_port = MESH_ROUTE_PORT;
+    espconn_regist_recvcb(mesh_route_conn, mesh_route_recv_cb);
+    espconn_create(mesh_route_conn);
 }
+#endif /* MESH_ROUTING */
 
-char *console_output = NULL;
 void console_send_response(struct espconn *pespconn, uint8_t do_cmd)
 {
-    uint16_t len = ringbuf_bytes_used(console_tx_buffer);
-    console_output = (char *)os_malloc(len + 4);
+    struct ringbuf_span spans[2];
+    uint16_t len;
 
-    ringbuf_memcpy_from(console_output, console_tx_buffer, len);
-    
     if (do_cmd)
-    {
-        os_memcpy(&console_output[len], "CMD>", 4);
-        len += 4;
-    }
+        console_write("CMD>", 4);
+
+    // The ring is owned by the send in flight, the rest follows when it is done
+    if (console_inflight != 0)
+        return;
+
+    len = ringbuf_peek(console_tx_buffer, spans);
 
     if (pespconn != NULL)
     {
-        espconn_send(pespconn, console_output, len);
+        if (len == 0)
+            return;
+
+        // Send directly from the ring, release it when sent. If the data
+        // wraps, the part at the start of the ring follows from the sent
+        // callback.
+        console_inflight = spans[0].len;
+        if (espconn_send(pespconn, spans[0].data, spans[0].len) != 0)
+            console_inflight = 0;
     }
     else
     {
-        UART_Send(0, console_output, len);
-        os_free(console_output);
-        console_output = NULL;
+        // Queue what the UART tx buffer takes, the rest is resent from console_uart_tx_ready()
+        uint16_t n = UART_Send(0, spans[0].data, spans[0].len);
+        if (n == spans[0].len)
+            n += UART_Send(0, spans[1].data, spans[1].len);
+        ringbuf_consume(console_tx_buffer, n);
+        console_backlog_drain();
     }
 }
 
+// Called from the UART ISR when the tx buffer has room again
+static void console_uart_tx_ready(void)
+{
+    system_os_post(0, SIG_CONSOLE_TX_RAW, 0);
+}
+
+// To be called from the sent and disconnect callbacks of a console connection
+void console_send_done(void)
+{
+    ringbuf_consume(console_tx_buffer, console_inflight);
+    console_inflight = 0;
+    console_backlog_drain();
+}
+
 #if ALLOW_SCANNING
 void ICACHE_FLASH_ATTR scan_done(void *arg, STATUS status)
 {
@@ -334,7 +652,7 @@ void ICACHE_FLASH_ATTR scan_done(void *arg, STATUS status)
     {
         struct bss_info *bss_link = (struct bss_info *)arg;
 
-        ringbuf_memcpy_into(console_tx_buffer, "\r", 1);
+        console_write("\r", 1);
         while (bss_link != NULL)
         {
             os_sprintf(response, "%d,\"%s\",%d,\"" MACSTR "\",%d\r\n",
@@ -430,202 +748,1265 @@ static char INVALID_ARG[] = "Invalid argument\r\n";
 
 
 
+#define MAX_CMD_TOKENS 9
+
 #if ALLOW_PING
-    if (strcmp(tokens[0], "ping") == 0)
+static int ICACHE_FLASH_ATTR cmd_ping(struct espconn *pespconn, char **tokens, int nTokens, char *response)
+{
+    currentconn = pespconn;
+    uint32_t result = espconn_gethostbyname(NULL, tokens[1], &resolve_ip, user_do_ping);
+    if (result == ESPCONN_OK)
+    {
+        user_do_ping(tokens[1], &resolve_ip, NULL);
+    }
+    else if (result == ESPCONN_INPROGRESS)
+    {
+        // lookup taking place, will call user_do_ping on completion
+        return CMD_ASYNC;
+    }
+    else
+    {
+        os_sprintf(response, "DNS lookup failed for: %s\r\n", tokens[1]);
+    }
+    return CMD_DONE;
+}
+#endif
+
+static int ICACHE_FLASH_ATTR cmd_help(struct espconn *pespconn, char **tokens, int nTokens, char *response);
+
+static int ICACHE_FLASH_ATTR cmd_reset(struct espconn *pespconn, char **tokens, int nTokens, char *response)
+{
+    if (nTokens == 2)
+    {
+        if (strcmp(tokens[1], "factory") != 0)
+        {
+            os_sprintf(response, INVALID_ARG);
+            return CMD_DONE;
+        }
+        if (config.locked)
+        {
+            os_sprintf(response, INVALID_LOCKED);
+            return CMD_DONE;
+        }
+        config_load_default(&config);
+        config_save(&config);
+        blob_zero(0, sizeof(struct portmap_table) * config.max_portmap);
+    }
+    os_printf("Restarting ... \r\n");
+    system_restart(); // if it works this will not return
+
+    os_sprintf(response, "Reset failed\r\n");
+    return CMD_DONE;
+}
+
+static int ICACHE_FLASH_ATTR cmd_save(struct espconn *pespconn, char **tokens, int nTokens, char *response)
+{
+    config_save(&config);
+    os_sprintf(response, "Config saved\r\n");
+    return CMD_DONE;
+}
+
+static int ICACHE_FLASH_ATTR cmd_lock(struct espconn *pespconn, char **tokens, int nTokens, char *response)
+{
+    if (config.locked)
+    {
+        os_sprintf(response, "Config already locked\r\n");
+        return CMD_DONE;
+    }
+    if (nTokens == 1)
+    {
+        if (os_strlen(config.lock_password) == 0)
+        {
+            os_sprintf(response, "No password defined\r\n");
+            return CMD_DONE;
+        }
+    }
+    else
+    {
+        if (os_strlen(tokens[1]) >= sizeof(config.lock_password))
+        {
+            os_sprintf(response, INVALID_ARG);
+            return CMD_DONE;
+        }
+        os_sprintf(config.lock_password, "%s", tokens[1]);
+    }
+    config.locked = 1;
+    config_save(&config);
+    os_sprintf(response, "Config locked\r\n");
+    return CMD_DONE;
+}
+
+static int ICACHE_FLASH_ATTR cmd_unlock(struct espconn *pespconn, char **tokens, int nTokens, char *response)
+{
+    if (!config.locked)
+    {
+        os_sprintf(response, "Config not locked\r\n");
+        return CMD_DONE;
+    }
+    if (os_strcmp(tokens[1], config.lock_password) == 0)
+    {
+        config.locked = 0;
+        config_save(&config);
+        os_sprintf(response, "Config unlocked\r\n");
+    }
+    else
+    {
+        os_sprintf(response, "Unlock failed. Invalid password\r\n");
+    }
+    return CMD_DONE;
+}
+
+static int ICACHE_FLASH_ATTR cmd_quit(struct espconn *pespconn, char **tokens, int nTokens, char *response)
+{
+    remote_console_disconnect = 1;
+    os_sprintf(response, "Quitting console\r\n");
+    return CMD_DONE;
+}
+
+// Copies a token into a fixed size config string, false if too long
+static bool ICACHE_FLASH_ATTR set_config_string(uint8_t *dst, uint16_t size, char *val)
+{
+    if (os_strlen(val) >= size)
+        return false;
+    os_sprintf(dst, "%s", val);
+    return true;
+}
+
+static int ICACHE_FLASH_ATTR cmd_set_string(char *name, uint8_t *dst, uint16_t size, char *val, char *response)
+{
+    if (!set_config_string(dst, size, val))
+        os_sprintf(response, INVALID_ARG);
+    else
+        os_sprintf(response, "%s set\r\n", name);
+    return CMD_DONE;
+}
+
+static int ICACHE_FLASH_ATTR cmd_set_ssid(struct espconn *pespconn, char **tokens, int nTokens, char *response)
+{
+    return cmd_set_string("SSID", config.ssid, sizeof(config.ssid), tokens[2], response);
+}
+
+static int ICACHE_FLASH_ATTR cmd_set_password(struct espconn *pespconn, char **tokens, int nTokens, char *response)
+{
+    return cmd_set_string("Password", config.password, sizeof(config.password), tokens[2], response);
+}
+
+static int ICACHE_FLASH_ATTR cmd_set_ap_ssid(struct espconn *pespconn, char **tokens, int nTokens, char *response)
+{
+    return cmd_set_string("AP SSID", config.ap_ssid, sizeof(config.ap_ssid), tokens[2], response);
+}
+
+static int ICACHE_FLASH_ATTR cmd_set_ap_password(struct espconn *pespconn, char **tokens, int nTokens, char *response)
+{
+    if (os_strlen(tokens[2]) < 8 && os_strcmp(tokens[2], "none") != 0)
     {
-        if (nTokens != 2)
+        os_sprintf(response, "Password must be at least 8 chars\r\n");
+        return CMD_DONE;
+    }
+    return cmd_set_string("AP Password", config.ap_password, sizeof(config.ap_password), tokens[2], response);
+}
+
+static int ICACHE_FLASH_ATTR cmd_set_ap_open(struct espconn *pespconn, char **tokens, int nTokens, char *response)
+{
+    config.ap_open = atoi(tokens[2]) != 0;
+    os_sprintf(response, "Open auth set\r\n");
+    return CMD_DONE;
+}
+
+static int ICACHE_FLASH_ATTR cmd_set_automesh(struct espconn *pespconn, char **tokens, int nTokens, char *response)
+{
+    config.automesh_mode = atoi(tokens[2]) != 0 ? AUTOMESH_LEARNING : AUTOMESH_OFF;
+    config.automesh_checked = 0;
+    os_sprintf(response, "Automesh %s\r\n", config.automesh_mode == AUTOMESH_OFF ? "off" : "on");
+    return CMD_DONE;
+}
+
+static int ICACHE_FLASH_ATTR cmd_set_nat(struct espconn *pespconn, char **tokens, int nTokens, char *response)
+{
+    config.nat_enable = atoi(tokens[2]) != 0;
+    os_sprintf(response, "NAT %s\r\n", config.nat_enable ? "enabled" : "disabled");
+    return CMD_DONE;
+}
+
+static int ICACHE_FLASH_ATTR cmd_set_network(struct espconn *pespconn, char **tokens, int nTokens, char *response)
+{
+    config.network_addr.addr = ipaddr_addr(tokens[2]);
+    ip4_addr4(&config.network_addr) = 0;
+    os_sprintf(response, "Network set to %d.%d.%d.%d/24\r\n", IP2STR(&config.network_addr));
+    return CMD_DONE;
+}
+
+static int ICACHE_FLASH_ATTR cmd_set_tcp_timeout(struct espconn *pespconn, char **tokens, int nTokens, char *response)
+{
+    config.tcp_timeout = atoi(tokens[2]);
+    ip_napt_set_tcp_timeout(config.tcp_timeout);
+    os_sprintf(response, "TCP timeout set\r\n");
+    return CMD_DONE;
+}
+
+static int ICACHE_FLASH_ATTR cmd_set_udp_timeout(struct espconn *pespconn, char **tokens, int nTokens, char *response)
+{
+    config.udp_timeout = atoi(tokens[2]);
+    ip_napt_set_udp_timeout(config.udp_timeout);
+    os_sprintf(response, "UDP timeout set\r\n");
+    return CMD_DONE;
+}
+
+#if TOKENBUCKET
+// The timer hands the new rates to the shaper on its next tick
+static int ICACHE_FLASH_ATTR cmd_set_upstream_kbps(struct espconn *pespconn, char **tokens, int nTokens, char *response)
+{
+    config.kbps_us = atoi(tokens[2]);
+    os_sprintf(response, "Upstream limit %s\r\n", config.kbps_us == 0 ? "off" : "set");
+    return CMD_DONE;
+}
+
+static int ICACHE_FLASH_ATTR cmd_set_downstream_kbps(struct espconn *pespconn, char **tokens, int nTokens, char *response)
+{
+    config.kbps_ds = atoi(tokens[2]);
+    os_sprintf(response, "Downstream limit %s\r\n", config.kbps_ds == 0 ? "off" : "set");
+    return CMD_DONE;
+}
+#endif
+
+static int ICACHE_FLASH_ATTR cmd_show(struct espconn *pespconn, char **tokens, int nTokens, char *response)
+{
+    os_sprintf(response, "STA: SSID:%s PW:%s%s\r\n",
+               config.ssid, config.locked ? "***" : (char *)config.password,
+               config.auto_connect ? "" : " [AutoConnect:0]");
+    to_console(response);
+    os_sprintf(response, "AP:  SSID:%s PW:%s%s%s IP:%d.%d.%d.%d/24\r\n",
+               config.ap_ssid, config.locked ? "***" : (char *)config.ap_password,
+               config.ap_open ? " [open]" : "", config.ap_on ? "" : " [disabled]",
+               IP2STR(&config.network_addr));
+    to_console(response);
+#if TOKENBUCKET
+    if (config.kbps_us != 0 || config.kbps_ds != 0)
+    {
+        os_sprintf(response, "Limits: upstream %d kbps downstream %d kbps (0: none)\r\n",
+                   config.kbps_us, config.kbps_ds);
+        to_console(response);
+    }
+#endif
+    os_sprintf(response, "Automesh: %s NAT: %s%s\r\n",
+               config.automesh_mode == AUTOMESH_OFF ? "off" : (config.automesh_mode == AUTOMESH_LEARNING ? "learning" : "operational"),
+               config.nat_enable ? "on" : "off", config.locked ? " [Config locked]" : "");
+    return CMD_DONE;
+}
+
+static int ICACHE_FLASH_ATTR cmd_show_stats(struct espconn *pespconn, char **tokens, int nTokens, char *response)
+{
+    os_sprintf(response, "System uptime: %d:%02d:%02d\r\nPower supply: %d.%03d V\r\nFree mem: %d\r\n",
+               (uint32_t)(get_long_systime() / 3600000000ULL),
+               (uint32_t)(get_long_systime() / 60000000ULL) % 60,
+               (uint32_t)(get_long_systime() / 1000000ULL) % 60,
+               Vdd / 1000, Vdd % 1000, system_get_free_heap_size());
+    to_console(response);
+    os_sprintf(response, "%d KiB in (%d packets)\r\n%d KiB out (%d packets)\r\n",
+               (uint32_t)(Bytes_in / 1024), Packets_in,
+               (uint32_t)(Bytes_out / 1024), Packets_out);
+    to_console(response);
+    os_sprintf(response, "Mesh level: %d Uplink: " MACSTR "\r\n", mesh_level, MAC2STR(uplink_bssid));
+    if (config.automesh_mode != AUTOMESH_OFF)
+    {
+        to_console(response);
+        os_sprintf(response, "Automesh: %s, %d scans, %d uplink switches (%d held), last convergence %d ms\r\n",
+                   automesh.state == AUTOMESH_SCANNING ? "scanning" :
+                   (automesh.state == AUTOMESH_CONNECTING ? "connecting" :
+                   (automesh.state == AUTOMESH_CONNECTED ? "connected" : "stable")),
+                   automesh.scans, automesh.switches, automesh.held, automesh.last_convergence);
+        to_console(response);
+        os_sprintf(response, "Automesh failovers: %d, last %d ms, %d backups, %d unreachable uplinks\r\n",
+                   automesh.failovers, automesh.last_failover, automesh.backups, automesh.unreachable);
+#if MESH_IE
+        to_console(response);
+        os_sprintf(response, "Mesh IEs: %d received, %d errors\r\n", mesh_ie_cache.received, mesh_ie_cache.errors);
+#endif
+    }
+#if MESH_ROUTING
+    if (mesh_route_conn != NULL)
+    {
+        to_console(response);
+        os_sprintf(response, "Mesh routing: %s, adverts %d out %d in, %d rejected, %d foreign, %d errors\r\n",
+                   mesh_routed ? "routed" : "NAT", mesh_route.adverts_sent, mesh_route.adverts_rcvd,
+                   mesh_route.rejected, mesh_route.foreign, mesh_route.errors);
+        to_console(response);
+        os_sprintf(response, "Mesh network conflicts: %d rejected, %d times renumbered\r\n",
+                   mesh_route.conflicts, mesh_route.renumbered);
+    }
+#endif
+#if WEB_CONFIG
+    to_console(response);
+    os_sprintf(response, "Web page peak heap: %d\r\n", web_page_heap_peak);
+#endif
+    return CMD_DONE;
+}
+
+// The "show stats" counters as one JSON object
+static void ICACHE_FLASH_ATTR status_json(json_writer_t *w, uint32_t uptime, uint32_t free_heap, uint32_t now)
+{
+    int i;
+
+    json_object_begin(w, NULL);
+    json_uint(w, "uptime", uptime);
+    json_uint(w, "vdd", Vdd);
+    json_uint(w, "bytes_in", Bytes_in);
+    json_uint(w, "bytes_out", Bytes_out);
+    json_uint(w, "packets_in", Packets_in);
+    json_uint(w, "packets_out", Packets_out);
+    json_uint(w, "mesh_level", mesh_level);
+    json_mac(w, "uplink_bssid", uplink_bssid);
+    if (config.automesh_mode != AUTOMESH_OFF)
+    {
+        json_object_begin(w, "automesh");
+        json_uint(w, "state", automesh.state);
+        json_uint(w, "scans", automesh.scans);
+        json_uint(w, "switches", automesh.switches);
+        json_uint(w, "held", automesh.held);
+        json_uint(w, "failovers", automesh.failovers);
+        json_uint(w, "failover_ms", automesh.last_failover);
+        json_uint(w, "reachable", automesh.reachable);
+        json_uint(w, "unreachable", automesh.unreachable);
+        json_uint(w, "rtt", automesh.rtt);
+        json_array_begin(w, "neighbors");
+        for (i = 0; i < AUTOMESH_NEIGHBORS; i++)
+        {
+            automesh_neighbor_t *nb = &automesh.neighbor[i];
+
+            if (!nb->used)
+                continue;
+            json_object_begin(w, NULL);
+            json_mac(w, "bssid", nb->bssid);
+            json_uint(w, "channel", nb->channel);
+            json_int(w, "rssi", nb->rssi / 16);
+            json_uint(w, "level", nb->level);
+            json_uint(w, "load", nb->load);
+            json_uint(w, "napt_free", nb->napt_free);
+            json_int(w, "uplink_rssi", nb->uplink_rssi);
+            json_uint(w, "age", (now - nb->last_seen) / 1000);
+            json_uint(w, "cost", automesh_cost(&automesh, nb));
+            json_object_end(w);
+        }
+        json_array_end(w);
+        json_uint(w, "convergence_ms", automesh.last_convergence);
+        json_object_end(w);
+    }
+
+    json_object_begin(w, "napt");
+    json_uint(w, "max", config.max_nat);
+    json_uint(w, "portmap_max", config.max_portmap);
+    json_uint(w, "table", ip_napt_max);
+    json_uint(w, "tcp", nr_active_napt_tcp);
+    json_uint(w, "udp", nr_active_napt_udp);
+    json_uint(w, "icmp", nr_active_napt_icmp);
+    json_object_end(w);
+
+#if MESH_ROUTING
+    json_object_begin(w, "mesh_route");
+    json_uint(w, "routed", mesh_routed);
+    json_uint(w, "adverts_out", mesh_route.adverts_sent);
+    json_uint(w, "adverts_in", mesh_route.adverts_rcvd);
+    json_uint(w, "rejected", mesh_route.rejected);
+    json_uint(w, "conflicts", mesh_route.conflicts);
+    json_uint(w, "renumbered", mesh_route.renumbered);
+    json_uint(w, "foreign", mesh_route.foreign);
+    json_uint(w, "errors", mesh_route.errors);
+    json_object_end(w);
+#endif
+
+#if FASTPATH
+    json_object_begin(w, "fastpath");
+    json_uint(w, "hits_out", fastpath_stats.hits_out);
+    json_uint(w, "hits_in", fastpath_stats.hits_in);
+    json_uint(w, "learned", fastpath_stats.learned);
+    json_uint(w, "misses", fastpath_stats.misses);
+    json_object_end(w);
+#endif
+
+    json_object_begin(w, "heap");
+    json_uint(w, "free", free_heap);
+#if WEB_CONFIG
+    json_uint(w, "web_peak", web_page_heap_peak);
+#endif
+    json_object_end(w);
+    json_object_end(w);
+}
+
+// Writes the status JSON into a heap buffer (4 byte aligned, so web_render
+// can read it), NULL if out of memory. The buffer is sized from the last
+// document, it is only measured and written again if it has grown by
+// more than STATUS_JSON_SLACK bytes since then (test/bench_json.c).
+#define STATUS_JSON_SLACK 64
+static char * ICACHE_FLASH_ATTR status_json_alloc(uint16_t *len)
+{
+    static uint16_t last_len;
+    uint64_t systime = get_long_systime();
+    uint32_t uptime = systime / 1000000ULL;
+    uint32_t now = systime / 1000;
+    uint32_t free_heap = system_get_free_heap_size();
+    uint16_t size = (last_len + STATUS_JSON_SLACK + 4) & ~3;
+    json_writer_t w;
+    char *buf;
+
+    for (;;)
+    {
+        buf = (char *)os_malloc(size);
+        if (buf == NULL)
+            return NULL;
+        json_init(&w, buf, size);
+        status_json(&w, uptime, free_heap, now);
+        if (json_finish(&w))
+            break;
+        os_free(buf);
+        size = (w.len + 4) & ~3;
+    }
+
+    *len = last_len = w.len;
+    return buf;
+}
+
+static int ICACHE_FLASH_ATTR cmd_show_json(struct espconn *pespconn, char **tokens, int nTokens, char *response)
+{
+    uint16_t len;
+    char *json = status_json_alloc(&len);
+
+    if (json == NULL)
+    {
+        os_sprintf(response, "Out of memory\r\n");
+        return CMD_DONE;
+    }
+    to_console(json);
+    os_free(json);
+    os_sprintf(response, "\r\n");
+    return CMD_DONE;
+}
+
+static void ICACHE_FLASH_ATTR show_route(void *arg, struct route_entry *rt, uint8_t flags)
+{
+    char *response = (char *)arg;
+
+    os_sprintf(response, IPSTR "/" IPSTR " gw " IPSTR "%s\r\n", IP2STR(&rt->ip), IP2STR(&rt->mask),
+               IP2STR(&rt->gw), (flags & ROUTE_DYNAMIC) ? " (mesh)" : "");
+    to_console(response);
+}
+
+#if TOKENBUCKET
+static int ICACHE_FLASH_ATTR cmd_show_clients(struct espconn *pespconn, char **tokens, int nTokens, char *response)
+{
+    int i;
+
+    os_sprintf(response, "Clients:\r\n");
+    to_console(response);
+    for (i = 0; i < SHAPER_STATIONS; i++)
+    {
+        shaper_station_t *st = &shaper.stations[i];
+
+        if (!st->used)
+            continue;
+        os_sprintf(response, MACSTR " " IPSTR " up: %d KiB (%d dropped) down: %d KiB (%d dropped)\r\n",
+                   MAC2STR(st->mac), IP2STR(&st->ip),
+                   (uint32_t)(st->sent[SHAPER_UP] / 1024), st->drops[SHAPER_UP],
+                   (uint32_t)(st->sent[SHAPER_DOWN] / 1024), st->drops[SHAPER_DOWN]);
+        to_console(response);
+    }
+    os_sprintf(response, "Other: %d up, %d down dropped\r\n",
+               shaper.dir[SHAPER_UP].drops, shaper.dir[SHAPER_DOWN].drops);
+    to_console(response);
+    for (i = 0; i < SHAPER_DIRS; i++)
+    {
+        shaper_class_t *cls = shaper.dir[i].cls;
+
+        os_sprintf(response, "%s queued/dropped: interactive %d/%d normal %d/%d bulk %d/%d\r\n",
+                   i == SHAPER_UP ? "Up" : "Down",
+                   cls[SHAPER_INTERACTIVE].sent, cls[SHAPER_INTERACTIVE].drops,
+                   cls[SHAPER_NORMAL].sent, cls[SHAPER_NORMAL].drops,
+                   cls[SHAPER_BULK].sent, cls[SHAPER_BULK].drops);
+        to_console(response);
+        os_sprintf(response, "%s AQM dropped: normal %d bulk %d, delay: normal %d ms bulk %d ms (target %d ms)\r\n",
+                   i == SHAPER_UP ? "Up" : "Down",
+                   cls[SHAPER_NORMAL].aqm_drops, cls[SHAPER_BULK].aqm_drops,
+                   cls[SHAPER_NORMAL].delay >> 3, cls[SHAPER_BULK].delay >> 3, shaper.dir[i].target);
+        to_console(response);
+    }
+    response[0] = 0;
+    return CMD_DONE;
+}
+#endif
+
+static int ICACHE_FLASH_ATTR cmd_show_neighbors(struct espconn *pespconn, char **tokens, int nTokens, char *response)
+{
+    uint32_t now = (uint32_t)(get_long_systime() / 1000);
+    int i;
+
+    if (config.automesh_mode == AUTOMESH_OFF)
+    {
+        os_sprintf(response, "Automesh is off\r\n");
+        return CMD_DONE;
+    }
+
+    os_sprintf(response, "Neighbors (uplink " MACSTR "):\r\n", MAC2STR(automesh.bssid));
+    to_console(response);
+    for (i = 0; i < AUTOMESH_NEIGHBORS; i++)
+    {
+        automesh_neighbor_t *nb = &automesh.neighbor[i];
+
+        if (!nb->used)
+            continue;
+        os_sprintf(response, MACSTR " ch %d %d dBm level %d load %d flows %d uplink %d dBm, %d s ago, cost %d%s\r\n",
+                   MAC2STR(nb->bssid), nb->channel, nb->rssi / 16, nb->level, nb->load, nb->napt_free,
+                   nb->uplink_rssi, (now - nb->last_seen) / 1000, automesh_cost(&automesh, nb),
+                   os_memcmp(nb->bssid, automesh.bssid, 6) == 0 ? " *" : "");
+        to_console(response);
+    }
+    for (i = 0; i < automesh.backups; i++)
+    {
+        os_sprintf(response, "Backup %d: " MACSTR "\r\n", i + 1, MAC2STR(automesh.backup[i]));
+        to_console(response);
+    }
+    response[0] = 0;
+    return CMD_DONE;
+}
+
+static int ICACHE_FLASH_ATTR cmd_show_route(struct espconn *pespconn, char **tokens, int nTokens, char *response)
+{
+    os_sprintf(response, "Routes:\r\n");
+    to_console(response);
+    route_walk(show_route, response);
+    response[0] = 0;
+    return CMD_DONE;
+}
+
+static int ICACHE_FLASH_ATTR cmd_route_add(struct espconn *pespconn, char **tokens, int nTokens, char *response)
+{
+    ip_addr_t ip, mask, gw;
+
+    ip.addr = ipaddr_addr(tokens[2]);
+    mask.addr = ipaddr_addr(tokens[3]);
+    gw.addr = ipaddr_addr(tokens[4]);
+
+    if (ip_add_route(ip, mask, gw))
+        os_sprintf(response, "Route added\r\n");
+    else
+        os_sprintf(response, "Route adding failed\r\n");
+    return CMD_DONE;
+}
+
+static int ICACHE_FLASH_ATTR cmd_route_delete(struct espconn *pespconn, char **tokens, int nTokens, char *response)
+{
+    ip_addr_t ip, mask;
+
+    ip.addr = ipaddr_addr(tokens[2]);
+    mask.addr = ipaddr_addr(tokens[3]);
+
+    if (ip_rm_route(ip, mask))
+        os_sprintf(response, "Route deleted\r\n");
+    else
+        os_sprintf(response, "Route not found\r\n");
+    return CMD_DONE;
+}
+
+#if ACLS
+static const char *acl_names[MAX_NO_ACLS] = {"from_sta", "to_sta", "from_ap", "to_ap"};
+
+// "any" or a.b.c.d[/bits]
+static bool ICACHE_FLASH_ATTR acl_parse_addr(char *str, uint32_t *addr, uint32_t *mask)
+{
+    char *slash = strchr(str, '/');
+    int bits = 32;
+
+    if (strcmp(str, "any") == 0)
+    {
+        *addr = *mask = 0;
+        return true;
+    }
+    if (slash != NULL)
+    {
+        *slash = '\0';
+        bits = atoi(slash + 1);
+        if (bits < 0 || bits > 32)
+            return false;
+    }
+    *addr = ipaddr_addr(str);
+    *mask = bits == 0 ? 0 : htonl(0xffffffff << (32 - bits));
+    return true;
+}
+
+static uint8_t ICACHE_FLASH_ATTR acl_mask_bits(uint32_t mask)
+{
+    uint8_t bits = 0;
+
+    for (mask = ntohl(mask); mask & 0x80000000; mask <<= 1)
+        bits++;
+    return bits;
+}
+
+static int ICACHE_FLASH_ATTR cmd_acl(struct espconn *pespconn, char **tokens, int nTokens, char *response)
+{
+    uint32_t src, s_mask, dest, d_mask;
+    uint8_t acl_no, proto, allow;
+
+    for (acl_no = 0; acl_no < MAX_NO_ACLS && strcmp(tokens[1], acl_names[acl_no]) != 0; acl_no++)
+        ;
+    if (acl_no == MAX_NO_ACLS || (nTokens != 3 && nTokens != 8))
+    {
+        os_sprintf(response, INVALID_ARG);
+        return CMD_DONE;
+    }
+
+    if (nTokens == 3)
+    {
+        if (strcmp(tokens[2], "clear") == 0)
+            acl_clear(acl_no);
+        else if (strcmp(tokens[2], "clear_stats") == 0)
+            acl_clear_stats(acl_no);
+        else
+        {
+            os_sprintf(response, INVALID_ARG);
+            return CMD_DONE;
+        }
+        os_sprintf(response, "ACL %s cleared\r\n", acl_names[acl_no]);
+        return CMD_DONE;
+    }
+
+    // acl <list> IP|TCP|UDP|ICMP <src> <src port> <dest> <dest port> allow|deny
+    if (strcmp(tokens[2], "IP") == 0)
+        proto = ACL_ANY_PROTO;
+    else if (strcmp(tokens[2], "TCP") == 0)
+        proto = IP_PROTO_TCP;
+    else if (strcmp(tokens[2], "UDP") == 0)
+        proto = IP_PROTO_UDP;
+    else if (strcmp(tokens[2], "ICMP") == 0)
+        proto = IP_PROTO_ICMP;
+    else
+        proto = 0xff;
+
+    if (strcmp(tokens[7], "allow") == 0)
+        allow = ACL_ALLOW;
+    else if (strcmp(tokens[7], "deny") == 0)
+        allow = ACL_DENY;
+    else
+        allow = 0xff;
+
+    if (proto == 0xff || allow == 0xff ||
+        !acl_parse_addr(tokens[3], &src, &s_mask) || !acl_parse_addr(tokens[5], &dest, &d_mask))
+    {
+        os_sprintf(response, INVALID_ARG);
+        return CMD_DONE;
+    }
+
+    if (acl_add(acl_no, src, s_mask, dest, d_mask, proto,
+                strcmp(tokens[4], "any") == 0 ? 0 : atoi(tokens[4]),
+                strcmp(tokens[6], "any") == 0 ? 0 : atoi(tokens[6]), allow))
+        os_sprintf(response, "ACL added\r\n");
+    else
+        os_sprintf(response, "ACL %s full\r\n", acl_names[acl_no]);
+    return CMD_DONE;
+}
+
+static int ICACHE_FLASH_ATTR cmd_show_acl(struct espconn *pespconn, char **tokens, int nTokens, char *response)
+{
+    int i, j;
+
+    for (i = 0; i < MAX_NO_ACLS; i++)
+    {
+        if (acl_is_empty(i))
+            continue;
+        os_sprintf(response, "%s:\r\n", acl_names[i]);
+        to_console(response);
+        for (j = 0; j < acl_freep[i]; j++)
+        {
+            acl_entry *r = &acl[i][j];
+
+            os_sprintf(response, "  %s " IPSTR "/%d:%d " IPSTR "/%d:%d %s (%d hits)\r\n",
+                       r->proto == IP_PROTO_TCP ? "TCP" : (r->proto == IP_PROTO_UDP ? "UDP" : (r->proto == IP_PROTO_ICMP ? "ICMP" : "IP")),
+                       IP2STR((ip_addr_t *)&r->src), acl_mask_bits(r->s_mask), r->s_port,
+                       IP2STR((ip_addr_t *)&r->dest), acl_mask_bits(r->d_mask), r->d_port,
+                       (r->allow & ACL_ALLOW) ? "allow" : "deny",
+                       acl_hits[i][j]);
+            to_console(response);
+        }
+    }
+    os_sprintf(response, "Packets allowed: %d denied: %d\r\n", acl_allow_count, acl_deny_count);
+    return CMD_DONE;
+}
+#endif
+
+#if GPIO_CMDS
+static int ICACHE_FLASH_ATTR cmd_gpio(struct espconn *pespconn, char **tokens, int nTokens, char *response)
+{
+    uint8_t pin = atoi(tokens[1]);
+
+    if (pin > 16)
+    {
+        os_sprintf(response, INVALID_ARG);
+        return CMD_DONE;
+    }
+    if (strcmp(tokens[2], "get") == 0 && nTokens == 3)
+    {
+        os_sprintf(response, "GPIO%d: %d\r\n", pin, easygpio_inputGet(pin));
+        return CMD_DONE;
+    }
+    if (strcmp(tokens[2], "set") == 0 && nTokens >= 4)
+    {
+        if (config.locked)
+        {
+            os_sprintf(response, INVALID_LOCKED);
+            return CMD_DONE;
+        }
+        do_outputSet(pin, atoi(tokens[3]), nTokens == 5 ? atoi(tokens[4]) : 0);
+        os_sprintf(response, "GPIO%d set\r\n", pin);
+        return CMD_DONE;
+    }
+    os_sprintf(response, INVALID_ARG);
+    return CMD_DONE;
+}
+#endif
+
+// All tables must be kept sorted by name (strcmp order)
+static const console_cmd_t route_cmds[] = {
+    { "add",            5, 5, CMD_CFG, cmd_route_add },
+    { "delete",         4, 4, CMD_CFG, cmd_route_delete },
+};
+
+static const console_cmd_t set_cmds[] = {
+    { "ap_open",        3, 3, CMD_CFG, cmd_set_ap_open },
+    { "ap_password",    3, 3, CMD_CFG, cmd_set_ap_password },
+    { "ap_ssid",        3, 3, CMD_CFG, cmd_set_ap_ssid },
+    { "automesh",       3, 3, CMD_CFG, cmd_set_automesh },
+#if TOKENBUCKET
+    { "downstream_kbps", 3, 3, CMD_CFG, cmd_set_downstream_kbps },
+#endif
+    { "nat",            3, 3, CMD_CFG, cmd_set_nat },
+    { "network",        3, 3, CMD_CFG, cmd_set_network },
+    { "password",       3, 3, CMD_CFG, cmd_set_password },
+    { "ssid",           3, 3, CMD_CFG, cmd_set_ssid },
+    { "tcp_timeout",    3, 3, CMD_CFG, cmd_set_tcp_timeout },
+    { "udp_timeout",    3, 3, CMD_CFG, cmd_set_udp_timeout },
+#if TOKENBUCKET
+    { "upstream_kbps",  3, 3, CMD_CFG, cmd_set_upstream_kbps },
+#endif
+};
+
+static const console_cmd_t show_cmds[] = {
+#if ACLS
+    { "acl",            2, 2, 0,       cmd_show_acl },
+#endif
+#if TOKENBUCKET
+    { "clients",        2, 2, 0,       cmd_show_clients },
+#endif
+    { "json",           2, 2, 0,       cmd_show_json },
+    { "neighbors",      2, 2, 0,       cmd_show_neighbors },
+    { "route",          2, 2, 0,       cmd_show_route },
+    { "stats",          2, 2, 0,       cmd_show_stats },
+};
+
+static const console_cmd_t console_cmds[] = {
+#if ACLS
+    { "acl",            3, 8, CMD_CFG, cmd_acl },
+#endif
+#if GPIO_CMDS
+    { "gpio",           3, 5, 0,       cmd_gpio },
+#endif
+    { "help",           1, 1, 0,       cmd_help },
+    { "lock",           1, 2, 0,       cmd_lock },
+#if ALLOW_PING
+    { "ping",           2, 2, 0,       cmd_ping },
+#endif
+    { "quit",           1, 1, 0,       cmd_quit },
+    { "reset",          1, 2, 0,       cmd_reset },
+    { "route",          1, 0, 0,       NULL,  route_cmds, CMD_TABLE_LEN(route_cmds) },
+    { "save",           1, 1, CMD_CFG, cmd_save },
+    { "set",            1, 0, 0,       NULL,  set_cmds,   CMD_TABLE_LEN(set_cmds) },
+    { "show",           1, 1, 0,       cmd_show, show_cmds, CMD_TABLE_LEN(show_cmds) },
+    { "unlock",         2, 2, 0,       cmd_unlock },
+};
+
+static int ICACHE_FLASH_ATTR cmd_help(struct espconn *pespconn, char **tokens, int nTokens, char *response)
+{
+    int i, j;
+
+    for (i = 0; i < CMD_TABLE_LEN(console_cmds); i++)
+    {
+        const console_cmd_t *cmd = &console_cmds[i];
+
+        if (cmd->fn != NULL)
+        {
+            os_sprintf(response, "%s\r\n", cmd->name);
+            to_console(response);
+        }
+        for (j = 0; j < cmd->sub_len; j++)
+        {
+            os_sprintf(response, "%s %s\r\n", cmd->name, cmd->sub[j].name);
+            to_console(response);
+        }
+    }
+    // A bare '"' opens a quoted string, one left open is a syntax error
+    os_sprintf(response, "Args with blanks: \"a b\", a\\ b or a%%20b; a literal \": \\\" or %%22\r\n");
+    to_console(response);
+    response[0] = 0;
+    return CMD_DONE;
+}
+
+// The spans of the first line in rx, up to and including term, and its
+// length, 0 if there is no complete line
+static size_t ICACHE_FLASH_ATTR console_line(ringbuf_t rx, char term, struct ringbuf_span spans[2])
+{
+    size_t i;
+    int s;
+
+    ringbuf_peek(rx, spans);
+    for (s = 0; s < 2; s++)
+    {
+        for (i = 0; i < spans[s].len; i++)
+        {
+            if (((char *)spans[s].data)[i] == term)
+            {
+                spans[s].len = i + 1;
+                if (s == 0)
+                {
+                    spans[1].data = NULL;
+                    spans[1].len = 0;
+                }
+                return spans[0].len + spans[1].len;
+            }
+        }
+    }
+    return 0;
+}
+
+void ICACHE_FLASH_ATTR console_handle_command(struct espconn *pespconn)
+{
+    char cmd_line[MAX_CON_CMD_SIZE + 1];
+    char response[256];
+    char *tokens[MAX_CMD_TOKENS];
+    struct ringbuf_span spans[2];
+    const console_cmd_t *table = console_cmds;
+    const console_cmd_t *cmd = NULL;
+    uint8_t table_len = CMD_TABLE_LEN(console_cmds);
+    uint8_t flags = 0;
+    int bytes_count, nTokens, level, err_offset;
+    ringbuf_t rx = console_rx_buffer;
+    char term = '\r';
+
+#if REMOTE_CONFIG
+    if (pespconn != NULL)
+    {
+        rx = console_tcp_rx;
+        term = '\n';
+    }
+#endif
+    // Tokenize the first line straight out of the ring, then release it
+    bytes_count = console_line(rx, term, spans);
+    if (bytes_count == 0)
+        bytes_count = ringbuf_peek(rx, spans);
+    nTokens = tokenize_spans(spans, 2, cmd_line, sizeof(cmd_line), tokens, MAX_CMD_TOKENS, &err_offset);
+    ringbuf_consume(rx, bytes_count);
+    response[0] = 0;
+
+    if (nTokens < 0)
+    {
+        os_sprintf(response, "Syntax error at position %d\r\n", err_offset + 1);
+        goto command_handled;
+    }
+    if (nTokens == 0)
+    {
+        char c = '\n';
+        console_write(&c, 1);
+        goto command_handled_2;
+    }
+
+    // Walk down the tables as long as the next token names a sub command
+    for (level = 0; level < nTokens && table != NULL; level++)
+    {
+        const console_cmd_t *next = console_cmd_find(table, table_len, tokens[level]);
+        if (next == NULL)
+            break;
+        cmd = next;
+        flags |= cmd->flags;
+        table = cmd->sub;
+        table_len = cmd->sub_len;
+    }
+
+    if (cmd == NULL)
+    {
+        os_sprintf(response, "Invalid command\r\n");
+        goto command_handled;
+    }
+    if (cmd->fn == NULL)
+    {
+        os_sprintf(response, level == nTokens ? INVALID_NUMARGS : INVALID_ARG);
+        goto command_handled;
+    }
+    if (nTokens < cmd->min_tokens || nTokens > cmd->max_tokens)
+    {
+        os_sprintf(response, INVALID_NUMARGS);
+        goto command_handled;
+    }
+    if ((flags & CMD_CFG) && config.locked)
+    {
+        os_sprintf(response, INVALID_LOCKED);
+        goto command_handled;
+    }
+
+    if (cmd->fn(pespconn, tokens, nTokens, response) == CMD_ASYNC)
+        return;
+
+command_handled:
+    to_console(response);
+command_handled_2:
+    system_os_post(0, SIG_CONSOLE_TX, (ETSParam)pespconn);
+}
+
+
+bool ICACHE_FLASH_ATTR check_connection_access(struct espconn *pesp_conn, uint8_t access_flags)
+{
+    remot_info *premot = NULL;
+    ip_addr_t *remote_addr;
+    bool is_local;
+
+    remote_addr = (ip_addr_t *)&(pesp_conn->proto.tcp->remote_ip);
+    //os_printf("Remote addr is %d.%d.%d.%d\r\n", IP2STR(remote_addr));
+    is_local = (remote_addr->addr & 0x00ffffff) == (config.network_addr.addr & 0x00ffffff);
+
+    if (is_local && (access_flags & LOCAL_ACCESS))
+        return true;
+    if (!is_local && (access_flags & REMOTE_ACCESS))
+        return true;
+
+    return false;
+}
+
+#if REMOTE_CONFIG
+// Only whole lines go into console_tcp_rx: what follows the last line
+// end that fits is lost, up to the next line end
+static void ICACHE_FLASH_ATTR tcp_client_recv_cb(void *arg, char *data, unsigned short length)
+{
+    unsigned short skip = 0, n;
+
+    if (console_tcp_discard)
+    {
+        while (skip < length && data[skip] != '\n')
+            skip++;
+        if (skip == length)
+            return;
+        console_tcp_discard = false;
+        skip++;
+    }
+
+    n = length - skip;
+    if (n > ringbuf_bytes_free(console_tcp_rx))
+    {
+        n = ringbuf_bytes_free(console_tcp_rx);
+        while (n > 0 && data[skip + n - 1] != '\n')
+            n--;
+        console_tcp_discard = true;
+    }
+    ringbuf_memcpy_into(console_tcp_rx, data + skip, n);
+
+    // One signal per segment, the task takes all its lines
+    if (!console_tcp_posted)
+    {
+        console_tcp_posted = true;
+        system_os_post(0, SIG_CONSOLE_RX, (ETSParam)arg);
+    }
+}
+
+// True if a complete line is in console_tcp_rx, to be called from the
+// task until false
+static bool ICACHE_FLASH_ATTR console_tcp_line(void)
+{
+    struct ringbuf_span spans[2];
+
+    // Cleared before looking, so a segment arriving from now on is posted again
+    console_tcp_posted = false;
+    return console_line(console_tcp_rx, '\n', spans) > 0;
+}
+
+static void ICACHE_FLASH_ATTR tcp_client_sent_cb(void *arg)
+{
+    console_send_done();
+
+    // The rest of a wrapped ring, or what was written meanwhile
+    if (!ringbuf_is_empty(console_tx_buffer))
+        system_os_post(0, SIG_CONSOLE_TX_RAW, (ETSParam)arg);
+}
+
+static void ICACHE_FLASH_ATTR tcp_client_discon_cb(void *arg)
+{
+    // A send in flight will not complete anymore
+    console_send_done();
+    if (currentconn == (struct espconn *)arg)
+        currentconn = NULL;
+}
+
+/* Called when a client connects to the console server */
+static void ICACHE_FLASH_ATTR tcp_client_connected_cb(void *arg)
+{
+    struct espconn *pespconn = (struct espconn *)arg;
+
+    if (!check_connection_access(pespconn, config.config_access))
+    {
+        os_printf("Client disconnected - no config access on this network\r\n");
+        espconn_disconnect(pespconn);
+        return;
+    }
+
+    espconn_regist_recvcb(pespconn, tcp_client_recv_cb);
+    espconn_regist_sentcb(pespconn, tcp_client_sent_cb);
+    espconn_regist_disconcb(pespconn, tcp_client_discon_cb);
+    espconn_regist_time(pespconn, 300, 1);
+
+    ringbuf_reset(console_tcp_rx);
+    console_tcp_discard = false;
+    console_send_done();
+    ringbuf_reset(console_tx_buffer);
+
+    console_write("CMD>", 4);
+    system_os_post(0, SIG_CONSOLE_TX_RAW, (ETSParam)pespconn);
+}
+#endif /* REMOTE_CONFIG */
+
+#if WEB_CONFIG
+// Fields of a web config transaction
+#define WEB_SSID            0x0001
+#define WEB_PASSWORD        0x0002
+#define WEB_AP_SSID         0x0004
+#define WEB_AP_PASSWORD     0x0008
+#define WEB_NETWORK         0x0010
+#define WEB_AP_OPEN         0x0020
+#define WEB_AUTOMESH        0x0040
+#define WEB_LOCK            0x0080
+#define WEB_UNLOCK          0x0100
+#define WEB_RESET           0x0200
+#define WEB_GPIO            0x0400
+
+// All form fields of one request, applied together once the request is complete
+typedef struct {
+    uint16_t fields;
+    uint8_t ap_open;
+    ip_addr_t network;
+    uint8_t ssid[sizeof(config.ssid)];
+    uint8_t password[sizeof(config.password)];
+    uint8_t ap_ssid[sizeof(config.ap_ssid)];
+    uint8_t ap_password[sizeof(config.ap_password)];
+    uint8_t unlock_password[sizeof(config.lock_password)];
+#if GPIO_CMDS
+    char gpio[HTTP_MAX_VAL];
+#endif
+} web_txn_t;
+
+// Stages one query parameter, invalid values are ignored
+static void ICACHE_FLASH_ATTR web_config_param(void *arg, char *key, char *val)
+{
+    web_txn_t *txn = (web_txn_t *)arg;
+
+    //os_printf("web_config_param(): key:%s:val:%s:\n",key,val);
+    if (strcmp(key, "ssid") == 0)
+    {
+        if (set_config_string(txn->ssid, sizeof(txn->ssid), val))
+            txn->fields |= WEB_SSID;
+    }
+    else if (strcmp(key, "password") == 0)
+    {
+        if (set_config_string(txn->password, sizeof(txn->password), val))
+            txn->fields |= WEB_PASSWORD;
+    }
+    else if (strcmp(key, "am") == 0)
+    {
+        txn->fields |= WEB_AUTOMESH;
+    }
+    else if (strcmp(key, "lock") == 0)
+    {
+        txn->fields |= WEB_LOCK;
+    }
+    else if (strcmp(key, "ap_ssid") == 0)
+    {
+        if (set_config_string(txn->ap_ssid, sizeof(txn->ap_ssid), val))
+            txn->fields |= WEB_AP_SSID;
+    }
+    else if (strcmp(key, "ap_password") == 0)
+    {
+        if ((os_strlen(val) >= 8 || strcmp(val, "none") == 0) &&
+            set_config_string(txn->ap_password, sizeof(txn->ap_password), val))
+            txn->fields |= WEB_AP_PASSWORD;
+    }
+    else if (strcmp(key, "network") == 0)
+    {
+        txn->network.addr = ipaddr_addr(val);
+        if (txn->network.addr != IPADDR_NONE)
+            txn->fields |= WEB_NETWORK;
+    }
+    else if (strcmp(key, "unlock_password") == 0)
+    {
+        if (set_config_string(txn->unlock_password, sizeof(txn->unlock_password), val))
+            txn->fields |= WEB_UNLOCK;
+    }
+    else if (strcmp(key, "ap_open") == 0)
+    {
+        if (strcmp(val, "wpa2") == 0 || strcmp(val, "open") == 0)
+        {
+            txn->ap_open = strcmp(val, "open") == 0;
+            txn->fields |= WEB_AP_OPEN;
+        }
+    }
+    else if (strcmp(key, "reset") == 0)
+    {
+        txn->fields |= WEB_RESET;
+    }
+#if GPIO_CMDS
+    else if (strcmp(key, "gpio") == 0)
+    {
+        os_sprintf(txn->gpio, "%s", val);
+        txn->fields |= WEB_GPIO;
+    }
+#endif
+}
+
+// Applies a complete transaction with a single config_save
+static void ICACHE_FLASH_ATTR web_config_apply(struct espconn *pespconn, web_txn_t *txn)
+{
+    bool do_reset = false;
+    bool do_save = false;
+
+    if (txn->fields == 0)
+        return;
+
+    if ((txn->fields & WEB_UNLOCK) && config.locked &&
+        os_strcmp(txn->unlock_password, config.lock_password) == 0)
+    {
+        config.locked = 0;
+        do_save = true;
+    }
+
+    if (!config.locked)
+    {
+        if (txn->fields & WEB_SSID)
+        {
+            os_memcpy(config.ssid, txn->ssid, sizeof(config.ssid));
+            config.automesh_mode = AUTOMESH_OFF;
+        }
+        if (txn->fields & WEB_PASSWORD)
+            os_memcpy(config.password, txn->password, sizeof(config.password));
+        if (txn->fields & WEB_AUTOMESH)
+        {
+            config.automesh_mode = AUTOMESH_LEARNING;
+            config.automesh_checked = 0;
+        }
+        if (txn->fields & WEB_AP_SSID)
+            os_memcpy(config.ap_ssid, txn->ap_ssid, sizeof(config.ap_ssid));
+        if (txn->fields & WEB_AP_PASSWORD)
+            os_memcpy(config.ap_password, txn->ap_password, sizeof(config.ap_password));
+        if (txn->fields & WEB_AP_OPEN)
+            config.ap_open = txn->ap_open;
+        if (txn->fields & WEB_NETWORK)
         {
-            os_sprintf(response, INVALID_NUMARGS);
-            goto command_handled;
+            config.network_addr = txn->network;
+            ip4_addr4(&config.network_addr) = 0;
         }
-        currentconn = pespconn;
-        uint32_t result = espconn_gethostbyname(NULL, tokens[1], &resolve_ip, user_do_ping);
-        if (result == ESPCONN_OK)
+#if GPIO_CMDS
+        if (txn->fields & WEB_GPIO)
         {
-            user_do_ping(tokens[1], &resolve_ip, NULL);
+            char response[64];
+            char *tokens[5];
+            int nTokens;
+
+            tokens[0] = "gpio";
+            nTokens = parse_str_into_tokens(txn->gpio, &tokens[1], 4);
+            if (nTokens >= 2)
+                cmd_gpio(pespconn, tokens, nTokens + 1, response);
         }
-        else if (result == ESPCONN_INPROGRESS)
+#endif
+        if (txn->fields & (WEB_SSID | WEB_PASSWORD | WEB_AUTOMESH | WEB_AP_SSID |
+                           WEB_AP_PASSWORD | WEB_AP_OPEN | WEB_NETWORK))
         {
-            // lookup taking place, will call dns_resolved on completion
-            return;
+            do_save = true;
+            do_reset = true;
         }
-        else
+        if (txn->fields & WEB_RESET)
+            do_reset = true;
+
+        // Last, so the other fields of a locking request still apply
+        if (txn->fields & WEB_LOCK)
         {
-            os_sprintf(response, "DNS lookup failed for: %s\r\n", tokens[1]);
+            os_memcpy(config.lock_password, config.password, sizeof(config.lock_password));
+            config.locked = 1;
+            do_save = true;
         }
-        goto command_handled;
     }
-#endif
-
-
-bool ICACHE_FLASH_ATTR check_connection_access(struct espconn *pesp_conn, uint8_t access_flags)
-{
-    remot_info *premot = NULL;
-    ip_addr_t *remote_addr;
-    bool is_local;
-
-    remote_addr = (ip_addr_t *)&(pesp_conn->proto.tcp->remote_ip);
-    //os_printf("Remote addr is %d.%d.%d.%d\r\n", IP2STR(remote_addr));
-    is_local = (remote_addr->addr & 0x00ffffff) == (config.network_addr.addr & 0x00ffffff);
 
-    if (is_local && (access_flags & LOCAL_ACCESS))
-        return true;
-    if (!is_local && (access_flags & REMOTE_ACCESS))
-        return true;
+    // Every save erases a flash sector, skip it if nothing changed
+    if (do_save)
+        config_save(&config);
 
-    return false;
+    if (do_reset)
+    {
+        os_printf("Restarting ... \r\n");
+        system_restart();
+    }
 }
 
+#define WEB_IDLE_TIMEOUT    30  // s until an idle keep-alive connection is closed
 
+static web_txn_t web_txns[WEB_MAX_SESSIONS];
 
-#if WEB_CONFIG
-static void ICACHE_FLASH_ATTR handle_set_cmd(void *arg, char *cmd, char *val)
+// Picks the response of a complete request, a config page view applies its form
+static uint8_t ICACHE_FLASH_ATTR web_config_request(struct espconn *pespconn, http_req_t *req, void *txn)
 {
-    struct espconn *pespconn = (struct espconn *)arg;
-    int max_current_cmd_size = MAX_CON_CMD_SIZE - (os_strlen(cmd) + 1);
-    char cmd_line[MAX_CON_CMD_SIZE + 1];
-
-    if (os_strlen(val) >= max_current_cmd_size)
+    if (os_strcmp(req->path, "/") == 0)
     {
-        val[max_current_cmd_size] = '\0';
+        web_config_apply(pespconn, (web_txn_t *)txn);
+        return WEB_RESP_PAGE;
     }
-    os_sprintf(cmd_line, "%s %s", cmd, val);
-    //os_printf("web_config_client_recv_cb(): cmd line:%s\n",cmd_line);
-
-    ringbuf_memcpy_into(console_rx_buffer, cmd_line, os_strlen(cmd_line));
-    console_handle_command(pespconn);
+    if (os_strcmp(req->path, "/status.json") == 0)
+        return WEB_RESP_STATUS;
+    return WEB_RESP_NOT_FOUND;
 }
 
-char *strstr(char *string, char *needle);
-char *strtok(char *str, const char *delimiters);
-char *strtok_r(char *s, const char *delim, char **last);
-
-static void ICACHE_FLASH_ATTR web_config_client_recv_cb(void *arg,
-                                                        char *data,
-                                                        unsigned short length)
+static const char * ICACHE_FLASH_ATTR web_config_page_start(web_page_t *page, uint8_t kind)
 {
-    struct espconn *pespconn = (struct espconn *)arg;
-    char *kv, *sv;
-    bool do_reset = false;
-    char *token[1];
-    char *str;
+    static const uint8_t config_page_str[] ICACHE_RODATA_ATTR STORE_ATTR = CONFIG_PAGE;
+    static const uint8_t lock_page_str[] ICACHE_RODATA_ATTR STORE_ATTR = LOCK_PAGE;
+    web_render_t *r = &page->render;
+    uint16_t body_len;
 
-    str = strstr(data, " /?");
-    if (str != NULL)
+    if (kind == WEB_RESP_STATUS)
     {
-        str = strtok(str + 3, " ");
-
-        char *keyval = strtok_r(str, "&", &kv);
-        while (keyval != NULL)
-        {
-            char *key = strtok_r(keyval, "=", &sv);
-            char *val = strtok_r(NULL, "=", &sv);
-
-            keyval = strtok_r(NULL, "&", &kv);
-            //os_printf("web_config_client_recv_cb(): key:%s:val:%s:\n",key,val);
-            if (val != NULL)
-            {
-
-                if (strcmp(key, "ssid") == 0)
-                {
-                    parse_str_into_tokens(val, token, 1);
-                    handle_set_cmd(pespconn, "set ssid", token[0]);
-                    config.automesh_mode = AUTOMESH_OFF;
-                    do_reset = true;
-                }
-                else if (strcmp(key, "password") == 0)
-                {
-                    parse_str_into_tokens(val, token, 1);
-                    handle_set_cmd(pespconn, "set password", token[0]);
-                    do_reset = true;
-                }
-                else if (strcmp(key, "am") == 0)
-                {
-                    config.automesh_mode = AUTOMESH_LEARNING;
-                    config.automesh_checked = 0;
-                    do_reset = true;
-                }
-                else if (strcmp(key, "lock") == 0)
-                {
-                    os_memcpy(config.lock_password, config.password, sizeof(config.lock_password));
-                    config.locked = 1;
-                }
-                else if (strcmp(key, "ap_ssid") == 0)
-                {
-                    parse_str_into_tokens(val, token, 1);
-                    handle_set_cmd(pespconn, "set ap_ssid", token[0]);
-                    do_reset = true;
-                }
-                else if (strcmp(key, "ap_password") == 0)
-                {
-                    parse_str_into_tokens(val, token, 1);
-                    handle_set_cmd(pespconn, "set ap_password", token[0]);
-                    do_reset = true;
-                }
-                else if (strcmp(key, "network") == 0)
-                {
-                    handle_set_cmd(pespconn, "set network", val);
-                    do_reset = true;
-                }
-                else if (strcmp(key, "unlock_password") == 0)
-                {
-                    handle_set_cmd(pespconn, "unlock", val);
-                }
-                else if (strcmp(key, "ap_open") == 0)
-                {
-                    if (strcmp(val, "wpa2") == 0)
-                    {
-                        config.ap_open = 0;
-                        do_reset = true;
-                    }
-                    if (strcmp(val, "open") == 0)
-                    {
-                        config.ap_open = 1;
-                        do_reset = true;
-                    }
-                }
-                else if (strcmp(key, "reset") == 0)
-                {
-                    do_reset = true;
-                }
-#if GPIO_CMDS
-                else if (strcmp(key, "gpio") == 0)
-                {
-                    handle_set_cmd(pespconn, "gpio", val);
-                }
-#endif
-            }
-        }
-
-        config_save(&config);
-
-        if (do_reset == true)
-        {
-            do_reset = false;
-            ringbuf_memcpy_into(console_rx_buffer, "reset", os_strlen("reset"));
-            console_handle_command(pespconn);
-        }
+        if ((page->body = status_json_alloc(&body_len)) == NULL)
+            return NULL;
+        web_render_init(r, (uint8_t *)page->body, body_len);
+        r->raw = 1;
+        return "application/json";
     }
-}
 
-static void ICACHE_FLASH_ATTR web_config_client_discon_cb(void *arg)
-{
-    //os_printf("web_config_client_discon_cb(): client disconnected\n");
-    struct espconn *pespconn = (struct espconn *)arg;
+    if (!config.locked)
+    {
+        web_render_init(r, config_page_str, sizeof(config_page_str) - 1);
+        web_render_arg(r, config.ssid);
+        web_render_arg(r, config.password);
+        web_render_arg(r, config.automesh_mode != AUTOMESH_OFF ? "checked" : "");
+        web_render_arg(r, config.ap_ssid);
+        web_render_arg(r, config.ap_password);
+        web_render_arg(r, config.ap_open ? " selected" : "");
+        web_render_arg(r, config.ap_open ? "" : " selected");
+        web_render_arg_int(r, ip4_addr1(&config.network_addr));
+        web_render_arg_int(r, ip4_addr2(&config.network_addr));
+        web_render_arg_int(r, ip4_addr3(&config.network_addr));
+        web_render_arg_int(r, ip4_addr4(&config.network_addr));
+    }
+    else
+    {
+        web_render_init(r, lock_page_str, sizeof(lock_page_str) - 1);
+    }
+    return "text/html";
 }
 
-static void ICACHE_FLASH_ATTR web_config_client_sent_cb(void *arg)
-{
-    //os_printf("web_config_client_sent_cb(): data sent to client\n");
-    struct espconn *pespconn = (struct espconn *)arg;
-
-    espconn_disconnect(pespconn);
-}
+static const web_session_ops_t web_config_ops = {
+    web_config_param, web_config_request, web_config_page_start
+};
 
 /* Called when a client connects to the web config */
 static void ICACHE_FLASH_ATTR web_config_client_connected_cb(void *arg)
 {
-
     struct espconn *pespconn = (struct espconn *)arg;
 
     //os_printf("web_config_client_connected_cb(): Client connected\r\n");
@@ -636,50 +2017,7 @@ static void ICACHE_FLASH_ATTR web_config_client_connected_cb(void *arg)
         espconn_disconnect(pespconn);
         return;
     }
-
-    espconn_regist_disconcb(pespconn, web_config_client_discon_cb);
-    espconn_regist_recvcb(pespconn, web_config_client_recv_cb);
-    espconn_regist_sentcb(pespconn, web_config_client_sent_cb);
-
-    ringbuf_reset(console_rx_buffer);
-    ringbuf_reset(console_tx_buffer);
-
-    if (!config.locked)
-    {
-        static const uint8_t config_page_str[] ICACHE_RODATA_ATTR STORE_ATTR = CONFIG_PAGE;
-        uint32_t slen = (sizeof(config_page_str) + 4) & ~3;
-        uint8_t *config_page = (char *)os_malloc(slen);
-        if (config_page == NULL)
-            return;
-        os_memcpy(config_page, config_page_str, slen);
-
-        uint8_t *page_buf = (char *)os_malloc(slen + 200);
-        if (page_buf == NULL)
-            return;
-        os_sprintf(page_buf, config_page, config.ssid, config.password,
-                   config.automesh_mode != AUTOMESH_OFF ? "checked" : "",
-                   config.ap_ssid, config.ap_password,
-                   config.ap_open ? " selected" : "", config.ap_open ? "" : " selected",
-                   IP2STR(&config.network_addr));
-        os_free(config_page);
-
-        espconn_send(pespconn, page_buf, os_strlen(page_buf));
-
-        os_free(page_buf);
-    }
-    else
-    {
-        static const uint8_t lock_page_str[] ICACHE_RODATA_ATTR STORE_ATTR = LOCK_PAGE;
-        uint32_t slen = (sizeof(lock_page_str) + 4) & ~3;
-        uint8_t *lock_page = (char *)os_malloc(slen);
-        if (lock_page == NULL)
-            return;
-        os_memcpy(lock_page, lock_page_str, slen);
-
-        espconn_send(pespconn, lock_page, sizeof(lock_page_str));
-
-        os_free(lock_page);
-    }
+    web_session_open(pespconn);
 }
 #endif /* WEB_CONFIG */
 
@@ -689,7 +2027,6 @@ void ICACHE_FLASH_ATTR timer_func(void *arg)
 {
     uint32_t Vcurr;
     uint64_t t_new;
-    uint32_t t_diff;
 #if TOKENBUCKET
     uint32_t Bps;
 #endif
@@ -766,6 +2103,22 @@ void ICACHE_FLASH_ATTR timer_func(void *arg)
         Vcurr = (system_get_vdd33() * 1000) / 1024;
         Vdd = (Vdd * 3 + Vcurr) / 4;
 
+#if MESH_ROUTING
+        if (mesh_route_conn != NULL)
+            mesh_route_tick(&mesh_route, (uint32_t)(get_long_systime() / 1000));
+#endif
+        if (config.automesh_mode != AUTOMESH_OFF)
+        {
+#if MESH_ROUTING
+            if (mesh_route_conn != NULL)
+                automesh_set_rtt(&automesh, mesh_route.rtt);
+#endif
+            automesh_tick(&automesh, (uint32_t)(get_long_systime() / 1000));
+#if MESH_IE
+            if (config.automesh_mode == AUTOMESH_OPERATIONAL)
+                mesh_ie_update();
+#endif
+        }
     }
 
     // Do we still have to configure the AP netif?
@@ -794,22 +2147,11 @@ void ICACHE_FLASH_ATTR timer_func(void *arg)
     t_new = get_long_systime();
 
 #if TOKENBUCKET
-    t_diff = (uint32_t)((t_new - t_old_tb) / 1000);
-    if (config.kbps_ds != 0)
-    {
-        Bps = config.kbps_ds * 1024 / 8;
-        token_bucket_ds += (t_diff * Bps) / 1000;
-        if (token_bucket_ds > MAX_TOKEN_RATIO * Bps)
-            token_bucket_ds = MAX_TOKEN_RATIO * Bps;
-    }
-    if (config.kbps_us != 0)
-    {
-        Bps = config.kbps_us * 1024 / 8;
-        token_bucket_us += (t_diff * Bps) / 1000;
-        if (token_bucket_us > MAX_TOKEN_RATIO * Bps)
-            token_bucket_us = MAX_TOKEN_RATIO * Bps;
-    }
-    t_old_tb = t_new;
+    // The buckets are refilled by the shaper itself, only pick up config changes
+    Bps = config.kbps_us * 1024 / 8;
+    shaper_set_rate(&shaper, SHAPER_UP, Bps, MAX_TOKEN_RATIO * Bps, t_new);
+    Bps = config.kbps_ds * 1024 / 8;
+    shaper_set_rate(&shaper, SHAPER_DOWN, Bps, MAX_TOKEN_RATIO * Bps, t_new);
 #endif
 
 
@@ -842,7 +2184,20 @@ static void ICACHE_FLASH_ATTR user_procTask(os_event_t *events)
     case SIG_CONSOLE_RX:
     {
         struct espconn *pespconn = (struct espconn *)events->par;
-        console_handle_command(pespconn);
+        if (pespconn == NULL)
+        {
+            // One signal may stand for several lines from the UART
+            while (UART_RecvConsoleLine())
+                console_handle_command(NULL);
+        }
+        else
+        {
+#if REMOTE_CONFIG
+            // And one may stand for several lines of a segment
+            while (console_tcp_line())
+                console_handle_command(pespconn);
+#endif
+        }
     }
     break;
 #if HAVE_LOOPBACK
@@ -885,61 +2240,26 @@ void wifi_handle_event_cb(System_Event_t *evt)
             }
         }
 
-        if (config.automesh_mode == AUTOMESH_OPERATIONAL && wrong_bssid)
-        {
-            config.automesh_mode = AUTOMESH_LEARNING;
-            config_save(&config);
-            system_restart();
-            while (true)
-                ;
-            return;
-        }
+        if (config.automesh_mode != AUTOMESH_OFF && wrong_bssid)
+            automesh_connected(&automesh, evt->event_info.connected.bssid, (uint32_t)(get_long_systime() / 1000));
 
         break;
 
     case EVENT_STAMODE_DISCONNECTED:
         os_printf("disconnect from ssid %s, reason %d\r\n", evt->event_info.disconnected.ssid, evt->event_info.disconnected.reason);
         connected = false;
-
-
+#if FASTPATH
+        fastpath_flush();
+#endif
+#if MESH_ROUTING
+        if (mesh_route_conn != NULL)
+            mesh_route_set_uplink(&mesh_route, 0, (uint32_t)(get_long_systime() / 1000));
+#endif
 
         os_memset(uplink_bssid, 0, sizeof(uplink_bssid));
-        if (config.automesh_mode == AUTOMESH_OPERATIONAL)
-        {
-            if (evt->event_info.disconnected.reason == 201)
-            {
-                wifi_set_opmode(STATION_MODE);
-            }
-
-            config.automesh_tries++;
-
-            if (config.automesh_checked)
-            {
-                if (config.automesh_tries <= 3)
-                    break;
-                os_printf("Connect to known SSID %s failed, rouge AP?\r\n", config.ssid);
-                *(int *)config.bssid = 0;
-                config.automesh_mode = AUTOMESH_LEARNING;
-            }
-            else
-            {
-                if (config.automesh_tries > 3)
-                {
-                    os_printf("Initial connect to SSID %s failed, check password - factory reset\r\n", config.ssid);
-                    config_load_default(&config);
-                }
-                else
-                {
-                    os_printf("Cannot connect to SSID %s - %d. trial\r\n", config.ssid, config.automesh_tries);
-                }
-            }
-
-            config_save(&config);
-            system_restart();
-            while (true)
-                ;
-            return;
-        }
+        if (config.automesh_mode != AUTOMESH_OFF)
+            automesh_disconnected(&automesh, evt->event_info.disconnected.bssid, evt->event_info.disconnected.reason,
+                                  (uint32_t)(get_long_systime() / 1000));
 
         break;
 
@@ -973,13 +2293,17 @@ void wifi_handle_event_cb(System_Event_t *evt)
 
         if (config.automesh_mode == AUTOMESH_OPERATIONAL)
         {
-            wifi_set_opmode(STATIONAP_MODE);
-            if (config.automesh_checked == 0)
+            automesh_got_ip(&automesh, (uint32_t)(get_long_systime() / 1000));
+            os_printf("Automesh successfully configured and started\r\n");
+#if MESH_ROUTING
+            if (mesh_route_conn != NULL)
             {
-                config.automesh_checked = 1;
-                config_save(&config);
+                // The network of the uplink is ours, the AP must move
+                if ((evt->event_info.got_ip.gw.addr & 0x00ffffff) == (config.network_addr.addr & 0x00ffffff))
+                    mesh_route_renumber(&mesh_route, (uint32_t)(get_long_systime() / 1000));
+                mesh_route_set_uplink(&mesh_route, evt->event_info.got_ip.gw.addr, (uint32_t)(get_long_systime() / 1000));
             }
-            os_printf("Automesh successfully configured and started\r\n");
+#endif
         }
 
 
@@ -994,12 +2318,19 @@ void wifi_handle_event_cb(System_Event_t *evt)
 
         ip_addr_t ap_ip = config.network_addr;
         ip4_addr4(&ap_ip) = 1;
+#if MESH_ROUTING
+        patch_netif(ap_ip, my_input_ap, &orig_input_ap, my_output_ap, &orig_output_ap, config.nat_enable && !mesh_routed);
+#else
         patch_netif(ap_ip, my_input_ap, &orig_input_ap, my_output_ap, &orig_output_ap, config.nat_enable);
+#endif
         break;
 
     case EVENT_SOFTAPMODE_STADISCONNECTED:
         os_sprintf(mac_str, MACSTR, MAC2STR(evt->event_info.sta_disconnected.mac));
         os_printf("station: %s leave, AID = %d\r\n", mac_str, evt->event_info.sta_disconnected.aid);
+#if TOKENBUCKET
+        shaper_station_gone(&shaper, evt->event_info.sta_disconnected.mac);
+#endif
         break;
 
     default:
@@ -1120,95 +2451,264 @@ void ICACHE_FLASH_ATTR user_set_station_config(void)
 
 
 
-void ICACHE_FLASH_ATTR automesh_scan_done(void *arg, STATUS status)
+#if MESH_IE
+// Vendor IEs of received beacons and probe responses
+static void ICACHE_FLASH_ATTR mesh_ie_recv_cb(user_ie_type type, const uint8 sa[6], const uint8 m_oui[3],
+                                              uint8 *ie, uint8 ie_len, sint32 rssi)
 {
-    if (status == OK)
-    {
-        mesh_level = 0xff;
-        int rssi = -1000;
+    if (os_memcmp(m_oui, mesh_ie_oui, 3) != 0)
+        return;
+    mesh_ie_cache_input(&mesh_ie_cache, sa, ie, ie_len, (uint32_t)(get_long_systime() / 1000));
+}
 
-        struct bss_info *bss_link;
+// Free NAPT flows, 0xfe at most so it never reads as MESH_IE_UNKNOWN,
+// which stands for a NAPT not set up yet
+static uint8_t ICACHE_FLASH_ATTR napt_flows_free(void)
+{
+    int free = ip_napt_max - (nr_active_napt_tcp + nr_active_napt_udp + nr_active_napt_icmp);
 
-        for (bss_link = (struct bss_info *)arg; bss_link != NULL; bss_link = bss_link->next.stqe_next)
-        {
-            if (os_strcmp(bss_link->ssid, config.ssid) == 0)
-            {
-                uint8_t this_mesh_level;
+    if (ip_napt_max == 0)
+        return MESH_IE_UNKNOWN;
+    if (free < 0)
+        return 0;
+    return free > MESH_IE_UNKNOWN - 1 ? MESH_IE_UNKNOWN - 1 : free;
+}
 
-                os_printf("Found: %d,\"%s\",%d,\"" MACSTR "\",%d",
-                          bss_link->authmode, bss_link->ssid, bss_link->rssi,
-                          MAC2STR(bss_link->bssid), bss_link->channel);
-                if (bss_link->bssid[0] != 0x24 || bss_link->bssid[1] != 0x24)
-                {
-                    this_mesh_level = 0;
-                }
-                else
-                {
-                    this_mesh_level = bss_link->bssid[2];
-                }
+// Puts our current state into the beacons, the SDK is only called on a change
+static void ICACHE_FLASH_ATTR mesh_ie_update(void)
+{
+    mesh_ie_t ie;
+    uint8_t buf[MESH_IE_LEN];
+    uint8_t len;
+    uint32_t now = (uint32_t)(get_long_systime() / 1000);
 
-                // If it is bad quality, give is a handicap of one level
-                if (bss_link->rssi < -config.automesh_threshold)
-                    this_mesh_level++;
+    if ((int32_t)(now - mesh_ie_next) < 0)
+        return;
+    mesh_ie_next = now + MESH_IE_REFRESH;
 
-                os_printf(", mesh level: %d\r\n", this_mesh_level);
+    ie.level = mesh_level + 1;
+    ie.load = wifi_softap_get_station_num();
+    ie.napt_free = napt_flows_free();
+    ie.uplink_rssi = connected ? wifi_station_get_rssi() : 0;
+    mesh_ie_version(ESP_REPEATER_VERSION, ie.firmware);
 
-                // Lower mesh level or same but better RSSI
-                if (this_mesh_level < mesh_level ||
-                    (this_mesh_level == mesh_level && bss_link->rssi > rssi))
-                {
-                    rssi = bss_link->rssi;
-                    mesh_level = this_mesh_level;
-                    os_memcpy(config.bssid, bss_link->bssid, 6);
-                }
-            }
-        }
+    len = mesh_ie_encode(&ie, buf);
+    if (os_memcmp(buf, mesh_ie_buf, len) == 0)
+        return;
+    os_memcpy(mesh_ie_buf, buf, len);
+    wifi_set_user_ie(true, mesh_ie_oui, USER_IE_BEACON, mesh_ie_buf, len);
+    wifi_set_user_ie(true, mesh_ie_oui, USER_IE_PROBE_RESP, mesh_ie_buf, len);
+}
+#endif /* MESH_IE */
 
-        if (mesh_level < 0xff)
-        {
-            os_printf("Using: " MACSTR "\r\n", MAC2STR(config.bssid));
+static void ICACHE_FLASH_ATTR automesh_scan(void *ctx)
+{
+    wifi_station_disconnect();
+    wifi_station_scan(NULL, automesh_scan_done);
+}
+
+static void ICACHE_FLASH_ATTR automesh_survey(void *ctx)
+{
+    struct scan_config scan;
+
+    // All of the mesh is on the channel of the root AP, no need to leave it
+    os_memset(&scan, 0, sizeof(scan));
+    scan.ssid = (uint8 *)config.ssid;
+    scan.channel = my_channel;
+    wifi_station_scan(&scan, automesh_scan_done);
+}
 
-            config.AP_MAC_address[0] = 0x24;
-            config.AP_MAC_address[1] = 0x24;
-            config.AP_MAC_address[2] = mesh_level + 1;
-            os_get_random(&config.AP_MAC_address[3], 3);
+// Addresses of the SoftAP below an uplink at level. With the mesh IE
+// telling the level the MAC stays; without it the BSSID has to, as
+// 24:24:<level>:<random>, which the neighbors read back.
+static void ICACHE_FLASH_ATTR automesh_address_ap(uint8_t level)
+{
+#if !MESH_IE
+    config.AP_MAC_address[0] = 0x24;
+    config.AP_MAC_address[1] = 0x24;
+    config.AP_MAC_address[2] = level + 1;
+    os_get_random(&config.AP_MAC_address[3], 3);
+#endif
+#if MESH_ROUTING
+    // Routed networks must be unique in the mesh, not only per level
+    config.network_addr.addr = mesh_route_subnet(config.AP_MAC_address, 0);
+    ip4_addr4(&config.network_addr) = 1;
+#else
+    IP4_ADDR(&config.network_addr, 10, 24, level + 1, 1);
+#endif
+    do_ip_config = true;
+#if MESH_ROUTING
+    if (mesh_route_conn == NULL)
+    {
+        mesh_route_start();
+    }
+    else
+    {
+        ip_addr_t ap_net = config.network_addr;
 
-            wifi_set_macaddr(SOFTAP_IF, config.AP_MAC_address);
-            user_set_softap_wifi_config();
+        ip4_addr4(&ap_net) = 0;
+        mesh_route_set_local(&mesh_route, config.AP_MAC_address, ap_net.addr, 24, (uint32_t)(get_long_systime() / 1000));
+    }
+#endif
+}
 
-            IP4_ADDR(&config.network_addr, 10, 24, mesh_level + 1, 1);
+// Moves the node below the new uplink, the SoftAP follows the level
+static void ICACHE_FLASH_ATTR automesh_connect(void *ctx, const uint8_t *bssid, uint8_t level)
+{
+    struct station_config stationConf;
+    uint8_t old_level = config.automesh_level;
 
-            config.automesh_mode = AUTOMESH_OPERATIONAL;
-            config.automesh_tries = 0;
+    os_printf("Using: " MACSTR ", mesh level: %d\r\n", MAC2STR(bssid), level);
+#if FASTPATH
+    // The cached flows carry the STA address and gateway MAC of the old uplink
+    if (os_memcmp(config.bssid, bssid, 6) != 0)
+        fastpath_flush();
+#endif
+    os_memcpy(config.bssid, bssid, 6);
+    mesh_level = config.automesh_level = level;
+#if MESH_IE
+    // The beacons tell the new level right away
+    mesh_ie_next = 0;
+#endif
 
-            config_save(&config);
-            //wifi_set_macaddr(SOFTAP_IF, config.AP_MAC_address);
+    if (config.automesh_mode != AUTOMESH_OPERATIONAL)
+    {
+        // Out of learning mode the SoftAP comes up, once
+        config.automesh_mode = AUTOMESH_OPERATIONAL;
+        config.ap_on = 1;
+        config.auto_connect = 1;
+        config.ap_open = os_strncmp(config.password, "none", 4) == 0;
 
-            system_restart();
-            while (true)
-                ;
-            return;
-        }
+        automesh_address_ap(level);
+        wifi_set_opmode(STATIONAP_MODE);
+        wifi_set_macaddr(SOFTAP_IF, config.AP_MAC_address);
+        user_set_softap_wifi_config();
     }
-    else
+#if !MESH_IE || !MESH_ROUTING
+    else if (level != old_level)
     {
-        os_printf("Scan fail !!!\r\n");
+        // The level is in the BSSID or the network, the SoftAP moves in place
+        automesh_address_ap(level);
+#if !MESH_IE
+        wifi_set_macaddr(SOFTAP_IF, config.AP_MAC_address);
+        user_set_softap_wifi_config();
+#endif
     }
+#endif
+    // Otherwise the SoftAP, its stations and DHCP leases stay
+
+    wifi_station_disconnect();
+    wifi_station_get_config(&stationConf);
+    stationConf.bssid_set = 1;
+    os_memcpy(stationConf.bssid, bssid, 6);
+    wifi_station_set_config_current(&stationConf);
+    wifi_station_set_auto_connect(1);
+    wifi_station_connect();
+}
 
-    os_printf("No AP with ssid %s found\r\n", config.ssid);
+#if ALLOW_PING
+static struct ping_option automesh_ping;
 
+static void ICACHE_FLASH_ATTR automesh_ping_recv(void *arg, void *pdata)
+{
+    struct ping_resp *ping_resp = pdata;
 
+    if (ping_resp->ping_err != -1)
+        automesh_reachable(&automesh, (uint32_t)(get_long_systime() / 1000));
+}
 #endif
 
-    wifi_station_scan(NULL, automesh_scan_done);
+// The parent answers even if it lost its own uplink, so ping the DNS
+// server: it is the one of the root AP, handed down by DHCP
+static void ICACHE_FLASH_ATTR automesh_probe(void *ctx)
+{
+#if ALLOW_PING
+    os_memset(&automesh_ping, 0, sizeof(automesh_ping));
+    automesh_ping.count = 1;
+    automesh_ping.coarse_time = 1;
+    automesh_ping.ip = dns_ip.addr;
+    ping_regist_recv(&automesh_ping, automesh_ping_recv);
+    ping_start(&automesh_ping);
+#else
+    // Nothing to check with
+    automesh_reachable(&automesh, (uint32_t)(get_long_systime() / 1000));
+#endif
 }
 
-void ICACHE_FLASH_ATTR to_scan(void)
+static void ICACHE_FLASH_ATTR automesh_persist(void *ctx)
+{
+    os_printf("Automesh uplink " MACSTR " stable, saved\r\n", MAC2STR(config.bssid));
+    config.automesh_checked = 1;
+    config.automesh_tries = 0;
+    config_save(&config);
+}
+
+static void ICACHE_FLASH_ATTR automesh_factory_reset(void *ctx)
+{
+    os_printf("Initial connect to SSID %s failed, check password - factory reset\r\n", config.ssid);
+    config_load_default(&config);
+    config_save(&config);
+    system_restart();
+    while (true)
+        ;
+}
+
+static const automesh_ops_t automesh_ops = {
+    automesh_scan, automesh_survey, automesh_connect, automesh_probe, automesh_persist, automesh_factory_reset};
+
+void ICACHE_FLASH_ATTR automesh_scan_done(void *arg, STATUS status)
 {
-    if (config.automesh_mode == AUTOMESH_LEARNING)
+    automesh_bss_t bss[AUTOMESH_MAX_BSS];
+    uint8_t n = 0;
+
+    if (status == OK)
+    {
+        struct bss_info *bss_link;
+
+        for (bss_link = (struct bss_info *)arg; bss_link != NULL; bss_link = bss_link->next.stqe_next)
+        {
+            if (os_strcmp(bss_link->ssid, config.ssid) == 0 && n < AUTOMESH_MAX_BSS)
+            {
+                // Background scans only go to the neighbor table, see "show neighbors"
+                if (automesh.state == AUTOMESH_SCANNING)
+                    os_printf("Found: %d,\"%s\",%d,\"" MACSTR "\",%d\r\n",
+                              bss_link->authmode, bss_link->ssid, bss_link->rssi,
+                              MAC2STR(bss_link->bssid), bss_link->channel);
+                os_memcpy(bss[n].bssid, bss_link->bssid, 6);
+                bss[n].rssi = bss_link->rssi;
+                bss[n].channel = bss_link->channel;
+                bss[n].level = AUTOMESH_UNKNOWN;
+                bss[n].load = AUTOMESH_UNKNOWN;
+                bss[n].napt_free = AUTOMESH_UNKNOWN;
+                bss[n].uplink_rssi = 0;
+#if MESH_IE
+                const mesh_ie_t *ie = mesh_ie_cache_get(&mesh_ie_cache, bss_link->bssid, (uint32_t)(get_long_systime() / 1000));
+                if (ie != NULL)
+                {
+                    bss[n].level = ie->level;
+                    bss[n].load = ie->load;
+                    bss[n].napt_free = ie->napt_free;
+                    bss[n].uplink_rssi = ie->uplink_rssi;
+                }
+#endif
+                n++;
+            }
+        }
+        if (n == 0)
+            os_printf("No AP with ssid %s found\r\n", config.ssid);
+    }
+    else
     {
-        wifi_station_scan(NULL, automesh_scan_done);
+        os_printf("Scan fail !!!\r\n");
     }
+
+    automesh_scan_result(&automesh, bss, n, (uint32_t)(get_long_systime() / 1000));
+}
+
+void ICACHE_FLASH_ATTR to_scan(void)
+{
+    if (config.automesh_mode != AUTOMESH_OFF)
+        automesh_start(&automesh, (uint32_t)(get_long_systime() / 1000));
 }
 
 #if HAVE_LOOPBACK
@@ -1238,17 +2738,20 @@ void ICACHE_FLASH_ATTR user_init()
 #endif
 
 #if TOKENBUCKET
-    t_old_tb = 0;
-    token_bucket_ds = token_bucket_us = 0;
+    shaper_init(&shaper, ap_input_forward, ap_output_forward);
 #endif
 
     console_rx_buffer = ringbuf_new(MAX_CON_CMD_SIZE);
     console_tx_buffer = ringbuf_new(MAX_CON_SEND_SIZE);
+#if REMOTE_CONFIG
+    console_tcp_rx = ringbuf_new(MAX_CON_TCP_RX_SIZE);
+#endif
 
     gpio_init();
     init_long_systime();
 
     UART_init_console(BIT_RATE_115200, 0, console_rx_buffer, console_tx_buffer);
+    UART_SetTxReadyCb(console_uart_tx_ready);
 
     os_printf("\r\n\r\nWiFi Repeater %s starting\r\n\nrunning rom %d\r", ESP_REPEATER_VERSION, rboot_get_current_rom());
 
@@ -1331,7 +2834,16 @@ void ICACHE_FLASH_ATTR user_init()
             config.ap_on = 1;
             config.auto_connect = 1;
             config.ap_open = os_strncmp(config.password, "none", 4) == 0;
+            mesh_level = config.automesh_level;
         }
+
+        automesh_init(&automesh, &automesh_ops, NULL, config.automesh_mode == AUTOMESH_OPERATIONAL,
+                      config.bssid, mesh_level, config.automesh_checked != 0, config.automesh_threshold,
+                      (uint32_t)(get_long_systime() / 1000));
+#if MESH_IE
+        mesh_ie_cache_init(&mesh_ie_cache);
+        wifi_register_user_ie_manufacturer_recv_cb(mesh_ie_recv_cb);
+#endif
     }
 
     // Configure the AP and start it, if required
@@ -1426,13 +2938,20 @@ void ICACHE_FLASH_ATTR user_init()
         pCon->proto.tcp->local_port = config.web_port;
 
         /* Register callback when clients connect to the server */
+        web_session_init(&web_config_ops, web_txns, sizeof(web_txn_t));
         espconn_regist_connectcb(pCon, web_config_client_connected_cb);
 
         /* Put the connection in accept mode */
         espconn_accept(pCon);
+        espconn_tcp_set_max_con_allow(pCon, WEB_MAX_SESSIONS);
+        espconn_regist_time(pCon, WEB_IDLE_TIMEOUT, 0);
     }
 #endif
 
+#if MESH_ROUTING
+    if (config.automesh_mode == AUTOMESH_OPERATIONAL)
+        mesh_route_start();
+#endif
 
     // Start the timer
     os_timer_setfn(&ptimer, timer_func, 0);
@@ -1440,4 +2959,7 @@ void ICACHE_FLASH_ATTR user_init()
 
     //Start task
     system_os_task(user_procTask, user_procTaskPrio, user_procTaskQueue, user_procTaskQueueLen);
+
+    // Look for an uplink once the SDK is up
+    system_init_done_cb(to_scan);
 }
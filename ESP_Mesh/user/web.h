@@ -1,4 +1,4 @@
-#define CONFIG_PAGE "HTTP/1.0 200 OK\r\nContent-Type: text/html\r\n\r\n\
+#define CONFIG_PAGE "\
 <html>\
 <head></head>\
 <meta name='viewport' content='width=device-width, initial-scale=1'>\
@@ -40,7 +40,7 @@ setTimeout(\"location.href = '/'\",10000);\
 </html>\
 "
 
-#define LOCK_PAGE "HTTP/1.0 200 OK\r\nContent-Type: text/html\r\n\r\n\
+#define LOCK_PAGE "\
 <html>\
 <head></head>\
 <meta name='viewport' content='width=device-width, initial-scale=1'>\
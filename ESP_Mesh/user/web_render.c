@@ -0,0 +1,161 @@
+#include "c_types.h"
+#include "osapi.h"
+
+#include "web_render.h"
+
+void ICACHE_FLASH_ATTR web_render_init(web_render_t *r, const uint8_t *tmpl, uint32_t tmpl_len)
+{
+    os_memset(r, 0, sizeof(web_render_t) - WEB_RENDER_WINDOW);
+    r->tmpl = tmpl;
+    r->tmpl_len = tmpl_len;
+}
+
+void ICACHE_FLASH_ATTR web_render_arg(web_render_t *r, const char *val)
+{
+    if (r->nargs < WEB_RENDER_MAX_ARGS)
+        r->args[r->nargs++] = val;
+}
+
+void ICACHE_FLASH_ATTR web_render_arg_int(web_render_t *r, int val)
+{
+    char *p = &r->scratch[r->scratch_len];
+
+    if (r->scratch_len > WEB_RENDER_SCRATCH - 12)
+        return;
+    os_sprintf(p, "%d", val);
+    r->scratch_len += os_strlen(p) + 1;
+    web_render_arg(r, p);
+}
+
+// Next template char, -1 at the end. Flash is only read in aligned words.
+static int ICACHE_FLASH_ATTR next_char(web_render_t *r)
+{
+    if (r->chunk_pos == r->chunk_len)
+    {
+        const uint32_t *src = (const uint32_t *)(r->tmpl + r->pos);
+        uint32_t left = r->tmpl_len - r->pos;
+        uint8_t words, i;
+
+        if (r->pos >= r->tmpl_len)
+            return -1;
+
+        words = left >= sizeof(r->chunk) ? WEB_RENDER_CHUNK : (left + 3) / 4;
+        for (i = 0; i < words; i++)
+            r->chunk[i] = src[i];
+
+        r->chunk_len = left >= sizeof(r->chunk) ? sizeof(r->chunk) : left;
+        r->chunk_pos = 0;
+        r->pos += r->chunk_len;
+    }
+    return ((uint8_t *)r->chunk)[r->chunk_pos++];
+}
+
+static void ICACHE_FLASH_ATTR render_rewind(web_render_t *r)
+{
+    r->pos = 0;
+    r->chunk_pos = r->chunk_len = 0;
+    r->pct = 0;
+    r->next_arg = 0;
+    r->arg_p = NULL;
+}
+
+uint32_t ICACHE_FLASH_ATTR web_render_length(web_render_t *r)
+{
+    uint32_t len = 0;
+    uint8_t pct = 0, arg = 0;
+    int c;
+
+    render_rewind(r);
+    while ((c = next_char(r)) >= 0)
+    {
+        if (r->raw)
+        {
+            len++;
+        }
+        else if (pct)
+        {
+            pct = 0;
+            if (c == 's' || c == 'd')
+            {
+                if (arg < r->nargs)
+                    len += os_strlen(r->args[arg]);
+                arg++;
+            }
+            else
+            {
+                len += c == '%' ? 1 : 2;
+            }
+        }
+        else if (c == '%')
+        {
+            pct = 1;
+        }
+        else
+        {
+            len++;
+        }
+    }
+    render_rewind(r);
+    return len + pct;
+}
+
+uint16_t ICACHE_FLASH_ATTR web_render_next(web_render_t *r)
+{
+    uint16_t len = r->fill;
+    int c;
+
+    r->fill = 0;
+
+    while (len < WEB_RENDER_WINDOW)
+    {
+        // Continue an arg first
+        if (r->arg_p != NULL)
+        {
+            while (*r->arg_p != 0 && len < WEB_RENDER_WINDOW)
+                r->window[len++] = *r->arg_p++;
+            if (*r->arg_p != 0)
+                break;
+            r->arg_p = NULL;
+            continue;
+        }
+
+        if ((c = next_char(r)) < 0)
+        {
+            if (r->pct)
+            {
+                r->window[len++] = '%';
+                r->pct = 0;
+            }
+            break;
+        }
+
+        if (r->pct)
+        {
+            r->pct = 0;
+            if (c == 's' || c == 'd')
+            {
+                r->arg_p = r->next_arg < r->nargs ? r->args[r->next_arg] : "";
+                r->next_arg++;
+                continue;
+            }
+            if (c != '%')
+            {
+                r->window[len++] = '%';
+                if (len == WEB_RENDER_WINDOW)
+                {
+                    // c goes into the next window
+                    r->chunk_pos--;
+                    break;
+                }
+            }
+            r->window[len++] = c;
+            continue;
+        }
+
+        if (c == '%' && !r->raw)
+            r->pct = 1;
+        else
+            r->window[len++] = c;
+    }
+    return len;
+}
@@ -0,0 +1,54 @@
+#ifndef _WEB_RENDER_H_
+#define _WEB_RENDER_H_
+
+#include "c_types.h"
+
+//
+// Streaming renderer for the flash resident web page templates
+//
+// The template is read from flash in small aligned chunks and its %s/%d
+// placeholders are replaced by the args in order ("%%" is a literal '%').
+// The output is produced one window at a time, so serving a page needs
+// only this struct on the heap instead of two page sized buffers.
+//
+
+#define WEB_RENDER_WINDOW   512     // bytes per espconn_send
+#define WEB_RENDER_CHUNK    16      // 32 bit words read from flash at once
+#define WEB_RENDER_MAX_ARGS 12
+#define WEB_RENDER_SCRATCH  48      // room for formatted numeric args
+
+typedef struct {
+    const uint8_t *tmpl;    // template in flash, must be 4 byte aligned
+    uint32_t tmpl_len;
+    uint32_t pos;           // flash offset of the chunk after the current one
+    uint32_t chunk[WEB_RENDER_CHUNK];
+    uint8_t chunk_pos, chunk_len;
+    uint8_t pct;            // '%' was the last template char
+    uint8_t raw;            // no placeholders, e.g. for a generated body in RAM
+    uint8_t nargs, next_arg;
+    const char *args[WEB_RENDER_MAX_ARGS];
+    const char *arg_p;      // rest of an arg that did not fit into the window
+    char scratch[WEB_RENDER_SCRATCH];
+    uint8_t scratch_len;
+    uint16_t fill;          // bytes already put into the window, e.g. response headers
+    char window[WEB_RENDER_WINDOW];
+} web_render_t;
+
+// Sets up the rendering of tmpl (tmpl_len bytes, without the trailing 0).
+// Set r->raw afterwards to send tmpl unchanged.
+void web_render_init(web_render_t *r, const uint8_t *tmpl, uint32_t tmpl_len);
+
+// Appends the value of the next placeholder, val must stay valid until rendered
+void web_render_arg(web_render_t *r, const char *val);
+
+// Appends a numeric placeholder value
+void web_render_arg_int(web_render_t *r, int val);
+
+// Length of the complete rendered page, call before web_render_next()
+uint32_t web_render_length(web_render_t *r);
+
+// Renders the next part of the page into r->window after the first r->fill bytes,
+// returns the window length, 0 when done
+uint16_t web_render_next(web_render_t *r);
+
+#endif
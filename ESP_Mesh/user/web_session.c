@@ -0,0 +1,281 @@
+#include "c_types.h"
+#include "mem.h"
+#include "osapi.h"
+#include "user_interface.h"
+#include "lwip/app/espconn.h"
+
+#include "user_config.h"
+#include "web_session.h"
+
+#if WEB_CONFIG
+
+uint32_t web_page_heap_peak;
+
+static web_session_t web_sessions[WEB_MAX_SESSIONS];
+static uint8_t web_inflight;
+static uint8_t web_rr;      // session served last
+static const web_session_ops_t *web_ops;
+static uint8_t *web_txns;
+static uint16_t web_txn_size;
+
+static web_session_t * ICACHE_FLASH_ATTR web_session_find(struct espconn *pespconn)
+{
+    web_session_t *s = (web_session_t *)pespconn->reverse;
+    int i;
+
+    if (s >= web_sessions && s < &web_sessions[WEB_MAX_SESSIONS] && s->conn == pespconn)
+        return s;
+
+    // The disconnect callback may get another espconn for the same connection
+    for (i = 0; i < WEB_MAX_SESSIONS; i++)
+    {
+        s = &web_sessions[i];
+        if (s->conn != NULL && s->remote_port == pespconn->proto.tcp->remote_port &&
+            os_memcmp(s->remote_ip, pespconn->proto.tcp->remote_ip, 4) == 0)
+            return s;
+    }
+    return NULL;
+}
+
+static void ICACHE_FLASH_ATTR web_session_close(web_session_t *s)
+{
+    if (s->closing)
+        return;
+    s->closing = 1;
+    espconn_disconnect(s->conn);
+}
+
+// Clears the transaction and starts parsing the next request
+static void ICACHE_FLASH_ATTR web_session_next_req(web_session_t *s)
+{
+    os_memset(s->txn, 0, web_txn_size);
+    http_req_init(&s->req, web_ops->param, s->txn);
+}
+
+static void ICACHE_FLASH_ATTR web_page_free(web_session_t *s)
+{
+    if (s->page == NULL)
+        return;
+    web_page_heap_peak = s->page->heap_peak;
+    if (s->page->body != NULL)
+        os_free(s->page->body);
+    os_free(s->page);
+    s->page = NULL;
+}
+
+static bool ICACHE_FLASH_ATTR web_page_start(web_session_t *s, uint8_t resp)
+{
+    uint32_t heap_base = system_get_free_heap_size();
+    uint8_t kind = resp & WEB_RESP_KIND;
+    const char *status = "200 OK";
+    const char *type = "text/html";
+    web_page_t *page;
+
+    page = (web_page_t *)os_malloc(sizeof(web_page_t));
+    if (page == NULL)
+        return false;
+    page->heap_base = heap_base;
+    page->heap_peak = heap_base - system_get_free_heap_size();
+    page->body = NULL;
+    s->page = page;
+
+    if (kind == WEB_RESP_NOT_FOUND)
+    {
+        web_render_init(&page->render, NULL, 0);
+        status = "404 Not Found";
+    }
+    else if ((type = web_ops->page_start(page, kind)) == NULL)
+    {
+        return false;
+    }
+
+    page->render.fill = os_sprintf(page->render.window,
+                                   "HTTP/1.1 %s\r\nContent-Type: %s\r\nContent-Length: %d\r\nConnection: %s\r\n\r\n",
+                                   status, type, (int)web_render_length(&page->render),
+                                   (resp & WEB_RESP_CLOSE) ? "close" : "keep-alive");
+    return true;
+}
+
+// Sends the next window of the session, returns false if there is nothing to send
+static bool ICACHE_FLASH_ATTR web_session_send_next(web_session_t *s)
+{
+    uint32_t used;
+    uint16_t len;
+
+    for (;;)
+    {
+        if (s->page == NULL)
+        {
+            if (s->nqueued == 0)
+            {
+                if (s->close)
+                    web_session_close(s);
+                return false;
+            }
+            if (!web_page_start(s, s->queue[0]))
+            {
+                web_session_close(s);
+                return false;
+            }
+            os_memmove(&s->queue[0], &s->queue[1], --s->nqueued);
+        }
+
+        len = web_render_next(&s->page->render);
+        if (len != 0)
+            break;
+        web_page_free(s);
+    }
+
+    if (espconn_send(s->conn, (uint8 *)s->page->render.window, len) != 0)
+    {
+        web_session_close(s);
+        return false;
+    }
+    s->sending = 1;
+    web_inflight++;
+
+    used = s->page->heap_base - system_get_free_heap_size();
+    if (used > s->page->heap_peak)
+        s->page->heap_peak = used;
+    return true;
+}
+
+// Hands out the free send slots round robin, one window per session and turn
+static void ICACHE_FLASH_ATTR web_schedule(void)
+{
+    web_session_t *s;
+    int i;
+
+    for (i = 0; i < WEB_MAX_SESSIONS && web_inflight < WEB_MAX_INFLIGHT; i++)
+    {
+        web_rr = (web_rr + 1) % WEB_MAX_SESSIONS;
+        s = &web_sessions[web_rr];
+        if (s->conn != NULL && !s->sending && !s->closing)
+            web_session_send_next(s);
+    }
+}
+
+static void ICACHE_FLASH_ATTR web_session_free(web_session_t *s)
+{
+    if (s->sending)
+        web_inflight--;
+    web_page_free(s);
+    s->conn->reverse = NULL;
+    s->conn = NULL;
+}
+
+static void ICACHE_FLASH_ATTR web_session_recv_cb(void *arg, char *data, unsigned short length)
+{
+    struct espconn *pespconn = (struct espconn *)arg;
+    web_session_t *s = web_session_find(pespconn);
+    uint16_t used = 0;
+
+    if (s == NULL)
+    {
+        espconn_disconnect(pespconn);
+        return;
+    }
+
+    // Requests may arrive in several segments or several in one segment
+    while (used < length && !s->close && !s->closing)
+    {
+        used += http_req_feed(&s->req, data + used, length - used);
+
+        if (s->req.state == HTTP_REQ_ERROR)
+        {
+            web_session_close(s);
+            return;
+        }
+        if (s->req.state == HTTP_REQ_DONE)
+        {
+            uint8_t resp;
+
+            if (s->nqueued == WEB_MAX_QUEUED)
+            {
+                web_session_close(s);
+                return;
+            }
+            resp = web_ops->request(pespconn, &s->req, s->txn);
+            if (!s->req.keep_alive)
+            {
+                resp |= WEB_RESP_CLOSE;
+                s->close = 1;
+            }
+            s->queue[s->nqueued++] = resp;
+            web_session_next_req(s);
+        }
+    }
+
+    web_schedule();
+}
+
+static void ICACHE_FLASH_ATTR web_session_discon_cb(void *arg)
+{
+    struct espconn *pespconn = (struct espconn *)arg;
+    web_session_t *s = web_session_find(pespconn);
+
+    if (s == NULL)
+        return;
+    web_session_free(s);
+    web_schedule();
+}
+
+static void ICACHE_FLASH_ATTR web_session_recon_cb(void *arg, sint8 err)
+{
+    web_session_discon_cb(arg);
+}
+
+static void ICACHE_FLASH_ATTR web_session_sent_cb(void *arg)
+{
+    struct espconn *pespconn = (struct espconn *)arg;
+    web_session_t *s = web_session_find(pespconn);
+
+    if (s != NULL && s->sending)
+    {
+        s->sending = 0;
+        web_inflight--;
+    }
+    web_schedule();
+}
+
+void ICACHE_FLASH_ATTR web_session_init(const web_session_ops_t *ops, void *txns, uint16_t txn_size)
+{
+    os_memset(web_sessions, 0, sizeof(web_sessions));
+    web_inflight = 0;
+    web_rr = 0;
+    web_ops = ops;
+    web_txns = (uint8_t *)txns;
+    web_txn_size = txn_size;
+}
+
+void ICACHE_FLASH_ATTR web_session_open(struct espconn *pespconn)
+{
+    web_session_t *s = NULL;
+    int i;
+
+    for (i = 0; i < WEB_MAX_SESSIONS && s == NULL; i++)
+    {
+        if (web_sessions[i].conn == NULL)
+            s = &web_sessions[i];
+    }
+    if (s == NULL)
+    {
+        espconn_disconnect(pespconn);
+        return;
+    }
+
+    os_memset(s, 0, sizeof(web_session_t));
+    s->conn = pespconn;
+    os_memcpy(s->remote_ip, pespconn->proto.tcp->remote_ip, 4);
+    s->remote_port = pespconn->proto.tcp->remote_port;
+    s->txn = web_txns + (s - web_sessions) * web_txn_size;
+    web_session_next_req(s);
+    pespconn->reverse = s;
+
+    espconn_regist_disconcb(pespconn, web_session_discon_cb);
+    espconn_regist_reconcb(pespconn, web_session_recon_cb);
+    espconn_regist_recvcb(pespconn, web_session_recv_cb);
+    espconn_regist_sentcb(pespconn, web_session_sent_cb);
+}
+
+#endif /* WEB_CONFIG */
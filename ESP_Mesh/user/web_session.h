@@ -0,0 +1,84 @@
+#ifndef _WEB_SESSION_H_
+#define _WEB_SESSION_H_
+
+#include "c_types.h"
+#include "lwip/app/espconn.h"
+#include "http_req.h"
+#include "web_render.h"
+
+//
+// Session pool of the web config server
+//
+// Each connection gets a slot from a fixed pool, one more is refused.
+// A slot holds its own parser state, staged form fields and response.
+// Connections stay open for HTTP/1.1 unless the client sends
+// "Connection: close", pipelined requests are queued up to
+// WEB_MAX_QUEUED per session - the one after that closes it.
+//
+// Responses go out one window (WEB_RENDER_WINDOW) per espconn_send.
+// The windows are handed out round robin with at most WEB_MAX_INFLIGHT
+// in flight over all sessions and one per session, so one long download
+// cannot starve the others and the heap holds at most that many windows
+// the SDK has not sent yet.
+//
+// What is served is up to the ops: they stage the query parameters of
+// a request into the session's transaction, pick the response for a
+// complete request and render its body.
+//
+
+#define WEB_MAX_SESSIONS    4   // concurrent web clients
+#define WEB_MAX_INFLIGHT    2   // response windows in flight over all sessions
+#define WEB_MAX_QUEUED      4   // pipelined requests waiting for their response
+
+// Queued responses
+#define WEB_RESP_PAGE       0x01
+#define WEB_RESP_NOT_FOUND  0x02
+#define WEB_RESP_STATUS     0x03
+#define WEB_RESP_KIND       0x0f
+#define WEB_RESP_CLOSE      0x80    // close the connection after this one
+
+// A response in progress
+typedef struct {
+        uint32_t heap_base;     // free heap before the page view started
+        uint32_t heap_peak;     // most heap in use while serving it
+        char *body;             // generated body, NULL for the flash pages, freed with the page
+        web_render_t render;
+} web_page_t;
+
+typedef struct {
+        // Stages one query parameter, arg is the transaction of the session
+        http_param_cb param;
+        // A complete request, its parameters staged in txn: returns the
+        // WEB_RESP_* kind to answer it with
+        uint8_t (*request)(struct espconn *pespconn, http_req_t *req, void *txn);
+        // Sets up page->render (and page->body) for a response other than
+        // WEB_RESP_NOT_FOUND, returns its Content-Type, NULL on no memory
+        const char *(*page_start)(web_page_t *page, uint8_t kind);
+} web_session_ops_t;
+
+typedef struct {
+        struct espconn *conn;   // NULL if the slot is free
+        uint8_t remote_ip[4];
+        int remote_port;
+        http_req_t req;
+        void *txn;              // staged form fields of the request being parsed
+        web_page_t *page;
+        uint8_t sending;        // a window of this session is in flight
+        uint8_t close;          // no more requests, close when the queue is sent
+        uint8_t closing;        // espconn_disconnect() called, waiting for the callback
+        uint8_t nqueued;
+        uint8_t queue[WEB_MAX_QUEUED];
+} web_session_t;
+
+// Most heap a page view took, of the last one that ended
+extern uint32_t web_page_heap_peak;
+
+// Sets the ops and the transactions of the sessions, WEB_MAX_SESSIONS of
+// txn_size bytes each, cleared before every request
+void web_session_init(const web_session_ops_t *ops, void *txns, uint16_t txn_size);
+
+// A client connected: takes a free slot and registers the callbacks of
+// the session, or disconnects it if the pool is full
+void web_session_open(struct espconn *pespconn);
+
+#endif